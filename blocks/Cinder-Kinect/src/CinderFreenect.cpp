@@ -26,6 +26,8 @@
 
 #include "CinderFreenect.h"
 #include "libfreenect.h"
+#include "demosaic.h"
+#include <chrono>
 using namespace std;
 
 namespace cinder {
@@ -33,11 +35,17 @@ namespace cinder {
 // statics
 std::mutex			Kinect::sContextMutex;
 freenect_context*	Kinect::sContext = 0;
+std::mutex			Kinect::sEventMutex;
+std::atomic<int>	Kinect::sEventWaiters( 0 );
+std::mutex			Kinect::sEventThreadMutex;
+std::shared_ptr<std::thread>	Kinect::sEventThread;
+int					Kinect::sEventDevices = 0;
+std::atomic<bool>	Kinect::sEventShouldDie( false );
 
 class ImageSourceKinectColor : public ImageSource {
   public:
-	ImageSourceKinectColor( uint8_t *buffer, shared_ptr<Kinect::Obj> ownerObj )
-		: ImageSource(), mOwnerObj( ownerObj ), mData( buffer )
+	ImageSourceKinectColor( Kinect::Obj::BufferManager<uint8_t>::Buffer *buffer, shared_ptr<Kinect::Obj> ownerObj )
+		: ImageSource(), mOwnerObj( ownerObj ), mBuffer( buffer )
 	{
 		setSize( 640, 480 );
 		setColorModel( ImageIo::CM_RGB );
@@ -48,26 +56,31 @@ class ImageSourceKinectColor : public ImageSource {
 	~ImageSourceKinectColor()
 	{
 		// let the owner know we are done with the buffer
-		mOwnerObj->mColorBuffers.derefBuffer( mData );
+		if( mBuffer )
+			mOwnerObj->mColorBuffers.derefBuffer( mBuffer );
 	}
 
 	virtual void load( ImageTargetRef target )
 	{
+		if( ! mBuffer )
+			return;
+
 		ImageSource::RowFunc func = setupRowFunc( target );
 		
 		for( int32_t row = 0; row < 480; ++row )
-			((*this).*func)( target, row, mData + row * 640 * 3 );
+			((*this).*func)( target, row, mBuffer->mData + row * 640 * 3 );
 	}
 	
   protected:
-	shared_ptr<Kinect::Obj>		mOwnerObj;
-	uint8_t						*mData;
+	shared_ptr<Kinect::Obj>								mOwnerObj;
+	Kinect::Obj::BufferManager<uint8_t>::Buffer		*mBuffer;
 };
 
+// Any single-channel video: infrared, or the green plane in green-only mode
 class ImageSourceKinectInfrared : public ImageSource {
   public:
-	ImageSourceKinectInfrared( uint8_t *buffer, shared_ptr<Kinect::Obj> ownerObj )
-		: ImageSource(), mOwnerObj( ownerObj ), mData( buffer )
+	ImageSourceKinectInfrared( Kinect::Obj::BufferManager<uint8_t>::Buffer *buffer, shared_ptr<Kinect::Obj> ownerObj )
+		: ImageSource(), mOwnerObj( ownerObj ), mBuffer( buffer )
 	{
 		setSize( 640, 480 );
 		setColorModel( ImageIo::CM_GRAY );
@@ -78,27 +91,31 @@ class ImageSourceKinectInfrared : public ImageSource {
 	~ImageSourceKinectInfrared()
 	{
 		// let the owner know we are done with the buffer
-		mOwnerObj->mColorBuffers.derefBuffer( mData );
+		if( mBuffer )
+			mOwnerObj->mColorBuffers.derefBuffer( mBuffer );
 	}
 
 	virtual void load( ImageTargetRef target )
 	{
+		if( ! mBuffer )
+			return;
+
 		ImageSource::RowFunc func = setupRowFunc( target );
 		
 		for( int32_t row = 0; row < 480; ++row )
-			((*this).*func)( target, row, mData + row * 640 * 1 );
+			((*this).*func)( target, row, mBuffer->mData + row * 640 * 1 );
 	}
 	
   protected:
-	shared_ptr<Kinect::Obj>		mOwnerObj;
-	uint8_t						*mData;
+	shared_ptr<Kinect::Obj>								mOwnerObj;
+	Kinect::Obj::BufferManager<uint8_t>::Buffer		*mBuffer;
 };
 
 
 class ImageSourceKinectDepth : public ImageSource {
   public:
-	ImageSourceKinectDepth( uint16_t *buffer, shared_ptr<Kinect::Obj> ownerObj )
-		: ImageSource(), mOwnerObj( ownerObj ), mData( buffer )
+	ImageSourceKinectDepth( Kinect::Obj::BufferManager<uint16_t>::Buffer *buffer, shared_ptr<Kinect::Obj> ownerObj )
+		: ImageSource(), mOwnerObj( ownerObj ), mBuffer( buffer )
 	{
 		setSize( 640, 480 );
 		setColorModel( ImageIo::CM_GRAY );
@@ -109,48 +126,75 @@ class ImageSourceKinectDepth : public ImageSource {
 	~ImageSourceKinectDepth()
 	{
 		// let the owner know we are done with the buffer
-		mOwnerObj->mDepthBuffers.derefBuffer( mData );
+		if( mBuffer )
+			mOwnerObj->mDepthBuffers.derefBuffer( mBuffer );
 	}
 
 	virtual void load( ImageTargetRef target )
 	{
+		if( ! mBuffer )
+			return;
+
 		ImageSource::RowFunc func = setupRowFunc( target );
 		
 		for( int32_t row = 0; row < 480; ++row )
-			((*this).*func)( target, row, mData + row * 640 );
+			((*this).*func)( target, row, mBuffer->mData + row * 640 );
 	}
 	
   protected:
-	shared_ptr<Kinect::Obj>		mOwnerObj;
-	uint16_t					*mData;
+	shared_ptr<Kinect::Obj>								mOwnerObj;
+	Kinect::Obj::BufferManager<uint16_t>::Buffer		*mBuffer;
 };
 
 // Used as the deleter for the shared_ptr returned by getImageData() and getDepthData()
 template<typename T>
 class KinectDataDeleter {
   public:
-	KinectDataDeleter( Kinect::Obj::BufferManager<T> *bufferMgr, shared_ptr<Kinect::Obj> ownerObj )
-		: mOwnerObj( ownerObj ), mBufferMgr( bufferMgr )
+	KinectDataDeleter( Kinect::Obj::BufferManager<T> *bufferMgr, typename Kinect::Obj::BufferManager<T>::Buffer *buffer, shared_ptr<Kinect::Obj> ownerObj )
+		: mOwnerObj( ownerObj ), mBufferMgr( bufferMgr ), mBuffer( buffer )
 	{}
 	
 	void operator()( T *data ) {
-		mBufferMgr->derefBuffer( data );
+		mBufferMgr->derefBuffer( mBuffer );
 	}
 	
 	shared_ptr<Kinect::Obj>			mOwnerObj; // to prevent deletion of our parent Obj
 	Kinect::Obj::BufferManager<T> *mBufferMgr;
+	typename Kinect::Obj::BufferManager<T>::Buffer *mBuffer;
 };
 
 Kinect::Kinect( Device device )
-	: mObj( new Obj( device.mIndex, device.mDepthRegister ) )
+	: mObj( new Obj( device ) )
 {
 }
 
-Kinect::Obj::Obj( int deviceIndex, bool depthRegister )
-	: mColorBuffers( 640 * 480 * 3, this ), mDepthBuffers( 640 * 480, this ),
-		mShouldDie( false ), mVideoInfrared( false ),
-		mNewVideoFrame( false ), mNewDepthFrame( false )
+Kinect::Obj::Obj( const Device &device )
+	: mDevice( 0 ), mColorBuffers( 640 * 480 * 3 ), mDepthBuffers( 640 * 480 ),
+		mShouldDie( false ), mVideoInfrared( false ), mVideoGreen( device.mVideoGreen ),
+		mNewVideoFrame( false ), mNewDepthFrame( false ), mTilt( 0 ),
+		mReplayRealTime( device.mReplayRealTime ), mReplayFinished( false ),
+		mFrameSource( device.mFrameSource )
 {
+	if( mFrameSource ) {
+		mThread = shared_ptr<thread>( new thread( frameSourceFunc, this ) );
+		return;
+	}
+
+	if( ! device.mReplayPath.empty() ) {
+		try {
+			mReplay = KinectCaptureReaderRef( new KinectCapture::Reader( device.mReplayPath ) );
+		}
+		catch( KinectCapture::Exc &e ) {
+			throw ExcFailedOpenDevice();
+		}
+		mThread = shared_ptr<thread>( new thread( replayFunc, this ) );
+		return;
+	}
+
+	int deviceIndex = device.mIndex;
+	bool depthRegister = device.mDepthRegister;
+
+	EventLock lock;
 	if( freenect_open_device( getContext(), &mDevice, deviceIndex ) < 0 )
 		throw ExcFailedOpenDevice();
 
@@ -160,7 +204,7 @@ Kinect::Obj::Obj( int deviceIndex, bool depthRegister )
 	freenect_set_led( mDevice, ::LED_GREEN );
 	freenect_set_depth_callback( mDevice, depthImageCB );
 	freenect_set_video_callback( mDevice, colorImageCB );
-	freenect_set_video_mode( mDevice, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB) );
+	freenect_set_video_mode( mDevice, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, mVideoGreen ? FREENECT_VIDEO_BAYER : FREENECT_VIDEO_RGB) );
 
 	if( depthRegister ) {
 		freenect_set_depth_mode( mDevice, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_REGISTERED));
@@ -169,62 +213,261 @@ Kinect::Obj::Obj( int deviceIndex, bool depthRegister )
 		freenect_set_depth_mode( mDevice, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
 	}
 
-	mLastVideoFrameInfrared = mVideoInfrared;
-	
-	mThread = shared_ptr<thread>( new thread( threadedFunc, this ) );
+	freenect_start_depth( mDevice );
+	freenect_start_video( mDevice );
+	acquireEvents();
 }
 
 Kinect::Obj::~Obj()
 {
-	mShouldDie = true;
-	mThread->join();
+	{
+		// Under the lock, so the replay thread can't miss the wakeup between
+		// testing mShouldDie and waiting
+		lock_guard<recursive_mutex> lock( mMutex );
+		mShouldDie = true;
+		mFrameConsumed.notify_all();
+	}
+	if( mThread )
+		mThread->join();
+
+	if( mDevice ) {
+		{
+			EventLock lock;
+			freenect_stop_depth( mDevice );
+			freenect_stop_video( mDevice );
+			freenect_close_device( mDevice );
+		}
+		releaseEvents();
+	}
+}
+
+void Kinect::Obj::deliverVideo( const void *pixels, VideoFormat format, uint32_t timestamp )
+{
+	BufferManager<uint8_t>::Buffer *dest = mColorBuffers.getNewBuffer();	// request a new buffer
+	const uint8_t *src = reinterpret_cast<const uint8_t*>( pixels );
+	bool single = format == VIDEO_IR || mVideoGreen;
+
+	switch( format ) {
+		case VIDEO_IR:
+			memcpy( dest->mData, src, 640 * 480 * sizeof(uint8_t) );		// blast the pixels in
+			break;
+		case VIDEO_BAYER:
+			if( mVideoGreen )
+				freenect_demosaic_green( src, dest->mData, 640, 480 );
+			else
+				freenect_demosaic( src, dest->mData, 640, 480 );
+			break;
+		case VIDEO_RGB:
+			if( mVideoGreen ) {
+				for( size_t i = 0; i < 640 * 480; ++i )
+					dest->mData[i] = src[i * 3 + 1];
+			}
+			else
+				memcpy( dest->mData, src, 640 * 480 * 3 * sizeof(uint8_t) );	// blast the pixels in
+			break;
+	}
+	mVideoCounter.next( dest->mInfo, timestamp );
+	dest->mInfo.mChannels = single ? 1 : 3;
+	mColorBuffers.setActiveBuffer( dest );		// publish it, releasing the previous active buffer
+	mNewVideoFrame = true;						// flag that there's a new color frame
+}
+
+void Kinect::Obj::deliverDepth( const void *depth, uint32_t timestamp )
+{
+	BufferManager<uint16_t>::Buffer *dest = mDepthBuffers.getNewBuffer();	// request a new buffer
+	memcpy( dest->mData, depth, 640 * 480 * sizeof(uint16_t) );
+	mDepthCounter.next( dest->mInfo, timestamp );
+	dest->mInfo.mChannels = 1;
+	mDepthBuffers.setActiveBuffer( dest );		// publish it, releasing the previous active buffer
+	mNewDepthFrame = true;						// flag that there's a new depth frame
+}
+
+void Kinect::Obj::FrameCounter::next( FrameInfo &info, uint32_t timestamp )
+{
+	if( mCount > 0 ) {
+		// Differences wrap along with the device clock. A timestamp that doesn't move forward is a discontinuity, not a frame interval.
+		int32_t delta = int32_t( timestamp - mLastTimestamp );
+		if( delta > 0 ) {
+			uint32_t interval = uint32_t( delta );
+			if( mPeriod == 0 || interval < mPeriod - mPeriod / 4 )
+				mPeriod = interval;						// first estimate, or the last one spanned a drop
+			else if( interval < mPeriod + mPeriod / 2 )
+				mPeriod = uint32_t( int64_t( mPeriod ) + ( int64_t( interval ) - int64_t( mPeriod ) ) / 8 );	// follow the clock
+			else
+				mDropped += ( interval + mPeriod / 2 ) / mPeriod - 1;
+		}
+	}
+
+	info.mTimestamp = timestamp;
+	info.mSequence = mCount++;
+	info.mDropped = mDropped;
+	info.mPeriod = mPeriod;
+	mLastTimestamp = timestamp;
 }
 
 void Kinect::colorImageCB( freenect_device *dev, void *rgb, uint32_t timestamp )
 {
 	Kinect::Obj *kinectObj = reinterpret_cast<Kinect::Obj*>( freenect_get_user( dev ) );
+	Obj::VideoFormat format = kinectObj->mVideoInfrared ? Obj::VIDEO_IR : kinectObj->mVideoGreen ? Obj::VIDEO_BAYER : Obj::VIDEO_RGB;
+
+	kinectObj->deliverVideo( rgb, format, timestamp );
+
+	KinectCaptureWriterRef recorder;
 	{
 		lock_guard<recursive_mutex> lock( kinectObj->mMutex );
-		
-		kinectObj->mColorBuffers.derefActiveBuffer();					// finished with current active buffer
-		uint8_t *destPixels = kinectObj->mColorBuffers.getNewBuffer();	// request a new buffer
-		if( kinectObj->mVideoInfrared )
-			memcpy( destPixels, rgb, 640 * 480 * sizeof(uint8_t) );		// blast the pixels in
+		recorder = kinectObj->mRecorder;
+	}
+	if( recorder ) {
+		if( format == Obj::VIDEO_IR )
+			recorder->writeFrame( KinectCapture::FRAME_VIDEO_IR, rgb, KinectCapture::getFrameSize( KinectCapture::FRAME_VIDEO_IR ), timestamp );
+		else if( format == Obj::VIDEO_BAYER )
+			recorder->writeFrame( KinectCapture::FRAME_VIDEO_BAYER, rgb, KinectCapture::getFrameSize( KinectCapture::FRAME_VIDEO_BAYER ), timestamp );
 		else
-			memcpy( destPixels, rgb, 640 * 480 * 3 * sizeof(uint8_t) );		// blast the pixels in
-		kinectObj->mColorBuffers.setActiveBuffer( destPixels );			// set this new buffer to be the current active buffer
-		kinectObj->mNewVideoFrame = true;								// flag that there's a new color frame
-		kinectObj->mLastVideoFrameInfrared = kinectObj->mVideoInfrared;
+			recorder->writeFrame( KinectCapture::FRAME_VIDEO_RGB, rgb, KinectCapture::getFrameSize( KinectCapture::FRAME_VIDEO_RGB ), timestamp );
 	}
 }
 
 void Kinect::depthImageCB( freenect_device *dev, void *d, uint32_t timestamp )
 {
 	Kinect::Obj *kinectObj = reinterpret_cast<Kinect::Obj*>( freenect_get_user( dev ) );
+
+	kinectObj->deliverDepth( d, timestamp );
+
+	KinectCaptureWriterRef recorder;
 	{
 		lock_guard<recursive_mutex> lock( kinectObj->mMutex );
+		recorder = kinectObj->mRecorder;
+	}
+	if( recorder )
+		recorder->writeFrame( KinectCapture::FRAME_DEPTH, d, KinectCapture::getFrameSize( KinectCapture::FRAME_DEPTH ), timestamp );
+}
 
-		uint16_t *depth = reinterpret_cast<uint16_t*>( d );
+void Kinect::replayFunc( Kinect::Obj *kinectObj )
+{
+	ci::ThreadSetup ts;
 
-		kinectObj->mDepthBuffers.derefActiveBuffer();					// finished with current active buffer
-		uint16_t *destPixels = kinectObj->mDepthBuffers.getNewBuffer(); // request a new buffer
-        memcpy(destPixels, depth, 640 * 480 * sizeof(uint16_t));
-		kinectObj->mDepthBuffers.setActiveBuffer( destPixels );			// set this new buffer to be the current active buffer
-		kinectObj->mNewDepthFrame = true;								// flag that there's a new depth frame
+	const KinectCapture::Reader &reader = *kinectObj->mReplay;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	for( size_t i = 0; i < reader.getFrameCount() && ! kinectObj->mShouldDie; ++i ) {
+		const KinectCapture::IndexEntry &entry = reader.getEntry( i );
+		const uint8_t *payload = reader.getPayload( i );
+
+		if( kinectObj->mReplayRealTime ) {
+			// Sleep on the condition so shutdown doesn't wait out a long gap
+			unique_lock<recursive_mutex> lock( kinectObj->mMutex );
+			chrono::steady_clock::time_point due = start + chrono::microseconds( entry.timestamp );
+			while( ! kinectObj->mShouldDie && chrono::steady_clock::now() < due )
+				kinectObj->mFrameConsumed.wait_until( lock, due );
+			if( kinectObj->mShouldDie )
+				break;
+		}
+		else if( entry.type != KinectCapture::FRAME_LED_STATE ) {
+			// Wait until the previous frame of this kind has been picked up
+			unique_lock<recursive_mutex> lock( kinectObj->mMutex );
+			atomic<bool> &pending = entry.type == KinectCapture::FRAME_DEPTH ? kinectObj->mNewDepthFrame : kinectObj->mNewVideoFrame;
+			while( pending && ! kinectObj->mShouldDie )
+				kinectObj->mFrameConsumed.wait( lock );
+		}
+
+		switch( entry.type ) {
+			case KinectCapture::FRAME_DEPTH:
+				kinectObj->deliverDepth( payload, entry.deviceTimestamp );
+				break;
+			case KinectCapture::FRAME_VIDEO_RGB:
+				kinectObj->deliverVideo( payload, Obj::VIDEO_RGB, entry.deviceTimestamp );
+				break;
+			case KinectCapture::FRAME_VIDEO_IR:
+				kinectObj->deliverVideo( payload, Obj::VIDEO_IR, entry.deviceTimestamp );
+				break;
+			case KinectCapture::FRAME_VIDEO_BAYER:
+				kinectObj->deliverVideo( payload, Obj::VIDEO_BAYER, entry.deviceTimestamp );
+				break;
+			case KinectCapture::FRAME_LED_STATE: {
+				lock_guard<recursive_mutex> lock( kinectObj->mMutex );
+				kinectObj->mReplayLedState.assign( payload, payload + entry.size );
+				break;
+			}
+		}
 	}
+
+	kinectObj->mReplayFinished = true;
 }
 
-void Kinect::threadedFunc( Kinect::Obj *kinectObj )
+void Kinect::frameSourceFunc( Kinect::Obj *kinectObj )
 {
 	ci::ThreadSetup ts;
 
-	freenect_start_depth( kinectObj->mDevice );
-	freenect_start_video( kinectObj->mDevice );
+	vector<uint16_t> depth( 640 * 480 );
+	vector<uint8_t> video( 640 * 480 * 3 );
+	chrono::steady_clock::time_point next = chrono::steady_clock::now();
+	chrono::microseconds period( int64_t( kinectObj->mFrameSource->getFramePeriod() * 1e6 ) );
 
-	while( ( ! kinectObj->mShouldDie ) && ( freenect_process_events( getContext() ) >= 0 ) )
-		;
-		
-	freenect_close_device( kinectObj->mDevice );
+	while( ! kinectObj->mShouldDie ) {
+		uint32_t timestamp;
+
+		if( kinectObj->mFrameSource->renderDepth( &depth[0], timestamp ) )
+			kinectObj->deliverDepth( &depth[0], timestamp );
+		if( kinectObj->mFrameSource->renderVideo( &video[0], timestamp ) )
+			kinectObj->deliverVideo( &video[0], Obj::VIDEO_RGB, timestamp );
+
+		next += period;
+		this_thread::sleep_until( next );
+	}
+}
+
+void Kinect::eventFunc()
+{
+	ci::ThreadSetup ts;
+
+	freenect_context *context = getContext();
+	// Short enough that device setup and teardown never wait long for the lock
+	timeval timeout = { 0, 10000 };
+
+	while( ! sEventShouldDie ) {
+		int result;
+		{
+			lock_guard<mutex> lock( sEventMutex );
+			result = freenect_process_events_timeout( context, &timeout );
+		}
+		while( sEventWaiters > 0 )
+			this_thread::yield();
+
+		// A dead device has its streams stopped but keeps failing until it's closed; don't spin on it
+		if( result < 0 )
+			this_thread::sleep_for( chrono::milliseconds( 1 ) );
+	}
+}
+
+void Kinect::acquireEvents()
+{
+	lock_guard<mutex> lock( sEventThreadMutex );
+	if( sEventDevices++ == 0 ) {
+		sEventShouldDie = false;
+		sEventThread = shared_ptr<thread>( new thread( eventFunc ) );
+	}
+}
+
+void Kinect::releaseEvents()
+{
+	lock_guard<mutex> lock( sEventThreadMutex );
+	if( --sEventDevices == 0 ) {
+		sEventShouldDie = true;
+		sEventThread->join();
+		sEventThread.reset();
+	}
+}
+
+Kinect::EventLock::EventLock()
+{
+	++sEventWaiters;
+	sEventMutex.lock();
+	--sEventWaiters;
+}
+
+Kinect::EventLock::~EventLock()
+{
+	sEventMutex.unlock();
 }
 
 freenect_context* Kinect::getContext()
@@ -251,24 +494,71 @@ int	Kinect::getNumDevices()
 
 bool Kinect::checkNewVideoFrame()
 {
-	lock_guard<recursive_mutex> lock( mObj->mMutex );
-	bool oldValue = mObj->mNewVideoFrame;
-	mObj->mNewVideoFrame = false;
+	bool oldValue = mObj->mNewVideoFrame.exchange( false );
+	if( oldValue && mObj->mReplay && ! mObj->mReplayRealTime ) {
+		// Lockstep replay is waiting for this frame to be picked up
+		lock_guard<recursive_mutex> lock( mObj->mMutex );
+		mObj->mFrameConsumed.notify_all();
+	}
 	return oldValue;
 }
 
 bool Kinect::checkNewDepthFrame()
 {
-	lock_guard<recursive_mutex> lock( mObj->mMutex );
-	bool oldValue = mObj->mNewDepthFrame;
-	mObj->mNewDepthFrame = false;
+	bool oldValue = mObj->mNewDepthFrame.exchange( false );
+	if( oldValue && mObj->mReplay && ! mObj->mReplayRealTime ) {
+		lock_guard<recursive_mutex> lock( mObj->mMutex );
+		mObj->mFrameConsumed.notify_all();
+	}
 	return oldValue;
 }
 
+void Kinect::startRecording( const std::string &path )
+{
+	KinectCaptureWriterRef recorder( new KinectCapture::Writer( path ) );
+	lock_guard<recursive_mutex> lock( mObj->mMutex );
+	mObj->mRecorder = recorder;
+}
+
+void Kinect::stopRecording()
+{
+	KinectCaptureWriterRef recorder;
+	{
+		lock_guard<recursive_mutex> lock( mObj->mMutex );
+		recorder.swap( mObj->mRecorder );
+	}
+	if( recorder )
+		recorder->close();
+}
+
+bool Kinect::isRecording()
+{
+	lock_guard<recursive_mutex> lock( mObj->mMutex );
+	return mObj->mRecorder != 0;
+}
+
+void Kinect::recordLedState( const void *data, size_t size )
+{
+	KinectCaptureWriterRef recorder;
+	{
+		lock_guard<recursive_mutex> lock( mObj->mMutex );
+		recorder = mObj->mRecorder;
+	}
+	if( recorder )
+		recorder->writeFrame( KinectCapture::FRAME_LED_STATE, data, size );
+}
+
+std::vector<uint8_t> Kinect::getReplayLedState()
+{
+	lock_guard<recursive_mutex> lock( mObj->mMutex );
+	return mObj->mReplayLedState;
+}
+
 void Kinect::setTilt( float degrees )
 {
 	mObj->mTilt = math<float>::clamp( degrees, -31, 31 );
-	freenect_set_tilt_degs( mObj->mDevice, mObj->mTilt );
+	if( mObj->mDevice )
+		freenect_set_tilt_degs( mObj->mDevice, mObj->mTilt );
 }
 
 float Kinect::getTilt() const
@@ -279,12 +569,15 @@ float Kinect::getTilt() const
 void Kinect::setLedColor( LedColor ledColorCode )
 {
 	int code = ledColorCode;
-	freenect_set_led( mObj->mDevice, (freenect_led_options)code );
+	if( mObj->mDevice )
+		freenect_set_led( mObj->mDevice, (freenect_led_options)code );
 }
 
 Vec3f Kinect::getAccel() const
 {
 	Vec3d raw;
+	if( ! mObj->mDevice )
+		return Vec3f::zero();
 	freenect_update_tilt_state( mObj->mDevice );
 	freenect_get_mks_accel( freenect_get_tilt_state( mObj->mDevice ), &raw.x, &raw.y, &raw.z );
 	return Vec3f( raw );
@@ -293,8 +586,8 @@ Vec3f Kinect::getAccel() const
 ImageSourceRef Kinect::getVideoImage()
 {
 	// register a reference to the active buffer
-	uint8_t *activeColor = mObj->mColorBuffers.refActiveBuffer();
-	if( mObj->mLastVideoFrameInfrared )
+	Obj::BufferManager<uint8_t>::Buffer *activeColor = mObj->mColorBuffers.refActiveBuffer();
+	if( activeColor && activeColor->mInfo.mChannels == 1 )
 		return ImageSourceRef( new ImageSourceKinectInfrared( activeColor, this->mObj ) );
 	else
 		return ImageSourceRef( new ImageSourceKinectColor( activeColor, this->mObj ) );
@@ -303,27 +596,36 @@ ImageSourceRef Kinect::getVideoImage()
 ImageSourceRef Kinect::getDepthImage()
 {
 	// register a reference to the active buffer
-	uint16_t *activeDepth = mObj->mDepthBuffers.refActiveBuffer();
+	Obj::BufferManager<uint16_t>::Buffer *activeDepth = mObj->mDepthBuffers.refActiveBuffer();
 	return ImageSourceRef( new ImageSourceKinectDepth( activeDepth, this->mObj ) );
 }
 
-std::shared_ptr<uint8_t> Kinect::getVideoData()
+std::shared_ptr<uint8_t> Kinect::getVideoData( FrameInfo *info )
 {
 	// register a reference to the active buffer
-	uint8_t *activeColor = mObj->mColorBuffers.refActiveBuffer();
-	return shared_ptr<uint8_t>( activeColor, KinectDataDeleter<uint8_t>( &mObj->mColorBuffers, mObj ) );	
+	Obj::BufferManager<uint8_t>::Buffer *activeColor = mObj->mColorBuffers.refActiveBuffer();
+	if( info )
+		*info = activeColor ? activeColor->mInfo : FrameInfo();
+	if( ! activeColor )
+		return shared_ptr<uint8_t>();
+	return shared_ptr<uint8_t>( activeColor->mData, KinectDataDeleter<uint8_t>( &mObj->mColorBuffers, activeColor, mObj ) );
 }
 
-std::shared_ptr<uint16_t> Kinect::getDepthData()
+std::shared_ptr<uint16_t> Kinect::getDepthData( FrameInfo *info )
 {
 	// register a reference to the active buffer
-	uint16_t *activeDepth = mObj->mDepthBuffers.refActiveBuffer();
-	return shared_ptr<uint16_t>( activeDepth, KinectDataDeleter<uint16_t>( &mObj->mDepthBuffers, mObj ) );	
+	Obj::BufferManager<uint16_t>::Buffer *activeDepth = mObj->mDepthBuffers.refActiveBuffer();
+	if( info )
+		*info = activeDepth ? activeDepth->mInfo : FrameInfo();
+	if( ! activeDepth )
+		return shared_ptr<uint16_t>();
+	return shared_ptr<uint16_t>( activeDepth->mData, KinectDataDeleter<uint16_t>( &mObj->mDepthBuffers, activeDepth, mObj ) );
 }
 
 void Kinect::setVideoInfrared( bool infrared )
 {
-	if( mObj->mVideoInfrared != infrared ) {
+	if( mObj->mVideoInfrared != infrared && mObj->mDevice ) {
+		EventLock eventLock;
 		freenect_stop_video( mObj->mDevice );
 		{
 			lock_guard<recursive_mutex> lock( mObj->mMutex );
@@ -332,7 +634,7 @@ void Kinect::setVideoInfrared( bool infrared )
 			if( mObj->mVideoInfrared )
 				freenect_set_video_mode( mObj->mDevice, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_8BIT) );
 			else
-				freenect_set_video_mode( mObj->mDevice, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB) );
+				freenect_set_video_mode( mObj->mDevice, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, mObj->mVideoGreen ? FREENECT_VIDEO_BAYER : FREENECT_VIDEO_RGB) );
 		}
 		freenect_start_video( mObj->mDevice );
 	}
@@ -340,63 +642,80 @@ void Kinect::setVideoInfrared( bool infrared )
 
 // Buffer management
 template<typename T>
-Kinect::Obj::BufferManager<T>::~BufferManager()
+Kinect::Obj::BufferManager<T>::BufferManager( size_t allocationSize, size_t initialCount )
+	: mAllocationSize( allocationSize ), mBuffers( 0 ), mActiveBuffer( 0 )
 {
-	for( typename map<T*,size_t>::iterator bufIt = mBuffers.begin(); bufIt != mBuffers.end(); ++bufIt ) {
-		delete [] bufIt->first;
+	for( size_t i = 0; i < initialCount; ++i ) {
+		Buffer *buffer = new Buffer;
+		buffer->mData = new T[mAllocationSize];
+		buffer->mRefs = 0;
+		buffer->mNext = mBuffers;
+		mBuffers = buffer;
 	}
 }
 
 template<typename T>
-T* Kinect::Obj::BufferManager<T>::getNewBuffer()
+Kinect::Obj::BufferManager<T>::~BufferManager()
 {
-	lock_guard<recursive_mutex> lock( mKinectObj->mMutex );
-
-	typename map<T*,size_t>::iterator bufIt;
-	for( bufIt = mBuffers.begin(); bufIt != mBuffers.end(); ++bufIt ) {
-		if( bufIt->second == 0 ) // 0 means free buffer
-			break;
-	}
-	if( bufIt != mBuffers.end() ) {
-		bufIt->second = 1;
-		return bufIt->first;
-	}
-	else { // there were no available buffers - add a new one and return it
-		T *newBuffer = new T[mAllocationSize];
-		mBuffers[newBuffer] = 1;
-		return newBuffer;
+	while( mBuffers ) {
+		Buffer *next = mBuffers->mNext;
+		delete [] mBuffers->mData;
+		delete mBuffers;
+		mBuffers = next;
 	}
 }
 
 template<typename T>
-void Kinect::Obj::BufferManager<T>::setActiveBuffer( T *buffer )
+typename Kinect::Obj::BufferManager<T>::Buffer* Kinect::Obj::BufferManager<T>::getNewBuffer()
 {
-	lock_guard<recursive_mutex> lock( mKinectObj->mMutex );
-	// assign new active buffer
-	mActiveBuffer = buffer;
+	// Claim a free buffer. A consumer may briefly bump the count of a buffer it
+	// has since seen retired; the compare-exchange just skips over those.
+	for( Buffer *buffer = mBuffers; buffer; buffer = buffer->mNext ) {
+		int expected = 0;
+		if( buffer->mRefs.compare_exchange_strong( expected, 1 ) )
+			return buffer;
+	}
+
+	// there were no available buffers - add a new one and return it. Consumers
+	// only reach buffers through mActiveBuffer, so the list itself is ours alone.
+	Buffer *buffer = new Buffer;
+	buffer->mData = new T[mAllocationSize];
+	buffer->mRefs = 1;
+	buffer->mNext = mBuffers;
+	mBuffers = buffer;
+	return buffer;
 }
 
 template<typename T>
-T* Kinect::Obj::BufferManager<T>::refActiveBuffer()
+void Kinect::Obj::BufferManager<T>::setActiveBuffer( Buffer *buffer )
 {
-	lock_guard<recursive_mutex> lock( mKinectObj->mMutex );
-	mBuffers[mActiveBuffer]++;
-	return mActiveBuffer;
+	// The producer's reference moves to the new active buffer
+	Buffer *previous = mActiveBuffer.exchange( buffer );
+	if( previous )
+		derefBuffer( previous );
 }
 
 template<typename T>
-void Kinect::Obj::BufferManager<T>::derefActiveBuffer()
+typename Kinect::Obj::BufferManager<T>::Buffer* Kinect::Obj::BufferManager<T>::refActiveBuffer()
 {
-	lock_guard<recursive_mutex> lock( mKinectObj->mMutex );
-	if( mActiveBuffer ) 	// decrement use count on current active buffer
-		mBuffers[mActiveBuffer]--;		
+	for( ;; ) {
+		Buffer *buffer = mActiveBuffer.load();
+		if( ! buffer )
+			return 0;
+
+		// The reference only counts if the buffer was still active once we held it.
+		// Otherwise the producer may already be reusing it, so back off and retry.
+		buffer->mRefs.fetch_add( 1 );
+		if( mActiveBuffer.load() == buffer )
+			return buffer;
+		derefBuffer( buffer );
+	}
 }
 
 template<typename T>
-void Kinect::Obj::BufferManager<T>::derefBuffer( T *buffer )
+void Kinect::Obj::BufferManager<T>::derefBuffer( Buffer *buffer )
 {
-	lock_guard<recursive_mutex> lock( mKinectObj->mMutex );
-	mBuffers[buffer]--;
+	buffer->mRefs.fetch_sub( 1 );
 }
 
 } // namespace cinder
@@ -31,7 +31,10 @@
 #include "cinder/Area.h"
 #include "cinder/Exception.h"
 #include "cinder/ImageIo.h"
-#include <map>
+#include "KinectCapture.h"
+#include "KinectFrameInfo.h"
+#include <atomic>
+#include <condition_variable>
 
 // Forward declarations from freenect
 //! @cond
@@ -49,6 +52,22 @@ typedef std::shared_ptr<class Kinect>	KinectRef;
 
 class Kinect {
   public:
+
+	//! Synthetic frame generator, used in place of a device when set in FreenectParams
+	class FrameSource {
+	  public:
+		virtual ~FrameSource() {}
+		//! Renders the next 640x480 depth frame. Returns false to drop the frame.
+		virtual bool	renderDepth( uint16_t *depth, uint32_t &timestamp ) = 0;
+		//! Renders the next 640x480 RGB frame. Returns false to drop the frame.
+		virtual bool	renderVideo( uint8_t *rgb, uint32_t &timestamp ) = 0;
+		//! Returns the interval between frames, in seconds
+		virtual double	getFramePeriod() const { return 1.0 / 30.0; }
+	};
+	typedef std::shared_ptr<FrameSource>	FrameSourceRef;
+
+	//! Metadata delivered with each depth or video frame
+	typedef KinectFrameInfo	FrameInfo;
     
     // initialization parameters
     struct FreenectParams {
@@ -56,21 +75,40 @@ class Kinect {
         FreenectParams() {
             mDeviceIndex = 0;
             mDepthRegister = false;
+            mReplayRealTime = true;
+            mVideoGreen = false;
         }
         
         int 	mDeviceIndex;
         bool 	mDepthRegister;
+
+        //! If set, frames are replayed from this capture file instead of opening a device
+        std::string	mReplayPath;
+        //! Replay at the recorded rate if true, otherwise as fast as frames are consumed
+        bool		mReplayRealTime;
+        //! If set, frames are generated by this source instead of opening a device
+        FrameSourceRef	mFrameSource;
+        //! Deliver video as a single 8-bit green plane rather than RGB. The device streams raw Bayer data, which is cheaper to convert and to record.
+        bool		mVideoGreen;
     };
     
 	//! Represents the identifier for a particular Kinect
 	struct Device {
 		Device( FreenectParams params = FreenectParams() )
 			: mIndex( params.mDeviceIndex ),
-              mDepthRegister ( params.mDepthRegister )
+              mDepthRegister ( params.mDepthRegister ),
+              mReplayPath( params.mReplayPath ),
+              mReplayRealTime( params.mReplayRealTime ),
+              mFrameSource( params.mFrameSource ),
+              mVideoGreen( params.mVideoGreen )
 		{}
 		
 		int		mIndex;
         bool    mDepthRegister;
+		std::string	mReplayPath;
+		bool	mReplayRealTime;
+		FrameSourceRef	mFrameSource;
+		bool	mVideoGreen;
 	};
 
 	static KinectRef	create( const Device &device = Device() ) { return std::shared_ptr<Kinect>( new Kinect( device ) ); }
@@ -106,19 +144,42 @@ class Kinect {
 	ImageSourceRef			getVideoImage();
 	ImageSourceRef			getDepthImage();
 
-	std::shared_ptr<uint8_t>	getVideoData();
-	std::shared_ptr<uint16_t>	getDepthData();
+	//! Returns the newest video frame, or an empty pointer if there is none yet. If \a info is set it receives that frame's metadata.
+	std::shared_ptr<uint8_t>	getVideoData( FrameInfo *info = 0 );
+	//! Returns the newest depth frame, or an empty pointer if there is none yet. If \a info is set it receives that frame's metadata.
+	std::shared_ptr<uint16_t>	getDepthData( FrameInfo *info = 0 );
 
 	//! Sets the video image returned by getVideoImage() and getVideoData() to be infrared when \a infrared is true, color when it's false (the default)
 	void		setVideoInfrared( bool infrared = true );
 	//! Returns whether the video image returned by getVideoImage() and getVideoData() is infrared when \c true, or color when it's \c false (the default)
 	bool		isVideoInfrared() const { return mObj->mVideoInfrared; }
+	//! Returns whether color video is delivered as a single green channel, as requested by FreenectParams::mVideoGreen
+	bool		isVideoGreen() const { return mObj->mVideoGreen; }
+	//! Returns the number of bytes per pixel in getVideoData(): 1 for infrared or green video, 3 for RGB
+	int			getVideoChannels() const { return ( mObj->mVideoInfrared || mObj->mVideoGreen ) ? 1 : 3; }
 
 	//! Sets whether the depth should be registered to the color image, by default it's true, however, if the setDepthRegistered() method is not called, then the depth is not registered to the RGB image
 	//void		setDepthRegistered( bool registerDepth = true );
 	//bool		isDepthRegistered() const { return mObj->mVideoInfrared; }
 
 
+	//! Starts writing every depth and video frame to the capture file at \a path
+	void		startRecording( const std::string &path );
+	//! Finishes the current capture file, if any
+	void		stopRecording();
+	bool		isRecording();
+	//! Adds an application-defined LED state record to the current capture, if any
+	void		recordLedState( const void *data, size_t size );
+
+	//! Returns whether this Kinect is replaying a capture file rather than a live device
+	bool		isReplay() const { return mObj->mReplay != 0; }
+	//! Returns whether this Kinect is driven by a synthetic FrameSource
+	bool		isSimulated() const { return mObj->mFrameSource != 0; }
+	//! Returns whether a replay has delivered all of its frames
+	bool		isReplayFinished() const { return mObj->mReplayFinished; }
+	//! Returns the most recent LED state record delivered by a replay
+	std::vector<uint8_t>	getReplayLedState();
+
 	//! Returns the number of Kinect devices attached to the system
 	static int	getNumDevices();
 
@@ -140,27 +201,49 @@ class Kinect {
 	static freenect_context*	getContext();
 
 	struct Obj {
-		Obj( int deviceIndex, bool depthRegister );
+		Obj( const Device &device );
 		~Obj();
+
+		void		deliverDepth( const void *depth, uint32_t timestamp );
+		//! Formats \a deliverVideo() accepts from the device, a replay or a FrameSource
+		typedef enum { VIDEO_RGB, VIDEO_IR, VIDEO_BAYER } VideoFormat;
+
+		void		deliverVideo( const void *pixels, VideoFormat format, uint32_t timestamp );
 		
+		//! Lock-free pool of reference counted frame buffers, with one producer (the capture thread) and any number of consumers.
+		//! A few buffers are allocated up front, so after warmup the pool only grows while consumers hold on to every buffer.
 		template<typename T>
 		struct BufferManager {
-			BufferManager( size_t allocationSize, Obj *kinectObj )
-				: mKinectObj( kinectObj ), mAllocationSize( allocationSize ), mActiveBuffer( 0 )
-			{}
+			struct Buffer {
+				T					*mData;
+				FrameInfo			mInfo;		// Written by the producer before the buffer is published
+				std::atomic<int>	mRefs;		// 0 means free
+				Buffer				*mNext;		// Only touched by the producer
+			};
+
+			BufferManager( size_t allocationSize, size_t initialCount = 3 );
 			~BufferManager();
 			
-			T*			getNewBuffer();
-			void		setActiveBuffer( T *buffer );
-			void		derefActiveBuffer();
-			T*			refActiveBuffer();
-			void		derefBuffer( T *buffer );
+			//! Producer only: returns a free buffer holding one reference
+			Buffer*		getNewBuffer();
+			//! Producer only: publishes \a buffer as the newest frame and drops the previous active buffer
+			void		setActiveBuffer( Buffer *buffer );
+			//! Returns the newest frame with an extra reference, or NULL if nothing has been delivered yet
+			Buffer*		refActiveBuffer();
+			void		derefBuffer( Buffer *buffer );
 
-			Obj						*mKinectObj;
 			size_t					mAllocationSize;
-			// map from pointer to reference count
-			std::map<T*,size_t>		mBuffers;
-			T						*mActiveBuffer;
+			Buffer					*mBuffers;
+			std::atomic<Buffer*>	mActiveBuffer;
+		};
+
+		//! Numbers the frames of one stream and spots drops from gaps in their timestamps. Only touched by the producer.
+		struct FrameCounter {
+			FrameCounter() : mCount( 0 ), mDropped( 0 ), mPeriod( 0 ), mLastTimestamp( 0 ) {}
+
+			void		next( FrameInfo &info, uint32_t timestamp );
+
+			uint32_t	mCount, mDropped, mPeriod, mLastTimestamp;
 		};
 				
 		std::shared_ptr<std::thread>	mThread;
@@ -169,12 +252,21 @@ class Kinect {
 
 		BufferManager<uint8_t>			mColorBuffers;
 		BufferManager<uint16_t>			mDepthBuffers;
+		FrameCounter					mVideoCounter, mDepthCounter;
 		
 		volatile bool					mShouldDie;
 		volatile bool					mVideoInfrared;
-		volatile bool					mNewVideoFrame, mNewDepthFrame;
-		volatile bool					mLastVideoFrameInfrared;
+		const bool						mVideoGreen;
+		std::atomic<bool>				mNewVideoFrame, mNewDepthFrame;
 		float							mTilt;
+
+		KinectCaptureWriterRef			mRecorder;
+		KinectCaptureReaderRef			mReplay;
+		bool							mReplayRealTime;
+		volatile bool					mReplayFinished;
+		std::condition_variable_any		mFrameConsumed;
+		std::vector<uint8_t>			mReplayLedState;
+		FrameSourceRef					mFrameSource;
 	};
 
   protected:
@@ -185,10 +277,30 @@ class Kinect {
 	friend class ImageSourceKinectDepth;
 	friend class ImageSourceKinectInfrared;
 
-	static void			threadedFunc( struct Kinect::Obj *arg );
+	static void			replayFunc( struct Kinect::Obj *arg );
+	static void			frameSourceFunc( struct Kinect::Obj *arg );
+
+	//! One thread handles USB events for every live device on the shared context, so adding devices adds no threads
+	//! competing for libusb's event lock. The first open device starts it and the last one to close stops it.
+	static void			eventFunc();
+	static void			acquireEvents();
+	static void			releaseEvents();
+
+	//! Keeps the event thread out of freenect while a device is opened, closed, started or stopped
+	struct EventLock {
+		EventLock();
+		~EventLock();
+	};
 	
 	static std::mutex				sContextMutex;
 	static freenect_context			*sContext;	
+
+	static std::mutex				sEventMutex;		// Held by the event thread while it handles events
+	static std::atomic<int>			sEventWaiters;		// Threads waiting on sEventMutex, which the event thread yields to
+	static std::mutex				sEventThreadMutex;	// Guards starting and stopping the event thread
+	static std::shared_ptr<std::thread>	sEventThread;
+	static int						sEventDevices;
+	static std::atomic<bool>		sEventShouldDie;
 	
 	std::shared_ptr<Obj>			mObj;
 };
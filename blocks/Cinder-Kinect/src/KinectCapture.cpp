@@ -0,0 +1,271 @@
+#include "KinectCapture.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace cinder { namespace KinectCapture {
+
+static uint64_t alignUp( uint64_t offset )
+{
+	return ( offset + kAlignment - 1 ) & ~uint64_t( kAlignment - 1 );
+}
+
+size_t getFrameSize( uint32_t type )
+{
+	switch( type ) {
+		case FRAME_DEPTH:		return 640 * 480 * sizeof( uint16_t );
+		case FRAME_VIDEO_RGB:	return 640 * 480 * 3;
+		case FRAME_VIDEO_IR:	return 640 * 480;
+		case FRAME_VIDEO_BAYER:	return 640 * 480;
+		default:				return 0;
+	}
+}
+
+static uint64_t nowMicroseconds()
+{
+	return chrono::duration_cast<chrono::microseconds>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+Writer::Writer( const std::string &path )
+	: mClosing( false ), mWriteFailed( false ), mOffset( 0 ), mStartTime( nowMicroseconds() ), mDropped( 0 )
+{
+	memset( mSequence, 0, sizeof mSequence );
+
+	mFile = fopen( path.c_str(), "wb" );
+	if( ! mFile )
+		throw ExcOpenFailed();
+
+	FileHeader header;
+	memset( &header, 0, sizeof header );
+	memcpy( header.magic, kMagic, sizeof header.magic );
+	header.version = kVersion;
+	header.alignment = kAlignment;
+	mWriteFailed = ! writePadded( &header, sizeof header );
+	mOffset = alignUp( sizeof header );
+
+	mThread = thread( &Writer::writeLoop, this );
+}
+
+Writer::~Writer()
+{
+	close();
+}
+
+bool Writer::writePadded( const void *data, size_t size )
+{
+	static const uint8_t zeroes[kAlignment] = { 0 };
+	uint64_t padded = alignUp( size );
+
+	return fwrite( data, 1, size, mFile ) == size && fwrite( zeroes, 1, padded - size, mFile ) == padded - size;
+}
+
+void Writer::writeFrame( FrameType type, const void *data, size_t size, uint32_t deviceTimestamp )
+{
+	lock_guard<mutex> lock( mMutex );
+	if( mClosing || ! mFile )
+		return;
+	if( mQueue.size() >= kMaxPending ) {
+		mDropped++;
+		return;
+	}
+
+	// Offsets are handed out here, in queue order, so the index is complete as soon as the frame is queued
+	mQueue.push_back( Pending() );
+	Pending &pending = mQueue.back();
+	RecordHeader &record = pending.mRecord;
+	record.type = type;
+	record.size = size;
+	record.timestamp = nowMicroseconds() - mStartTime;
+	record.deviceTimestamp = deviceTimestamp;
+	record.sequence = mSequence[type]++;
+
+	if( ! mFreeBuffers.empty() ) {
+		pending.mData.swap( mFreeBuffers.back() );
+		mFreeBuffers.pop_back();
+	}
+	const uint8_t *bytes = (const uint8_t*)data;
+	pending.mData.assign( bytes, bytes + size );
+
+	IndexEntry entry;
+	entry.offset = mOffset + alignUp( sizeof record );
+	entry.timestamp = record.timestamp;
+	entry.type = record.type;
+	entry.size = record.size;
+	entry.deviceTimestamp = record.deviceTimestamp;
+	entry.sequence = record.sequence;
+	mIndex.push_back( entry );
+	mOffset = entry.offset + alignUp( size );
+
+	mWake.notify_one();
+}
+
+void Writer::writeLoop()
+{
+	unique_lock<mutex> lock( mMutex );
+	for(;;) {
+		while( mQueue.empty() && ! mClosing )
+			mWake.wait( lock );
+		if( mQueue.empty() )
+			return;
+
+		// Only this thread pops, so the front stays put while the lock is released
+		Pending &pending = mQueue.front();
+		lock.unlock();
+		if( ! writePadded( &pending.mRecord, sizeof pending.mRecord ) || ! writePadded( pending.mData.data(), pending.mData.size() ) )
+			mWriteFailed = true;
+		lock.lock();
+
+		mFreeBuffers.push_back( vector<uint8_t>() );
+		mFreeBuffers.back().swap( pending.mData );
+		mQueue.pop_front();
+	}
+}
+
+void Writer::close()
+{
+	{
+		lock_guard<mutex> lock( mMutex );
+		if( mClosing )
+			return;
+		mClosing = true;
+	}
+	mWake.notify_one();
+	mThread.join();
+
+	// The writer thread is gone, so the rest needs no lock
+	uint64_t indexOffset = mOffset;
+	bool ok = ! mWriteFailed;
+	if( ! mIndex.empty() )
+		ok = fwrite( &mIndex[0], sizeof( IndexEntry ), mIndex.size(), mFile ) == mIndex.size() && ok;
+	ok = fflush( mFile ) == 0 && ok;
+
+	// Patch the header last, so a partially written index is never trusted.
+	// If any write failed, the magic stays zeroed and no reader takes the file.
+	FileHeader header;
+	memset( &header, 0, sizeof header );
+	if( ok ) {
+		memcpy( header.magic, kMagic, sizeof header.magic );
+		header.version = kVersion;
+		header.alignment = kAlignment;
+		header.indexOffset = indexOffset;
+		header.frameCount = mIndex.size();
+	}
+	if( fseek( mFile, 0, SEEK_SET ) == 0 )
+		fwrite( &header, sizeof header, 1, mFile );
+
+	fclose( mFile );
+	mFile = NULL;
+}
+
+uint64_t Writer::getFrameCount() const
+{
+	lock_guard<mutex> lock( mMutex );
+	return mIndex.size();
+}
+
+uint64_t Writer::getDroppedFrames() const
+{
+	lock_guard<mutex> lock( mMutex );
+	return mDropped;
+}
+
+Reader::Reader( const std::string &path )
+	: mData( NULL ), mSize( 0 )
+{
+	mFd = open( path.c_str(), O_RDONLY );
+	if( mFd < 0 )
+		throw ExcOpenFailed();
+
+	struct stat st;
+	if( fstat( mFd, &st ) < 0 || st.st_size < (off_t)sizeof( FileHeader ) ) {
+		::close( mFd );
+		throw ExcBadFormat();
+	}
+
+	mSize = st.st_size;
+	void *map = mmap( NULL, mSize, PROT_READ, MAP_SHARED, mFd, 0 );
+	if( map == MAP_FAILED ) {
+		::close( mFd );
+		throw ExcOpenFailed();
+	}
+	mData = (const uint8_t*)map;
+
+	const FileHeader *header = (const FileHeader*)mData;
+	if( memcmp( header->magic, kMagic, sizeof header->magic ) || header->version != kVersion || header->alignment != kAlignment ) {
+		munmap( (void*)mData, mSize );
+		::close( mFd );
+		throw ExcBadFormat();
+	}
+
+	// Trust the index only if it fits the file and every entry checks out.
+	// Compared by division, so a huge frame count can't overflow.
+	bool indexed = header->indexOffset && header->indexOffset % kAlignment == 0 && header->indexOffset <= mSize &&
+		header->frameCount <= ( mSize - header->indexOffset ) / sizeof( IndexEntry );
+	if( indexed ) {
+		const IndexEntry *index = (const IndexEntry*)( mData + header->indexOffset );
+		mIndex.assign( index, index + header->frameCount );
+		for( size_t i = 0; i < mIndex.size() && indexed; ++i )
+			indexed = isValid( mIndex[i].type, mIndex[i].offset, mIndex[i].size );
+	}
+	if( ! indexed ) {
+		mIndex.clear();
+		rebuildIndex();
+	}
+
+	madvise( (void*)mData, mSize, MADV_SEQUENTIAL );
+}
+
+Reader::~Reader()
+{
+	munmap( (void*)mData, mSize );
+	::close( mFd );
+}
+
+bool Reader::isValid( uint32_t type, uint64_t offset, uint64_t size ) const
+{
+	if( type < FRAME_DEPTH || type > FRAME_VIDEO_BAYER )
+		return false;
+	if( type != FRAME_LED_STATE && size != getFrameSize( type ) )
+		return false;
+	return offset <= mSize && size <= mSize - offset;
+}
+
+void Reader::rebuildIndex()
+{
+	// Walk records until we reach the end, a truncated frame or a record
+	// that makes no sense. Records of the wrong size for their type are
+	// skipped, since replay would read a whole frame from them.
+	uint64_t offset = alignUp( sizeof( FileHeader ) );
+	while( offset + alignUp( sizeof( RecordHeader ) ) <= mSize ) {
+		const RecordHeader *record = (const RecordHeader*)( mData + offset );
+		uint64_t payload = offset + alignUp( sizeof( RecordHeader ) );
+		if( record->type < FRAME_DEPTH || record->type > FRAME_VIDEO_BAYER || record->size > mSize - payload )
+			break;
+
+		offset = payload + alignUp( record->size );
+		if( ! isValid( record->type, payload, record->size ) )
+			continue;
+
+		IndexEntry entry;
+		entry.offset = payload;
+		entry.timestamp = record->timestamp;
+		entry.type = record->type;
+		entry.size = record->size;
+		entry.deviceTimestamp = record->deviceTimestamp;
+		entry.sequence = record->sequence;
+		mIndex.push_back( entry );
+	}
+}
+
+uint64_t Reader::getDuration() const
+{
+	return mIndex.empty() ? 0 : mIndex.back().timestamp;
+}
+
+} } // namespace cinder::KinectCapture
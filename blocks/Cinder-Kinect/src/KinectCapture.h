@@ -0,0 +1,153 @@
+#pragma once
+
+#include "cinder/Exception.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace cinder {
+
+/*
+ * Capture files hold a sequence of timestamped frame records:
+ *
+ *   FileHeader
+ *   { RecordHeader, padding, payload, padding } ...
+ *   IndexEntry[frameCount]        (written when the file is closed)
+ *
+ * Payloads start on kAlignment boundaries, so a reader can map the file
+ * and hand payload pointers out directly. If the writer never closed the
+ * file, or the index doesn't fit the file, the index is rebuilt by walking
+ * the records. Either way, every frame a reader hands out lies inside the
+ * file and has the full size of its type.
+ */
+
+namespace KinectCapture {
+
+	static const char		kMagic[8] = { 'V', 'M', 'K', 'C', 'A', 'P', '0', '1' };
+	static const uint32_t	kVersion = 1;
+	static const uint32_t	kAlignment = 64;
+
+	typedef enum {
+		FRAME_DEPTH = 1,		//!< 640x480 uint16_t depth
+		FRAME_VIDEO_RGB = 2,	//!< 640x480 packed RGB8
+		FRAME_VIDEO_IR = 3,		//!< 640x480 8-bit infrared
+		FRAME_LED_STATE = 4,	//!< Application-defined LED state, typically an OPC packet
+		FRAME_VIDEO_BAYER = 5	//!< 640x480 raw GRBG Bayer, demosaiced on replay
+	} FrameType;
+
+	//! Payload size of every frame of \a type, or 0 if it varies (FRAME_LED_STATE) or the type is unknown
+	size_t		getFrameSize( uint32_t type );
+
+	struct FileHeader {
+		char		magic[8];
+		uint32_t	version;
+		uint32_t	alignment;
+		uint64_t	indexOffset;	// Zero if the writer did not finish
+		uint64_t	frameCount;
+	};
+
+	struct RecordHeader {
+		uint32_t	type;
+		uint32_t	size;			// Payload size in bytes
+		uint64_t	timestamp;		// Host time in microseconds since the start of the capture
+		uint32_t	deviceTimestamp;
+		uint32_t	sequence;		// Per-type frame counter
+	};
+
+	struct IndexEntry {
+		uint64_t	offset;			// File offset of the payload
+		uint64_t	timestamp;
+		uint32_t	type;
+		uint32_t	size;
+		uint32_t	deviceTimestamp;
+		uint32_t	sequence;
+	};
+
+	//! Base class for capture file exceptions
+	class Exc : public cinder::Exception {
+	};
+
+	//! Exception thrown if a capture file can't be opened or created
+	class ExcOpenFailed : public Exc {
+	};
+
+	//! Exception thrown if a capture file has the wrong format
+	class ExcBadFormat : public Exc {
+	};
+
+	//! Appends frames to a capture file. All methods are thread safe.
+	//! Frames are copied and written by a thread of the writer's own, so callers on the USB thread never wait on the disk.
+	class Writer {
+	  public:
+		Writer( const std::string &path );
+		~Writer();
+
+		//! Queues a copy of the frame. If the disk has fallen kMaxPending frames behind, the frame is dropped instead.
+		void		writeFrame( FrameType type, const void *data, size_t size, uint32_t deviceTimestamp = 0 );
+		//! Writes out queued frames, finishes the index and closes the file. Called automatically on destruction.
+		void		close();
+
+		uint64_t	getFrameCount() const;
+		uint64_t	getDroppedFrames() const;
+
+		static const size_t	kMaxPending = 32;
+
+	  private:
+		struct Pending {
+			RecordHeader			mRecord;
+			std::vector<uint8_t>	mData;
+		};
+
+		mutable std::mutex		mMutex;
+		std::condition_variable	mWake;
+		std::thread				mThread;
+		bool					mClosing;
+		FILE					*mFile;
+		bool					mWriteFailed;	// Only touched by the writer thread, then close()
+		uint64_t				mOffset;		// Where the next record goes, counting frames still queued
+		uint64_t				mStartTime;
+		uint64_t				mDropped;
+		uint32_t				mSequence[FRAME_VIDEO_BAYER + 1];
+		std::vector<IndexEntry>	mIndex;
+		std::deque<Pending>		mQueue;
+		std::vector<std::vector<uint8_t> >	mFreeBuffers;	// Payload buffers to reuse
+
+		void		writeLoop();
+		bool		writePadded( const void *data, size_t size );
+	};
+
+	//! Read-only memory mapped view of a capture file
+	class Reader {
+	  public:
+		Reader( const std::string &path );
+		~Reader();
+
+		size_t				getFrameCount() const { return mIndex.size(); }
+		const IndexEntry&	getEntry( size_t i ) const { return mIndex[i]; }
+		const uint8_t*		getPayload( size_t i ) const { return mData + mIndex[i].offset; }
+
+		//! Returns the capture duration in microseconds
+		uint64_t			getDuration() const;
+
+	  private:
+		int						mFd;
+		const uint8_t			*mData;
+		size_t					mSize;
+		std::vector<IndexEntry>	mIndex;
+
+		bool		isValid( uint32_t type, uint64_t offset, uint64_t size ) const;
+		void		rebuildIndex();
+	};
+
+} // namespace KinectCapture
+
+typedef std::shared_ptr<KinectCapture::Writer>	KinectCaptureWriterRef;
+typedef std::shared_ptr<KinectCapture::Reader>	KinectCaptureReaderRef;
+
+} // namespace cinder
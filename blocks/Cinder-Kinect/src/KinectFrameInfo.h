@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace cinder {
+
+//! Metadata delivered with each depth or video frame. Kept out of CinderFreenect.h so code that only handles frames, like frame pairing, builds without freenect or the rest of Cinder.
+struct KinectFrameInfo {
+	KinectFrameInfo() : mTimestamp( 0 ), mSequence( 0 ), mDropped( 0 ), mPeriod( 0 ), mChannels( 0 ) {}
+
+	uint32_t	mTimestamp;		//!< Device timestamp. Depth and video share one clock, and replays keep the recorded values.
+	uint32_t	mSequence;		//!< Number of frames delivered on this stream before this one
+	uint32_t	mDropped;		//!< Frames missing from this stream so far, judging by gaps between timestamps
+	uint32_t	mPeriod;		//!< Estimated interval between frames in timestamp units, or 0 until known
+	int			mChannels;		//!< Bytes per pixel for video (1 or 3); 1 for depth
+};
+
+} // namespace cinder
@@ -34,6 +34,7 @@
 #include "freenect_internal.h"
 #include "registration.h"
 #include "cameras.h"
+#include "unpack.h"
 #ifdef BUILD_AUDIO
 #include "loader.h"
 #endif
@@ -47,6 +48,7 @@ FREENECTAPI int freenect_init(freenect_context **ctx, freenect_usb_context *usb_
 		return -1;
 
 	memset(*ctx, 0, sizeof(freenect_context));
+	freenect_unpack_init();
 
 	(*ctx)->log_level = LL_WARNING;
 	(*ctx)->enabled_subdevices = (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA
@@ -0,0 +1,37 @@
+#include "cpu.h"
+#include "freenect_internal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>
+
+FN_INTERNAL int freenect_cpu_has_ssse3(void)
+{
+	unsigned a, b, c, d;
+	return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3);
+}
+
+FN_INTERNAL int freenect_cpu_has_avx2(void)
+{
+	unsigned a, b, c, d;
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return 0;
+	// The OS has to save YMM state too (OSXSAVE, then XCR0 bits 1 and 2)
+	if (!(c & bit_OSXSAVE) || !(c & bit_AVX))
+		return 0;
+	unsigned xcr0_lo, xcr0_hi;
+	__asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+	if ((xcr0_lo & 6) != 6)
+		return 0;
+	if (__get_cpuid_max(0, 0) < 7)
+		return 0;
+	__cpuid_count(7, 0, a, b, c, d);
+	return (b & bit_AVX2) != 0;
+}
+
+#else
+
+FN_INTERNAL int freenect_cpu_has_ssse3(void) { return 0; }
+FN_INTERNAL int freenect_cpu_has_avx2(void) { return 0; }
+
+#endif
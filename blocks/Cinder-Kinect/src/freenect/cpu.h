@@ -0,0 +1,9 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Runtime CPU feature checks for the SIMD frame conversions. These are
+// always false on non-x86 builds.
+int freenect_cpu_has_ssse3(void);
+int freenect_cpu_has_avx2(void);
+
+#endif
@@ -0,0 +1,335 @@
+#include "demosaic.h"
+#include "freenect_internal.h"
+#include "cpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DEMOSAIC_X86
+#include <immintrin.h>
+#endif
+
+// Converting a frame in more than one band spawns this many threads per frame
+#ifndef FREENECT_DEMOSAIC_THREADS
+#define FREENECT_DEMOSAIC_THREADS 1
+#endif
+
+#if FREENECT_DEMOSAIC_THREADS > 1
+#include <pthread.h>
+#endif
+
+// Widest row that fits the padded row buffers on the stack
+#define DEMOSAIC_MAX_WIDTH 1280
+
+/* Pixel arrangement:
+ * G R G R G R G R
+ * B G B G B G B G
+ * G R G R G R G R
+ * B G B G B G B G
+ * G R G R G R G R
+ * B G B G B G B G
+ *
+ * To convert a Bayer-pattern into RGB you have to handle four pattern
+ * configurations:
+ * 1)         2)         3)         4)
+ *      B1      B1 G1 B2   R1 G1 R2      R1       <- previous line
+ *   R1 G1 R2   G2 R1 G3   G2 B1 G3   B1 G1 B2    <- current line
+ *      B2      B3 G4 B4   R3 G4 R4      R2       <- next line
+ *   ^  ^  ^
+ *   |  |  next pixel
+ *   |  current pixel
+ *   previous pixel
+ *
+ * The RGB values (r,g,b) for each configuration are calculated as
+ * follows:
+ *
+ * 1) r = (R1 + R2) / 2
+ *    g =  G1
+ *    b = (B1 + B2) / 2
+ *
+ * 2) r =  R1
+ *    g = (G1 + G2 + G3 + G4) / 4
+ *    b = (B1 + B2 + B3 + B4) / 4
+ *
+ * 3) r = (R1 + R2 + R3 + R4) / 4
+ *    g = (G1 + G2 + G3 + G4) / 4
+ *    b =  B1
+ *
+ * 4) r = (R1 + R2) / 2
+ *    g =  G1
+ *    b = (B1 + B2) / 2
+ *
+ * The boundary conditions for the first and last line and the first
+ * and last column are solved via mirroring the second and second last
+ * line and the second and second last column.
+ *
+ * With c the current row and v the average of the previous and next
+ * rows, every average rounded down, that is per pixel:
+ *
+ *   h  = (c[x-1] + c[x+1]) / 2
+ *   vh = (v[x-1] + v[x+1]) / 2
+ *   gm = (h + v[x]) / 2
+ *
+ *               even x           odd x
+ *   even y   (h,  c,  v)      (c,  gm, vh)
+ *   odd y    (vh, gm, c)      (v,  c,  h)
+ *
+ * so the four-way averages above are really nested pairwise averages.
+ */
+static void demosaic_row_scalar(const uint8_t *c, const uint8_t *v, uint8_t *dst, int x0, int x1, int yOdd)
+{
+	int x;
+	for (x = x0; x < x1; x++, dst += 3) {
+		uint8_t h  = (c[x-1] + c[x+1]) >> 1;
+		uint8_t vh = (v[x-1] + v[x+1]) >> 1;
+		uint8_t gm = (h + v[x]) >> 1;
+		if (!yOdd) {
+			if (!(x & 1)) {
+				dst[0] = h;    dst[1] = c[x]; dst[2] = v[x];
+			} else {
+				dst[0] = c[x]; dst[1] = gm;   dst[2] = vh;
+			}
+		} else {
+			if (!(x & 1)) {
+				dst[0] = vh;   dst[1] = gm;   dst[2] = c[x];
+			} else {
+				dst[0] = v[x]; dst[1] = c[x]; dst[2] = h;
+			}
+		}
+	}
+}
+
+// Green plane only: the center pixel at G sites, gm at R and B sites
+static void demosaic_green_row_scalar(const uint8_t *c, const uint8_t *v, uint8_t *dst, int x0, int x1, int yOdd)
+{
+	int x;
+	for (x = x0; x < x1; x++, dst++) {
+		if (((x ^ yOdd) & 1) == 0)
+			*dst = c[x];
+		else
+			*dst = (((c[x-1] + c[x+1]) >> 1) + v[x]) >> 1;
+	}
+}
+
+#ifdef DEMOSAIC_X86
+
+__attribute__((target("ssse3")))
+static inline __m128i avg_floor(__m128i a, __m128i b)
+{
+	// pavgb rounds up; take back the carried half where the sum was odd
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i select_even(__m128i even, __m128i odd)
+{
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	return _mm_or_si128(_mm_and_si128(mask, even), _mm_andnot_si128(mask, odd));
+}
+
+__attribute__((target("ssse3")))
+static inline void store_rgb(uint8_t *dst, __m128i r, __m128i g, __m128i b)
+{
+	#define S(m) _mm_setr_epi8 m
+	__m128i out0 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, S((0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5))),
+		_mm_shuffle_epi8(g, S((-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1)))),
+		_mm_shuffle_epi8(b, S((-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1))));
+	__m128i out1 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, S((-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1))),
+		_mm_shuffle_epi8(g, S((5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10)))),
+		_mm_shuffle_epi8(b, S((-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1))));
+	__m128i out2 = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, S((-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1))),
+		_mm_shuffle_epi8(g, S((-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1)))),
+		_mm_shuffle_epi8(b, S((10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))));
+	#undef S
+	_mm_storeu_si128((__m128i*)(dst + 0), out0);
+	_mm_storeu_si128((__m128i*)(dst + 16), out1);
+	_mm_storeu_si128((__m128i*)(dst + 32), out2);
+}
+
+// Vertical averages for a row. Returns the first column left for scalar code.
+__attribute__((target("ssse3")))
+static int average_rows_ssse3(const uint8_t *prev, const uint8_t *next, uint8_t *v, int width)
+{
+	int x;
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m128i p = _mm_loadu_si128((const __m128i*)(prev + x));
+		__m128i n = _mm_loadu_si128((const __m128i*)(next + x));
+		_mm_storeu_si128((__m128i*)(v + x), avg_floor(p, n));
+	}
+	return x;
+}
+
+// 16 pixels per iteration. Returns the first column left for scalar code.
+__attribute__((target("ssse3")))
+static int demosaic_row_ssse3(const uint8_t *c, const uint8_t *v, uint8_t *dst, int width, int yOdd)
+{
+	int x;
+	for (x = 0; x + 16 <= width; x += 16, dst += 48) {
+		__m128i cm = _mm_loadu_si128((const __m128i*)(c + x - 1));
+		__m128i cc = _mm_loadu_si128((const __m128i*)(c + x));
+		__m128i cp = _mm_loadu_si128((const __m128i*)(c + x + 1));
+		__m128i vm = _mm_loadu_si128((const __m128i*)(v + x - 1));
+		__m128i vv = _mm_loadu_si128((const __m128i*)(v + x));
+		__m128i vp = _mm_loadu_si128((const __m128i*)(v + x + 1));
+
+		__m128i h = avg_floor(cm, cp);
+		__m128i vh = avg_floor(vm, vp);
+		__m128i gm = avg_floor(h, vv);
+
+		// x is even, so even lanes are even columns
+		if (!yOdd)
+			store_rgb(dst, select_even(h, cc), select_even(cc, gm), select_even(vv, vh));
+		else
+			store_rgb(dst, select_even(vh, vv), select_even(gm, cc), select_even(cc, h));
+	}
+	return x;
+}
+
+__attribute__((target("ssse3")))
+static int demosaic_green_row_ssse3(const uint8_t *c, const uint8_t *v, uint8_t *dst, int width, int yOdd)
+{
+	int x;
+	for (x = 0; x + 16 <= width; x += 16, dst += 16) {
+		__m128i cm = _mm_loadu_si128((const __m128i*)(c + x - 1));
+		__m128i cc = _mm_loadu_si128((const __m128i*)(c + x));
+		__m128i cp = _mm_loadu_si128((const __m128i*)(c + x + 1));
+		__m128i vv = _mm_loadu_si128((const __m128i*)(v + x));
+		__m128i gm = avg_floor(avg_floor(cm, cp), vv);
+
+		_mm_storeu_si128((__m128i*)dst, yOdd ? select_even(gm, cc) : select_even(cc, gm));
+	}
+	return x;
+}
+
+#endif // DEMOSAIC_X86
+
+// Shared row loop; writes packed RGB, or just the green plane if 'green' is set
+static void demosaic_rows(const uint8_t *raw, uint8_t *out, int width, int height, int y0, int y1, int green)
+{
+	// Rows padded by one mirrored pixel on each side
+	uint8_t cstack[DEMOSAIC_MAX_WIDTH + 2];
+	uint8_t vstack[DEMOSAIC_MAX_WIDTH + 2];
+	uint8_t *cbuf = cstack;
+	uint8_t *vbuf = vstack;
+	int x, y;
+
+	if (width < 2 || height < 2)
+		return;
+	if (width > DEMOSAIC_MAX_WIDTH) {
+		cbuf = (uint8_t*)malloc(width + 2);
+		vbuf = (uint8_t*)malloc(width + 2);
+		if (!cbuf || !vbuf) {
+			free(cbuf);
+			free(vbuf);
+			return;
+		}
+	}
+	uint8_t *c = cbuf + 1;
+	uint8_t *v = vbuf + 1;
+
+#ifdef DEMOSAIC_X86
+	int simd = freenect_cpu_has_ssse3();
+#endif
+
+	for (y = y0; y < y1; y++) {
+		const uint8_t *cur = raw + y * width;
+		const uint8_t *prev = raw + (y > 0 ? y - 1 : 1) * width;
+		const uint8_t *next = raw + (y < height - 1 ? y + 1 : height - 2) * width;
+		uint8_t *dst = out + y * width * (green ? 1 : 3);
+
+		memcpy(c, cur, width);
+		x = 0;
+#ifdef DEMOSAIC_X86
+		if (simd)
+			x = average_rows_ssse3(prev, next, v, width);
+#endif
+		for (; x < width; x++)
+			v[x] = (prev[x] + next[x]) >> 1;
+		c[-1] = c[1];
+		c[width] = c[width - 2];
+		v[-1] = v[1];
+		v[width] = v[width - 2];
+
+		x = 0;
+		if (green) {
+#ifdef DEMOSAIC_X86
+			if (simd)
+				x = demosaic_green_row_ssse3(c, v, dst, width, y & 1);
+#endif
+			demosaic_green_row_scalar(c, v, dst + x, x, width, y & 1);
+			continue;
+		}
+#ifdef DEMOSAIC_X86
+		if (simd)
+			x = demosaic_row_ssse3(c, v, dst, width, y & 1);
+#endif
+		demosaic_row_scalar(c, v, dst + x * 3, x, width, y & 1);
+	}
+
+	if (cbuf != cstack) {
+		free(cbuf);
+		free(vbuf);
+	}
+}
+
+FN_INTERNAL void freenect_demosaic_rows(const uint8_t *raw, uint8_t *rgb, int width, int height, int y0, int y1)
+{
+	demosaic_rows(raw, rgb, width, height, y0, y1, 0);
+}
+
+FN_INTERNAL void freenect_demosaic_green(const uint8_t *raw, uint8_t *green, int width, int height)
+{
+	demosaic_rows(raw, green, width, height, 0, height, 1);
+}
+
+#if FREENECT_DEMOSAIC_THREADS > 1
+
+struct demosaic_band {
+	const uint8_t *raw;
+	uint8_t *rgb;
+	int width, height, y0, y1;
+};
+
+static void *demosaic_band_thread(void *arg)
+{
+	struct demosaic_band *band = (struct demosaic_band*)arg;
+	freenect_demosaic_rows(band->raw, band->rgb, band->width, band->height, band->y0, band->y1);
+	return NULL;
+}
+
+#endif
+
+FN_INTERNAL void freenect_demosaic(const uint8_t *raw, uint8_t *rgb, int width, int height)
+{
+#if FREENECT_DEMOSAIC_THREADS > 1
+	struct demosaic_band bands[FREENECT_DEMOSAIC_THREADS];
+	pthread_t threads[FREENECT_DEMOSAIC_THREADS];
+	int started[FREENECT_DEMOSAIC_THREADS];
+	int i;
+
+	for (i = 0; i < FREENECT_DEMOSAIC_THREADS; i++) {
+		bands[i].raw = raw;
+		bands[i].rgb = rgb;
+		bands[i].width = width;
+		bands[i].height = height;
+		bands[i].y0 = height * i / FREENECT_DEMOSAIC_THREADS;
+		bands[i].y1 = height * (i + 1) / FREENECT_DEMOSAIC_THREADS;
+	}
+
+	// The calling thread takes the first band. If a thread can't start, do its band here.
+	for (i = 1; i < FREENECT_DEMOSAIC_THREADS; i++)
+		started[i] = pthread_create(&threads[i], NULL, demosaic_band_thread, &bands[i]) == 0;
+	demosaic_band_thread(&bands[0]);
+	for (i = 1; i < FREENECT_DEMOSAIC_THREADS; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			demosaic_band_thread(&bands[i]);
+	}
+#else
+	freenect_demosaic_rows(raw, rgb, width, height, 0, height);
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef DEMOSAIC_H
+#define DEMOSAIC_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bilinear Bayer (GRBG) to packed RGB, see demosaic.c for the exact rules.
+// Rows depend only on their neighbors in the source, so any band of rows
+// [y0, y1) can be converted independently.
+void freenect_demosaic_rows(const uint8_t *raw, uint8_t *rgb, int width, int height, int y0, int y1);
+
+// Whole frame, split across FREENECT_DEMOSAIC_THREADS threads
+void freenect_demosaic(const uint8_t *raw, uint8_t *rgb, int width, int height);
+
+// Green channel of the same interpolation as a single 8-bit plane. It's a
+// third of the output bandwidth, and the G sites pass through untouched.
+void freenect_demosaic_green(const uint8_t *raw, uint8_t *green, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -97,6 +97,12 @@ typedef struct {
 	float reference_pixel_size;  // The size of a single pixel on the zero plane, in mm.
 } freenect_zero_plane_info;
 
+/// precomputed target of one depth pixel
+typedef struct {
+	int32_t x;      // registration_table x, or out of bounds if the pixel can never land in the image
+	int32_t base;   // output index of the target row, for nx = 0
+} freenect_reg_target;
+
 /// all data needed for depth->RGB mapping
 typedef struct {
 	freenect_reg_info        reg_info;
@@ -109,6 +115,8 @@ typedef struct {
 	int32_t* depth_to_rgb_shift;
 	int32_t (*registration_table)[2];  // A table of 640*480 pairs of x,y values.
 	                                   // Index first by pixel, then x:0 and y:1.
+	freenect_reg_target* target_table; // registration_table flattened into output indices, in depth pixel order.
+	int32_t (*target_span)[2];         // Per depth row: the lowest and highest output index it can write.
 } freenect_registration;
 
 
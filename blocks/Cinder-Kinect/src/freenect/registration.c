@@ -27,10 +27,18 @@
 #include <libfreenect.h>
 #include <freenect_internal.h>
 #include "registration.h"
+#include "unpack.h"
+#include "cpu.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define REGISTRATION_X86
+#include <immintrin.h>
+#endif
 
 
 #define REG_X_VAL_SCALE 256 // "fixed-point" precision for double -> int32_t conversion
@@ -55,6 +63,24 @@
 // disabled by default, noise removal better handled in later stages
 // #define DENSE_REGISTRATION
 
+// Registers each frame in this many bands of output rows, on worker threads
+// that start with the first frame and then wait for the next. Ignored with
+// DENSE_REGISTRATION, whose writes depend on order.
+#ifndef FREENECT_REGISTRATION_THREADS
+#define FREENECT_REGISTRATION_THREADS 1
+#endif
+
+// Use the AVX2 gather rows where the CPU has them. Off by default: on the
+// machines we've measured, the gathers are slower than the scalar rows.
+#ifndef FREENECT_REGISTRATION_AVX2
+#define FREENECT_REGISTRATION_AVX2 0
+#endif
+
+#if FREENECT_REGISTRATION_THREADS > 1 && !defined(DENSE_REGISTRATION)
+#include <pthread.h>
+#include <stdint.h>
+#endif
+
 
 /// fill the table of horizontal shift values for metric depth -> RGB conversion
 static void freenect_init_depth_to_rgb(int32_t* depth_to_rgb, freenect_zero_plane_info* zpi)
@@ -73,34 +99,10 @@ static void freenect_init_depth_to_rgb(int32_t* depth_to_rgb, freenect_zero_plan
 	}
 }
 
-// unrolled inner loop of the 11-bit unpacker
-static inline void unpack_8_pixels(uint8_t *raw, uint16_t *frame)
-{
-	uint16_t baseMask = 0x7FF;
-
-	uint8_t r0  = *(raw+0);
-	uint8_t r1  = *(raw+1);
-	uint8_t r2  = *(raw+2);
-	uint8_t r3  = *(raw+3);
-	uint8_t r4  = *(raw+4);
-	uint8_t r5  = *(raw+5);
-	uint8_t r6  = *(raw+6);
-	uint8_t r7  = *(raw+7);
-	uint8_t r8  = *(raw+8);
-	uint8_t r9  = *(raw+9);
-	uint8_t r10 = *(raw+10);
-
-	frame[0] =  (r0<<3)  | (r1>>5);
-	frame[1] = ((r1<<6)  | (r2>>2) )           & baseMask;
-	frame[2] = ((r2<<9)  | (r3<<1) | (r4>>7) ) & baseMask;
-	frame[3] = ((r4<<4)  | (r5>>4) )           & baseMask;
-	frame[4] = ((r5<<7)  | (r6>>1) )           & baseMask;
-	frame[5] = ((r6<<10) | (r7<<2) | (r8>>6) ) & baseMask;
-	frame[6] = ((r8<<5)  | (r9>>3) )           & baseMask;
-	frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
-}
+#ifdef DENSE_REGISTRATION
 
-// apply registration data to a single packed frame
+// apply registration data to a single packed frame, in order, since the
+// neighbor fill overwrites earlier results
 FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm)
 {
 	freenect_registration* reg = &(dev->registration);
@@ -108,23 +110,20 @@ FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input
 	size_t i, *wipe = (size_t*)output_mm;
 	for (i = 0; i < DEPTH_X_RES * DEPTH_Y_RES * sizeof(uint16_t) / sizeof(size_t); i++) wipe[i] = DEPTH_NO_MM_VALUE;
 
-	uint16_t unpack[8];
+	uint16_t unpack[DEPTH_X_RES];
 
 	uint32_t target_offset = DEPTH_Y_RES * reg->reg_pad_info.start_lines;
-	uint32_t x,y,source_index = 8;
+	uint32_t x,y;
 
 	for (y = 0; y < DEPTH_Y_RES; y++) {
-		for (x = 0; x < DEPTH_X_RES; x++) {
+		// unpack a whole row from the packed frame
+		freenect_unpack_11bit( input_packed, unpack, DEPTH_X_RES );
+		input_packed += DEPTH_X_RES * 11 / 8;
 
-			// get 8 pixels from the packed frame
-			if (source_index == 8) {
-				unpack_8_pixels( input_packed, unpack );
-				source_index = 0;
-				input_packed += 11;
-			}
+		for (x = 0; x < DEPTH_X_RES; x++) {
 
 			// get the value at the current depth pixel, convert to millimeters
-			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[source_index++] ];
+			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[x] ];
 
 			// so long as the current pixel has a depth value
 			if (metric_depth == DEPTH_NO_MM_VALUE) continue;
@@ -150,40 +149,298 @@ FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input
 			if ((current_depth == DEPTH_NO_MM_VALUE) || (current_depth > metric_depth)) {
 				output_mm[target_index] = metric_depth; // always save depth at current location
 
-				#ifdef DENSE_REGISTRATION
-					// if we're not on the first row, or the first column
-					if ((nx > 0) && (ny > 0)) {
-						output_mm[target_index - DEPTH_X_RES    ] = metric_depth; // save depth at (x,y-1)
-						output_mm[target_index - DEPTH_X_RES - 1] = metric_depth; // save depth at (x-1,y-1)
-						output_mm[target_index               - 1] = metric_depth; // save depth at (x-1,y)
-					} else if (ny > 0) {
-						output_mm[target_index - DEPTH_X_RES] = metric_depth; // save depth at (x,y-1)
-					} else if (nx > 0) {
-						output_mm[target_index - 1] = metric_depth; // save depth at (x-1,y)
-					}
-				#endif
+				// if we're not on the first row, or the first column
+				if ((nx > 0) && (ny > 0)) {
+					output_mm[target_index - DEPTH_X_RES    ] = metric_depth; // save depth at (x,y-1)
+					output_mm[target_index - DEPTH_X_RES - 1] = metric_depth; // save depth at (x-1,y-1)
+					output_mm[target_index               - 1] = metric_depth; // save depth at (x-1,y)
+				} else if (ny > 0) {
+					output_mm[target_index - DEPTH_X_RES] = metric_depth; // save depth at (x,y-1)
+				} else if (nx > 0) {
+					output_mm[target_index - 1] = metric_depth; // save depth at (x-1,y)
+				}
 			}
 		}
 	}
 	return 0;
 }
 
+#else
+
+/*
+ * Without the neighbor fill, each output pixel ends up with the nearest depth
+ * that lands on it, whatever order pixels are visited in. So the output is
+ * split into bands, and each band visits just the depth rows that can reach
+ * it (target_span) and keeps only its own writes. Bands never touch the same
+ * memory and the result is identical for any band count.
+ */
+
+static inline void register_pixel(const freenect_registration* reg, uint16_t raw, const freenect_reg_target* target,
+                                  uint16_t* output_mm, int32_t lo, int32_t hi)
+{
+	// get the value at the current depth pixel, convert to millimeters
+	uint16_t metric_depth = reg->raw_to_mm_shift[raw];
+
+	// so long as the current pixel has a depth value
+	if (metric_depth == DEPTH_NO_MM_VALUE) return;
+	if (metric_depth >= DEPTH_MAX_METRIC_VALUE) return;
+
+	// registration_table for the basic rectification and
+	// depth_to_rgb_shift for determining the x shift
+	int32_t nx = (target->x + reg->depth_to_rgb_shift[metric_depth]) / REG_X_VAL_SCALE;
+	if (nx < 0 || nx >= DEPTH_X_RES) return;
+
+	int32_t target_index = DEPTH_MIRROR_X ? target->base - nx : target->base + nx;
+	if (target_index < lo || target_index >= hi) return;
+
+	// make sure the new location is empty, or the new value is closer
+	uint16_t current_depth = output_mm[target_index];
+	if ((current_depth == DEPTH_NO_MM_VALUE) || (current_depth > metric_depth))
+		output_mm[target_index] = metric_depth;
+}
+
+#ifdef REGISTRATION_X86
+
+// 8 pixels per iteration, with the table lookups as gathers. Returns the first
+// column left for scalar code.
+__attribute__((target("avx2")))
+static int register_row_avx2(const freenect_registration* reg, const uint16_t* raw, const freenect_reg_target* targets,
+                             uint16_t* output_mm, int32_t lo, int32_t hi)
+{
+	const __m256i noDepth = _mm256_set1_epi32(DEPTH_NO_MM_VALUE);
+	const __m256i maxDepth = _mm256_set1_epi32(DEPTH_MAX_METRIC_VALUE);
+	const __m256i width = _mm256_set1_epi32(DEPTH_X_RES);
+	const __m256i lower = _mm256_set1_epi32(lo - 1);
+	const __m256i upper = _mm256_set1_epi32(hi);
+	const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	int x;
+
+	for (x = 0; x + 8 <= DEPTH_X_RES; x += 8) {
+		// raw_to_mm_shift has a spare entry, so the 32-bit gather of the last one stays in bounds
+		__m256i index = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(raw + x)));
+		__m256i depth = _mm256_and_si256(_mm256_i32gather_epi32((const int*)reg->raw_to_mm_shift, index, 2), _mm256_set1_epi32(0xFFFF));
+		__m256i valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(depth, noDepth), _mm256_cmpgt_epi32(maxDepth, depth));
+		__m256i shift = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)reg->depth_to_rgb_shift, depth, valid, 4);
+
+		// Split 8 {x, base} pairs into a vector of each
+		__m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(targets + x)), deinterleave);
+		__m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(targets + x + 4)), deinterleave);
+		__m256i tx = _mm256_permute2x128_si256(a, b, 0x20);
+		__m256i base = _mm256_permute2x128_si256(a, b, 0x31);
+
+		// Divide by REG_X_VAL_SCALE, rounding toward zero like C division
+		__m256i sum = _mm256_add_epi32(tx, shift);
+		__m256i nx = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_and_si256(_mm256_srai_epi32(sum, 31), _mm256_set1_epi32(REG_X_VAL_SCALE - 1))), 8);
+		valid = _mm256_and_si256(valid, _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), nx), _mm256_cmpgt_epi32(width, nx)));
+
+		__m256i target = DEPTH_MIRROR_X ? _mm256_sub_epi32(base, nx) : _mm256_add_epi32(base, nx);
+		valid = _mm256_and_si256(valid, _mm256_and_si256(_mm256_cmpgt_epi32(target, lower), _mm256_cmpgt_epi32(upper, target)));
+
+		int mask = _mm256_movemask_ps(_mm256_castsi256_ps(valid));
+		if (!mask)
+			continue;
+
+		// There's no scatter, so the z-buffer test stays scalar
+		int32_t targetLanes[8], depthLanes[8];
+		_mm256_storeu_si256((__m256i*)targetLanes, target);
+		_mm256_storeu_si256((__m256i*)depthLanes, depth);
+		while (mask) {
+			int lane = __builtin_ctz(mask);
+			mask &= mask - 1;
+			uint16_t metric_depth = depthLanes[lane];
+			uint16_t current_depth = output_mm[targetLanes[lane]];
+			if ((current_depth == DEPTH_NO_MM_VALUE) || (current_depth > metric_depth))
+				output_mm[targetLanes[lane]] = metric_depth;
+		}
+	}
+	return x;
+}
+
+#endif // REGISTRATION_X86
+
+// Checked once by freenect_init_registration, not with cpuid in every band.
+// Only ever set, so bands already running never see it change.
+static int has_avx2 = 0;
+
+typedef struct {
+	const freenect_registration* reg;
+	const uint8_t* input_packed;
+	uint16_t* output_mm;
+	int32_t lo, hi;     // output indices owned by this band
+	int simd;
+} registration_band;
+
+static void* register_band(void* arg)
+{
+	registration_band* band = (registration_band*)arg;
+	const freenect_registration* reg = band->reg;
+	uint16_t unpack[DEPTH_X_RES];
+	uint32_t y;
+
+	// DEPTH_NO_MM_VALUE is zero
+	memset(band->output_mm + band->lo, 0, (band->hi - band->lo) * sizeof(uint16_t));
+
+	for (y = 0; y < DEPTH_Y_RES; y++) {
+		// skip depth rows that can't land in this band
+		if (reg->target_span[y][1] < band->lo || reg->target_span[y][0] >= band->hi)
+			continue;
+
+		freenect_unpack_11bit( band->input_packed + y * (DEPTH_X_RES * 11 / 8), unpack, DEPTH_X_RES );
+		const freenect_reg_target* targets = reg->target_table + y * DEPTH_X_RES;
+
+		int x = 0;
+#ifdef REGISTRATION_X86
+		if (band->simd)
+			x = register_row_avx2(reg, unpack, targets, band->output_mm, band->lo, band->hi);
+#endif
+		for (; x < DEPTH_X_RES; x++)
+			register_pixel(reg, unpack[x], targets + x, band->output_mm, band->lo, band->hi);
+	}
+	return NULL;
+}
+
+static void init_band(registration_band* band, const freenect_registration* reg, const uint8_t* input_packed,
+                      uint16_t* output_mm, int index, int count, int simd)
+{
+	const int32_t size = DEPTH_X_RES * DEPTH_Y_RES;
+	band->reg = reg;
+	band->input_packed = input_packed;
+	band->output_mm = output_mm;
+	band->lo = size * index / count;
+	band->hi = size * (index + 1) / count;
+	band->simd = simd && has_avx2;
+}
+
+FN_INTERNAL int freenect_apply_registration_bands(const freenect_registration* reg, const uint8_t* input_packed,
+                                                  uint16_t* output_mm, int num_bands, int simd)
+{
+	registration_band band;
+	int i;
+	for (i = 0; i < num_bands; i++) {
+		init_band(&band, reg, input_packed, output_mm, i, num_bands, simd);
+		register_band(&band);
+	}
+	return 0;
+}
+
+#if FREENECT_REGISTRATION_THREADS > 1
+
+/*
+ * Worker i registers band i of each frame; the calling thread takes band 0,
+ * and any band whose worker couldn't start. Workers are shared by every
+ * device and live as long as the process, asleep between frames. Frames go
+ * through one at a time.
+ */
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;			// generation changed
+	pthread_cond_t		done;			// pending reached zero
+	registration_band*	bands;
+	unsigned			generation;		// frames handed out so far
+	int					pending;		// workers still busy with this frame
+	int					workers;		// running, for bands 1 through workers
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0 };
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_frame = PTHREAD_MUTEX_INITIALIZER;
+
+static void* pool_worker(void* arg)
+{
+	int index = (int)(intptr_t)arg;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == seen)
+			pthread_cond_wait(&pool.wake, &pool.lock);
+		seen = pool.generation;
+		registration_band* band = &pool.bands[index];
+		pthread_mutex_unlock(&pool.lock);
+
+		register_band(band);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	return NULL;
+}
+
+static void pool_start(void)
+{
+	int i;
+	for (i = 1; i < FREENECT_REGISTRATION_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, pool_worker, (void*)(intptr_t)i) != 0)
+			break;
+		pthread_detach(thread);
+		pool.workers++;
+	}
+}
+
+static void register_bands(registration_band* bands)
+{
+	int i;
+	pthread_once(&pool_once, pool_start);
+	pthread_mutex_lock(&pool_frame);
+
+	pthread_mutex_lock(&pool.lock);
+	pool.bands = bands;
+	pool.pending = pool.workers;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.lock);
+
+	register_band(&bands[0]);
+	for (i = pool.workers + 1; i < FREENECT_REGISTRATION_THREADS; i++)
+		register_band(&bands[i]);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool_frame);
+}
+
+#else
+
+static void register_bands(registration_band* bands)
+{
+	register_band(&bands[0]);
+}
+
+#endif // FREENECT_REGISTRATION_THREADS > 1
+
+// apply registration data to a single packed frame
+FN_INTERNAL int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm)
+{
+	registration_band bands[FREENECT_REGISTRATION_THREADS];
+	int i;
+
+	for (i = 0; i < FREENECT_REGISTRATION_THREADS; i++)
+		init_band(&bands[i], &(dev->registration), input_packed, output_mm, i, FREENECT_REGISTRATION_THREADS,
+		          FREENECT_REGISTRATION_AVX2);
+
+	register_bands(bands);
+	return 0;
+}
+
+#endif // DENSE_REGISTRATION
+
 // Same as freenect_apply_registration, but don't bother aligning to the RGB image
 FN_INTERNAL int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm)
 {
 	freenect_registration* reg = &(dev->registration);
-	uint16_t unpack[8];
-	uint32_t x,y,source_index = 8;
+	uint16_t unpack[DEPTH_X_RES];
+	uint32_t x,y;
 	for (y = 0; y < DEPTH_Y_RES; y++) {
+		// unpack a whole row from the packed frame
+		freenect_unpack_11bit( input_packed, unpack, DEPTH_X_RES );
+		input_packed += DEPTH_X_RES * 11 / 8;
 		for (x = 0; x < DEPTH_X_RES; x++) {
-			// get 8 pixels from the packed frame
-			if (source_index == 8) {
-				unpack_8_pixels( input_packed, unpack );
-				source_index = 0;
-				input_packed += 11;
-			}
 			// get the value at the current depth pixel, convert to millimeters
-			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[source_index++] ];
+			uint16_t metric_depth = reg->raw_to_mm_shift[ unpack[x] ];
 			output_mm[y * DEPTH_X_RES + x] = metric_depth < DEPTH_MAX_METRIC_VALUE ? metric_depth : DEPTH_MAX_METRIC_VALUE;
 		}
 	}
@@ -288,6 +545,44 @@ static void freenect_init_registration_table(int32_t (*registration_table)[2], f
 	free(regtable_dy);
 }
 
+// flatten registration_table into output indices and find which output each depth row can reach
+static void freenect_init_target_table(freenect_registration* reg)
+{
+	int32_t target_offset = DEPTH_Y_RES * reg->reg_pad_info.start_lines;
+	int32_t size = DEPTH_X_RES * DEPTH_Y_RES;
+	int32_t x, y;
+
+	for (y = 0; y < DEPTH_Y_RES; y++) {
+		int32_t lo = INT32_MAX, hi = INT32_MIN;
+		for (x = 0; x < DEPTH_X_RES; x++) {
+			int32_t reg_index = DEPTH_MIRROR_X ? ((y + 1) * DEPTH_X_RES - x - 1) : (y * DEPTH_X_RES + x);
+			int32_t ny = reg->registration_table[reg_index][1];
+			freenect_reg_target* target = &reg->target_table[y * DEPTH_X_RES + x];
+
+			target->x = reg->registration_table[reg_index][0];
+			target->base = (DEPTH_MIRROR_X ? ((ny + 1) * DEPTH_X_RES - 1) : (ny * DEPTH_X_RES)) - target_offset;
+
+			// target_offset isn't a whole number of rows, so a target row can
+			// straddle either end of the output. register_pixel clips those;
+			// only pixels already outside the image, or rows entirely outside
+			// the output, can never be written.
+			int64_t first = (int64_t)target->base - (DEPTH_MIRROR_X ? DEPTH_X_RES - 1 : 0);
+			int64_t last = first + DEPTH_X_RES - 1;
+			if (target->x >= 2 * DEPTH_X_RES * REG_X_VAL_SCALE || last < 0 || first >= size) {
+				target->x = 2 * DEPTH_X_RES * REG_X_VAL_SCALE; // intentionally set value outside image bounds
+				target->base = 0;
+				continue;
+			}
+			if (first < 0) first = 0;
+			if (last > size - 1) last = size - 1;
+			if (first < lo) lo = (int32_t)first;
+			if (last > hi) hi = (int32_t)last;
+		}
+		reg->target_span[y][0] = lo;
+		reg->target_span[y][1] = hi;
+	}
+}
+
 // These are just constants.
 static double parameter_coefficient = 4;
 static double shift_scale = 10;
@@ -312,6 +607,8 @@ static void complete_tables(freenect_registration* reg) {
 	freenect_init_depth_to_rgb( reg->depth_to_rgb_shift, &(reg->zero_plane_info) );
 
 	freenect_init_registration_table( reg->registration_table, &(reg->reg_info) );
+
+	freenect_init_target_table( reg );
 }
 
 /// camera -> world coordinate helper function
@@ -339,14 +636,20 @@ FN_INTERNAL int freenect_init_registration(freenect_device* dev)
 	// Ensure that we free the previous tables before dropping the pointers, if there were any.
 	freenect_destroy_registration(&(dev->registration));
 
-	// Allocate tables.
-	reg->raw_to_mm_shift    = (uint16_t*)malloc( sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE );
+	// Allocate tables. raw_to_mm_shift has one spare entry for 32-bit gathers.
+	reg->raw_to_mm_shift    = (uint16_t*)calloc( DEPTH_MAX_RAW_VALUE + 1, sizeof(uint16_t) );
 	reg->depth_to_rgb_shift = (int32_t*)malloc( sizeof( int32_t) * DEPTH_MAX_METRIC_VALUE );
 	reg->registration_table = (int32_t (*)[2])malloc( sizeof( int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2 );
+	reg->target_table       = (freenect_reg_target*)malloc( sizeof(freenect_reg_target) * DEPTH_X_RES * DEPTH_Y_RES );
+	reg->target_span        = (int32_t (*)[2])malloc( sizeof( int32_t) * DEPTH_Y_RES * 2 );
 
 	// Fill tables.
 	complete_tables(reg);
 
+#if defined(REGISTRATION_X86) && !defined(DENSE_REGISTRATION)
+	if (!has_avx2 && freenect_cpu_has_avx2())
+		has_avx2 = 1;
+#endif
 	return 0;
 }
 
@@ -357,9 +660,11 @@ freenect_registration freenect_copy_registration(freenect_device* dev)
 	retval.reg_pad_info = dev->registration.reg_pad_info;
 	retval.zero_plane_info = dev->registration.zero_plane_info;
 	retval.const_shift = dev->registration.const_shift;
-	retval.raw_to_mm_shift    = (uint16_t*)malloc( sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE );
+	retval.raw_to_mm_shift    = (uint16_t*)calloc( DEPTH_MAX_RAW_VALUE + 1, sizeof(uint16_t) );
 	retval.depth_to_rgb_shift = (int32_t*)malloc( sizeof( int32_t) * DEPTH_MAX_METRIC_VALUE );
 	retval.registration_table = (int32_t (*)[2])malloc( sizeof( int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2 );
+	retval.target_table       = (freenect_reg_target*)malloc( sizeof(freenect_reg_target) * DEPTH_X_RES * DEPTH_Y_RES );
+	retval.target_span        = (int32_t (*)[2])malloc( sizeof( int32_t) * DEPTH_Y_RES * 2 );
 	complete_tables(&retval);
 	return retval;
 }
@@ -378,5 +683,13 @@ int freenect_destroy_registration(freenect_registration* reg)
 		free(reg->registration_table);
 		reg->registration_table = NULL;
 	}
+	if (reg->target_table) {
+		free(reg->target_table);
+		reg->target_table = NULL;
+	}
+	if (reg->target_span) {
+		free(reg->target_span);
+		reg->target_span = NULL;
+	}
 	return 0;
 }
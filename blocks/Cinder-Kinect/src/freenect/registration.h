@@ -34,4 +34,12 @@ int freenect_init_registration(freenect_device* dev);
 int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
 int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
 
+// freenect_apply_registration split into 'num_bands' output bands, all on the
+// calling thread, using AVX2 rows only if 'simd' is set and the CPU has it
+// (as checked by freenect_init_registration).
+// The output is the same either way; this lets tests check that. Not built
+// with DENSE_REGISTRATION.
+int freenect_apply_registration_bands(const freenect_registration* reg, const uint8_t* input_packed,
+                                      uint16_t* output_mm, int num_bands, int simd);
+
 #endif
@@ -0,0 +1,157 @@
+#include "unpack.h"
+#include "freenect_internal.h"
+#include "cpu.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define UNPACK_X86
+#include <immintrin.h>
+#endif
+
+FN_INTERNAL void freenect_unpack_11bit_scalar(const uint8_t *raw, uint16_t *frame, int n)
+{
+	uint16_t baseMask = (1 << 11) - 1;
+	while(n >= 8)
+	{
+		uint8_t r0  = *(raw+0);
+		uint8_t r1  = *(raw+1);
+		uint8_t r2  = *(raw+2);
+		uint8_t r3  = *(raw+3);
+		uint8_t r4  = *(raw+4);
+		uint8_t r5  = *(raw+5);
+		uint8_t r6  = *(raw+6);
+		uint8_t r7  = *(raw+7);
+		uint8_t r8  = *(raw+8);
+		uint8_t r9  = *(raw+9);
+		uint8_t r10 = *(raw+10);
+
+		frame[0] =  (r0<<3)  | (r1>>5);
+		frame[1] = ((r1<<6)  | (r2>>2) )           & baseMask;
+		frame[2] = ((r2<<9)  | (r3<<1) | (r4>>7) ) & baseMask;
+		frame[3] = ((r4<<4)  | (r5>>4) )           & baseMask;
+		frame[4] = ((r5<<7)  | (r6>>1) )           & baseMask;
+		frame[5] = ((r6<<10) | (r7<<2) | (r8>>6) ) & baseMask;
+		frame[6] = ((r8<<5)  | (r9>>3) )           & baseMask;
+		frame[7] = ((r9<<8)  | (r10)   )           & baseMask;
+
+		n -= 8;
+		raw += 11;
+		frame += 8;
+	}
+}
+
+#ifdef UNPACK_X86
+
+/*
+ * Each group of 8 pixels is 11 bytes. Pixel i starts at bit 11*i, so it
+ * begins in byte b = 11*i/8 at bit offset k = 11*i%8. In 16-bit lanes:
+ *
+ *   pixel = (((raw[b] << 8 | raw[b+1]) << k) & 0xFFFF) >> 5 | raw[b+2] >> (13 - k)
+ *
+ * The per-lane left shift is a multiply by 1 << k. The third byte only
+ * matters for k = 6 and 7 (pixels 2 and 5). It gets shuffled into the
+ * high byte and shifted down with a high-half multiply.
+ */
+#define UNPACK_SHUFFLE_HI	1, 0, 2, 1, 3, 2, 5, 4, 6, 5, 7, 6, 9, 8, 10, 9
+#define UNPACK_SHUFFLE_LO	-1, -1, -1, -1, -1, 4, -1, -1, -1, -1, -1, 8, -1, -1, -1, -1
+#define UNPACK_MUL_HI		1, 8, 64, 2, 16, 128, 4, 32
+#define UNPACK_MUL_LO		0, 0, 2, 0, 0, 4, 0, 0
+
+__attribute__((target("ssse3")))
+static inline __m128i unpack_group_ssse3(__m128i bytes)
+{
+	const __m128i shuffleHi = _mm_setr_epi8(UNPACK_SHUFFLE_HI);
+	const __m128i shuffleLo = _mm_setr_epi8(UNPACK_SHUFFLE_LO);
+	const __m128i mulHi = _mm_setr_epi16(UNPACK_MUL_HI);
+	const __m128i mulLo = _mm_setr_epi16(UNPACK_MUL_LO);
+
+	__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(bytes, shuffleHi), mulHi), 5);
+	__m128i lo = _mm_mulhi_epu16(_mm_shuffle_epi8(bytes, shuffleLo), mulLo);
+	return _mm_or_si128(hi, lo);
+}
+
+__attribute__((target("ssse3")))
+static void unpack_11bit_ssse3(const uint8_t *raw, uint16_t *frame, int n)
+{
+	// Each group loads 16 bytes, so stop while a full load still fits
+	while (n >= 32) {
+		__m128i a = unpack_group_ssse3(_mm_loadu_si128((const __m128i*)(raw + 0)));
+		__m128i b = unpack_group_ssse3(_mm_loadu_si128((const __m128i*)(raw + 11)));
+		_mm_storeu_si128((__m128i*)(frame + 0), a);
+		_mm_storeu_si128((__m128i*)(frame + 8), b);
+		n -= 16;
+		raw += 22;
+		frame += 16;
+	}
+	freenect_unpack_11bit_scalar(raw, frame, n);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i unpack_groups_avx2(const uint8_t *raw)
+{
+	const __m256i shuffleHi = _mm256_setr_epi8(UNPACK_SHUFFLE_HI, UNPACK_SHUFFLE_HI);
+	const __m256i shuffleLo = _mm256_setr_epi8(UNPACK_SHUFFLE_LO, UNPACK_SHUFFLE_LO);
+	const __m256i mulHi = _mm256_setr_epi16(UNPACK_MUL_HI, UNPACK_MUL_HI);
+	const __m256i mulLo = _mm256_setr_epi16(UNPACK_MUL_LO, UNPACK_MUL_LO);
+
+	// One 11-byte group in each 128-bit lane, since the byte shuffle doesn't cross lanes
+	__m256i bytes = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)raw)),
+		_mm_loadu_si128((const __m128i*)(raw + 11)), 1);
+
+	__m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(bytes, shuffleHi), mulHi), 5);
+	__m256i lo = _mm256_mulhi_epu16(_mm256_shuffle_epi8(bytes, shuffleLo), mulLo);
+	return _mm256_or_si256(hi, lo);
+}
+
+__attribute__((target("avx2")))
+static void unpack_11bit_avx2(const uint8_t *raw, uint16_t *frame, int n)
+{
+	while (n >= 48) {
+		_mm256_storeu_si256((__m256i*)(frame + 0), unpack_groups_avx2(raw + 0));
+		_mm256_storeu_si256((__m256i*)(frame + 16), unpack_groups_avx2(raw + 22));
+		n -= 32;
+		raw += 44;
+		frame += 32;
+	}
+	freenect_unpack_11bit_scalar(raw, frame, n);
+}
+
+#endif // UNPACK_X86
+
+static freenect_unpack_func unpack = 0;
+
+FN_INTERNAL freenect_unpack_func freenect_unpack_11bit_isa(freenect_unpack_isa isa)
+{
+	switch (isa) {
+	case FREENECT_UNPACK_SCALAR:
+		return freenect_unpack_11bit_scalar;
+#ifdef UNPACK_X86
+	case FREENECT_UNPACK_SSSE3:
+		return freenect_cpu_has_ssse3() ? unpack_11bit_ssse3 : 0;
+	case FREENECT_UNPACK_AVX2:
+		return freenect_cpu_has_avx2() ? unpack_11bit_avx2 : 0;
+#endif
+	default:
+		return 0;
+	}
+}
+
+FN_INTERNAL void freenect_unpack_init(void)
+{
+	// Only the first call stores, so later contexts don't race the threads
+	// already unpacking
+	if (unpack)
+		return;
+	freenect_unpack_func best = freenect_unpack_11bit_isa(FREENECT_UNPACK_AVX2);
+	if (!best)
+		best = freenect_unpack_11bit_isa(FREENECT_UNPACK_SSSE3);
+	unpack = best ? best : freenect_unpack_11bit_scalar;
+}
+
+FN_INTERNAL void freenect_unpack_11bit(const uint8_t *raw, uint16_t *frame, int n)
+{
+	freenect_unpack_func f = unpack;
+	if (!f)
+		f = freenect_unpack_11bit_scalar;
+	f(raw, frame, n);
+}
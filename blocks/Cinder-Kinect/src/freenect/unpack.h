@@ -0,0 +1,31 @@
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stdint.h>
+
+typedef void (*freenect_unpack_func)(const uint8_t *raw, uint16_t *frame, int n);
+
+typedef enum {
+	FREENECT_UNPACK_SCALAR,
+	FREENECT_UNPACK_SSSE3,
+	FREENECT_UNPACK_AVX2,
+} freenect_unpack_isa;
+
+// Picks the implementation freenect_unpack_11bit() uses: AVX2 or SSSE3 when
+// the CPU supports one, with the scalar loop as fallback. Called from
+// freenect_init(), before any thread unpacks; until then the scalar loop
+// is used.
+void freenect_unpack_init(void);
+
+// Unpack n 11-bit big-endian packed depth values into 16-bit values.
+// n must be a multiple of 8.
+void freenect_unpack_11bit(const uint8_t *raw, uint16_t *frame, int n);
+
+// The portable implementation, kept for comparison against the SIMD paths
+void freenect_unpack_11bit_scalar(const uint8_t *raw, uint16_t *frame, int n);
+
+// One implementation, for tests and benchmarks. NULL if this build or CPU
+// can't run it.
+freenect_unpack_func freenect_unpack_11bit_isa(freenect_unpack_isa isa);
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Fixed-size queue between one producer thread and one consumer thread,
+// without locks. Neither side ever waits on the other: push() fails when
+// the queue is full, and the producer decides whether to retry (backpressure)
+// or let the item go (a drop, which is counted).
+//
+// Slots are reused. Popping moves the item out, so a slot doesn't keep
+// frame buffers alive after the consumer is done with them.
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    struct Stats {
+        uint64_t    pushed;
+        uint64_t    dropped;        // push() calls that found the queue full
+        size_t      maxDepth;       // Most items queued at once
+    };
+
+    // Capacity is rounded up to a power of two
+    explicit BoundedQueue(size_t capacity = 16)
+        : mHead(0), mTail(0), mPushed(0), mDropped(0), mMaxDepth(0)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mSlots.resize(size);
+        mMask = size - 1;
+    }
+
+    // Producer only. Moves from 'item' only if it was queued.
+    bool push(T&& item)
+    {
+        size_t tail = mTail.load(std::memory_order_relaxed);
+        size_t depth = tail - mHead.load(std::memory_order_acquire);
+        if (depth > mMask) {
+            mDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        mSlots[tail & mMask] = std::move(item);
+        mTail.store(tail + 1, std::memory_order_release);
+
+        mPushed.fetch_add(1, std::memory_order_relaxed);
+        if (depth + 1 > mMaxDepth.load(std::memory_order_relaxed)) {
+            mMaxDepth.store(depth + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer only
+    bool pop(T& item)
+    {
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        item = std::move(mSlots[head & mMask]);
+        mSlots[head & mMask] = T();
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Discards everything queued.
+    void clear()
+    {
+        T item;
+        while (pop(item)) {}
+    }
+
+    // Approximate, from any thread
+    size_t size() const { return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire); }
+    size_t capacity() const { return mMask + 1; }
+
+    Stats getStats() const
+    {
+        Stats stats;
+        stats.pushed = mPushed.load(std::memory_order_relaxed);
+        stats.dropped = mDropped.load(std::memory_order_relaxed);
+        stats.maxDepth = mMaxDepth.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    std::vector<T>      mSlots;
+    size_t              mMask;
+
+    // Each index is written by one side only. Kept on separate cache lines
+    // so the two threads don't contend for them.
+    alignas(64) std::atomic<size_t> mHead;
+    alignas(64) std::atomic<size_t> mTail;
+    alignas(64) std::atomic<uint64_t> mPushed;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<size_t> mMaxDepth;
+
+    BoundedQueue(const BoundedQueue&);
+    BoundedQueue& operator=(const BoundedQueue&);
+};
@@ -0,0 +1,119 @@
+#include "BrickVolume.h"
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+
+BrickVolume::BrickVolume()
+    : mSizeX(0), mSizeY(0), mSizeZ(0), mBricksX(0), mBricksY(0), mBricksZ(0)
+{}
+
+bool BrickVolume::resize(int x, int y, int z)
+{
+    if (x == mSizeX && y == mSizeY && z == mSizeZ) {
+        return false;
+    }
+    mSizeX = x;
+    mSizeY = y;
+    mSizeZ = z;
+
+    // Edge bricks may hang over the volume; those voxels are never touched
+    mBricksX = (x + kBrickSize - 1) >> kBrickBits;
+    mBricksY = (y + kBrickSize - 1) >> kBrickBits;
+    mBricksZ = (z + kBrickSize - 1) >> kBrickBits;
+    mPages.assign(size_t(mBricksX) * mBricksY * mBricksZ, -1);
+    mBricks.clear();
+    mPool.clear();
+    return true;
+}
+
+void BrickVolume::clear()
+{
+    for (size_t i = 0; i < mBricks.size(); i++) {
+        mPages[mBricks[i]] = -1;
+    }
+    mBricks.clear();
+    mPool.clear();
+}
+
+size_t BrickVolume::getMemoryBytes() const
+{
+    return mPages.capacity() * sizeof(int32_t) + mBricks.capacity() * sizeof(uint32_t) +
+        mPool.capacity() * sizeof(float);
+}
+
+int32_t BrickVolume::allocate(size_t page)
+{
+    int32_t brick = int32_t(mBricks.size());
+    mBricks.push_back(uint32_t(page));
+    mPool.resize(mPool.size() + kBrickVoxels, 0.0f);
+    return brick;
+}
+
+void BrickVolume::exportDense(VoxelVolume& volume) const
+{
+    exportDense(volume, 0, mSizeZ);
+}
+
+void BrickVolume::exportDense(VoxelVolume& volume, int z0, int z1) const
+{
+    z0 = max(z0, 0);
+    z1 = max(z0, min(z1, mSizeZ));
+    volume.resize(mSizeX, mSizeY, z1 - z0);
+    volume.clear();
+
+    for (size_t i = 0; i < mBricks.size(); i++) {
+        uint32_t page = mBricks[i];
+        int bx = int(page % mBricksX) << kBrickBits;
+        int by = int(page / mBricksX % mBricksY) << kBrickBits;
+        int bz = int(page / (size_t(mBricksX) * mBricksY)) << kBrickBits;
+        if (bz + kBrickSize <= z0 || bz >= z1) {
+            continue;
+        }
+        int width = min(int(kBrickSize), mSizeX - bx);
+        const float *brick = &mPool[i * kBrickVoxels];
+
+        // One brick row at a time, clipped to the slice range
+        for (int z = max(0, z0 - bz); z < kBrickSize && bz + z < z1; z++) {
+            for (int y = 0; y < kBrickSize && by + y < mSizeY; y++) {
+                const float *src = brick + ((z << kBrickBits) + y) * kBrickSize;
+                copy(src, src + width, &volume.at(bx, by + y, bz + z - z0));
+            }
+        }
+    }
+}
+
+void BrickVolume::importDense(const VoxelVolume& volume, float threshold)
+{
+    resize(volume.getSizeX(), volume.getSizeY(), volume.getSizeZ());
+    clear();
+
+    for (int z = 0; z < mSizeZ; z++) {
+        for (int y = 0; y < mSizeY; y++) {
+            for (int x = 0; x < mSizeX; x++) {
+                float v = volume.at(x, y, z);
+                if (fabsf(v) > threshold) {
+                    at(x, y, z) = v;
+                }
+            }
+        }
+    }
+}
+
+bool BrickVolume::assign(int x, int y, int z, const uint32_t* bricks, size_t numBricks)
+{
+    resize(x, y, z);
+    clear();
+
+    for (size_t i = 0; i < numBricks; i++) {
+        if (bricks[i] >= mPages.size() || mPages[bricks[i]] >= 0) {
+            clear();
+            return false;
+        }
+        mPages[bricks[i]] = int32_t(i);
+        mBricks.push_back(bricks[i]);
+    }
+    mPool.assign(numBricks * kBrickVoxels, 0.0f);
+    return true;
+}
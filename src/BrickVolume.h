@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "VoxelVolume.h"
+
+// Sparse float volume made of 8x8x8 bricks, allocated on first write. A
+// flat page table maps each brick position to its slot in one pool, so a
+// lookup is two array reads. A single LED only lights a small part of the
+// scene, and voxels it never reaches cost one page table entry per brick.
+//
+// Bricks are only added, never freed individually; clear() drops them all.
+// References into the pool are invalidated by the next allocation.
+
+class BrickVolume
+{
+public:
+    static const int kBrickBits = 3;
+    static const int kBrickSize = 1 << kBrickBits;
+    static const int kBrickVoxels = kBrickSize * kBrickSize * kBrickSize;
+
+    BrickVolume();
+
+    // Changing the size discards all voxels. Returns true if the size changed.
+    bool resize(int x, int y, int z);
+
+    // Drop all voxels, keeping the pool's capacity
+    void clear();
+    bool empty() const { return mBricks.empty(); }
+
+    int getSizeX() const { return mSizeX; }
+    int getSizeY() const { return mSizeY; }
+    int getSizeZ() const { return mSizeZ; }
+    size_t getNumBricks() const { return mBricks.size(); }
+    size_t getMemoryBytes() const;
+
+    // Zero where no brick has been allocated
+    float get(int x, int y, int z) const
+    {
+        int32_t brick = mPages[pageIndex(x, y, z)];
+        return brick < 0 ? 0.0f : mPool[size_t(brick) * kBrickVoxels + voxelIndex(x, y, z)];
+    }
+
+    // Allocates the brick on first use
+    float& at(int x, int y, int z)
+    {
+        int32_t& brick = mPages[pageIndex(x, y, z)];
+        if (brick < 0) {
+            brick = allocate(pageIndex(x, y, z));
+        }
+        return mPool[size_t(brick) * kBrickVoxels + voxelIndex(x, y, z)];
+    }
+
+    // Alpha blending, as in GL_SRC_ALPHA / GL_ONE_MINUS_SRC_ALPHA. Blending
+    // zero into an empty brick leaves it unallocated.
+    void blend(int x, int y, int z, float value, float alpha)
+    {
+        int32_t brick = mPages[pageIndex(x, y, z)];
+        if (brick < 0 && value * alpha == 0.0f) {
+            return;
+        }
+        float &voxel = at(x, y, z);
+        voxel = value * alpha + voxel * (1.0f - alpha);
+    }
+
+    // Calls fn(x, y, z, value) for every nonzero voxel, brick by brick
+    template <typename Fn> void forEachNonzero(Fn fn) const;
+
+    // Copies into a dense volume of the same size, in VoxelAtlas layout
+    void exportDense(VoxelVolume& volume) const;
+    // Copies slices [z0, z1) only, into a volume that many slices deep. A
+    // grid taller than one texture allows goes to the GPU in pieces.
+    void exportDense(VoxelVolume& volume, int z0, int z1) const;
+    // Replaces the contents, allocating only bricks with a voxel whose
+    // magnitude is above 'threshold'. Voxels at or below it are left empty,
+    // so the faint noise a GPU grid accumulates everywhere stays sparse.
+    void importDense(const VoxelVolume& volume, float threshold = 0.0f);
+
+    // Raw storage, for saving. Brick slot i holds its voxels at
+    // getVoxels() + i * kBrickVoxels, for the brick at page getBricks()[i].
+    size_t getNumPages() const { return mPages.size(); }
+    const int32_t* getPages() const { return mPages.empty() ? 0 : &mPages[0]; }
+    const uint32_t* getBricks() const { return mBricks.empty() ? 0 : &mBricks[0]; }
+    const float* getVoxels() const { return mPool.empty() ? 0 : &mPool[0]; }
+    float* getVoxels() { return mPool.empty() ? 0 : &mPool[0]; }
+
+    // Replaces the contents with the given bricks, zeroed, ready to be
+    // filled through getVoxels(). Returns false, leaving the volume empty,
+    // if a brick is out of range or repeated.
+    bool assign(int x, int y, int z, const uint32_t* bricks, size_t numBricks);
+
+private:
+    size_t pageIndex(int x, int y, int z) const
+    {
+        return (size_t(z >> kBrickBits) * mBricksY + (y >> kBrickBits)) * mBricksX + (x >> kBrickBits);
+    }
+
+    static int voxelIndex(int x, int y, int z)
+    {
+        const int mask = kBrickSize - 1;
+        return (((z & mask) << kBrickBits) + (y & mask)) * kBrickSize + (x & mask);
+    }
+
+    int32_t allocate(size_t page);
+
+    int mSizeX, mSizeY, mSizeZ;
+    int mBricksX, mBricksY, mBricksZ;
+    std::vector<int32_t>    mPages;     // Brick slot per brick position, or -1
+    std::vector<uint32_t>   mBricks;    // Page index of each allocated brick
+    std::vector<float>      mPool;      // kBrickVoxels floats per brick
+};
+
+template <typename Fn> void BrickVolume::forEachNonzero(Fn fn) const
+{
+    for (size_t i = 0; i < mBricks.size(); i++) {
+        uint32_t page = mBricks[i];
+        int bx = int(page % mBricksX) << kBrickBits;
+        int by = int(page / mBricksX % mBricksY) << kBrickBits;
+        int bz = int(page / (size_t(mBricksX) * mBricksY)) << kBrickBits;
+        const float *voxels = &mPool[i * kBrickVoxels];
+
+        for (int z = 0; z < kBrickSize; z++) {
+            for (int y = 0; y < kBrickSize; y++) {
+                for (int x = 0; x < kBrickSize; x++, voxels++) {
+                    if (*voxels != 0.0f) {
+                        fn(bx + x, by + y, bz + z, *voxels);
+                    }
+                }
+            }
+        }
+    }
+}
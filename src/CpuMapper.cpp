@@ -0,0 +1,573 @@
+#include "CpuMapper.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+
+// Missing depth threshold, shared with depthMask.glslf
+static const float kDepthMinimum = 1e-4f;
+
+// Texture coordinate offset used by slice.glslv when sampling the filter
+static const float kFilterOffset = 0.01f;
+
+// Normalization of unsigned integer textures
+static const float kDepthScale = 65535.0f;
+static const float kColorScale = 255.0f;
+
+
+// Each reduction combines 'count' input rows element-wise into 'dst'. The
+// same kernels handle horizontal windows (rows are shifted pointers into one
+// padded scanline) and vertical windows (rows are separate scanlines).
+
+static void reduceMax16(uint16_t *dst, const uint16_t* const* rows, int count, int width)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    for (; x + 16 <= width; x += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            v = _mm256_max_epu16(v, _mm256_loadu_si256((const __m256i*) (rows[k] + x)));
+        }
+        _mm256_storeu_si256((__m256i*) (dst + x), v);
+    }
+#elif defined(__SSE2__)
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            // Unsigned max without SSE4.1: max(a,b) = (a -sat b) + b
+            __m128i s = _mm_loadu_si128((const __m128i*) (rows[k] + x));
+            v = _mm_add_epi16(_mm_subs_epu16(v, s), s);
+        }
+        _mm_storeu_si128((__m128i*) (dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        uint16_t v = rows[0][x];
+        for (int k = 1; k < count; k++) {
+            v = max(v, rows[k][x]);
+        }
+        dst[x] = v;
+    }
+}
+
+static void reduceMin16(uint16_t *dst, const uint16_t* const* rows, int count, int width)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    for (; x + 16 <= width; x += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            v = _mm256_min_epu16(v, _mm256_loadu_si256((const __m256i*) (rows[k] + x)));
+        }
+        _mm256_storeu_si256((__m256i*) (dst + x), v);
+    }
+#elif defined(__SSE2__)
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            // Unsigned min without SSE4.1: min(a,b) = a - (a -sat b)
+            __m128i s = _mm_loadu_si128((const __m128i*) (rows[k] + x));
+            v = _mm_sub_epi16(v, _mm_subs_epu16(v, s));
+        }
+        _mm_storeu_si128((__m128i*) (dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        uint16_t v = rows[0][x];
+        for (int k = 1; k < count; k++) {
+            v = min(v, rows[k][x]);
+        }
+        dst[x] = v;
+    }
+}
+
+static void reduceSum32(int32_t *dst, const int32_t* const* rows, int count, int width)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    for (; x + 8 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            v = _mm256_add_epi32(v, _mm256_loadu_si256((const __m256i*) (rows[k] + x)));
+        }
+        _mm256_storeu_si256((__m256i*) (dst + x), v);
+    }
+#elif defined(__SSE2__)
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (rows[0] + x));
+        for (int k = 1; k < count; k++) {
+            v = _mm_add_epi32(v, _mm_loadu_si128((const __m128i*) (rows[k] + x)));
+        }
+        _mm_storeu_si128((__m128i*) (dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        int32_t v = rows[0][x];
+        for (int k = 1; k < count; k++) {
+            v += rows[k][x];
+        }
+        dst[x] = v;
+    }
+}
+
+// Sliding window update for column sums: dst += add - sub
+static void slideSum32(int32_t *dst, const int32_t *add, const int32_t *sub, int width)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    for (; x + 8 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (dst + x));
+        v = _mm256_add_epi32(v, _mm256_loadu_si256((const __m256i*) (add + x)));
+        v = _mm256_sub_epi32(v, _mm256_loadu_si256((const __m256i*) (sub + x)));
+        _mm256_storeu_si256((__m256i*) (dst + x), v);
+    }
+#elif defined(__SSE2__)
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (dst + x));
+        v = _mm_add_epi32(v, _mm_loadu_si128((const __m128i*) (add + x)));
+        v = _mm_sub_epi32(v, _mm_loadu_si128((const __m128i*) (sub + x)));
+        _mm_storeu_si128((__m128i*) (dst + x), v);
+    }
+#endif
+    for (; x < width; x++) {
+        dst[x] += add[x] - sub[x];
+    }
+}
+
+// Copy a scanline with 'radius' clamped pixels on each side, matching GL_CLAMP_TO_EDGE
+template <typename T>
+static void padRow(vector<T>& pad, const T *row, int width, int radius)
+{
+    pad.resize(width + 2 * radius);
+    fill(pad.begin(), pad.begin() + radius, row[0]);
+    copy(row, row + width, pad.begin() + radius);
+    fill(pad.begin() + radius + width, pad.end(), row[width - 1]);
+}
+
+// Same median as filter.glslf, on integer color differences
+static inline int median3(int a, int b, int c)
+{
+    return max(min(a, b), min(max(a, b), c));
+}
+
+CpuMapper::CpuMapper()
+    : mWidth(0), mHeight(0), mNumThreads(1), mScratch(1)
+{}
+
+void CpuMapper::setup(unsigned width, unsigned height, unsigned numThreads)
+{
+    mWidth = width;
+    mHeight = height;
+    mNumThreads = numThreads ? numThreads : max(1u, thread::hardware_concurrency());
+    mPool.setup(mNumThreads);
+
+    mRowMax.resize(width * height);
+    mRowMin.resize(width * height);
+    mDiff.resize(width * height);
+    mRowSum.resize(width * height);
+
+    // Sized for the default radii; a larger radius grows them once
+    const int maskRadius = 16, filterRadius = 5;
+    const unsigned bandRows = (height + mNumThreads - 1) / mNumThreads;
+    mScratch.resize(mNumThreads);
+    for (unsigned i = 0; i < mNumThreads; i++) {
+        Scratch& s = mScratch[i];
+        size_t extrema = max(size_t(width + 2 * maskRadius), size_t(bandRows + 2 * maskRadius) * width);
+        s.pad16.resize(width + 2 * maskRadius);
+        s.maxFwd.resize(extrema);
+        s.maxBack.resize(extrema);
+        s.minFwd.resize(extrema);
+        s.minBack.resize(extrema);
+        s.windowMax.resize(width);
+        s.windowMin.resize(width);
+        s.pad32.resize(width + 2 * filterRadius);
+        s.windowSum.resize(width);
+        s.sumRows.resize(2 * filterRadius + 1);
+    }
+}
+
+template <typename Fn>
+void CpuMapper::parallelRows(unsigned rows, Fn fn)
+{
+    // Split the image into contiguous bands, one per thread. The caller's
+    // thread takes one too.
+    unsigned n = min(mNumThreads, rows);
+    if (n <= 1) {
+        fn(0u, 0u, rows);
+        return;
+    }
+
+    mPool.run(n, [&](unsigned i) {
+        fn(i, rows * i / n, rows * (i + 1) / n);
+    });
+}
+
+void CpuMapper::updateDepthMask(Led& led, const uint16_t* depth, const uint16_t* background,
+    int radius, float bias, float maxSpread)
+{
+    const int width = mWidth;
+    const int height = mHeight;
+    const int taps = 2 * radius + 1;
+
+    led.mask.resize(width * height);
+
+    // The erosion in depthMask.glslf rejects a pixel if any neighbor is beyond
+    // the background threshold or missing. That only depends on the maximum
+    // and minimum depth in the neighborhood, which are separable. Each pass
+    // uses the van Herk / Gil-Werman algorithm: running extrema within
+    // blocks of 'taps' samples, forward and backward, so any window is the
+    // combination of one backward and one forward value.
+
+    parallelRows(height, [&](unsigned band, unsigned y0, unsigned y1) {
+        Scratch& s = mScratch[band];
+        vector<uint16_t>& pad = s.pad16;
+        vector<uint16_t>& maxFwd = s.maxFwd;
+        vector<uint16_t>& maxBack = s.maxBack;
+        vector<uint16_t>& minFwd = s.minFwd;
+        vector<uint16_t>& minBack = s.minBack;
+
+        for (unsigned y = y0; y < y1; y++) {
+            padRow(pad, depth + y * width, width, radius);
+            int n = pad.size();
+            if (maxFwd.size() < size_t(n)) {
+                maxFwd.resize(n);
+                maxBack.resize(n);
+                minFwd.resize(n);
+                minBack.resize(n);
+            }
+
+            for (int i = 0; i < n; i++) {
+                bool start = i % taps == 0;
+                maxFwd[i] = start ? pad[i] : max(maxFwd[i-1], pad[i]);
+                minFwd[i] = start ? pad[i] : min(minFwd[i-1], pad[i]);
+            }
+            for (int i = n - 1; i >= 0; i--) {
+                bool end = i == n - 1 || (i + 1) % taps == 0;
+                maxBack[i] = end ? pad[i] : max(maxBack[i+1], pad[i]);
+                minBack[i] = end ? pad[i] : min(minBack[i+1], pad[i]);
+            }
+
+            uint16_t *rowMax = &mRowMax[y * width];
+            uint16_t *rowMin = &mRowMin[y * width];
+            for (int x = 0; x < width; x++) {
+                rowMax[x] = max(maxBack[x], maxFwd[x + taps - 1]);
+                rowMin[x] = min(minBack[x], minFwd[x + taps - 1]);
+            }
+        }
+    });
+
+    parallelRows(height, [&](unsigned band, unsigned y0, unsigned y1) {
+        // Same algorithm down the columns, on whole rows at a time. Each band
+        // covers its rows plus 'radius' clamped rows above and below.
+        const int n = (y1 - y0) + 2 * radius;
+        Scratch& s = mScratch[band];
+        if (s.maxFwd.size() < size_t(n) * width) {
+            s.maxFwd.resize(n * width);
+            s.maxBack.resize(n * width);
+            s.minFwd.resize(n * width);
+            s.minBack.resize(n * width);
+        }
+        s.windowMax.resize(width);
+        s.windowMin.resize(width);
+        uint16_t *maxFwd = &s.maxFwd[0];
+        uint16_t *maxBack = &s.maxBack[0];
+        uint16_t *minFwd = &s.minFwd[0];
+        uint16_t *minBack = &s.minBack[0];
+        uint16_t *windowMax = &s.windowMax[0];
+        uint16_t *windowMin = &s.windowMin[0];
+        const uint16_t *rows[2];
+
+        for (int i = 0; i < n; i++) {
+            int sy = min(max(int(y0) + i - radius, 0), height - 1);
+            uint16_t *dstMax = &maxFwd[i * width];
+            uint16_t *dstMin = &minFwd[i * width];
+            if (i % taps == 0) {
+                copy(&mRowMax[sy * width], &mRowMax[sy * width] + width, dstMax);
+                copy(&mRowMin[sy * width], &mRowMin[sy * width] + width, dstMin);
+            } else {
+                rows[0] = dstMax - width;
+                rows[1] = &mRowMax[sy * width];
+                reduceMax16(dstMax, rows, 2, width);
+                rows[0] = dstMin - width;
+                rows[1] = &mRowMin[sy * width];
+                reduceMin16(dstMin, rows, 2, width);
+            }
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            int sy = min(max(int(y0) + i - radius, 0), height - 1);
+            uint16_t *dstMax = &maxBack[i * width];
+            uint16_t *dstMin = &minBack[i * width];
+            if (i == n - 1 || (i + 1) % taps == 0) {
+                copy(&mRowMax[sy * width], &mRowMax[sy * width] + width, dstMax);
+                copy(&mRowMin[sy * width], &mRowMin[sy * width] + width, dstMin);
+            } else {
+                rows[0] = dstMax + width;
+                rows[1] = &mRowMax[sy * width];
+                reduceMax16(dstMax, rows, 2, width);
+                rows[0] = dstMin + width;
+                rows[1] = &mRowMin[sy * width];
+                reduceMin16(dstMin, rows, 2, width);
+            }
+        }
+
+        for (unsigned y = y0; y < y1; y++) {
+            int i = y - y0;
+            rows[0] = &maxBack[i * width];
+            rows[1] = &maxFwd[(i + taps - 1) * width];
+            reduceMax16(windowMax, rows, 2, width);
+            rows[0] = &minBack[i * width];
+            rows[1] = &minFwd[(i + taps - 1) * width];
+            reduceMin16(windowMin, rows, 2, width);
+
+            const uint16_t *depthRow = depth + y * width;
+            const uint16_t *backgroundRow = background + y * width;
+            float *maskRow = &led.mask[y * width];
+
+            for (int x = 0; x < width; x++) {
+                float threshold = backgroundRow[x] / kDepthScale - bias;
+                float hi = windowMax[x] / kDepthScale;
+                float lo = windowMin[x] / kDepthScale;
+                bool valid = threshold > 0.0f && hi <= threshold && lo >= kDepthMinimum &&
+                    (maxSpread <= 0.0f || hi - lo <= maxSpread);
+                maskRow[x] = valid ? depthRow[x] / kDepthScale : 0.0f;
+            }
+        }
+    });
+}
+
+void CpuMapper::updateFilter(Led& led, const std::vector<const uint8_t*>& frames, int radius, int channels)
+{
+    if (frames.size() < 1) {
+        return;
+    }
+
+    const int width = mWidth;
+    const int height = mHeight;
+    const int taps = 2 * radius + 1;
+    const int numPairs = int(frames.size()) - 1;
+
+    // filter.glslf scales each color by 1/frames before differencing, and
+    // the median commutes with that positive scale, so we can work in
+    // integer units and apply the whole scale once at the end.
+    const float scale = 1.0f / (kColorScale * frames.size());
+
+    led.filter.resize(width * height);
+
+    // The box filter uses running sums in both directions, so its cost
+    // doesn't depend on the radius. Integer sums keep this exact.
+
+    parallelRows(height, [&](unsigned band, unsigned y0, unsigned y1) {
+        vector<int32_t>& pad = mScratch[band].pad32;
+
+        for (unsigned y = y0; y < y1; y++) {
+            int32_t *diffRow = &mDiff[y * width];
+            fill(diffRow, diffRow + width, 0);
+
+            for (int i = 0; i < numPairs; i++) {
+                const uint8_t *p1 = frames[i] + y * width * channels;
+                const uint8_t *p2 = frames[i+1] + y * width * channels;
+                if (channels == 1) {
+                    // The median of three equal differences is that difference
+                    for (int x = 0; x < width; x++) {
+                        diffRow[x] += int(p1[x]) - int(p2[x]);
+                    }
+                    continue;
+                }
+                for (int x = 0; x < width; x++, p1 += 3, p2 += 3) {
+                    diffRow[x] += median3(int(p1[0]) - int(p2[0]),
+                                          int(p1[1]) - int(p2[1]),
+                                          int(p1[2]) - int(p2[2]));
+                }
+            }
+
+            padRow(pad, diffRow, width, radius);
+            int32_t *sumRow = &mRowSum[y * width];
+            int32_t sum = 0;
+            for (int k = 0; k < taps; k++) {
+                sum += pad[k];
+            }
+            for (int x = 0; x < width; x++) {
+                sumRow[x] = sum;
+                if (x + 1 < width) {
+                    sum += pad[x + taps] - pad[x];
+                }
+            }
+        }
+    });
+
+    parallelRows(height, [&](unsigned band, unsigned y0, unsigned y1) {
+        Scratch& s = mScratch[band];
+        s.windowSum.resize(width);
+        s.sumRows.resize(taps);
+        vector<int32_t>& windowSum = s.windowSum;
+        vector<const int32_t*>& rows = s.sumRows;
+
+        // Each band starts its own column sums, then slides them down
+        for (int k = 0; k < taps; k++) {
+            int sy = min(max(int(y0) + k - radius, 0), height - 1);
+            rows[k] = &mRowSum[sy * width];
+        }
+        reduceSum32(&windowSum[0], &rows[0], taps, width);
+
+        for (unsigned y = y0; y < y1; y++) {
+            float *filterRow = &led.filter[y * width];
+            for (int x = 0; x < width; x++) {
+                filterRow[x] = windowSum[x] * scale;
+            }
+
+            if (y + 1 < y1) {
+                int addY = min(int(y) + radius + 1, height - 1);
+                int subY = max(int(y) - radius, 0);
+                slideSum32(&windowSum[0], &mRowSum[addY * width], &mRowSum[subY * width], width);
+            }
+        }
+    });
+}
+
+// Slice s holds depths in (1e-3 + s * zStep, 1e-3 + (s+1) * zStep], as in slice.glslv
+static int sliceForDepth(float z, float zStep)
+{
+    int slice = int(ceilf((z - 1e-3f) / zStep)) - 1;
+    if (slice >= 0 && !(z <= 1e-3f + (slice + 1) * zStep)) {
+        slice++;
+    }
+    if (slice >= 0 && !(z > 1e-3f + slice * zStep)) {
+        slice--;
+    }
+    return slice;
+}
+
+void CpuMapper::updateGrid(Led& led, int gridX, int gridY, int gridZ, float zLimit, float alpha)
+{
+    if (binGrid(led, gridX, gridY, gridZ, zLimit, mBins)) {
+        applyGrid(led.grid, mBins, alpha);
+    }
+}
+
+bool CpuMapper::binGrid(const Led& led, int gridX, int gridY, int gridZ, float zLimit, GridBins& bins)
+{
+    if (led.mask.empty() || led.filter.empty()) {
+        return false;
+    }
+
+    const int width = mWidth;
+    const int height = mHeight;
+    const float zStep = zLimit / float(max(1, gridZ - 1));
+
+    // Like slice.glslv, each grid cell samples the mask once and lands in
+    // the one slice that contains its depth, so cost doesn't grow with gridZ.
+    // Cells are sampled in parallel here, then blended serially by
+    // applyGrid since blending may allocate bricks.
+
+    size_t cells = size_t(gridX) * gridY;
+    bins.sizeX = gridX;
+    bins.sizeY = gridY;
+    bins.sizeZ = gridZ;
+    bins.slices.resize(cells);
+    bins.values.resize(cells);
+
+    parallelRows(gridY, [&](unsigned, unsigned y0, unsigned y1) {
+        for (unsigned gy = y0; gy < y1; gy++) {
+            float v = (gy + 0.5f) / gridY;
+            int maskY = min(int(v * height), height - 1);
+
+            // Bilinear filter sample, offset like the shader
+            float fy = min(max((v + kFilterOffset) * height - 0.5f, 0.0f), float(height - 1));
+            int fy0 = int(fy);
+            int fy1 = min(fy0 + 1, height - 1);
+            float ty = fy - fy0;
+
+            for (int gx = 0; gx < gridX; gx++) {
+                float u = (gx + 0.5f) / gridX;
+                int maskX = min(int(u * width), width - 1);
+                float z = led.mask[maskY * width + maskX];
+
+                int slice = sliceForDepth(z, zStep);
+                bins.slices[gy * gridX + gx] = slice;
+                if (slice < 0 || slice >= gridZ) {
+                    continue;
+                }
+
+                float fx = min(max((u + kFilterOffset) * width - 0.5f, 0.0f), float(width - 1));
+                int fx0 = int(fx);
+                int fx1 = min(fx0 + 1, width - 1);
+                float tx = fx - fx0;
+
+                const float *f0 = &led.filter[fy0 * width];
+                const float *f1 = &led.filter[fy1 * width];
+                float intensity =
+                    (f0[fx0] * (1.0f - tx) + f0[fx1] * tx) * (1.0f - ty) +
+                    (f1[fx0] * (1.0f - tx) + f1[fx1] * tx) * ty;
+
+                bins.values[gy * gridX + gx] = intensity;
+            }
+        }
+    });
+    return true;
+}
+
+void CpuMapper::applyGrid(BrickVolume& grid, const GridBins& bins, float alpha)
+{
+    grid.resize(bins.sizeX, bins.sizeY, bins.sizeZ);
+
+    for (int gy = 0; gy < bins.sizeY; gy++) {
+        const int32_t *slices = &bins.slices[size_t(gy) * bins.sizeX];
+        const float *values = &bins.values[size_t(gy) * bins.sizeX];
+        for (int gx = 0; gx < bins.sizeX; gx++) {
+            if (slices[gx] >= 0 && slices[gx] < bins.sizeZ) {
+                grid.blend(gx, gy, slices[gx], values[gx], alpha);
+            }
+        }
+    }
+}
+
+void CpuMapper::updateGridSparse(BrickVolume& grid, const float* mask, const float* values,
+    const uint32_t* pixels, size_t count, int gridX, int gridY, int gridZ, float zLimit, float alpha)
+{
+    grid.resize(gridX, gridY, gridZ);
+
+    const int width = mWidth;
+    const int height = mHeight;
+    const float zStep = zLimit / float(max(1, gridZ - 1));
+
+    // Pixels land in the voxel under them. Several pixels can share a
+    // voxel, so average those first and blend each voxel once.
+
+    mSplats.clear();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t p = pixels[i];
+        int slice = sliceForDepth(mask[p], zStep);
+        if (slice < 0 || slice >= gridZ) {
+            continue;
+        }
+        int gx = int(p % width) * gridX / width;
+        int gy = int(p / width) * gridY / height;
+        size_t voxel = (size_t(slice) * gridY + gy) * gridX + gx;
+        mSplats.push_back(make_pair(voxel, values[p]));
+    }
+    sort(mSplats.begin(), mSplats.end());
+
+    for (size_t i = 0; i < mSplats.size();) {
+        size_t voxel = mSplats[i].first;
+        float sum = 0.0f;
+        size_t n = 0;
+        for (; i < mSplats.size() && mSplats[i].first == voxel; i++, n++) {
+            sum += mSplats[i].second;
+        }
+        grid.blend(int(voxel % gridX), int(voxel / gridX % gridY), int(voxel / (size_t(gridX) * gridY)),
+            sum / n, alpha);
+    }
+}
+
+void CpuMapper::clearGrid(Led& led)
+{
+    led.grid.clear();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "BrickVolume.h"
+#include "WorkerPool.h"
+
+// Headless implementation of the mapping pipeline. This mirrors the math in
+// depthMask.glslf, filter.glslf and slice.glslv, operating on raw Kinect
+// buffers instead of textures. All output images use the same normalized
+// units as the GPU path, so results can be uploaded directly to R32F textures.
+
+class CpuMapper
+{
+public:
+    struct Led {
+        std::vector<float>  mask;       // Masked depth, width x height
+        std::vector<float>  filter;     // Filtered color difference, width x height
+        BrickVolume         grid;
+    };
+
+    CpuMapper();
+
+    // Set frame size and worker thread count (0 = one per hardware thread)
+    void setup(unsigned width, unsigned height, unsigned numThreads = 0);
+
+    // Depth buffers are 16-bit registered depth, color frames are packed RGB8
+    // or, with 'channels' set to 1, a single green plane.
+    // Pixels are kept if every depth sample within 'radius' is present and at
+    // least 'bias' closer than the background. If maxSpread is positive, the
+    // neighborhood's depth range must also be within it.
+    void updateDepthMask(Led& led, const uint16_t* depth, const uint16_t* background,
+        int radius = 16, float bias = 0.005f, float maxSpread = 0.0f);
+    void updateFilter(Led& led, const std::vector<const uint8_t*>& frames, int radius = 5, int channels = 3);
+    void updateGrid(Led& led, int gridX, int gridY, int gridZ, float zLimit, float alpha);
+
+    // updateGrid in two halves. Binning only reads the mask and filter, so
+    // it can run on a different thread from the one that owns the grid.
+    // Returns false if there's nothing to bin.
+    struct GridBins {
+        int                     sizeX, sizeY, sizeZ;
+        std::vector<int32_t>    slices;     // Per grid cell; out of range if the cell is empty
+        std::vector<float>      values;
+    };
+    bool binGrid(const Led& led, int gridX, int gridY, int gridZ, float zLimit, GridBins& bins);
+    static void applyGrid(BrickVolume& grid, const GridBins& bins, float alpha);
+
+    // Blends a sparse set of pixels into 'grid', each at its own masked
+    // depth. Voxels no pixel lands in are left alone. Used for coded
+    // acquisition, where each LED only owns the few pixels decoded to it.
+    void updateGridSparse(BrickVolume& grid, const float* mask, const float* values,
+        const uint32_t* pixels, size_t count, int gridX, int gridY, int gridZ, float zLimit, float alpha);
+
+    // Drop all accumulated grid data, keeping allocations
+    static void clearGrid(Led& led);
+
+    unsigned getWidth() const { return mWidth; }
+    unsigned getHeight() const { return mHeight; }
+
+private:
+    unsigned mWidth;
+    unsigned mHeight;
+    unsigned mNumThreads;
+    WorkerPool mPool;
+
+    // Intermediate images, reused between calls
+    std::vector<uint16_t> mRowMax, mRowMin;
+    std::vector<int32_t> mDiff, mRowSum;
+    std::vector<std::pair<size_t, float> > mSplats;
+    GridBins mBins;
+
+    // Working buffers for one band, so the per-frame passes don't allocate.
+    // The erosion's row and column passes share the extrema buffers.
+    struct Scratch {
+        std::vector<uint16_t>       pad16;
+        std::vector<uint16_t>       maxFwd, maxBack, minFwd, minBack;
+        std::vector<uint16_t>       windowMax, windowMin;
+        std::vector<int32_t>        pad32;
+        std::vector<int32_t>        windowSum;
+        std::vector<const int32_t*> sumRows;
+    };
+    std::vector<Scratch> mScratch;
+
+    // Calls fn(band, firstRow, endRow) for each band, in parallel
+    template <typename Fn> void parallelRows(unsigned rows, Fn fn);
+
+};
@@ -0,0 +1,86 @@
+#include "FramePairer.h"
+#include <stdlib.h>
+
+using namespace cinder;
+using namespace std;
+
+
+FramePairer::FramePairer()
+    : mMaxPendingVideo(3), mMaxSkew(0.5f), mPairedCount(0), mUnpairedCount(0)
+{}
+
+void FramePairer::clear()
+{
+    mDepth.clear();
+    mVideo.clear();
+}
+
+void FramePairer::pushDepth(const shared_ptr<uint16_t>& depth, const KinectFrameInfo& info)
+{
+    DepthFrame frame = { depth, info };
+    mDepth.push_back(frame);
+
+    // Without video to pair with, only the newest few are worth keeping
+    while (mDepth.size() > kMaxDepthFrames) {
+        mDepth.pop_front();
+    }
+}
+
+void FramePairer::pushVideo(const shared_ptr<uint8_t>& video, const KinectFrameInfo& info)
+{
+    VideoFrame frame = { video, info };
+    mVideo.push_back(frame);
+}
+
+bool FramePairer::pop(Pair& pair)
+{
+    if (mVideo.empty()) {
+        return false;
+    }
+    const VideoFrame& video = mVideo.front();
+
+    // Timestamps wrap, so compare them by their signed difference
+    int best = -1;
+    int32_t bestSkew = 0;
+    bool caughtUp = false;
+    for (unsigned i = 0; i < mDepth.size(); i++) {
+        int32_t skew = int32_t(mDepth[i].info.mTimestamp - video.info.mTimestamp);
+        caughtUp = caughtUp || skew >= 0;
+        if (best < 0 || abs(skew) < abs(bestSkew)) {
+            best = i;
+            bestSkew = skew;
+        }
+    }
+
+    if (!caughtUp && mVideo.size() <= size_t(mMaxPendingVideo)) {
+        return false;
+    }
+
+    pair.video = video.data;
+    pair.videoInfo = video.info;
+    pair.depth.reset();
+    pair.depthInfo = KinectFrameInfo();
+    pair.skew = 0;
+
+    if (best >= 0) {
+        // Until the depth period is known, take the nearest frame
+        uint32_t period = mDepth[best].info.mPeriod;
+        if (period == 0 || abs(bestSkew) <= mMaxSkew * period) {
+            pair.depth = mDepth[best].data;
+            pair.depthInfo = mDepth[best].info;
+            pair.skew = bestSkew;
+        }
+
+        // Later video frames can't be closer to anything older than the nearest one
+        mDepth.erase(mDepth.begin(), mDepth.begin() + best);
+    }
+
+    if (pair.depth) {
+        mPairedCount++;
+    } else {
+        mUnpairedCount++;
+    }
+
+    mVideo.pop_front();
+    return true;
+}
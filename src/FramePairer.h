@@ -0,0 +1,60 @@
+#pragma once
+
+#include "KinectFrameInfo.h"
+#include <deque>
+#include <memory>
+#include <stdint.h>
+
+// Matches each video frame with the depth frame nearest to it in device
+// time. A video frame is held until depth at or after its timestamp has
+// arrived, since no later depth frame could be any closer, or until too
+// many video frames are waiting. In that case the depth stream has stalled,
+// and the frame is released with the nearest depth seen so far if it's
+// close enough, or with none at all.
+
+class FramePairer
+{
+public:
+    struct Pair {
+        std::shared_ptr<uint8_t>    video;
+        std::shared_ptr<uint16_t>   depth;      // Empty if no depth frame was close enough
+        cinder::KinectFrameInfo     videoInfo;
+        cinder::KinectFrameInfo     depthInfo;
+        int32_t                     skew;       // Depth minus video timestamp, if paired
+    };
+
+    FramePairer();
+
+    // Forget queued frames, e.g. after switching to a different source
+    void clear();
+
+    void pushDepth(const std::shared_ptr<uint16_t>& depth, const cinder::KinectFrameInfo& info);
+    void pushVideo(const std::shared_ptr<uint8_t>& video, const cinder::KinectFrameInfo& info);
+
+    // Returns the oldest video frame once its pairing is decided
+    bool pop(Pair& pair);
+
+    unsigned getPairedCount() const { return mPairedCount; }
+    unsigned getUnpairedCount() const { return mUnpairedCount; }
+
+    int     mMaxPendingVideo;   // Video frames to hold while waiting for depth
+    float   mMaxSkew;           // Largest accepted skew, in depth frame periods
+
+private:
+    struct DepthFrame {
+        std::shared_ptr<uint16_t>   data;
+        cinder::KinectFrameInfo     info;
+    };
+
+    struct VideoFrame {
+        std::shared_ptr<uint8_t>    data;
+        cinder::KinectFrameInfo     info;
+    };
+
+    static const unsigned kMaxDepthFrames = 8;
+
+    std::deque<DepthFrame>  mDepth;
+    std::deque<VideoFrame>  mVideo;
+    unsigned                mPairedCount;
+    unsigned                mUnpairedCount;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Round-robin slots that frames are streamed into, each holding a reusable
+// buffer (a texture, in FrameUploader). A slot's buffer is reused in place
+// when nothing else holds it; if something does, the slot gets a new buffer
+// and the holder keeps the old one. Anything that keeps frames for longer
+// than the ring takes to come around should copy them into storage of its
+// own, or every upload allocates.
+//
+// Free of GL, so buffer lifetimes can be checked and benchmarked headlessly.
+
+template <typename T>
+class FrameRing
+{
+public:
+    typedef std::shared_ptr<T> Ref;
+    typedef std::function<Ref()> CreateFn;
+
+    explicit FrameRing(size_t size = 3)
+        : mSlots(size), mNext(0), mAllocations(0)
+    {}
+
+    // Drops every buffer, for when their format changes
+    void clear()
+    {
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            mSlots[i].reset();
+        }
+        mNext = 0;
+    }
+
+    // The slot for the next frame, with a buffer nobody else holds. Its
+    // index is stored in 'index' if that's set.
+    Ref& next(const CreateFn& create, size_t *index = 0)
+    {
+        size_t slot = mNext;
+        mNext = (mNext + 1) % mSlots.size();
+        if (index) {
+            *index = slot;
+        }
+
+        Ref& ref = mSlots[slot];
+        if (!ref || !ref.unique()) {
+            ref = create();
+            mAllocations++;
+        }
+        return ref;
+    }
+
+    size_t size() const { return mSlots.size(); }
+
+    // Buffers created so far, including each slot's first
+    uint64_t getAllocations() const { return mAllocations; }
+
+private:
+    std::vector<Ref>    mSlots;
+    size_t              mNext;
+    uint64_t            mAllocations;
+};
@@ -0,0 +1,89 @@
+#include "FrameUploader.h"
+#include <string.h>
+
+using namespace ci;
+
+
+FrameUploader::FrameUploader()
+    : mRing(kRingSize), mNextBuffer(0), mWidth(0), mHeight(0), mFrameBytes(0)
+{
+    for (int i = 0; i < kRingSize; i++) {
+        mBuffers[i] = 0;
+    }
+}
+
+FrameUploader::~FrameUploader()
+{
+    if (mBuffers[0]) {
+        glDeleteBuffers(kRingSize, mBuffers);
+    }
+}
+
+void FrameUploader::setup(int width, int height, GLint internalFormat, GLenum format, GLenum type, size_t bytesPerPixel)
+{
+    mWidth = width;
+    mHeight = height;
+    mInternalFormat = internalFormat;
+    mFormat = format;
+    mType = type;
+    mFrameBytes = size_t(width) * height * bytesPerPixel;
+
+    if (!mBuffers[0]) {
+        glGenBuffers(kRingSize, mBuffers);
+    }
+    mRing.clear();
+    for (int i = 0; i < kRingSize; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, mBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, mFrameBytes, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+gl::TextureRef FrameUploader::createTexture() const
+{
+    gl::Texture::Format format;
+    format.setInternalFormat(mInternalFormat);
+    return gl::Texture::create(mWidth, mHeight, format);
+}
+
+gl::TextureRef FrameUploader::upload(const void *pixels)
+{
+    gl::TextureRef& texture = mRing.next(std::bind(&FrameUploader::createTexture, this));
+    transfer(pixels, *texture);
+    return texture;
+}
+
+void FrameUploader::upload(const void *pixels, gl::TextureRef& texture)
+{
+    if (!texture || texture->getWidth() != mWidth || texture->getHeight() != mHeight ||
+        texture->getInternalFormat() != mInternalFormat) {
+        texture = createTexture();
+    }
+    transfer(pixels, *texture);
+}
+
+void FrameUploader::transfer(const void *pixels, gl::Texture& texture)
+{
+    // Orphan the old storage so we never wait on a transfer still in flight
+    GLuint buffer = mBuffers[mNextBuffer];
+    mNextBuffer = (mNextBuffer + 1) % kRingSize;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, mFrameBytes, NULL, GL_STREAM_DRAW);
+    void *dest = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    if (dest) {
+        memcpy(dest, pixels, mFrameBytes);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+        glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, mFrameBytes, pixels);
+    }
+
+    // Rows are tightly packed; put the caller's alignment back afterwards
+    GLint alignment;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &alignment);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    texture.bind();
+    glTexSubImage2D(texture.getTarget(), 0, 0, 0, mWidth, mHeight, mFormat, mType, 0);
+    texture.unbind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
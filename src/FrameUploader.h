@@ -0,0 +1,52 @@
+#pragma once
+
+#include "cinder/gl/gl.h"
+#include "cinder/gl/Texture.h"
+#include "FrameRing.h"
+#include <vector>
+
+// Streams camera frames into a small ring of persistent textures, copying
+// raw pixels through pixel buffer objects instead of allocating a texture
+// and converting through an ImageSource for every frame.
+//
+// Ring textures are meant to be shown and replaced. Frames that have to
+// stay around, like an LED's captures or the depth background, go into
+// textures the caller owns, so they don't pin ring slots.
+
+class FrameUploader
+{
+public:
+    FrameUploader();
+    ~FrameUploader();
+
+    void setup(int width, int height, GLint internalFormat, GLenum format, GLenum type, size_t bytesPerPixel);
+
+    // Upload one tightly packed frame of width * height pixels into the ring
+    ci::gl::TextureRef upload(const void *pixels);
+
+    // Upload into a texture the caller keeps, overwriting it in place. It's
+    // created, or replaced if its size or format doesn't match.
+    void upload(const void *pixels, ci::gl::TextureRef& texture);
+
+    // Ring textures created so far. Stays at the ring size unless something
+    // holds on to ring textures.
+    uint64_t getAllocations() const { return mRing.getAllocations(); }
+
+private:
+    FrameUploader(const FrameUploader&);
+    FrameUploader& operator=(const FrameUploader&);
+
+    static const int kRingSize = 3;
+
+    FrameRing<ci::gl::Texture> mRing;
+    GLuint              mBuffers[kRingSize];
+    int                 mNextBuffer;
+
+    int                 mWidth, mHeight;
+    GLint               mInternalFormat;
+    GLenum              mFormat, mType;
+    size_t              mFrameBytes;
+
+    ci::gl::TextureRef  createTexture() const;
+    void                transfer(const void *pixels, ci::gl::Texture& texture);
+};
@@ -0,0 +1,119 @@
+#include "FusedGrid.h"
+#include "KinectIntrinsics.h"
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+
+FusedGrid::FusedGrid()
+    : mSizeX(0), mSizeY(0), mSizeZ(0)
+{
+    fill(mMin, mMin + 3, 0.0f);
+    fill(mMax, mMax + 3, 0.0f);
+}
+
+void FusedGrid::setup(const float boundsMin[3], const float boundsMax[3], int gridX, int gridY, int gridZ)
+{
+    copy(boundsMin, boundsMin + 3, mMin);
+    copy(boundsMax, boundsMax + 3, mMax);
+    mSizeX = max(gridX, 1);
+    mSizeY = max(gridY, 1);
+    mSizeZ = max(gridZ, 1);
+}
+
+void FusedGrid::accumulate(BrickVolume& grid, const float* mask, const float* values,
+    unsigned width, unsigned height, const float transform[16], float alpha)
+{
+    if (bin(mask, values, width, height, transform, mBins)) {
+        apply(grid, mBins, alpha);
+    }
+}
+
+bool FusedGrid::bin(const float* mask, const float* values, unsigned width, unsigned height,
+    const float transform[16], Bins& bins)
+{
+    if (!mSizeX) {
+        return false;
+    }
+
+    // Intrinsics scale with the image
+    const float scale = float(width) / kKinectWidth;
+    const float focal = kKinectFocalLength * scale;
+    const float cx = kKinectCenterX * scale;
+    const float cy = kKinectCenterY * scale;
+
+    float cells[3] = { float(mSizeX), float(mSizeY), float(mSizeZ) };
+    float toCell[3];
+    for (int i = 0; i < 3; i++) {
+        float extent = mMax[i] - mMin[i];
+        toCell[i] = extent > 0.0f ? cells[i] / extent : 0.0f;
+    }
+
+    const float *m = transform;
+    for (unsigned y = 0; y < height; y++) {
+        const float *maskRow = mask + size_t(y) * width;
+        for (unsigned x = 0; x < width; x++) {
+            float z = maskRow[x] * kKinectDepthScale;
+            if (z <= 0.0f) {
+                continue;
+            }
+
+            float px = (x - cx) * z / focal;
+            float py = (y - cy) * z / focal;
+            float world[3];
+            for (int i = 0; i < 3; i++) {
+                world[i] = m[i] * px + m[4 + i] * py + m[8 + i] * z + m[12 + i];
+            }
+
+            int gx = int((world[0] - mMin[0]) * toCell[0]);
+            int gy = int((world[1] - mMin[1]) * toCell[1]);
+            int gz = int((world[2] - mMin[2]) * toCell[2]);
+            if (world[0] < mMin[0] || world[1] < mMin[1] || world[2] < mMin[2] ||
+                gx >= mSizeX || gy >= mSizeY || gz >= mSizeZ) {
+                continue;
+            }
+
+            uint32_t voxel = (uint32_t(gz) * mSizeY + gy) * mSizeX + gx;
+            uint32_t bits;
+            memcpy(&bits, &values[size_t(y) * width + x], sizeof bits);
+            mSamples.push_back(uint64_t(voxel) << 32 | bits);
+        }
+    }
+
+    // Average each run of samples in the same voxel
+    sort(mSamples.begin(), mSamples.end());
+    bins.sizeX = mSizeX;
+    bins.sizeY = mSizeY;
+    bins.sizeZ = mSizeZ;
+    bins.voxels.clear();
+    bins.values.clear();
+    for (size_t i = 0; i < mSamples.size();) {
+        uint32_t voxel = uint32_t(mSamples[i] >> 32);
+        float sum = 0.0f;
+        size_t count = 0;
+        for (; i < mSamples.size() && uint32_t(mSamples[i] >> 32) == voxel; i++, count++) {
+            uint32_t bits = uint32_t(mSamples[i]);
+            float value;
+            memcpy(&value, &bits, sizeof value);
+            sum += value;
+        }
+        bins.voxels.push_back(voxel);
+        bins.values.push_back(sum / count);
+    }
+    mSamples.clear();
+    return !bins.voxels.empty();
+}
+
+void FusedGrid::apply(BrickVolume& grid, const Bins& bins, float alpha)
+{
+    grid.resize(bins.sizeX, bins.sizeY, bins.sizeZ);
+
+    for (size_t i = 0; i < bins.voxels.size(); i++) {
+        uint32_t voxel = bins.voxels[i];
+        int gx = int(voxel % bins.sizeX);
+        int gy = int(voxel / bins.sizeX % bins.sizeY);
+        int gz = int(voxel / (uint32_t(bins.sizeX) * bins.sizeY));
+        grid.blend(gx, gy, gz, bins.values[i], alpha);
+    }
+}
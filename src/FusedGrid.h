@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "BrickVolume.h"
+
+// One voxel grid shared by several cameras. The per-camera grids are in each
+// camera's own image space, so they can't be combined directly. Here each
+// masked pixel is back-projected to a point using nominal Kinect intrinsics,
+// moved into world space by its camera's extrinsic transform, and blended
+// into the world-space voxel it lands in.
+//
+// Depth and filter images use CpuMapper's normalized units. World space is
+// in millimeters; a camera with an identity transform defines it.
+
+class FusedGrid
+{
+public:
+    FusedGrid();
+
+    // The world-space box covered by the grid, and its resolution
+    void setup(const float boundsMin[3], const float boundsMax[3], int gridX, int gridY, int gridZ);
+
+    // Blends one camera's results into 'grid'. 'transform' is a column-major
+    // 4x4 camera-to-world matrix, as in ci::Matrix44f. Voxels no pixel lands
+    // in are left alone.
+    void accumulate(BrickVolume& grid, const float* mask, const float* values,
+        unsigned width, unsigned height, const float transform[16], float alpha);
+
+    // accumulate in two halves. Binning doesn't touch the grid, so it can
+    // run on a different thread from the one that owns it. Pixels sharing a
+    // voxel are averaged, so each voxel blends once per camera. Returns
+    // false if no pixel lands in the grid.
+    struct Bins {
+        int                     sizeX, sizeY, sizeZ;
+        std::vector<uint32_t>   voxels;     // (z * sizeY + y) * sizeX + x
+        std::vector<float>      values;
+    };
+    bool bin(const float* mask, const float* values, unsigned width, unsigned height,
+        const float transform[16], Bins& bins);
+    static void apply(BrickVolume& grid, const Bins& bins, float alpha);
+
+private:
+    float   mMin[3], mMax[3];
+    int     mSizeX, mSizeY, mSizeZ;
+
+    // Every binned pixel for one call, voxel index in the high half and
+    // value bits in the low. Sorting brings pixels sharing a voxel together,
+    // so scratch grows with the pixels rather than the whole world grid.
+    std::vector<uint64_t>   mSamples;
+    Bins                    mBins;
+};
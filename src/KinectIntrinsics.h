@@ -0,0 +1,14 @@
+#pragma once
+
+// Nominal intrinsics of the Kinect depth camera at 640x480, which registered
+// depth shares with video. The simulator renders with these, and the mapper
+// uses them to turn masked pixels back into points.
+
+static const float kKinectFocalLength = 525.0f;
+static const float kKinectCenterX = 319.5f;
+static const float kKinectCenterY = 239.5f;
+static const int kKinectWidth = 640;
+static const int kKinectHeight = 480;
+
+// Masked and normalized depth is millimeters over this
+static const float kKinectDepthScale = 65535.0f;
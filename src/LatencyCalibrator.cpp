@@ -0,0 +1,148 @@
+#include "LatencyCalibrator.h"
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+// Brightness changes this far between the settled levels mark the start
+// and end of an edge
+static const float kEdgeStart = 0.1f;
+static const float kEdgeEnd = 0.9f;
+
+// Mean brightness only needs a sparse sample of the image
+static const int kSampleStep = 4;
+
+
+LatencyCalibrator::LatencyCalibrator()
+    : mSettleFrames(10), mMinContrast(1.0f), mRunning(false), mOn(false),
+      mEdgesLeft(0), mHold(0), mLevelBefore(0), mSendFrame(-1), mSendSeconds(0)
+{
+    mResult.edges = 0;
+}
+
+void LatencyCalibrator::start(int numEdges)
+{
+    mRunning = true;
+    mOn = false;
+    mEdgesLeft = max(numEdges, 1);
+    mHold = 0;
+    mSendFrame = -1;
+    mSamples.clear();
+    mEdges.clear();
+    mResult = Result();
+}
+
+void LatencyCalibrator::stop()
+{
+    mRunning = false;
+    mOn = false;
+}
+
+bool LatencyCalibrator::update(int64_t frameIndex, const uint8_t *pixels, int width, int height, int channels, double seconds)
+{
+    if (!mRunning) {
+        return false;
+    }
+
+    Sample sample = { frameIndex, meanLevel(pixels, width, height, channels), seconds };
+    mSamples.push_back(sample);
+    if (++mHold < mSettleFrames) {
+        return mOn;
+    }
+
+    // Settled. The first hold is only a baseline; the rest each follow an edge.
+    if (mSendFrame >= 0) {
+        measureEdge();
+        mEdgesLeft--;
+    }
+    if (mEdgesLeft <= 0) {
+        finish();
+        return false;
+    }
+
+    mLevelBefore = sample.level;
+    mSamples.clear();
+    mOn = !mOn;
+    mSendFrame = frameIndex;
+    mSendSeconds = seconds;
+    mHold = 0;
+    return mOn;
+}
+
+float LatencyCalibrator::meanLevel(const uint8_t *pixels, int width, int height, int channels)
+{
+    uint64_t sum = 0;
+    unsigned count = 0;
+    for (int y = 0; y < height; y += kSampleStep) {
+        const uint8_t *row = pixels + size_t(y) * width * channels;
+        for (int x = 0; x < width; x += kSampleStep) {
+            for (int ch = 0; ch < channels; ch++) {
+                sum += row[x * channels + ch];
+            }
+            count += channels;
+        }
+    }
+    return count ? sum / float(count) : 0.0f;
+}
+
+void LatencyCalibrator::measureEdge()
+{
+    float contrast = mSamples.back().level - mLevelBefore;
+    if (fabsf(contrast) < mMinContrast) {
+        return;
+    }
+
+    Edge edge = { -1, -1, 0 };
+    for (unsigned i = 0; i < mSamples.size(); i++) {
+        const Sample& s = mSamples[i];
+        float progress = (s.level - mLevelBefore) / contrast;
+        int frames = int(s.frameIndex - mSendFrame);
+
+        if (edge.firstFrame < 0 && progress > kEdgeStart) {
+            edge.firstFrame = frames;
+            edge.seconds = s.seconds - mSendSeconds;
+        }
+        // Settled at the first frame that stays near the final level
+        if (progress < kEdgeEnd) {
+            edge.settledFrame = -1;
+        } else if (edge.settledFrame < 0) {
+            edge.settledFrame = frames;
+        }
+    }
+
+    if (edge.firstFrame > 0 && edge.settledFrame >= edge.firstFrame) {
+        mEdges.push_back(edge);
+    }
+}
+
+void LatencyCalibrator::finish()
+{
+    mRunning = false;
+    mOn = false;
+
+    mResult = Result();
+    mResult.edges = int(mEdges.size());
+    if (mEdges.empty()) {
+        return;
+    }
+
+    vector<double> seconds;
+    mResult.firstFrame = mEdges[0].firstFrame;
+    mResult.settledFrame = mEdges[0].settledFrame;
+    for (unsigned i = 0; i < mEdges.size(); i++) {
+        const Edge& edge = mEdges[i];
+        mResult.firstFrame = min(mResult.firstFrame, edge.firstFrame);
+        mResult.settledFrame = max(mResult.settledFrame, edge.settledFrame);
+        seconds.push_back(edge.seconds);
+
+        if (mResult.histogram.size() <= size_t(edge.firstFrame)) {
+            mResult.histogram.resize(edge.firstFrame + 1);
+        }
+        mResult.histogram[edge.firstFrame]++;
+    }
+
+    sort(seconds.begin(), seconds.end());
+    mResult.minSeconds = seconds.front();
+    mResult.medianSeconds = seconds[seconds.size() / 2];
+    mResult.maxSeconds = seconds.back();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Measures how long an OPC packet takes to show up in the camera. All LEDs
+// are switched on and off a number of times, holding each state long
+// enough to settle, while the mean image brightness is followed across each
+// edge. The results use the same frame counting as LedSequencer: a packet
+// sent after capturing frame c first shows up in frame c + firstFrame.
+
+class LatencyCalibrator
+{
+public:
+    struct Result {
+        int         edges;          // Edges with enough contrast to measure
+        int         firstFrame;     // Fewest frames until any change, over all edges
+        int         settledFrame;   // Most frames until the change was complete
+        double      minSeconds;     // Send to arrival of the first changed frame
+        double      medianSeconds;
+        double      maxSeconds;
+        std::vector<int> histogram; // Edges by frames until any change
+    };
+
+    LatencyCalibrator();
+
+    void start(int numEdges = 16);
+    void stop();
+    bool isRunning() const { return mRunning; }
+
+    // Call for every captured frame, in order. Returns whether the LEDs
+    // should be lit by the packet sent after this frame.
+    bool update(int64_t frameIndex, const uint8_t *pixels, int width, int height, int channels, double seconds);
+
+    // Valid once a run has finished with at least one measured edge
+    bool hasResult() const { return mResult.edges > 0; }
+    const Result& getResult() const { return mResult; }
+
+    int     mSettleFrames;      // Frames to hold each state, longer than the worst latency
+    float   mMinContrast;       // Smallest on/off difference in mean brightness, in 8-bit units
+
+private:
+    struct Sample {
+        int64_t     frameIndex;
+        float       level;
+        double      seconds;
+    };
+
+    struct Edge {
+        int         firstFrame;
+        int         settledFrame;
+        double      seconds;
+    };
+
+    static float meanLevel(const uint8_t *pixels, int width, int height, int channels);
+    void measureEdge();
+    void finish();
+
+    bool                mRunning;
+    bool                mOn;
+    int                 mEdgesLeft;
+    int                 mHold;
+    float               mLevelBefore;
+    int64_t             mSendFrame;
+    double              mSendSeconds;
+    std::vector<Sample> mSamples;
+    std::vector<Edge>   mEdges;
+    Result              mResult;
+};
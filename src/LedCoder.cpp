@@ -0,0 +1,124 @@
+#include "LedCoder.h"
+#include <algorithm>
+#include <stdlib.h>
+
+using namespace std;
+
+static const float kColorScale = 255.0f;
+
+
+static inline uint32_t grayEncode(uint32_t n)
+{
+    return n ^ (n >> 1);
+}
+
+static inline uint32_t grayDecode(uint32_t g)
+{
+    for (uint32_t shift = 1; shift < 32; shift <<= 1) {
+        g ^= g >> shift;
+    }
+    return g;
+}
+
+// Sum of all channels, so one pixel compares the same way in any format
+static inline int pixelSum(const uint8_t *p, int channels)
+{
+    int sum = 0;
+    for (int ch = 0; ch < channels; ch++) {
+        sum += p[ch];
+    }
+    return sum;
+}
+
+
+LedCoder::LedCoder()
+    : mWidth(0), mHeight(0), mNumLeds(0), mNumBits(0)
+{}
+
+bool LedCoder::setup(unsigned width, unsigned height, int numLeds)
+{
+    numLeds = max(numLeds, 1);
+    if (width == mWidth && height == mHeight && numLeds == mNumLeds) {
+        return false;
+    }
+
+    mWidth = width;
+    mHeight = height;
+    mNumLeds = numLeds;
+
+    // Enough bits for indices 0 through numLeds-1, and at least one
+    mNumBits = 1;
+    while ((1u << mNumBits) < unsigned(numLeds)) {
+        mNumBits++;
+    }
+
+    mLedMap.assign(size_t(width) * height, -1);
+    mContrast.assign(size_t(width) * height, 0.0f);
+    mOffsets.assign(numLeds + 1, 0);
+    mPixels.clear();
+    return true;
+}
+
+bool LedCoder::isLit(int pattern, int led) const
+{
+    if (pattern < 2) {
+        return pattern == 0;
+    }
+    int bit = (pattern - 2) >> 1;
+    bool inverse = (pattern - 2) & 1;
+    return bool((grayEncode(led) >> bit) & 1) != inverse;
+}
+
+void LedCoder::decode(const vector<const uint8_t*>& frames, int channels, float minContrast, float bitFraction)
+{
+    const size_t numPixels = size_t(mWidth) * mHeight;
+    fill(mLedMap.begin(), mLedMap.end(), -1);
+    fill(mContrast.begin(), mContrast.end(), 0.0f);
+    fill(mOffsets.begin(), mOffsets.end(), 0);
+    mPixels.clear();
+
+    if (frames.size() < size_t(getNumPatterns())) {
+        return;
+    }
+
+    const int minSum = max(1, int(minContrast * kColorScale * channels + 0.5f));
+
+    for (size_t i = 0; i < numPixels; i++) {
+        size_t offset = i * channels;
+        int contrast = pixelSum(frames[0] + offset, channels) - pixelSum(frames[1] + offset, channels);
+        if (contrast < minSum) {
+            continue;
+        }
+
+        int minBit = max(1, int(contrast * bitFraction));
+        uint32_t code = 0;
+        bool valid = true;
+        for (int bit = 0; bit < mNumBits && valid; bit++) {
+            int d = pixelSum(frames[2 + 2*bit] + offset, channels) - pixelSum(frames[3 + 2*bit] + offset, channels);
+            valid = abs(d) >= minBit;
+            code |= uint32_t(d > 0) << bit;
+        }
+        if (!valid) {
+            continue;
+        }
+
+        uint32_t led = grayDecode(code);
+        if (led < uint32_t(mNumLeds)) {
+            mLedMap[i] = led;
+            mContrast[i] = contrast / (kColorScale * channels);
+            mOffsets[led + 1]++;
+        }
+    }
+
+    // Bucket the decoded pixels by LED
+    for (int led = 0; led < mNumLeds; led++) {
+        mOffsets[led + 1] += mOffsets[led];
+    }
+    mPixels.resize(mOffsets[mNumLeds]);
+    vector<uint32_t> cursor(mOffsets.begin(), mOffsets.end() - 1);
+    for (size_t i = 0; i < numPixels; i++) {
+        if (mLedMap[i] >= 0) {
+            mPixels[cursor[mLedMap[i]]++] = uint32_t(i);
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Structured-light acquisition. Instead of lighting one LED at a time, each
+// frame shows one bit plane of a Gray code across all LEDs, followed by its
+// inverse. A pixel that sees mostly one LED reads that LED's index back from
+// the sequence, so N LEDs take 2 * ceil(log2 N) + 2 frames rather than
+// N * framesPerLed.
+//
+// Patterns 0 and 1 are all LEDs on and all off, which gives each pixel's
+// contrast. Pixels lit by a mix of LEDs barely change between a bit plane
+// and its inverse, so they fail the per-bit threshold and stay undecoded.
+
+class LedCoder
+{
+public:
+    LedCoder();
+
+    // Returns true if anything changed
+    bool setup(unsigned width, unsigned height, int numLeds);
+
+    int getNumBits() const { return mNumBits; }
+    int getNumPatterns() const { return 2 + 2 * mNumBits; }
+
+    // Whether 'led' is lit in pattern number 'pattern'
+    bool isLit(int pattern, int led) const;
+
+    // One frame per pattern, packed RGB8 or single channel. Pixels are kept
+    // if all-on minus all-off is at least 'minContrast' (normalized), and
+    // every bit differs from its inverse by at least 'bitFraction' of that.
+    void decode(const std::vector<const uint8_t*>& frames, int channels,
+        float minContrast = 0.05f, float bitFraction = 0.25f);
+
+    // Per pixel LED index, or -1
+    const std::vector<int32_t>& getLedMap() const { return mLedMap; }
+    // Per pixel normalized contrast, zero where undecoded
+    const std::vector<float>& getContrast() const { return mContrast; }
+
+    // Pixels decoded to each LED, as indices into the frame
+    size_t getNumPixels(int led) const { return mOffsets[led + 1] - mOffsets[led]; }
+    const uint32_t* getPixels(int led) const { return mPixels.empty() ? 0 : &mPixels[mOffsets[led]]; }
+
+private:
+    unsigned                mWidth, mHeight;
+    int                     mNumLeds;
+    int                     mNumBits;
+
+    std::vector<int32_t>    mLedMap;
+    std::vector<float>      mContrast;
+    std::vector<uint32_t>   mOffsets;   // numLeds + 1 entries into mPixels
+    std::vector<uint32_t>   mPixels;
+};
@@ -0,0 +1,98 @@
+#include "LedSequencer.h"
+#include <algorithm>
+
+using namespace std;
+
+
+LedSequencer::LedSequencer()
+    : mNumLeds(1), mFramesPerLed(1), mFirstFrame(1), mSettledFrame(1)
+{
+    reset();
+}
+
+bool LedSequencer::setup(int numLeds, int framesPerLed, int firstFrame, int settledFrame)
+{
+    numLeds = max(numLeds, 1);
+    framesPerLed = max(framesPerLed, 1);
+    firstFrame = max(firstFrame, 1);
+    settledFrame = max(settledFrame, firstFrame);
+
+    if (numLeds == mNumLeds && framesPerLed == mFramesPerLed &&
+        firstFrame == mFirstFrame && settledFrame == mSettledFrame) {
+        return false;
+    }
+
+    mNumLeds = numLeds;
+    mFramesPerLed = framesPerLed;
+    mFirstFrame = firstFrame;
+    mSettledFrame = settledFrame;
+    reset();
+    return true;
+}
+
+void LedSequencer::reset()
+{
+    mSent.clear();
+    mLed = 0;
+    mCapture = 0;
+    mHold = 0;
+    mSerial = 0;
+}
+
+LedSequencer::Command LedSequencer::next(int64_t frameIndex)
+{
+    Command command;
+    command.led = mLed;
+    command.capture = mCapture;
+    command.on = mCapture < (mFramesPerLed + 1) / 2;
+    command.serial = mSerial;
+    record(frameIndex, command);
+
+    if (++mHold >= getHoldFrames()) {
+        mHold = 0;
+        if (++mCapture >= mFramesPerLed) {
+            mCapture = 0;
+            mLed = (mLed + 1) % mNumLeds;
+            mSerial++;
+        }
+    }
+    return command;
+}
+
+void LedSequencer::record(int64_t frameIndex, const Command& command)
+{
+    Sent sent = { frameIndex, command };
+    mSent.push_back(sent);
+
+    // Frames still to come look back no further than this, and only need
+    // the last command sent at or before it.
+    int64_t oldest = frameIndex + 1 - mSettledFrame;
+    while (mSent.size() > 1 && mSent[1].frameIndex <= oldest) {
+        mSent.pop_front();
+    }
+}
+
+bool LedSequencer::classify(int64_t frameIndex, Command& shown) const
+{
+    // Commands in effect after each of these frames all reach this one.
+    // When frames were dropped nothing was sent after them, so the last
+    // earlier command was still in effect.
+    int64_t first = frameIndex - mSettledFrame;
+    int64_t last = frameIndex - mFirstFrame;
+
+    int found = -1;
+    for (unsigned i = 0; i < mSent.size() && mSent[i].frameIndex <= last; i++) {
+        if (mSent[i].frameIndex <= first) {
+            found = i;
+        } else if (found < 0 || mSent[i].command.serial != mSent[found].command.serial ||
+                   mSent[i].command.capture != mSent[found].command.capture) {
+            return false;
+        }
+    }
+
+    if (found < 0) {
+        return false;
+    }
+    shown = mSent[found].command;
+    return true;
+}
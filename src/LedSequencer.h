@@ -0,0 +1,64 @@
+#pragma once
+
+#include <deque>
+#include <stdint.h>
+
+// Decides which LED to light for each frame, and works out what each
+// captured frame actually shows given the latency between sending an OPC
+// packet and seeing it in the camera.
+//
+// A packet sent after capturing frame c first shows up in frame
+// c + firstFrame, and is fully visible from frame c + settledFrame. Frames
+// in between see a mix of old and new, so each state is held for
+// settledFrame - firstFrame + 1 packets. That leaves at least one frame
+// that sees only that state, and every other frame is skipped as a
+// transition. Frame indices count dropped frames, so gaps don't shift the
+// alignment.
+//
+// Each LED is on for the first half of its captures and off for the rest,
+// so the frame differences the filter sums add up to on minus off. Coded
+// acquisition runs its whole pattern sequence as one visit to a single LED,
+// with one capture per pattern, and ignores 'on'.
+
+class LedSequencer
+{
+public:
+    struct Command {
+        int         led;
+        int         capture;    // Which of the LED's captures this state is for
+        bool        on;
+        int64_t     serial;     // Counts LED visits, to tell repeated visits apart
+    };
+
+    LedSequencer();
+
+    // Starts over from the first LED if anything changed. Returns true if it did.
+    bool setup(int numLeds, int framesPerLed, int firstFrame, int settledFrame);
+    void reset();
+
+    // The packet to send after capturing frame 'frameIndex'. Call once per
+    // captured frame, in order.
+    Command next(int64_t frameIndex);
+
+    // Notes a packet sent after frame 'frameIndex' without advancing. Lets a
+    // second camera, with its own frame numbering, classify its frames
+    // against the commands another sequencer chose.
+    void record(int64_t frameIndex, const Command& command);
+
+    // If frame 'frameIndex' shows a single command, returns true and that command
+    bool classify(int64_t frameIndex, Command& shown) const;
+
+    int getHoldFrames() const { return mSettledFrame - mFirstFrame + 1; }
+    int getCapturesPerVisit() const { return mFramesPerLed; }
+
+private:
+    struct Sent {
+        int64_t     frameIndex;
+        Command     command;
+    };
+
+    std::deque<Sent>    mSent;
+    int                 mNumLeds, mFramesPerLed, mFirstFrame, mSettledFrame;
+    int                 mLed, mCapture, mHold;
+    int64_t             mSerial;
+};
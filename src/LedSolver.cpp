@@ -0,0 +1,221 @@
+#include "LedSolver.h"
+#include "KinectIntrinsics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+using namespace std;
+
+// Half-width, in voxels, of the neighborhood around the peak that counts
+// toward the confidence
+static const int kPeakRadius = 2;
+
+
+LedSolver::Space LedSolver::Space::camera(float zLimit)
+{
+    Space space;
+    memset(&space, 0, sizeof space);
+    space.kind = SPACE_CAMERA;
+    space.zLimit = zLimit;
+    return space;
+}
+
+LedSolver::Space LedSolver::Space::box(const float boxMin[3], const float boxMax[3])
+{
+    Space space;
+    memset(&space, 0, sizeof space);
+    space.kind = SPACE_BOX;
+    copy(boxMin, boxMin + 3, space.boxMin);
+    copy(boxMax, boxMax + 3, space.boxMax);
+    return space;
+}
+
+LedSolver::LedSolver()
+    : mNumThreads(1)
+{}
+
+void LedSolver::setup(size_t numLeds, unsigned numThreads)
+{
+    mNumThreads = numThreads ? numThreads : max(1u, thread::hardware_concurrency());
+    mPool.setup(mNumThreads);
+    mScratch.resize(mNumThreads);
+
+    Result empty;
+    memset(&empty, 0, sizeof empty);
+    mResults.resize(numLeds, empty);
+    mDirty.resize(numLeds, 1);
+}
+
+void LedSolver::invalidate(size_t led)
+{
+    if (led < mDirty.size()) {
+        mDirty[led] = 1;
+    }
+}
+
+void LedSolver::invalidateAll()
+{
+    fill(mDirty.begin(), mDirty.end(), 1);
+}
+
+size_t LedSolver::solve(const FetchFn& fetch)
+{
+    vector<size_t> dirty;
+    for (size_t i = 0; i < mDirty.size(); i++) {
+        if (mDirty[i]) {
+            dirty.push_back(i);
+        }
+    }
+
+    // Volumes vary a lot in size, so workers take one LED at a time rather
+    // than fixed bands. The caller's thread works too.
+    atomic<size_t> next(0);
+    auto work = [&](unsigned worker) {
+        BrickVolume& scratch = mScratch[worker];
+        for (size_t i = next++; i < dirty.size(); i = next++) {
+            size_t led = dirty[i];
+            Space space = Space::camera(0.0f);
+            const BrickVolume *volume = fetch(led, scratch, space);
+
+            Result result;
+            if (volume) {
+                result = solveVolume(*volume, space);
+            } else {
+                memset(&result, 0, sizeof result);
+            }
+            mResults[led] = result;
+        }
+    };
+
+    unsigned n = unsigned(min<size_t>(mNumThreads, dirty.size()));
+    mPool.run(n, work);
+
+    for (size_t i = 0; i < dirty.size(); i++) {
+        mDirty[dirty[i]] = 0;
+    }
+    return dirty.size();
+}
+
+// World position of a voxel's center, in mm
+static inline void voxelToWorld(const LedSolver::Space& space, const float toUnit[3], int x, int y, int z, float out[3])
+{
+    float u = (x + 0.5f) * toUnit[0];
+    float v = (y + 0.5f) * toUnit[1];
+    float w = (z + 0.5f) * toUnit[2];
+
+    if (space.kind == LedSolver::Space::SPACE_BOX) {
+        out[0] = space.boxMin[0] + u * (space.boxMax[0] - space.boxMin[0]);
+        out[1] = space.boxMin[1] + v * (space.boxMax[1] - space.boxMin[1]);
+        out[2] = space.boxMin[2] + w * (space.boxMax[2] - space.boxMin[2]);
+    } else {
+        // toUnit[2] is the slice depth step here; slices start at 1e-3, as in slice.glslv
+        float depth = (1e-3f + w) * kKinectDepthScale;
+        out[0] = (u * kKinectWidth - kKinectCenterX) * depth / kKinectFocalLength;
+        out[1] = (v * kKinectHeight - kKinectCenterY) * depth / kKinectFocalLength;
+        out[2] = depth;
+    }
+}
+
+LedSolver::Result LedSolver::solveVolume(const BrickVolume& volume, const Space& space)
+{
+    Result result;
+    memset(&result, 0, sizeof result);
+
+    float toUnit[3] = {
+        1.0f / max(1, volume.getSizeX()),
+        1.0f / max(1, volume.getSizeY()),
+        space.kind == Space::SPACE_BOX ? 1.0f / max(1, volume.getSizeZ())
+            : space.zLimit / float(max(1, volume.getSizeZ() - 1)),
+    };
+
+    // Moments are taken about the first voxel seen, so the covariance
+    // doesn't cancel against a large mean
+    double sum = 0, mean[3] = { 0, 0, 0 }, second[6] = { 0, 0, 0, 0, 0, 0 };
+    float origin[3] = { 0, 0, 0 };
+    int peakX = 0, peakY = 0, peakZ = 0;
+
+    volume.forEachNonzero([&](int x, int y, int z, float value) {
+        if (value <= 0.0f) {
+            return;
+        }
+        float p[3];
+        voxelToWorld(space, toUnit, x, y, z, p);
+        if (!result.voxels) {
+            copy(p, p + 3, origin);
+        }
+        double d[3] = { p[0] - origin[0], p[1] - origin[1], p[2] - origin[2] };
+
+        sum += value;
+        for (int i = 0; i < 3; i++) {
+            mean[i] += value * d[i];
+        }
+        second[0] += value * d[0] * d[0];
+        second[1] += value * d[0] * d[1];
+        second[2] += value * d[0] * d[2];
+        second[3] += value * d[1] * d[1];
+        second[4] += value * d[1] * d[2];
+        second[5] += value * d[2] * d[2];
+
+        if (value > result.peakValue) {
+            result.peakValue = value;
+            peakX = x;
+            peakY = y;
+            peakZ = z;
+        }
+        result.voxels++;
+    });
+
+    if (!result.voxels || sum <= 0) {
+        return result;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        mean[i] /= sum;
+        result.centroid[i] = float(origin[i] + mean[i]);
+    }
+    result.covariance[0] = float(second[0] / sum - mean[0] * mean[0]);
+    result.covariance[1] = float(second[1] / sum - mean[0] * mean[1]);
+    result.covariance[2] = float(second[2] / sum - mean[0] * mean[2]);
+    result.covariance[3] = float(second[3] / sum - mean[1] * mean[1]);
+    result.covariance[4] = float(second[4] / sum - mean[1] * mean[2]);
+    result.covariance[5] = float(second[5] / sum - mean[2] * mean[2]);
+    voxelToWorld(space, toUnit, peakX, peakY, peakZ, result.peak);
+    result.weight = float(sum);
+
+    double nearPeak = 0;
+    volume.forEachNonzero([&](int x, int y, int z, float value) {
+        if (value > 0.0f && abs(x - peakX) <= kPeakRadius && abs(y - peakY) <= kPeakRadius &&
+            abs(z - peakZ) <= kPeakRadius) {
+            nearPeak += value;
+        }
+    });
+    result.confidence = float(nearPeak / sum);
+    result.valid = true;
+    return result;
+}
+
+bool LedSolver::writeLayout(const string& path) const
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < mResults.size(); i++) {
+        const Result &r = mResults[i];
+        fprintf(file, "  {\"point\": [%.4f, %.4f, %.4f], \"confidence\": %.3f}%s\n",
+            r.valid ? r.centroid[0] * 1e-3f : 0.0f,
+            r.valid ? r.centroid[1] * 1e-3f : 0.0f,
+            r.valid ? r.centroid[2] * 1e-3f : 0.0f,
+            r.valid ? r.confidence : 0.0f,
+            i + 1 < mResults.size() ? "," : "");
+    }
+    fprintf(file, "]\n");
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
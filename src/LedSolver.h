@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+#include "BrickVolume.h"
+#include "WorkerPool.h"
+
+// Turns each LED's volume into a position. Each LED gets the
+// intensity-weighted centroid and covariance of its voxels, its brightest
+// voxel, and a confidence: the share of its light near that peak. A lone
+// LED seen directly scores close to 1; one seen only by its reflections
+// scores low.
+//
+// LEDs are solved on a pool of worker threads that stays up between solves,
+// each with its own scratch volume. Only LEDs invalidated since their last
+// solve are visited, so re-solving after each acquisition round is cheap.
+// Positions are in world space millimeters, as FusedGrid defines it.
+
+class LedSolver
+{
+public:
+    // Where a volume's voxels sit in the world
+    struct Space {
+        enum Kind {
+            SPACE_CAMERA,   // Per-LED grid: image X and Y, normalized depth slices
+            SPACE_BOX,      // Fused grid: a world-space box
+        };
+        Kind    kind;
+        float   zLimit;     // SPACE_CAMERA
+        float   boxMin[3];  // SPACE_BOX
+        float   boxMax[3];
+
+        static Space camera(float zLimit);
+        static Space box(const float boxMin[3], const float boxMax[3]);
+    };
+
+    struct Result {
+        bool        valid;          // False if the volume had no positive voxels
+        float       centroid[3];
+        float       covariance[6];  // xx, xy, xz, yy, yz, zz, in mm^2
+        float       peak[3];        // Center of the brightest voxel
+        float       peakValue;
+        float       weight;         // Sum of positive intensities
+        float       confidence;     // 0 to 1
+        uint32_t    voxels;         // Voxels with positive intensity
+    };
+
+    // Fills in a LED's volume, either by returning one it already has or by
+    // decoding into 'scratch' and returning that. Null skips the LED. Called
+    // concurrently from the worker threads, each with its own scratch.
+    typedef std::function<const BrickVolume* (size_t led, BrickVolume& scratch, Space& space)> FetchFn;
+
+    LedSolver();
+
+    // New LEDs start out invalid. 0 threads means one per hardware thread.
+    void setup(size_t numLeds, unsigned numThreads = 0);
+
+    void invalidate(size_t led);
+    void invalidateAll();
+    bool isValid(size_t led) const { return led < mDirty.size() && !mDirty[led]; }
+
+    // Solves every invalid LED. Returns how many were solved.
+    size_t solve(const FetchFn& fetch);
+
+    size_t getNumLeds() const { return mResults.size(); }
+    const Result& getResult(size_t led) const { return mResults[led]; }
+
+    // One LED, on the calling thread
+    static Result solveVolume(const BrickVolume& volume, const Space& space);
+
+    // Open Pixel Control layout JSON, one point per LED in meters. LEDs
+    // without a position are written at the origin with zero confidence.
+    bool writeLayout(const std::string& path) const;
+
+private:
+    unsigned                mNumThreads;
+    WorkerPool              mPool;
+    std::vector<BrickVolume> mScratch;  // One per worker
+    std::vector<uint8_t>    mDirty;
+    std::vector<Result>     mResults;
+};
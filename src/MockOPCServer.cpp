@@ -0,0 +1,293 @@
+#include "MockOPCServer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace ci;
+using namespace std;
+
+// Largest UDP datagram we accept
+static const size_t kMaxDatagram = 0x10000;
+
+// Sequence number ahead of each UDP datagram
+static const size_t kSequenceBytes = 4;
+
+
+MockOPCServer::MockOPCServer()
+    : mUdpChannelLeds(170), mMaxFadeSeconds(0.1), mFailed(false), mPort(0), mTransport(OPCClient::TRANSPORT_TCP),
+      mCurrentTime(0), mFade(0), mSequence(0), mHaveSequence(false)
+{
+    resetStats();
+}
+
+MockOPCServer::~MockOPCServer()
+{
+    stop();
+}
+
+double MockOPCServer::now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool MockOPCServer::start(uint16_t port, OPCClient::Transport transport)
+{
+    stop();
+    resetStats();
+    mPort = port;
+    mTransport = transport;
+    mPrevious.clear();
+    mCurrent.clear();
+    mStream.clear();
+    mHaveSequence = false;
+    mFailed = false;
+
+    mIo = shared_ptr<boost::asio::io_service>(new boost::asio::io_service());
+    mWork = shared_ptr<boost::asio::io_service::work>(new boost::asio::io_service::work(*mIo));
+
+    bool failed = false;
+    try {
+        if (transport == OPCClient::TRANSPORT_UDP) {
+            mUdpServer = UdpServer::create(*mIo);
+            mUdpServer->connectErrorEventHandler([&](string err, size_t) { failed = true; });
+            mUdpServer->connectAcceptEventHandler(&MockOPCServer::onUdpAccept, this);
+            mUdpServer->accept(port);
+            mUdpServer->connectErrorEventHandler(nullptr);
+        } else {
+            mTcpServer = TcpServer::create(*mIo);
+            mTcpServer->connectErrorEventHandler([&](string err, size_t) { failed = true; });
+            mTcpServer->connectAcceptEventHandler(&MockOPCServer::onTcpAccept, this);
+            mTcpServer->accept(port);
+            mTcpServer->connectErrorEventHandler(nullptr);
+        }
+    } catch (boost::system::system_error &e) {
+        failed = true;
+    }
+    if (failed) {
+        stop();
+        return false;
+    }
+
+    shared_ptr<boost::asio::io_service> io = mIo;
+    mThread = shared_ptr<thread>(new thread([io]() { io->run(); }));
+    return true;
+}
+
+void MockOPCServer::stop()
+{
+    if (mIo) {
+        mIo->stop();
+    }
+    if (mThread) {
+        mThread->join();
+        mThread.reset();
+    }
+    mTcpSessions.clear();
+    mUdpSession.reset();
+    mTcpServer.reset();
+    mUdpServer.reset();
+    mWork.reset();
+    mIo.reset();
+}
+
+void MockOPCServer::onTcpAccept(TcpSessionRef session)
+{
+    // One client at a time, but keep listening so it can reconnect
+    mTcpSessions.clear();
+    mTcpSessions.push_back(session);
+    mStream.clear();
+
+    TcpSession *s = session.get();
+    session->connectReadEventHandler([this, s](Buffer buffer) { onTcpRead(buffer, s); });
+    session->read();
+
+    // Listening again binds a new acceptor, which throws if the port has
+    // been taken meanwhile. Nothing on this thread would catch it.
+    try {
+        mTcpServer->accept(mPort);
+    } catch (boost::system::system_error &e) {
+        mFailed = true;
+        mIo->stop();
+    }
+}
+
+void MockOPCServer::onTcpRead(const Buffer& buffer, TcpSession* session)
+{
+    double t = now();
+    boost::system::error_code err;
+    unsigned queued = unsigned(session->getSocket()->available(err));
+
+    const uint8_t *bytes = (const uint8_t*) buffer.getData();
+    mStream.insert(mStream.end(), bytes, bytes + buffer.getDataSize());
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mBytes += buffer.getDataSize();
+        mQueueBytes = queued;
+        mMaxQueueBytes = max(mMaxQueueBytes, queued);
+
+        // Every complete message in the stream is a frame
+        size_t pos = 0;
+        while (mStream.size() - pos >= sizeof(OPCClient::Header)) {
+            const uint8_t *header = &mStream[pos];
+            size_t length = (size_t(header[2]) << 8) | header[3];
+            if (mStream.size() - pos < sizeof(OPCClient::Header) + length) {
+                break;
+            }
+            onMessage(header[0], header[1], header + sizeof(OPCClient::Header), length, t);
+            pos += sizeof(OPCClient::Header) + length;
+        }
+        mStream.erase(mStream.begin(), mStream.begin() + pos);
+    }
+
+    session->read();
+}
+
+void MockOPCServer::onUdpAccept(UdpSessionRef session)
+{
+    mUdpSession = session;
+    session->connectReadEventHandler(&MockOPCServer::onUdpRead, this);
+    session->read(kMaxDatagram);
+}
+
+void MockOPCServer::onUdpRead(const Buffer& buffer)
+{
+    double t = now();
+    boost::system::error_code err;
+    unsigned queued = unsigned(mUdpSession->getSocket()->available(err));
+
+    const uint8_t *bytes = (const uint8_t*) buffer.getData();
+    size_t size = buffer.getDataSize();
+
+    {
+        lock_guard<mutex> lock(mMutex);
+        mBytes += size;
+        mQueueBytes = queued;
+        mMaxQueueBytes = max(mMaxQueueBytes, queued);
+
+        if (size >= kSequenceBytes + sizeof(OPCClient::Header)) {
+            uint32_t sequence = (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) |
+                (uint32_t(bytes[2]) << 8) | bytes[3];
+            int32_t ahead = int32_t(sequence - mSequence);
+
+            if (mHaveSequence && ahead < 0) {
+                // Part of a frame that's already been replaced
+                mStaleDatagrams++;
+            } else {
+                if (!mHaveSequence || ahead > 0) {
+                    if (mHaveSequence) {
+                        mLostFrames += ahead - 1;
+                    }
+                    mSequence = sequence;
+                    mHaveSequence = true;
+                    onFrame(t);
+                }
+
+                const uint8_t *header = bytes + kSequenceBytes;
+                size_t length = min((size_t(header[2]) << 8) | header[3],
+                    size - kSequenceBytes - sizeof(OPCClient::Header));
+                onMessage(header[0], header[1], header + sizeof(OPCClient::Header), length, t);
+            }
+        }
+    }
+
+    mUdpSession->read(kMaxDatagram);
+}
+
+void MockOPCServer::onMessage(uint8_t channel, uint8_t command, const uint8_t* data, size_t length, double now)
+{
+    if (command != OPCClient::SET_PIXEL_COLORS) {
+        return;
+    }
+
+    // Over TCP each message is a whole frame. Over UDP, channels past the
+    // first carry later pieces of the frame its sequence number started.
+    size_t offset = 0;
+    if (mTransport == OPCClient::TRANSPORT_UDP) {
+        offset = channel > 1 ? size_t(channel - 1) * mUdpChannelLeds * 3 : 0;
+    } else {
+        onFrame(now);
+    }
+
+    if (mCurrent.size() < offset + length) {
+        mCurrent.resize(offset + length, 0);
+    }
+    copy(data, data + length, mCurrent.begin() + offset);
+}
+
+void MockOPCServer::onFrame(double now)
+{
+    if (mFrames > 0) {
+        double interval = now - mLastArrival;
+        mIntervalSum += interval;
+        mIntervalSquares += interval * interval;
+        mMaxInterval = max(mMaxInterval, interval);
+    }
+    mLastArrival = now;
+    mFrames++;
+
+    // Like Fadecandy, fade from whatever is showing now to the new frame
+    // over the time since the last one
+    interpolate(mPrevious, now);
+    mFade = mCurrentTime > 0 ? min(now - mCurrentTime, mMaxFadeSeconds) : 0.0;
+    mCurrentTime = now;
+    mFadeSum += mFade;
+}
+
+void MockOPCServer::interpolate(vector<uint8_t>& rgb, double now) const
+{
+    double a = mFade > 0 ? min(max((now - mCurrentTime) / mFade, 0.0), 1.0) : 1.0;
+
+    vector<uint8_t> result(mCurrent.size());
+    for (size_t i = 0; i < mCurrent.size(); i++) {
+        float from = i < mPrevious.size() ? mPrevious[i] : 0.0f;
+        result[i] = uint8_t(from + (mCurrent[i] - from) * a + 0.5f);
+    }
+    rgb.swap(result);
+}
+
+void MockOPCServer::getPixels(vector<uint8_t>& rgb)
+{
+    lock_guard<mutex> lock(mMutex);
+    interpolate(rgb, now());
+}
+
+MockOPCServer::Stats MockOPCServer::getStats()
+{
+    lock_guard<mutex> lock(mMutex);
+
+    Stats stats;
+    double elapsed = max(now() - mStatsStart, 1e-6);
+    unsigned intervals = mFrames > 1 ? mFrames - 1 : 0;
+    double mean = intervals ? mIntervalSum / intervals : 0.0;
+
+    stats.frames = mFrames;
+    stats.framesPerSecond = mFrames / elapsed;
+    stats.bytesPerSecond = mBytes / elapsed;
+    stats.meanInterval = mean;
+    stats.jitter = intervals ? sqrt(max(mIntervalSquares / intervals - mean * mean, 0.0)) : 0.0;
+    stats.maxInterval = mMaxInterval;
+    stats.meanFadeSeconds = mFrames ? mFadeSum / mFrames : 0.0;
+    stats.queueBytes = mQueueBytes;
+    stats.maxQueueBytes = mMaxQueueBytes;
+    stats.lostFrames = mLostFrames;
+    stats.staleDatagrams = mStaleDatagrams;
+    return stats;
+}
+
+void MockOPCServer::resetStats()
+{
+    lock_guard<mutex> lock(mMutex);
+    mStatsStart = now();
+    mLastArrival = 0;
+    mFrames = 0;
+    mBytes = 0;
+    mIntervalSum = 0;
+    mIntervalSquares = 0;
+    mMaxInterval = 0;
+    mFadeSum = 0;
+    mQueueBytes = 0;
+    mMaxQueueBytes = 0;
+    mLostFrames = 0;
+    mStaleDatagrams = 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "TcpServer.h"
+#include "UdpServer.h"
+#include "OPCClient.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Local stand-in for a Fadecandy server, for benchmarking the OPC write
+// path without hardware. Listens with the bundled TcpServer or UdpServer on
+// its own thread, parses OPC messages as they arrive and timestamps each one.
+//
+// The pixel state models Fadecandy's interpolation, which fades from the
+// previous frame to the newest over the time between the two. A frame sent
+// twice back to back is therefore shown almost at once, while a lone frame
+// takes a whole frame interval to be fully visible.
+
+class MockOPCServer
+{
+public:
+    struct Stats {
+        unsigned    frames;             // OPC messages, or UDP frame sequence numbers
+        double      framesPerSecond;
+        double      bytesPerSecond;
+        double      meanInterval;       // Seconds between frame arrivals
+        double      jitter;             // Standard deviation of the interval
+        double      maxInterval;
+        double      meanFadeSeconds;    // Interpolation time until each frame was fully shown
+        unsigned    queueBytes;         // Bytes waiting in the socket at the last read
+        unsigned    maxQueueBytes;
+        unsigned    lostFrames;         // UDP sequence numbers skipped
+        unsigned    staleDatagrams;     // UDP datagrams older than the newest frame
+    };
+
+    MockOPCServer();
+    ~MockOPCServer();
+
+    bool start(uint16_t port, OPCClient::Transport transport = OPCClient::TRANSPORT_TCP);
+    void stop();
+    // False after stop(), or if the server couldn't listen again after a client connected
+    bool isRunning() const { return mThread && !mFailed; }
+
+    // Counted since the last reset
+    Stats getStats();
+    void resetStats();
+
+    // Interpolated 8-bit RGB pixels as they'd be shown right now
+    void getPixels(std::vector<uint8_t>& rgb);
+
+    unsigned    mUdpChannelLeds;    // Must match the client's channel size
+    double      mMaxFadeSeconds;    // Longest interpolation, as Fadecandy caps it
+
+private:
+    void        onTcpAccept(TcpSessionRef session);
+    void        onTcpRead(const ci::Buffer& buffer, TcpSession* session);
+    void        onUdpAccept(UdpSessionRef session);
+    void        onUdpRead(const ci::Buffer& buffer);
+    void        onMessage(uint8_t channel, uint8_t command, const uint8_t* data, size_t length, double now);
+    void        onFrame(double now);
+    void        interpolate(std::vector<uint8_t>& rgb, double now) const;
+
+    static double now();
+
+    std::shared_ptr<boost::asio::io_service>        mIo;
+    std::shared_ptr<boost::asio::io_service::work>  mWork;
+    std::shared_ptr<std::thread>    mThread;
+    std::atomic<bool>               mFailed;        // Set on the server thread, which then exits
+    TcpServerRef                    mTcpServer;
+    UdpServerRef                    mUdpServer;
+    uint16_t                        mPort;
+    OPCClient::Transport            mTransport;
+    std::vector<TcpSessionRef>      mTcpSessions;
+    UdpSessionRef                   mUdpSession;
+    std::vector<uint8_t>            mStream;        // TCP bytes not yet parsed
+
+    std::mutex                      mMutex;         // Guards everything below, read from any thread
+    std::vector<uint8_t>            mPrevious, mCurrent;
+    double                          mCurrentTime;   // Arrival of the newest frame
+    double                          mFade;          // Seconds to fade from mPrevious to mCurrent
+    uint32_t                        mSequence;      // Newest UDP frame seen
+    bool                            mHaveSequence;
+
+    double      mStatsStart, mLastArrival;
+    unsigned    mFrames;
+    uint64_t    mBytes;
+    double      mIntervalSum, mIntervalSquares, mMaxInterval, mFadeSum;
+    unsigned    mQueueBytes, mMaxQueueBytes, mLostFrames, mStaleDatagrams;
+};
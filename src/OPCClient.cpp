@@ -37,16 +37,35 @@
 #include "OPCClient.h"
 #include "cinder/app/App.h"
 #include "cinder/Utilities.h"
+#include <algorithm>
 
 using namespace std;
 using namespace cinder;
 
-OPCClient::OPCClient( ) : mConnecting(false)
+// Pixels per UDP datagram by default, as in a DMX universe. Well under a
+// typical MTU once framing is added.
+static const unsigned kDefaultUdpChannelLeds = 170;
+
+const unsigned OPCClient::kMaxCopies;
+
+OPCClient::OPCClient( ) : mTransport(TRANSPORT_TCP), mConnecting(false), mActiveFrame(0),
+    mWritesOutstanding(0), mSupersededFrames(0), mUdpSequence(0), mDroppedDatagrams(0)
 {
     mHost		= "localhost";
     mPort		= 7890;
+    for (int i = 0; i < 2; i++) {
+        mFrames[i].data.reserve(sizeof(Header) + 0xFFFF);
+        mFrames[i].copies = 1;
+        mFrames[i].pending = false;
+    }
+    mWriteBuffers.reserve(kMaxCopies);
+    mUdpHeaders.resize(256);    // Enough for any channel size setUdpChannelLeds() allows
+    setUdpChannelLeds(kDefaultUdpChannelLeds);
     mIo = shared_ptr<boost::asio::io_service>( new boost::asio::io_service() );
+    mWork = shared_ptr<boost::asio::io_service::work>( new boost::asio::io_service::work( *mIo ) );
     mClient = TcpClient::create( *mIo );
+    mUdpClient = UdpClient::create( *mIo );
+    mUdpClient->connectConnectEventHandler( &OPCClient::onUdpConnect, this );
 }
 OPCClient::~OPCClient( )
 {
@@ -54,6 +73,48 @@ OPCClient::~OPCClient( )
         mSession->close();
     }
     mSession.reset();
+    mUdpSession.reset();
+}
+void OPCClient::setTransport(Transport transport)
+{
+    if (transport != mTransport) {
+        disconnect();
+        mTransport = transport;
+    }
+}
+void OPCClient::setAddress(const std::string &host, int port)
+{
+    if (host != mHost || port != mPort) {
+        disconnect();
+        mHost = host;
+        mPort = port;
+    }
+}
+void OPCClient::disconnect()
+{
+    if (mSession) {
+        mSession->close();
+    }
+    if (mUdpSession) {
+        boost::system::error_code err;
+        mUdpSession->getSocket()->close(err);
+    }
+    // Let aborted sends finish against the old transport before starting over
+    mIo->poll();
+    mSession.reset();
+    mUdpSession.reset();
+
+    mConnecting = false;
+    mWritesOutstanding = 0;
+    mFrames[0].pending = false;
+    mFrames[1].pending = false;
+}
+void OPCClient::setUdpChannelLeds(unsigned leds)
+{
+    // No more channels than OPC can address, for the largest packet
+    const unsigned maxPixels = 0xFFFF / 3;
+    leds = max(leds, maxPixels / 255 + 1);
+    mUdpChannelLeds = min(leds, maxPixels);
 }
 void OPCClient::update(){
     mIo->poll();
@@ -75,11 +136,15 @@ bool OPCClient::connect(std::string pHost, int pPort){
         mHost = pHost;
         mPort = pPort;
         
-        mClient->connectResolveEventHandler( [ & ]()
-                                            {
-                                                
-                                            } );
-        mClient->connect( mHost, (uint16_t)mPort );
+        if (mTransport == TRANSPORT_UDP) {
+            mUdpClient->connect( mHost, (uint16_t)mPort );
+        } else {
+            mClient->connectResolveEventHandler( [ & ]()
+                                                {
+                                                    
+                                                } );
+            mClient->connect( mHost, (uint16_t)mPort );
+        }
     }
     return false;
 }
@@ -90,42 +155,137 @@ void OPCClient::connectConnectEventHandler( const std::function<void( TcpSession
 void OPCClient::connectErrorEventHandler( const std::function<void( std::string, size_t )>& eventHandler )
 {
     mClient->connectErrorEventHandler(eventHandler);
+    mUdpClient->connectErrorEventHandler(eventHandler);
+}
+void OPCClient::write(const std::string &strBuffer, unsigned copies)
+{
+    getFrame().assign(strBuffer.begin(), strBuffer.end());
+    sendFrame(copies);
 }
-void OPCClient::write(std::string strBuffer)
+void OPCClient::write(const std::vector<char> &data, unsigned copies)
 {
-    if ( mSession && mSession->getSocket()->is_open() ) {
-        // Write data is packaged as a ci::Buffer. This allows
-        // you to send any kind of data. Because it's more common to
-        // work with strings, the session object has static convenience
-        // methods for converting between std::string and ci::Buffer.
-        Buffer buffer = TcpSession::stringToBuffer( strBuffer );
-        mSession->write( buffer );
-    } else {
+    getFrame().assign(data.begin(), data.end());
+    sendFrame(copies);
+}
+std::vector<char>& OPCClient::getFrame()
+{
+    // The frame that isn't on the wire
+    return mFrames[mWritesOutstanding ? 1 - mActiveFrame : mActiveFrame].data;
+}
+void OPCClient::sendFrame(unsigned copies)
+{
+    if (!isConnected()) {
         // Before we can write, we need to establish a connection
         // and create a session. Check out the onConnect method.
         connect(mHost,mPort);
+        return;
+    }
+
+    Frame& frame = mFrames[mWritesOutstanding ? 1 - mActiveFrame : mActiveFrame];
+    if (frame.pending) {
+        mSupersededFrames++;
+    }
+    frame.copies = std::max(1u, std::min(copies, kMaxCopies));
+    frame.pending = !frame.data.empty();
+
+    if (!mWritesOutstanding) {
+        startWrite();
     }
 }
-void OPCClient::write(std::vector<char> &data)
+void OPCClient::startWrite()
 {
-    if ( mSession && mSession->getSocket()->is_open()  ) {
-        Buffer buffer = Buffer( &data[ 0 ], data.size() );
-        mSession->write( buffer );
-    } else {
-        // Before we can write, we need to establish a connection
-        // and create a session. Check out the onConnect method.
-        connect(mHost,mPort);
+    Frame& frame = mFrames[mActiveFrame];
+    if (!frame.pending) {
+        return;
+    }
+    frame.pending = false;
+
+    if (mTransport == TRANSPORT_UDP) {
+        startDatagrams(frame);
+        return;
+    }
+
+    // Every copy points at the same bytes, and asio gathers them into one send
+    mWriteBuffers.clear();
+    for (unsigned i = 0; i < frame.copies; i++) {
+        mWriteBuffers.push_back(boost::asio::buffer(frame.data));
+    }
+
+    mWritesOutstanding = 1;
+    boost::asio::async_write(*mSession->getSocket(), mWriteBuffers,
+        boost::bind(&OPCClient::onFrameWritten, this,
+            boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+void OPCClient::startDatagrams(const Frame& frame)
+{
+    if (frame.data.size() < sizeof(Header)) {
+        return;
+    }
+
+    uint32_t sequence = ++mUdpSequence;
+    for (int i = 0; i < 4; i++) {
+        mUdpSequenceBytes[i] = uint8_t(sequence >> (24 - 8 * i));
+    }
+
+    // Only pixel data is split. Anything else goes as one datagram.
+    const Header& header = Header::view(frame.data);
+    const size_t length = frame.data.size() - sizeof(Header);
+    const size_t chunkSize = header.command == SET_PIXEL_COLORS ? mUdpChannelLeds * 3 : length;
+    const size_t chunks = chunkSize && length > chunkSize ? (length + chunkSize - 1) / chunkSize : 1;
+
+    mWritesOutstanding = unsigned(chunks);
+    for (size_t i = 0; i < chunks; i++) {
+        size_t offset = i * chunkSize;
+        size_t size = min(chunkSize, length - offset);
+        mUdpHeaders[i].init(chunks > 1 ? uint8_t(i + 1) : header.channel, header.command, uint16_t(size));
+
+        std::array<boost::asio::const_buffer, 3> buffers = {{
+            boost::asio::buffer(mUdpSequenceBytes),
+            boost::asio::buffer(&mUdpHeaders[i], sizeof(Header)),
+            boost::asio::buffer(header.data() + offset, size),
+        }};
+        mUdpSession->getSocket()->async_send(buffers,
+            boost::bind(&OPCClient::onDatagramSent, this,
+                boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+    }
+}
+void OPCClient::onDatagramSent( const boost::system::error_code& err, size_t bytesTransferred )
+{
+    // A lost datagram only costs that frame; the next one replaces it anyway
+    if (err) {
+        mDroppedDatagrams++;
+    }
+    if (mWritesOutstanding && --mWritesOutstanding == 0) {
+        mActiveFrame = 1 - mActiveFrame;
+        startWrite();
     }
 }
+void OPCClient::onFrameWritten( const boost::system::error_code& err, size_t bytesTransferred )
+{
+    mWritesOutstanding = 0;
+    if (err) {
+        mFrames[0].pending = false;
+        mFrames[1].pending = false;
+        onError(err.message(), bytesTransferred);
+        return;
+    }
+
+    // Anything sent meanwhile is waiting in the other frame
+    mActiveFrame = 1 - mActiveFrame;
+    startWrite();
+}
 bool OPCClient::isConnected()
 {
+    if (mTransport == TRANSPORT_UDP) {
+        return ( mUdpSession && mUdpSession->getSocket()->is_open() );
+    }
     return ( mSession && mSession->getSocket()->is_open() );
 }
 void OPCClient::onError( std::string err, size_t bytesTransferred ){
     ci::app::console()<< "OPCClient::onError "<< err << endl;
     //if(err == "An existing connection was forcibly closed by the remote host")
     mConnecting = false;
-    if(isConnected())
+    if(mSession && mSession->getSocket()->is_open())
         mSession->close();
 }
 void OPCClient::onConnect( TcpSessionRef session ){
@@ -145,4 +305,10 @@ void OPCClient::onConnect( TcpSessionRef session ){
     //mSession->connectReadEventHandler( &OPCClient::onRead, this );
     //mSession->connectWriteEventHandler( &OPCClient::onWrite, this );
     mConnecting = false;
-}
\ No newline at end of file
+}
+void OPCClient::onUdpConnect( UdpSessionRef session ){
+    ci::app::console()<< "OPCClient::onUdpConnect "<< endl;
+    mUdpSession = session;
+    mUdpSession->connectErrorEventHandler( &OPCClient::onError, this );
+    mConnecting = false;
+}
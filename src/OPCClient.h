@@ -28,6 +28,9 @@
 #pragma once
 
 #include "TcpClient.h"
+#include "UdpClient.h"
+#include <array>
+#include <vector>
 
 class OPCClient;
 
@@ -42,13 +45,47 @@ public:
     
     OPCClient();
     ~OPCClient();
+
+    // TCP is standard OPC. Over UDP, each datagram is a 32-bit big-endian
+    // frame sequence number followed by one OPC message, and pixel data too
+    // large for one datagram is split across OPC channels 1, 2, ... of at
+    // most getUdpChannelLeds() LEDs each. Receivers can drop anything older
+    // than the newest sequence they've seen, so a slow controller never
+    // builds a queue.
+    enum Transport {
+        TRANSPORT_TCP,
+        TRANSPORT_UDP,
+    };
+
+    // Drops the current connection if the transport changes
+    void setTransport(Transport transport);
+    Transport getTransport() const { return mTransport; }
+    void setUdpChannelLeds(unsigned leds);
+    // Drops the current connection if the address changes
+    void setAddress(const std::string &host, int port);
+    unsigned getUdpChannelLeds() const { return mUdpChannelLeds; }
     
     bool connect(std::string pHost, int pPort = 7890);
     void	update();
     bool	isConnected();
     bool	tryConnect();
-    void						write(std::string strBuffer);
-    void						write(std::vector<char> &data);
+    void						write(const std::string &strBuffer, unsigned copies = 1);
+    void						write(const std::vector<char> &data, unsigned copies = 1);
+
+    // Zero-copy sending. Build the packet in the buffer from getFrame(),
+    // then sendFrame() it. Buffers are allocated once at full OPC size, and
+    // only one write is ever outstanding on the socket: a frame sent while
+    // the previous one is still on the wire waits for it, and replaces any
+    // frame already waiting, since only the newest LED state matters.
+    std::vector<char>&			getFrame();
+    // Sends the frame 'copies' times back to back, in a single write. UDP
+    // sends it once, since copies would carry the same sequence number.
+    void						sendFrame(unsigned copies = 1);
+
+    // Frames replaced before they could be sent
+    unsigned					getSupersededFrames() const { return mSupersededFrames; }
+    // UDP datagrams that failed to send
+    unsigned					getDroppedDatagrams() const { return mDroppedDatagrams; }
     
     template< typename T, typename Y >
     inline void		connectConnectEventHandler( T eventHandler, Y* eventHandlerObject )
@@ -99,14 +136,48 @@ public:
     void						onConnect( TcpSessionRef session );
     void						onError( std::string err, size_t bytesTransferred );
 private:
+    Transport					mTransport;
     TcpClientRef				mClient;
     TcpSessionRef				mSession;
+    UdpClientRef				mUdpClient;
+    UdpSessionRef				mUdpSession;
     std::string					mHost;
     int32_t						mPort;
     bool						mConnecting;
     
     void						onRead( ci::Buffer buffer );
     void						onWrite( size_t bytesTransferred );
+
+    struct Frame {
+        std::vector<char>       data;
+        unsigned                copies;
+        bool                    pending;
+    };
+
+    static const unsigned		kMaxCopies = 4;
+
+    void						disconnect();
+    void						startWrite();
+    void						startDatagrams(const Frame& frame);
+    void						onFrameWritten( const boost::system::error_code& err, size_t bytesTransferred );
+    void						onDatagramSent( const boost::system::error_code& err, size_t bytesTransferred );
+    void						onUdpConnect( UdpSessionRef session );
+
+    Frame						mFrames[2];         // One on the wire, one being built or waiting
+    unsigned					mActiveFrame;       // Index of the frame on the wire, if writing
+    unsigned					mWritesOutstanding; // Sends in flight for the active frame
+    unsigned					mSupersededFrames;
+    std::vector<boost::asio::const_buffer> mWriteBuffers;
+
+    // UDP framing, filled per frame and kept alive until its sends finish
+    unsigned					mUdpChannelLeds;
+    uint32_t					mUdpSequence;
+    uint8_t						mUdpSequenceBytes[4];
+    std::vector<Header>			mUdpHeaders;        // One per datagram
+    unsigned					mDroppedDatagrams;
     
     std::shared_ptr<boost::asio::io_service>	mIo;
+    // Keeps poll() from stopping the service whenever nothing is in flight,
+    // which would strand the completion of every later write
+    std::shared_ptr<boost::asio::io_service::work>	mWork;
 };
@@ -0,0 +1,190 @@
+#include "PackedVolume.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+// Longest run one token can hold
+static const size_t kMaxRun = 128;
+
+
+PackedVolume::PackedVolume()
+    : mSizeX(0), mSizeY(0), mSizeZ(0), mMaxError(0)
+{
+    mQuantization.format = FORMAT_FLOAT;
+    mQuantization.scale = 1.0f;
+    mQuantization.offset = 0.0f;
+}
+
+void PackedVolume::pack(const BrickVolume& volume, Format format)
+{
+    size_t count = volume.getNumBricks() * BrickVolume::kBrickVoxels;
+
+    mSizeX = volume.getSizeX();
+    mSizeY = volume.getSizeY();
+    mSizeZ = volume.getSizeZ();
+    mBricks.assign(volume.getBricks(), volume.getBricks() + volume.getNumBricks());
+    mQuantization = quantize(volume.getVoxels(), count, format);
+    mData.clear();
+    mMaxError = encode(volume.getVoxels(), count, mQuantization, mData);
+
+    // Packed volumes are kept for a while, so don't hold on to slack
+    vector<uint32_t>(mBricks).swap(mBricks);
+    vector<uint8_t>(mData).swap(mData);
+}
+
+bool PackedVolume::unpack(BrickVolume& volume) const
+{
+    if (!volume.assign(mSizeX, mSizeY, mSizeZ, mBricks.empty() ? 0 : &mBricks[0], mBricks.size()) ||
+        !decode(mData.empty() ? 0 : &mData[0], mData.size(), mQuantization,
+            volume.getVoxels(), mBricks.size() * BrickVolume::kBrickVoxels)) {
+        volume.clear();
+        return false;
+    }
+    return true;
+}
+
+void PackedVolume::clear()
+{
+    mSizeX = mSizeY = mSizeZ = 0;
+    vector<uint32_t>().swap(mBricks);
+    vector<uint8_t>().swap(mData);
+    mMaxError = 0;
+}
+
+size_t PackedVolume::getMemoryBytes() const
+{
+    return mBricks.capacity() * sizeof(uint32_t) + mData.capacity();
+}
+
+PackedVolume::Quantization PackedVolume::quantize(const float* voxels, size_t count, Format format)
+{
+    Quantization q;
+    q.format = format;
+    q.scale = 1.0f;
+    q.offset = 0.0f;
+    if (format == FORMAT_FLOAT) {
+        return q;
+    }
+
+    float lo = INFINITY, hi = -INFINITY;
+    for (size_t i = 0; i < count; i++) {
+        if (voxels[i] != 0.0f) {
+            lo = min(lo, voxels[i]);
+            hi = max(hi, voxels[i]);
+        }
+    }
+    if (lo > hi) {
+        return q;
+    }
+
+    // Code 0 is reserved for zero, leaving maxCode steps for the range
+    unsigned maxCode = format == FORMAT_UINT8 ? 0xff : 0xffff;
+    q.offset = lo;
+    q.scale = hi > lo ? (hi - lo) / (maxCode - 1) : 1.0f;
+
+    // A range spanning zero could have a step land on it, and a small
+    // nonzero voxel would come back as zero. One step of slack lets the
+    // steps sit half a step either side of zero instead.
+    if (lo < 0.0f && hi > 0.0f) {
+        q.scale = (hi - lo) / (maxCode - 2);
+        q.offset = -(floorf(-lo / q.scale) + 0.5f) * q.scale;
+        if (q.offset > lo) {
+            q.offset -= q.scale;
+        }
+    }
+    return q;
+}
+
+float PackedVolume::encode(const float* voxels, size_t count, const Quantization& q, vector<uint8_t>& out)
+{
+    if (q.format == FORMAT_FLOAT) {
+        const uint8_t *bytes = (const uint8_t*)voxels;
+        out.insert(out.end(), bytes, bytes + count * sizeof(float));
+        return 0.0f;
+    }
+
+    const bool wide = q.format == FORMAT_UINT16;
+    const unsigned maxCode = wide ? 0xffff : 0xff;
+    const float invScale = 1.0f / q.scale;
+    float maxError = 0.0f;
+
+    size_t i = 0;
+    while (i < count) {
+        size_t run = 0;
+        if (voxels[i] == 0.0f) {
+            while (i + run < count && run < kMaxRun && voxels[i + run] == 0.0f) {
+                run++;
+            }
+            out.push_back(uint8_t(0x80 | (run - 1)));
+            i += run;
+            continue;
+        }
+
+        while (i + run < count && run < kMaxRun && voxels[i + run] != 0.0f) {
+            run++;
+        }
+        out.push_back(uint8_t(run - 1));
+        for (size_t end = i + run; i < end; i++) {
+            float steps = floorf((voxels[i] - q.offset) * invScale + 0.5f);
+            unsigned code = unsigned(min(max(steps, 0.0f), float(maxCode - 1))) + 1;
+            out.push_back(uint8_t(code));
+            if (wide) {
+                out.push_back(uint8_t(code >> 8));
+            }
+            maxError = max(maxError, fabsf(q.offset + (code - 1) * q.scale - voxels[i]));
+        }
+    }
+    return maxError;
+}
+
+bool PackedVolume::decode(const uint8_t* data, size_t size, const Quantization& q, float* voxels, size_t count)
+{
+    if (q.format == FORMAT_FLOAT) {
+        if (size != count * sizeof(float)) {
+            return false;
+        }
+        if (size) {
+            memcpy(voxels, data, size);
+        }
+        return true;
+    }
+    if (q.format != FORMAT_UINT16 && q.format != FORMAT_UINT8) {
+        return false;
+    }
+
+    const bool wide = q.format == FORMAT_UINT16;
+    const uint8_t *end = data + size;
+    float *out = voxels;
+    float *outEnd = voxels + count;
+
+    while (data < end) {
+        uint8_t token = *data++;
+        size_t run = (token & 0x7f) + 1;
+        if (run > size_t(outEnd - out)) {
+            return false;
+        }
+
+        if (token & 0x80) {
+            fill(out, out + run, 0.0f);
+            out += run;
+        } else if (wide) {
+            if (size_t(end - data) < run * 2) {
+                return false;
+            }
+            for (size_t i = 0; i < run; i++, data += 2) {
+                unsigned code = data[0] | (unsigned(data[1]) << 8);
+                *out++ = q.offset + (int(code) - 1) * q.scale;
+            }
+        } else {
+            if (size_t(end - data) < run) {
+                return false;
+            }
+            for (size_t i = 0; i < run; i++) {
+                *out++ = q.offset + (*data++ - 1) * q.scale;
+            }
+        }
+    }
+    return out == outEnd;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "BrickVolume.h"
+
+// Compact copy of a BrickVolume, for LEDs that aren't being updated and for
+// voxel map files. Voxels are quantized with one scale and offset per
+// volume, then runs of zeros are collapsed:
+//
+//   code 0                 exactly zero
+//   code c > 0             offset + (c - 1) * scale
+//
+// The stream is a sequence of tokens. A token byte t with the high bit set
+// is a run of (t & 0x7f) + 1 zero codes; otherwise t + 1 literal codes
+// follow it, little-endian. Zero stays zero and nonzero stays nonzero, so
+// unpacking allocates the same bricks.
+
+class PackedVolume
+{
+public:
+    enum Format {
+        FORMAT_FLOAT,       // Raw 32-bit floats, no quantization
+        FORMAT_UINT16,
+        FORMAT_UINT8,
+    };
+
+    struct Quantization {
+        uint32_t    format;
+        float       scale;
+        float       offset;
+    };
+
+    PackedVolume();
+
+    void pack(const BrickVolume& volume, Format format);
+    // Returns false, leaving the volume empty, if the packed data is damaged
+    bool unpack(BrickVolume& volume) const;
+
+    // Frees all storage
+    void clear();
+    bool empty() const { return mSizeX == 0; }
+
+    size_t getMemoryBytes() const;
+    // Largest difference between a voxel and its unpacked value
+    float getMaxError() const { return mMaxError; }
+
+    // Scale and offset covering every nonzero voxel
+    static Quantization quantize(const float* voxels, size_t count, Format format);
+    // Appends the stream to 'out'. Returns the largest error.
+    static float encode(const float* voxels, size_t count, const Quantization& q, std::vector<uint8_t>& out);
+    // Fills exactly 'count' voxels. Returns false if the stream is malformed.
+    static bool decode(const uint8_t* data, size_t size, const Quantization& q, float* voxels, size_t count);
+
+private:
+    int                     mSizeX, mSizeY, mSizeZ;
+    std::vector<uint32_t>   mBricks;    // As in BrickVolume; pages are rebuilt on unpack
+    Quantization            mQuantization;
+    std::vector<uint8_t>    mData;
+    float                   mMaxError;
+};
@@ -0,0 +1,265 @@
+#include "SceneSimulator.h"
+#include "KinectIntrinsics.h"
+#include "OPCClient.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+using namespace ci;
+using namespace std;
+
+static double steadySeconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SceneSimulator::SceneSimulator()
+    : mRandom(1234), mStartTime(steadySeconds()), mSurfacesValid(false)
+{
+    mDepthNoise = 1.5f;
+    mHoleRate = 0.002f;
+    mColorNoise = 2.0f;
+    mDropRate = 0.01f;
+    mLatency = 0.05f;
+    mForegroundDelay = 5.0f;
+    mAmbient = 0.05f;
+    mLedIntensity = 0.02f;
+}
+
+double SceneSimulator::elapsed() const
+{
+    return steadySeconds() - mStartTime;
+}
+
+void SceneSimulator::setup(int numLeds)
+{
+    clearScene();
+
+    // Room: back wall and floor are part of the captured background
+    Box wall = { Vec3f(-3000, -3000, 4000), Vec3f(3000, 1100, 4100), Color(0.6f, 0.6f, 0.6f), false };
+    Box floor = { Vec3f(-3000, 1000, 500), Vec3f(3000, 1100, 4100), Color(0.4f, 0.4f, 0.4f), false };
+    addBox(wall);
+    addBox(floor);
+
+    // Objects to map
+    Box a = { Vec3f(-800, 200, 2000), Vec3f(-200, 1000, 2600), Color(0.8f, 0.3f, 0.3f), true };
+    Box b = { Vec3f(300, -300, 2800), Vec3f(900, 1000, 3300), Color(0.3f, 0.7f, 0.4f), true };
+    Box c = { Vec3f(-200, 600, 1500), Vec3f(400, 1000, 1900), Color(0.7f, 0.7f, 0.8f), true };
+    addBox(a);
+    addBox(b);
+    addBox(c);
+
+    vector<Vec3f> leds;
+    for (int i = 0; i < numLeds; i++) {
+        float t = i / float(max(1, numLeds - 1));
+        float angle = t * float(M_PI) * 12.0f;
+        leds.push_back(Vec3f(1200.0f * cosf(angle), -800.0f + 1600.0f * t, 2700.0f + 900.0f * sinf(angle)));
+    }
+    setLedPositions(leds);
+}
+
+void SceneSimulator::clearScene()
+{
+    lock_guard<mutex> lock(mMutex);
+    mBoxes.clear();
+    mSurfacesValid = false;
+}
+
+void SceneSimulator::addBox(const Box& box)
+{
+    lock_guard<mutex> lock(mMutex);
+    mBoxes.push_back(box);
+    mSurfacesValid = false;
+}
+
+void SceneSimulator::setLedPositions(const std::vector<ci::Vec3f>& positions)
+{
+    lock_guard<mutex> lock(mMutex);
+    mLedPositions = positions;
+}
+
+void SceneSimulator::write(const std::vector<char>& packet)
+{
+    if (packet.size() < sizeof(OPCClient::Header)) {
+        return;
+    }
+
+    const OPCClient::Header& header = OPCClient::Header::view(packet);
+    if (header.command != OPCClient::SET_PIXEL_COLORS) {
+        return;
+    }
+    size_t length = min<size_t>((header.length[0] << 8) | header.length[1],
+        packet.size() - sizeof(OPCClient::Header));
+
+    LedState state;
+    state.time = elapsed();
+    state.rgb.assign(header.data(), header.data() + length);
+
+    lock_guard<mutex> lock(mMutex);
+
+    // Keep one state older than the latency window, since it's still visible
+    while (mLedStates.size() > 1 && mLedStates[1].time < state.time - mLatency - 1.0) {
+        mLedStates.pop_front();
+    }
+    mLedStates.push_back(state);
+}
+
+void SceneSimulator::traceScene(vector<Surface>& surfaces, bool foreground)
+{
+    surfaces.resize(kWidth * kHeight);
+
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            Vec3f dir((x - kKinectCenterX) / kKinectFocalLength, (y - kKinectCenterY) / kKinectFocalLength, 1.0f);
+            Surface& s = surfaces[y * kWidth + x];
+            float nearest = numeric_limits<float>::infinity();
+
+            s.position = Vec3f::zero();
+            s.normal = Vec3f::zero();
+            s.albedo = Color::black();
+
+            for (unsigned i = 0; i < mBoxes.size(); i++) {
+                const Box& box = mBoxes[i];
+                if (box.foreground && !foreground) {
+                    continue;
+                }
+
+                // Slab test, remembering which axis we entered through
+                float tNear = 0.0f, tFar = numeric_limits<float>::infinity();
+                int axis = -1;
+                float sign = 0.0f;
+                for (int a = 0; a < 3; a++) {
+                    if (dir[a] == 0.0f) {
+                        // Parallel to this slab; the camera is at the origin
+                        if (box.min[a] > 0.0f || box.max[a] < 0.0f) {
+                            tFar = -1.0f;
+                        }
+                        continue;
+                    }
+                    float t0 = box.min[a] / dir[a];
+                    float t1 = box.max[a] / dir[a];
+                    float enterSign = -1.0f;
+                    if (t0 > t1) {
+                        swap(t0, t1);
+                        enterSign = 1.0f;
+                    }
+                    if (t0 > tNear) {
+                        tNear = t0;
+                        axis = a;
+                        sign = enterSign;
+                    }
+                    tFar = min(tFar, t1);
+                }
+
+                if (axis >= 0 && tNear <= tFar && tNear < nearest) {
+                    nearest = tNear;
+                    s.position = dir * tNear;
+                    s.normal = Vec3f::zero();
+                    s.normal[axis] = sign;
+                    s.albedo = box.albedo;
+                }
+            }
+        }
+    }
+}
+
+void SceneSimulator::updateSurfaces()
+{
+    if (!mSurfacesValid) {
+        traceScene(mBackgroundSurfaces, false);
+        traceScene(mSceneSurfaces, true);
+        mSurfacesValid = true;
+    }
+}
+
+const vector<SceneSimulator::Surface>& SceneSimulator::currentSurfaces(double now)
+{
+    updateSurfaces();
+    return now < mForegroundDelay ? mBackgroundSurfaces : mSceneSurfaces;
+}
+
+bool SceneSimulator::renderDepth(uint16_t *depth, uint32_t &timestamp)
+{
+    lock_guard<mutex> lock(mMutex);
+    double now = elapsed();
+    timestamp = uint32_t(now * 1e6);
+
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    if (uniform(mRandom) < mDropRate) {
+        return false;
+    }
+
+    normal_distribution<float> noise(0.0f, 1.0f);
+    const vector<Surface>& surfaces = currentSurfaces(now);
+
+    for (int i = 0; i < kWidth * kHeight; i++) {
+        float z = surfaces[i].position.z;
+        if (z <= 0.0f || uniform(mRandom) < mHoleRate) {
+            depth[i] = 0;
+            continue;
+        }
+
+        float meters = z * 1e-3f;
+        z += noise(mRandom) * mDepthNoise * meters * meters;
+        depth[i] = uint16_t(min(max(z + 0.5f, 0.0f), 65535.0f));
+    }
+    return true;
+}
+
+bool SceneSimulator::renderVideo(uint8_t *rgb, uint32_t &timestamp)
+{
+    lock_guard<mutex> lock(mMutex);
+    double now = elapsed();
+    timestamp = uint32_t(now * 1e6);
+
+    uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    if (uniform(mRandom) < mDropRate) {
+        return false;
+    }
+
+    // The camera sees the LED state from 'mLatency' seconds ago
+    const LedState *state = NULL;
+    for (unsigned i = 0; i < mLedStates.size(); i++) {
+        if (mLedStates[i].time <= now - mLatency) {
+            state = &mLedStates[i];
+        }
+    }
+
+    // Only lit LEDs contribute, so sequential mapping stays cheap for large counts
+    vector<Vec3f> litPositions;
+    vector<Color> litColors;
+    if (state) {
+        size_t count = min(state->rgb.size() / 3, mLedPositions.size());
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t *c = &state->rgb[i * 3];
+            if (c[0] || c[1] || c[2]) {
+                litPositions.push_back(mLedPositions[i]);
+                litColors.push_back(Color(c[0], c[1], c[2]) * (mLedIntensity / 255.0f));
+            }
+        }
+    }
+
+    normal_distribution<float> noise(0.0f, mColorNoise);
+    const vector<Surface>& surfaces = currentSurfaces(now);
+
+    for (int i = 0; i < kWidth * kHeight; i++, rgb += 3) {
+        const Surface& s = surfaces[i];
+        Color light(mAmbient, mAmbient, mAmbient);
+
+        for (unsigned j = 0; j < litPositions.size(); j++) {
+            Vec3f l = litPositions[j] - s.position;
+            float distSquared = l.lengthSquared() * 1e-6f;
+            float cosine = s.normal.dot(l.normalized());
+            if (cosine > 0.0f && distSquared > 0.0f) {
+                light += litColors[j] * (cosine / distSquared);
+            }
+        }
+
+        for (int ch = 0; ch < 3; ch++) {
+            float v = s.albedo[ch] * light[ch] * 255.0f + noise(mRandom);
+            rgb[ch] = uint8_t(min(max(v + 0.5f, 0.0f), 255.0f));
+        }
+    }
+    return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "cinder/Vector.h"
+#include "cinder/Color.h"
+#include "cinder/Thread.h"
+#include "CinderFreenect.h"
+#include <deque>
+#include <random>
+#include <vector>
+
+// Stand-in for both the Kinect and the LED controller. Renders depth and
+// color frames of a static scene made of boxes, lit by whichever LEDs the
+// last OPC packet turned on. Camera and LED positions are in millimeters,
+// in camera space (X right, Y down, Z forward).
+
+class SceneSimulator;
+typedef std::shared_ptr<SceneSimulator> SceneSimulatorRef;
+
+class SceneSimulator : public ci::Kinect::FrameSource
+{
+public:
+    struct Box {
+        ci::Vec3f   min, max;
+        ci::Color   albedo;
+        bool        foreground;     // Hidden until mForegroundDelay has elapsed
+    };
+
+    SceneSimulator();
+
+    // Default scene: a room with a few objects and 'numLeds' LEDs strung
+    // through it in a spiral.
+    void setup(int numLeds);
+
+    void clearScene();
+    void addBox(const Box& box);
+    void setLedPositions(const std::vector<ci::Vec3f>& positions);
+
+    // Ground truth for evaluating the mapper
+    const std::vector<ci::Vec3f>& getLedPositions() const { return mLedPositions; }
+
+    // OPC stand-in: accepts the same packets as OPCClient::write
+    void write(const std::vector<char>& packet);
+
+    virtual bool renderDepth(uint16_t *depth, uint32_t &timestamp);
+    virtual bool renderVideo(uint8_t *rgb, uint32_t &timestamp);
+
+    float   mDepthNoise;        // Depth noise at 1 meter (mm), grows with distance squared
+    float   mHoleRate;          // Probability of a missing depth sample
+    float   mColorNoise;        // Color noise (8-bit units)
+    float   mDropRate;          // Probability of dropping each frame
+    float   mLatency;           // Seconds between an OPC packet and its light reaching the camera
+    float   mForegroundDelay;   // Seconds before foreground boxes appear
+    float   mAmbient;
+    float   mLedIntensity;      // Irradiance from a full-brightness LED at 1 meter
+
+private:
+    struct Surface {
+        ci::Vec3f   position;
+        ci::Vec3f   normal;
+        ci::Color   albedo;
+    };
+
+    struct LedState {
+        double                  time;
+        std::vector<uint8_t>    rgb;
+    };
+
+    std::mutex              mMutex;
+    std::mt19937            mRandom;
+    double                  mStartTime;
+
+    std::vector<Box>        mBoxes;
+    std::vector<ci::Vec3f>  mLedPositions;
+    std::deque<LedState>    mLedStates;
+
+    // Per-pixel first hit, with and without foreground boxes
+    std::vector<Surface>    mBackgroundSurfaces;
+    std::vector<Surface>    mSceneSurfaces;
+    bool                    mSurfacesValid;
+
+    void                    updateSurfaces();
+    void                    traceScene(std::vector<Surface>& surfaces, bool foreground);
+    const std::vector<Surface>& currentSurfaces(double now);
+    double                  elapsed() const;
+
+    static const int kWidth = 640;
+    static const int kHeight = 480;
+};
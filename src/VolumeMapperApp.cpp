@@ -3,13 +3,37 @@
 #include "cinder/gl/Fbo.h"
 #include "cinder/gl/GlslProg.h"
 #include "cinder/gl/Texture.h"
+#include "cinder/Channel.h"
 #include "cinder/Color.h"
 #include "cinder/MayaCamUI.h"
+#include "cinder/Utilities.h"
 #include "cinder/params/Params.h"
 
 #include "CinderFreenect.h"
 #include "PointCloudRenderer.h"
 #include "OPCClient.h"
+#include "CpuMapper.h"
+#include "SceneSimulator.h"
+#include "VoxelAtlas.h"
+#include "FrameUploader.h"
+#include "FramePairer.h"
+#include "LedSequencer.h"
+#include "LatencyCalibrator.h"
+#include "LedCoder.h"
+#include "FusedGrid.h"
+#include "MockOPCServer.h"
+#include "VoxelMapFile.h"
+#include "PackedVolume.h"
+#include "LedSolver.h"
+#include "BoundedQueue.h"
+#include "KinectIntrinsics.h"
+
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 using namespace ci;
 using namespace ci::app;
@@ -21,41 +45,107 @@ public:
 	void setup();
 	void update();
 	void draw();
+    void shutdown();
 	
     void mouseDown(MouseEvent event);
     void mouseDrag(MouseEvent event);
     void captureBackground();
     void clearGrid();
+    void toggleRecording();
+    void openReplay();
+    void startSimulator();
+    void toggleGreenVideo();
+    void calibrateLatency();
+    void openSensors();
+    void toggleMockOpc();
+    void saveMap();
+    void loadMap();
+    void solveLeds();
+    void saveLayout();
     
 private:
     params::InterfaceGlRef  mParams;
     ci::MayaCamUI           mMayaCam;
     
 	KinectRef           mKinect;
+    Kinect::FreenectParams mKinectConfig;
+    FramePairer         mPairer;
+    int                 mVideoChannels;
+    SceneSimulatorRef   mSimulator;
     PointCloudRenderer  mPointCloud;
     
     gl::GlslProgRef     mFilterProg;
+    gl::GlslProgRef     mBoxFilterProg;
     gl::GlslProgRef     mMaskProg;
+    gl::GlslProgRef     mDepthRangeProg;
     gl::GlslProgRef     mSliceProg;
     gl::GlslProgRef     mDrawGridProg;
 
     gl::TextureRef		mColorTexture;
     gl::TextureRef      mDepthTexture;
     gl::TextureRef      mDepthBackgroundTexture;
+    FrameUploader       mColorUploader;
+    FrameUploader       mDepthUploader;
+
+    gl::Fbo             mDiffFbo;
+    gl::Fbo             mBoxFbo;
+    gl::Fbo             mDepthRangeFbos[2];  // Erosion passes alternate between these
+
+    shared_ptr<uint16_t> mDepthData;
+    Kinect::FrameInfo   mDepthInfo;
+    shared_ptr<uint16_t> mDepthBackgroundData;
+
+    enum Backend {
+        BACKEND_GPU,
+        BACKEND_CPU,
+    };
+
+    CpuMapper           mCpuMapper;
+    int                 mBackend;
+
+    enum Acquisition {
+        ACQUIRE_SINGLE,     // One LED at a time, mFramesPerLed captures each
+        ACQUIRE_CODED,      // Gray-coded patterns across all LEDs at once
+    };
+
+    int                 mAcquisition;
+    int                 mLastAcquisition;
+    LedCoder            mCoder;
+    vector<shared_ptr<uint8_t> > mCodedFrames;     // One per pattern
+    CpuMapper::Led      mCodedMask;                 // Depth mask shared by all LEDs
+    float               mCodedMinContrast;
+    int                 mCodedLeds;                 // LEDs found by the last decode
     
     OPCClient           mOPC;
-    vector<char>        mPacket;
+    int                 mOpcTransport;
+
+    // Benchmarks the OPC path without a Fadecandy
+    MockOPCServer       mMockOpc;
+    MockOPCServer::Stats mMockStats;
+    int                 mMockQueueBytes;
     
     int                 mCurrentLed;
-    int                 mCurrentFrame;
     int                 mBackgroundInitCountdown;
 
+    // Captures are lined up with the packets that produced them. Latency is
+    // in frames, as measured by LatencyCalibrator.
+    LedSequencer        mSequencer;
+    LatencyCalibrator   mCalibrator;
+    int                 mLatencyFirstFrame;
+    int                 mLatencySettledFrame;
+    int64_t             mCaptureSerial;     // LED visit being captured, or -1
+    vector<bool>        mCaptured;          // Captures received so far for that visit
+
     int                 mNumLeds;
     int                 mFramesPerLed;
     int                 mGridX;
     int                 mGridY;
     int                 mGridZ;
     float               mZLimit;
+    int                 mFilterRadius;
+    int                 mErodeRadius;
+    float               mDepthBias;
+    float               mMaxDepthSpread;
     float               mGain;
     float               mSliceAlpha;
     Color               mLedColor;
@@ -63,20 +153,245 @@ private:
     bool                mViewCameraPointCloud;
     bool                mViewFilteredPointCloud;
     bool                mViewVolumeGrid;
+    bool                mViewFusedGrid;
+    bool                mReplayRealTime;
+    bool                mGreenVideo;
+
+    // Stream health, shown read-only in the params
+    int                 mDroppedVideoFrames;
+    int                 mDroppedDepthFrames;
+    int                 mUnpairedFrames;
+    float               mDepthSkew;
+    int                 mIncompleteLeds;
+    float               mLatencyMs;
+
+    // Kinects beyond the first. Each has its own frame queue and follows the
+    // packets the primary sensor's sequencer sends, numbered by its own
+    // frames and assuming the same latency. What every sensor sees in single
+    // LED acquisition also goes into the fused grid, in the world space set
+    // by the primary sensor's camera.
+    struct Sensor {
+        // Capture thread
+        KinectRef               kinect;
+        FramePairer             pairer;
+        LedSequencer            history;        // Packets sent, by this sensor's frame numbering
+        int64_t                 lastFrameIndex; // -1 until the first frame
+
+        // Render thread
+        shared_ptr<uint16_t>    depthData;
+        Kinect::FrameInfo       depthInfo;
+        shared_ptr<uint16_t>    depthBackgroundData;
+        int                     videoChannels;
+        int64_t                 captureSerial;
+        vector<bool>            captured;
+        vector<shared_ptr<uint8_t> > videoFrames;
+        Vec3f                   position;       // Extrinsics: sensor to world, in mm
+        Quatf                   orientation;
+    };
+
+    vector<shared_ptr<Sensor> > mSensors;
+    Vec3f               mFusedMin;
+    Vec3f               mFusedMax;
     
     struct Led {
         gl::Fbo                 filter;    // Filtered color buffer, for current depth
         gl::Fbo                 mask;      // Masked depth buffer
-        vector<gl::TextureRef>  frames;    // Refs to original frames that we filter
-        vector<gl::Fbo>         grid;      // One VBO for each Z slice
+        vector<gl::TextureRef>  frames;    // This LED's own copies of the frames we filter
+        VoxelAtlas              grid;      // All Z slices in one framebuffer
+
+        // CPU backend state. Results are uploaded into the above FBOs for display.
+        vector<shared_ptr<uint8_t> > videoFrames;   // Raw frames, for the visit in progress only
+        CpuMapper::Led          cpu;
+
+        BrickVolume             fused;      // World space, from every sensor
+
+        // Once acquisition stops, grids of LEDs that aren't drawn are kept
+        // here instead, quantized in mVoxelFormat. Unpacking keeps these
+        // until the grids change, so looking at an LED doesn't quantize it
+        // again, and grids still being accumulated stay in float so rounding
+        // doesn't compound from visit to visit.
+        PackedVolume            packedGrid;
+        PackedVolume            packedFused;
     };
     
     vector<Led>         mLeds;
 
+    // CPU grids stay sparse. Only the LED on display is expanded and
+    // uploaded, into shared atlases rather than one atlas per LED. A grid
+    // with more Z slices than one texture holds is split along Z.
+    vector<VoxelAtlas>  mCpuGridAtlases;
+    VoxelVolume         mCpuGridDense;
+    int                 mCpuGridAtlasLed;   // LED in mCpuGridAtlases, or -1 if stale
+    float               mVoxelMemoryMB;
+    int                 mVoxelFormat;       // PackedVolume::Format for idle LEDs and saved maps
+    double              mLastGridChange;    // Elapsed seconds, when any LED's grids last changed
+    float               mVoxelThreshold;    // GPU voxels this faint are left out of sparse grids
+
+    // A loaded voxel map stays mapped, and each LED's volumes are copied out
+    // the first time they're needed, so opening a large map is quick.
+    shared_ptr<VoxelMapFile::Reader> mMapFile;
+    vector<bool>        mMapPending;        // LEDs not yet copied from mMapFile
+
+    // LED positions, re-solved for LEDs whose grids changed
+    LedSolver           mSolver;
+    int                 mSolvedLeds;
+    float               mSolveMs;
+    vector<float>       mGridVertices;
+    vector<Vec3f>       mFusedPoints;       // Fused voxels projected for drawing, rebuilt each frame
+    vector<Color>       mFusedColors;
+    vector<Vec2f>       mGridCells;
+    int                 mGridCellsX;        // Grid size mGridCells was built for
+    int                 mGridCellsY;
+
+    // The app runs in stages, so a slow one doesn't hold up the others:
+    //
+    //   capture thread     Kinects, frame pairing, the LED sequence and OPC
+    //                      output, so the LEDs keep their cadence
+    //   render thread      update() and draw(). Takes every captured frame,
+    //                      uploads it, keeps all LED state, runs the GPU passes
+    //   mapping thread     CPU masks, filters and grid bins for finished LED
+    //                      visits; the render thread blends the results in
+    //
+    // Stages are joined by BoundedQueues. Frames the render thread has no
+    // room for are dropped and their visits come around again; finished
+    // mapping work waits for room instead.
+    //
+    // Not everything heavy has left the render thread. Coded decoding and
+    // the LED pack/unpack loops it drives run in update(), and draw() does
+    // real work too: it unpacks the LED on display, exports CPU grids to
+    // dense slices and uploads them. Nothing else touches that state, so
+    // this is safe, but a slow decode or a large grid still costs frames.
+    //
+    // Whatever the capture thread uses is only changed by the render thread
+    // with mCaptureMutex held. The capture thread holds it while it handles
+    // each batch of frames.
+    struct CaptureEvent {
+        int                     sensor;         // Index into mSensors, or -1 for the primary Kinect
+        FramePairer::Pair       pair;
+        unsigned                unpaired;       // Frames without depth so far
+        bool                    classified;     // 'shown' is the packet this frame captured
+        LedSequencer::Command   shown;
+        int                     captures;       // Captures per visit, as sequenced
+
+        CaptureEvent() : sensor(-1), unpaired(0), classified(false), captures(0) {}
+    };
+
+    // Copied from the params for the capture thread, once per update
+    struct CaptureSettings {
+        int                     numLeds;
+        Color                   ledColor;
+        int                     acquisition;
+    };
+
+    struct MapJob {
+        int                     led;
+        int                     sensor;         // Index into mSensors, or -1 for the primary Kinect
+        bool                    grid;           // Bin into the LED's own grid, rather than only fusing
+        int                     generation;
+        shared_ptr<uint16_t>    depth;
+        shared_ptr<uint16_t>    background;
+        vector<shared_ptr<uint8_t> > videoFrames;
+        int                     channels;
+        int                     erodeRadius;
+        int                     filterRadius;
+        float                   depthBias;
+        float                   maxDepthSpread;
+        int                     gridX, gridY, gridZ;
+        float                   zLimit;
+        bool                    fuse;           // Also bin into the fused grid
+        Vec3f                   fusedMin, fusedMax;
+        Matrix44f               extrinsic;      // Sensor to world
+    };
+
+    struct MapResult {
+        int                     led;
+        int                     sensor;
+        bool                    grid;
+        bool                    binned;         // 'bins' is filled in
+        bool                    fused;          // 'fusedBins' is filled in
+        int                     generation;
+        CpuMapper::Led          cpu;            // Mask and filter only
+        CpuMapper::GridBins     bins;
+        FusedGrid::Bins         fusedBins;
+    };
+
+    std::thread         mCaptureThread;
+    std::atomic<bool>   mCaptureRunning;
+    std::mutex          mCaptureMutex;
+    CaptureSettings     mCaptureSettings;
+    bool                mCalibrationDone;   // Set by the capture thread, finished by the render thread
+    bool                mReplayFinished;    // Render thread, so a finished replay is reported once
+
+    // Recordings store a RecordedCommand ahead of each OPC packet, so a
+    // replay can follow the LED sequence it captured instead of sending its own
+    struct RecordedCommand {
+        char                    tag[4];
+        uint32_t                videoTimestamp; // Device timestamp of the frame the packet was sent after
+        LedSequencer::Command   command;
+    };
+    RecordedCommand     mSentCommand;       // What the next packet is for
+    vector<char>        mRecordBuffer;
+    deque<pair<uint32_t, int64_t> > mReplayFrames;  // Recent device timestamps and frame indices
+    int64_t             mReplayedTimestamp; // Last recorded command followed, or -1
+    BoundedQueue<CaptureEvent> mCaptureQueue;
+    vector<CaptureEvent> mCaptureEvents;    // One update's worth
+
+    std::thread         mMapThread;
+    std::atomic<bool>   mMapRunning;
+    CpuMapper           mMapWorker;         // Mapping thread's own buffers
+    FusedGrid           mMapFusedGrid;
+    int                 mMapGeneration;     // Results from older generations are discarded
+    BoundedQueue<MapJob> mMapJobs;
+    BoundedQueue<MapResult> mMapResults;
+
+    int                 mDroppedCaptures;
+    int                 mCaptureQueuePeak;
+    int                 mDroppedMapJobs;
+    int                 mMapQueuePeak;
+
     void updateFilter(Led& led);
+    void boxFilterPass(gl::Fbo& source, gl::Fbo& dest, Vec2f step);
     void updateDepthMask(Led& led);
+    void depthRangePass(gl::Texture& source, bool fromDepth, gl::Fbo& dest, Vec2f step);
     void updateGrid(Led& led);
-    void drawGrid(Led& led);
+    void drawGrid(VoxelAtlas& grid, int firstSlice, int totalSlices);
+    void drawFusedGrid(const BrickVolume& fused);
+    bool usesCpuGrid() const;
+    void unpackLed(int index);
+    void packLed(int index);
+    void ledChanged(int index);
+    bool isAccumulating() const;
+    const BrickVolume* fetchLedVolume(size_t index, BrickVolume& scratch, LedSolver::Space& space) const;
+    void uploadCpuResults(Led& led);
+    void openKinect(Kinect::FreenectParams config);
+    void openSimulator();
+    void resetSequence();
+    void finishCalibration();
+
+    // Capture thread
+    void captureLoop();
+    bool pollCapture();
+    void pollKinect(KinectRef kinect, FramePairer& pairer);
+    void sequenceFrame(const FramePairer::Pair& pair);
+    void sequenceSensorFrame(int index, const FramePairer::Pair& pair);
+    void followReplay(int64_t frameIndex, uint32_t videoTimestamp);
+    void sendLeds(int led, bool on);
+    void sendPattern(int pattern);
+    vector<char>& beginPacket();
+    void writePacket(const vector<char>& packet);
+
+    // Render thread
+    void processFrame(const CaptureEvent& event, bool display);
+    bool captureFrame(const LedSequencer::Command& shown, int captures, shared_ptr<uint8_t> videoData);
+    void processSensorFrame(const CaptureEvent& event);
+    void captureSensorFrame(int index, const LedSequencer::Command& shown, int captures, shared_ptr<uint8_t> videoData);
+    void finishLedUpdate(int index);
+    bool queueMapJob(int led, int sensor, bool grid);
+    void applyMapResults();
+    void updateCoded();
+
+    // Mapping thread
+    void mapLoop();
 };
 
 void VolumeMapperApp::prepareSettings( Settings* settings )
@@ -89,10 +404,12 @@ void VolumeMapperApp::setup()
 {
     gl::disableVerticalSync();
 
-    Kinect::FreenectParams kinectConfig;
-    kinectConfig.mDepthRegister = true;
-    mKinect = Kinect::create(kinectConfig);
+    mGreenVideo = false;
+    openKinect(Kinect::FreenectParams());
+    openSensors();
     mPointCloud.setup(*this, 640, 480);
+    mCpuMapper.setup(640, 480);
+    mDepthUploader.setup(640, 480, GL_LUMINANCE16, GL_LUMINANCE, GL_UNSIGNED_SHORT, 2);
 
     CameraPersp cam;
     cam.setEyePoint(Vec3f(0.0, 0.0, -0.33));
@@ -106,308 +423,1698 @@ void VolumeMapperApp::setup()
 
     mNumLeds = 64;
     mFramesPerLed = 3;
+    mLatencyFirstFrame = 1;     // Conservative until calibrated
+    mLatencySettledFrame = 3;
     mGridX = 64;
     mGridY = 64;
     mGridZ = 64;
     mZLimit = 0.067;
+    mFilterRadius = 5;
+    mErodeRadius = 16;
+    mDepthBias = 0.005;
+    mMaxDepthSpread = 0;    // Disabled
 
     mSliceAlpha = 0.1;
     mGain = 0.8;
     mCurrentLed = 0;
-    mCurrentFrame = 0;
+    mBackend = BACKEND_GPU;
+    mOpcTransport = OPCClient::TRANSPORT_TCP;
+    mAcquisition = ACQUIRE_SINGLE;
+    mLastAcquisition = ACQUIRE_SINGLE;
+    mCodedMinContrast = 0.05f;
+    mCodedLeds = 0;
     mViewCameraPointCloud = true;
     mViewFilteredPointCloud = true;
     mViewVolumeGrid = true;
+    mViewFusedGrid = true;
+    mReplayRealTime = true;
+    mDroppedVideoFrames = 0;
+    mDroppedDepthFrames = 0;
+    mUnpairedFrames = 0;
+    mDepthSkew = 0;
+    mIncompleteLeds = 0;
+    mLatencyMs = 0;
     mLedColor.set(1.0f, 1.0f, 1.0f);
+    mMockStats = MockOPCServer::Stats();
+    mMockQueueBytes = 0;
+    mCpuGridAtlasLed = -1;
+    mGridCellsX = 0;
+    mGridCellsY = 0;
+    mVoxelMemoryMB = 0;
+    mVoxelFormat = PackedVolume::FORMAT_UINT16;
+    mLastGridChange = -1e9;
+    mVoxelThreshold = 0.001f;
+    mSolvedLeds = 0;
+    mSolveMs = 0;
+    mFusedMin.set(-1500.0f, -1500.0f, 500.0f);
+    mFusedMax.set(1500.0f, 1500.0f, 4500.0f);
+    mCaptureRunning = false;
+    mCalibrationDone = false;
+    mReplayFinished = false;
+    mReplayedTimestamp = -1;
+    mMapGeneration = 0;
+    mDroppedCaptures = 0;
+    mCaptureQueuePeak = 0;
+    mDroppedMapJobs = 0;
+    mMapQueuePeak = 0;
 
     // Give the system time to stabilize before we latch onto an initial background image
     mBackgroundInitCountdown = 120;
     
     mFilterProg = gl::GlslProg::create(loadResource("filter.glslv"), loadResource("filter.glslf"));
+    mBoxFilterProg = gl::GlslProg::create(loadResource("filter.glslv"), loadResource("boxFilter.glslf"));
     mSliceProg = gl::GlslProg::create(loadResource("slice.glslv"), loadResource("slice.glslf"));
     mMaskProg = gl::GlslProg::create(loadResource("depthMask.glslv"), loadResource("depthMask.glslf"));
+    mDepthRangeProg = gl::GlslProg::create(loadResource("depthMask.glslv"), loadResource("depthRange.glslf"));
     mDrawGridProg = gl::GlslProg::create(loadResource("drawGrid.glslv"), loadResource("drawGrid.glslf"));
 
     mOPC.connectConnectEventHandler(&OPCClient::onConnect, &mOPC);
     mOPC.connectErrorEventHandler(&OPCClient::onError, &mOPC);
-
-    // Static allocation for packet buffer, so we don't resize it during an async write
-    mPacket.reserve(sizeof(OPCClient::Header) + 0xFFFF);
     
     mParams = params::InterfaceGl::create( getWindow(), "Mapper parameters", toPixels(Vec2i(300, 400)) );
     
     mParams->addParam("Number of LEDs", &mNumLeds).min(1).max(0xffff/3);
+
+    vector<string> backendNames;
+    backendNames.push_back("GPU");
+    backendNames.push_back("CPU");
+    mParams->addParam("Backend", backendNames, &mBackend);
+
+    vector<string> acquisitionNames;
+    acquisitionNames.push_back("One LED at a time");
+    acquisitionNames.push_back("Coded patterns");
+    mParams->addParam("Acquisition", acquisitionNames, &mAcquisition);
+    mParams->addParam("Coded min contrast", &mCodedMinContrast).min(0.f).max(1.f).step(0.005f);
+    mParams->addParam("LEDs found by coding", &mCodedLeds, "", true);
+
+    vector<string> transportNames;
+    transportNames.push_back("TCP");
+    transportNames.push_back("UDP");
+    mParams->addParam("OPC transport", transportNames, &mOpcTransport);
+    mParams->addButton("Start/stop mock OPC server", bind(&VolumeMapperApp::toggleMockOpc, this), "key=m");
+    mParams->addParam("Mock OPC frames/sec", &mMockStats.framesPerSecond, "", true);
+    mParams->addParam("Mock OPC bytes/sec", &mMockStats.bytesPerSecond, "", true);
+    mParams->addParam("Mock OPC jitter (s)", &mMockStats.jitter, "", true);
+    mParams->addParam("Mock OPC fade (s)", &mMockStats.meanFadeSeconds, "", true);
+    mParams->addParam("Mock OPC queue (bytes)", &mMockQueueBytes, "", true);
+
     mParams->addButton("Capture background", bind(&VolumeMapperApp::captureBackground, this), "key=b");
     mParams->addButton("Clear grid", bind(&VolumeMapperApp::clearGrid, this), "key=c");
+    mParams->addButton("Save voxel map", bind(&VolumeMapperApp::saveMap, this), "key=S");
+    mParams->addButton("Load voxel map", bind(&VolumeMapperApp::loadMap, this), "key=O");
+    mParams->addButton("Start/stop recording", bind(&VolumeMapperApp::toggleRecording, this), "key=r");
+    mParams->addButton("Replay capture", bind(&VolumeMapperApp::openReplay, this), "key=o");
+    mParams->addParam("Replay in real-time", &mReplayRealTime);
+    mParams->addButton("Use simulator", bind(&VolumeMapperApp::startSimulator, this), "key=s");
+    mParams->addButton("Toggle green-only video", bind(&VolumeMapperApp::toggleGreenVideo, this), "key=g");
+    mParams->addButton("Calibrate latency", bind(&VolumeMapperApp::calibrateLatency, this), "key=l");
+    mParams->addParam("Dropped video frames", &mDroppedVideoFrames, "", true);
+    mParams->addParam("Dropped depth frames", &mDroppedDepthFrames, "", true);
+    mParams->addParam("Frames without depth", &mUnpairedFrames, "", true);
+    mParams->addParam("Depth skew (frames)", &mDepthSkew, "", true);
+    mParams->addParam("Incomplete LEDs", &mIncompleteLeds, "", true);
+    mParams->addParam("Dropped captured frames", &mDroppedCaptures, "", true);
+    mParams->addParam("Capture queue peak", &mCaptureQueuePeak, "", true);
+    mParams->addParam("Dropped mapping jobs", &mDroppedMapJobs, "", true);
+    mParams->addParam("Mapping queue peak", &mMapQueuePeak, "", true);
+    mParams->addParam("Median latency (ms)", &mLatencyMs, "", true);
+    mParams->addParam("CPU voxel memory (MB)", &mVoxelMemoryMB, "", true);
+
+    vector<string> voxelFormatNames;
+    voxelFormatNames.push_back("32-bit float");
+    voxelFormatNames.push_back("16-bit");
+    voxelFormatNames.push_back("8-bit");
+    mParams->addParam("Idle LED and map voxels", voxelFormatNames, &mVoxelFormat);
+    mParams->addParam("Empty voxel threshold", &mVoxelThreshold).min(0.f).max(1.f).step(0.0001f);
+    mParams->addButton("Solve LED positions", bind(&VolumeMapperApp::solveLeds, this), "key=p");
+    mParams->addButton("Save LED layout", bind(&VolumeMapperApp::saveLayout, this), "key=P");
+    mParams->addParam("LEDs located", &mSolvedLeds, "", true);
+    mParams->addParam("Solve time (ms)", &mSolveMs, "", true);
     mParams->addParam("View camera point cloud", &mViewCameraPointCloud, "key=1");
     mParams->addParam("View filtered point cloud", &mViewFilteredPointCloud, "key=2");
     mParams->addParam("View volume grid", &mViewVolumeGrid, "key=3");
+    mParams->addParam("View fused grid", &mViewFusedGrid, "key=4");
     mParams->addSeparator();
     mParams->addParam("Grid size (X)", &mGridX).min(1).max(640);
     mParams->addParam("Grid size (Y)", &mGridY).min(1).max(480);
     mParams->addParam("Grid size (Z)", &mGridZ).min(1).max(1024);
     mParams->addParam("Z Limit", &mZLimit).min(0.001f).max(1.f).step(0.001f);
-    mParams->addParam("Frames per LED", &mFramesPerLed);
+    mParams->addParam("Frames per LED", &mFramesPerLed).min(1).max(64);
+    mParams->addParam("Latency, first frame", &mLatencyFirstFrame).min(1).max(30);
+    mParams->addParam("Latency, settled frame", &mLatencySettledFrame).min(1).max(30);
+    mParams->addParam("Filter radius", &mFilterRadius).min(0).max(64);
+    mParams->addParam("Erode radius", &mErodeRadius).min(0).max(64);
+    mParams->addParam("Depth bias", &mDepthBias).min(0.f).max(0.1f).step(0.0005f);
+    mParams->addParam("Max depth spread", &mMaxDepthSpread).min(0.f).max(0.1f).step(0.0005f);
     mParams->addParam("LED Color", &mLedColor);
     mParams->addParam("Point size", &mPointCloud.mPointSize).min(0.f).max(50.f).step(0.1f);
     mParams->addParam("Gain", &mGain).min(0.f).max(999.9f).step(0.1f);
     mParams->addParam("Slice alpha", &mSliceAlpha).min(0.f).max(1.0f).step(0.01f);
+    mParams->addParam("Fused grid min (mm)", &mFusedMin);
+    mParams->addParam("Fused grid max (mm)", &mFusedMax);
+
+    for (int i = 0; i < mSensors.size(); i++) {
+        string name = "Sensor " + toString(i + 2);
+        mParams->addParam(name + " position (mm)", &mSensors[i]->position);
+        mParams->addParam(name + " orientation", &mSensors[i]->orientation);
+    }
+
+    // The capture thread starts with the first update, once the sequencer is set up
+    mMapWorker.setup(640, 480);
+    mMapRunning = true;
+    mMapThread = std::thread(&VolumeMapperApp::mapLoop, this);
+}
+
+void VolumeMapperApp::shutdown()
+{
+    mCaptureRunning = false;
+    if (mCaptureThread.joinable()) {
+        mCaptureThread.join();
+    }
+    mMapRunning = false;
+    if (mMapThread.joinable()) {
+        mMapThread.join();
+    }
 }
 
 void VolumeMapperApp::captureBackground()
 {
-    mDepthBackgroundTexture = mDepthTexture;
+    // A copy, so the background doesn't hold a slot in the upload ring
+    if (mDepthData) {
+        mDepthUploader.upload(mDepthData.get(), mDepthBackgroundTexture);
+    }
+    mDepthBackgroundData = mDepthData;
+
+    for (int i = 0; i < mSensors.size(); i++) {
+        mSensors[i]->depthBackgroundData = mSensors[i]->depthData;
+    }
 }
 
 void VolumeMapperApp::clearGrid()
 {
     for (int i = 0; i < mLeds.size(); i++) {
         mLeds[i].grid.clear();
+        CpuMapper::clearGrid(mLeds[i].cpu);
+        mLeds[i].fused.clear();
+        mLeds[i].packedGrid.clear();
+        mLeds[i].packedFused.clear();
     }
+    mCpuGridAtlasLed = -1;
+    mMapFile.reset();
+    mMapPending.clear();
+    mSolver.invalidateAll();
+    mMapGeneration++;
 }
 
-void VolumeMapperApp::update()
+void VolumeMapperApp::saveMap()
 {
-    mLeds.resize(mNumLeds);
-    if (mCurrentLed >= mNumLeds) {
-        mCurrentLed = 0;
+    fs::path path = getSaveFilePath(getDocumentsDirectory() / "map.vmmap");
+    if (path.empty()) {
+        return;
+    }
+
+    VoxelMapFile::Metadata metadata;
+    metadata.zLimit = mZLimit;
+    copy(mFusedMin.ptr(), mFusedMin.ptr() + 3, metadata.fusedMin);
+    copy(mFusedMax.ptr(), mFusedMax.ptr() + 3, metadata.fusedMax);
+
+    // Written beside the destination and renamed over it, since the loaded
+    // map may be the file being replaced
+    fs::path tempPath = path.string() + ".tmp";
+    VoxelMapFile::Writer writer;
+    if (!writer.open(tempPath.string(), mLeds.size(), metadata, PackedVolume::Format(mVoxelFormat))) {
+        console() << "Can't create voxel map " << tempPath << endl;
+        return;
     }
 
-    if (mKinect->checkNewDepthFrame()) {
-        mDepthTexture = gl::Texture::create(mKinect->getDepthImage());
-        if (!mDepthBackgroundTexture) {
-            mDepthBackgroundTexture = mDepthTexture;
+    // GPU grids are only in their atlases
+    VoxelVolume dense;
+    BrickVolume bricks;
+    for (int i = 0; i < mLeds.size(); i++) {
+        Led& led = mLeds[i];
+        unpackLed(i);
+        if (!usesCpuGrid() && led.grid) {
+            led.grid.download(dense);
+            bricks.importDense(dense, mVoxelThreshold);
+            writer.writeLed(i, bricks, led.fused);
+        } else {
+            writer.writeLed(i, led.cpu.grid, led.fused);
+        }
+        if (i != mCurrentLed) {
+            packLed(i);
         }
     }
-        
-    if (mKinect->checkNewVideoFrame()) {
-        mColorTexture = gl::Texture::create(mKinect->getVideoImage());
+    mMapFile.reset();
+    mMapPending.clear();
+
+    if (!writer.close()) {
+        console() << "Failed to write voxel map " << tempPath << endl;
+        return;
+    }
+
+    boost::system::error_code error;
+    fs::rename(tempPath, path, error);
+    if (error) {
+        console() << "Can't replace voxel map " << path << ": " << error.message() << endl;
+        return;
+    }
+    console() << "Saved voxel map " << path << ", largest quantization error " << writer.getMaxError() << endl;
+}
+
+void VolumeMapperApp::loadMap()
+{
+    fs::path path = getOpenFilePath(getDocumentsDirectory());
+    if (path.empty()) {
+        return;
+    }
 
-        if (mCurrentLed < mLeds.size()) {
-            // Store the frame we just captured
+    shared_ptr<VoxelMapFile::Reader> map(new VoxelMapFile::Reader());
+    if (!map->open(path.string())) {
+        console() << "Can't open voxel map " << path << endl;
+        return;
+    }
+
+    // The map replaces everything, including any GPU atlases, so it's
+    // drawn from the CPU grids until acquisition resumes
+    clearGrid();
+    mMapFile = map;
+    const VoxelMapFile::FileHeader& header = mMapFile->getHeader();
+    mNumLeds = max<int>(header.ledCount, 1);
+    mLeds.clear();
+    mLeds.resize(mNumLeds);
+    mMapPending.assign(header.ledCount, true);
+    mCurrentLed = 0;
 
-            Led &l = mLeds[mCurrentLed];
-            l.frames.resize(max(min<int>( mFramesPerLed, l.frames.size()), mCurrentFrame + 1 ));
-            l.frames[mCurrentFrame] = mColorTexture;
+    mZLimit = header.zLimit;
+    mFusedMin.set(header.fusedMin[0], header.fusedMin[1], header.fusedMin[2]);
+    mFusedMax.set(header.fusedMax[0], header.fusedMax[1], header.fusedMax[2]);
+    for (uint32_t i = 0; i < header.ledCount; i++) {
+        const VoxelMapFile::VolumeEntry& grid = mMapFile->getLed(i).grid;
+        if (grid.sizeX > 0 && grid.sizeY > 0 && grid.sizeZ > 0) {
+            mGridX = grid.sizeX;
+            mGridY = grid.sizeY;
+            mGridZ = grid.sizeZ;
+            break;
         }
+    }
+}
 
-        mCurrentFrame++;
-        if (mCurrentFrame >= mFramesPerLed) {
+void VolumeMapperApp::unpackLed(int index)
+{
+    Led& led = mLeds[index];
 
-            Led &l = mLeds[mCurrentLed];
-            updateDepthMask(l);
-            updateFilter(l);
-            updateGrid(l);
-            
-            mCurrentFrame = 0;
-            mCurrentLed++;
-            if (mCurrentLed >= mNumLeds) {
-                mCurrentLed = 0;
-            }
+    if (index < mMapPending.size() && mMapPending[index]) {
+        mMapPending[index] = false;
+        const VoxelMapFile::LedEntry& entry = mMapFile->getLed(index);
+        if (!mMapFile->load(entry.grid, led.cpu.grid) || !mMapFile->load(entry.fused, led.fused)) {
+            console() << "Voxel map entry for LED " << index << " is damaged" << endl;
         }
+    }
 
-        auto& header = OPCClient::Header::view(mPacket);
-        mPacket.resize(sizeof(OPCClient::Header) + mNumLeds * 3);
-        fill(mPacket.begin(), mPacket.end(), 0);
-        header.init(0, mOPC.SET_PIXEL_COLORS, mNumLeds * 3);
+    // Packed copies stay until the grids change, see ledChanged()
+    if (!led.packedGrid.empty() && !led.cpu.grid.getSizeX()) {
+        led.packedGrid.unpack(led.cpu.grid);
+    }
+    if (!led.packedFused.empty() && !led.fused.getSizeX()) {
+        led.packedFused.unpack(led.fused);
+    }
+}
 
-        // Blink the current LED on alternate frames
-        if ((mCurrentFrame & 1) && mCurrentLed < mNumLeds) {
-            for (int ch = 0; ch < 3; ch++) {
-                header.data()[mCurrentLed*3 + ch] = 255 * mLedColor[ch];
+void VolumeMapperApp::packLed(int index)
+{
+    Led& led = mLeds[index];
+    if (mVoxelFormat == PackedVolume::FORMAT_FLOAT || isAccumulating()) {
+        return;
+    }
+
+    // Only grids changed since they were last packed are quantized again.
+    // Assigning empty volumes frees their storage.
+    if (led.cpu.grid.getSizeX()) {
+        if (led.packedGrid.empty()) {
+            led.packedGrid.pack(led.cpu.grid, PackedVolume::Format(mVoxelFormat));
+        }
+        led.cpu.grid = BrickVolume();
+    }
+    if (led.fused.getSizeX()) {
+        if (led.packedFused.empty()) {
+            led.packedFused.pack(led.fused, PackedVolume::Format(mVoxelFormat));
+        }
+        led.fused = BrickVolume();
+    }
+}
+
+void VolumeMapperApp::ledChanged(int index)
+{
+    // The LED has been unpacked and its grids updated, so packed copies are stale
+    Led& led = mLeds[index];
+    led.packedGrid.clear();
+    led.packedFused.clear();
+    mSolver.invalidate(index);
+    mLastGridChange = getElapsedSeconds();
+}
+
+bool VolumeMapperApp::isAccumulating() const
+{
+    // Visits finish several times a second while acquisition runs
+    return getElapsedSeconds() - mLastGridChange < 2.0;
+}
+
+const BrickVolume* VolumeMapperApp::fetchLedVolume(size_t index, BrickVolume& scratch, LedSolver::Space& space) const
+{
+    // Called from the solver's threads, so this only reads. The fused grid
+    // is preferred, being in world space already; otherwise the LED's own
+    // grid is in the primary camera's space, which defines world space.
+    const Led& led = mLeds[index];
+    const VoxelMapFile::LedEntry* entry = index < mMapPending.size() && mMapPending[index] ?
+        &mMapFile->getLed(index) : 0;
+
+    space = LedSolver::Space::box(mFusedMin.ptr(), mFusedMax.ptr());
+    if (entry && entry->fused.brickCount && mMapFile->load(entry->fused, scratch)) {
+        return &scratch;
+    }
+    if (!entry && !led.packedFused.empty() && led.packedFused.unpack(scratch) && !scratch.empty()) {
+        return &scratch;
+    }
+    if (!entry && !led.fused.empty()) {
+        return &led.fused;
+    }
+
+    space = LedSolver::Space::camera(mZLimit);
+    if (entry) {
+        return mMapFile->load(entry->grid, scratch) ? &scratch : 0;
+    }
+    if (!led.packedGrid.empty()) {
+        return led.packedGrid.unpack(scratch) ? &scratch : 0;
+    }
+    return &led.cpu.grid;
+}
+
+void VolumeMapperApp::solveLeds()
+{
+    mSolver.setup(mLeds.size());
+
+    // The solver can't read textures, so GPU grids are copied out first
+    if (!usesCpuGrid()) {
+        for (int i = 0; i < mLeds.size(); i++) {
+            if (!mSolver.isValid(i) && mLeds[i].grid) {
+                unpackLed(i);
+                mLeds[i].grid.download(mCpuGridDense);
+                mLeds[i].cpu.grid.importDense(mCpuGridDense, mVoxelThreshold);
+                mLeds[i].packedGrid.clear();
+                if (i != mCurrentLed) {
+                    packLed(i);
+                }
             }
         }
-        
-        // Write two back-to-back frames, so this takes effect
-        // immediately even if Fadecandy's interpolation is enabled.
-        mOPC.write(mPacket);
-        mOPC.write(mPacket);
-        mOPC.update();
+        mCpuGridAtlasLed = -1;
     }
-    
-    if (mBackgroundInitCountdown) {
-        mBackgroundInitCountdown--;
-        captureBackground();
+
+    double start = getElapsedSeconds();
+    size_t solved = mSolver.solve([this](size_t index, BrickVolume& scratch, LedSolver::Space& space) {
+        return fetchLedVolume(index, scratch, space);
+    });
+    mSolveMs = (getElapsedSeconds() - start) * 1e3;
+
+    mSolvedLeds = 0;
+    for (size_t i = 0; i < mSolver.getNumLeds(); i++) {
+        if (mSolver.getResult(i).valid) {
+            mSolvedLeds++;
+        }
     }
+    console() << "Solved " << solved << " LEDs in " << mSolveMs << " ms, " << mSolvedLeds << " located" << endl;
 }
 
-void VolumeMapperApp::draw()
+void VolumeMapperApp::saveLayout()
 {
-    gl::setViewport(Area(Vec2i(0,0), getWindowSize()));
-    gl::setMatrices(mMayaCam.getCamera());
-    gl::clear();
+    solveLeds();
 
-    // Common coordinate system is the unit cube from [0,0,0] to [1,1,1], in camera space
-    gl::translate(0.5, 0.5, 0.2);
-    gl::scale(-1.0f, -1.0f, 16.0);
-    
-    // Draw a cube around the coordinate system bounds
-    gl::color(0.2f, 0.2f, 0.8f);
-    gl::drawStrokedCube(Vec3f(0.5f, 0.5f, mZLimit / 2.0f), Vec3f(1.0f, 1.0f, mZLimit));
-    
-    Led& currentLed = mLeds[mCurrentLed];
-    
-    if (mViewFilteredPointCloud && currentLed.filter && currentLed.mask) {
-        mPointCloud.mGain = mGain;
-        mPointCloud.draw(currentLed.mask.getTexture(), currentLed.filter.getTexture());
+    fs::path path = getSaveFilePath(getDocumentsDirectory() / "layout.json");
+    if (path.empty()) {
+        return;
     }
+    if (!mSolver.writeLayout(path.string())) {
+        console() << "Can't write LED layout " << path << endl;
+    }
+}
 
-    if (mViewCameraPointCloud && mDepthTexture && mColorTexture) {
-        mPointCloud.mGain = 1.0f;
-        mPointCloud.draw(*mDepthTexture, *mColorTexture);
+void VolumeMapperApp::toggleRecording()
+{
+    // Kinect locks for itself, and only this thread replaces mKinect
+    if (mKinect->isRecording()) {
+        mKinect->stopRecording();
+        return;
     }
 
-    if (mViewVolumeGrid) {
-        drawGrid(currentLed);
+    fs::path path = getSaveFilePath(getDocumentsDirectory() / "capture.vmcap");
+    if (!path.empty()) {
+        mKinect->startRecording(path.string());
     }
-        
-    mParams->draw();
 }
 
-void VolumeMapperApp::drawGrid(Led& led)
+void VolumeMapperApp::openReplay()
 {
-    gl::enableAdditiveBlending();
-    mDrawGridProg->bind();
-    mDrawGridProg->uniform("gain", mGain);
-    mDrawGridProg->uniform("layer", 0);
+    fs::path path = getOpenFilePath(getDocumentsDirectory());
+    if (path.empty()) {
+        return;
+    }
 
-    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
-    GLint position = mDrawGridProg->getAttribLocation("position");
-    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
-    glEnableVertexAttribArray(position);
+    Kinect::FreenectParams kinectConfig;
+    kinectConfig.mReplayPath = path.string();
+    kinectConfig.mReplayRealTime = mReplayRealTime;
 
-    for (int z = 0; z < mGridZ; z++) {
-        if (led.grid.size() > z && led.grid[z]) {
-            mDrawGridProg->uniform("z", z * mZLimit / float(mGridZ - 1));
-            led.grid[z].getTexture().bind(0);
-            glDrawArrays(GL_QUADS, 0, 4);
-        }
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+    try {
+        openKinect(kinectConfig);
+    } catch (Kinect::ExcFailedOpenDevice &e) {
+        console() << "Can't open capture " << path << endl;
+        return;
     }
-    
-    mDrawGridProg->unbind();
-    gl::disableAlphaBlending();
-    glDisableVertexAttribArray(position);
+    mSimulator.reset();
+    mSensors.clear();
+    mReplayFrames.clear();
+    mReplayedTimestamp = -1;
+    mReplayFinished = false;
+    resetSequence();
+
+    // Start the replay from a clean slate
+    mDepthTexture.reset();
+    mDepthBackgroundTexture.reset();
+    mDepthData.reset();
+    mDepthBackgroundData.reset();
+    mCurrentLed = 0;
+    mBackgroundInitCountdown = 0;
+    clearGrid();
 }
 
-void VolumeMapperApp::updateGrid(Led& led)
+void VolumeMapperApp::startSimulator()
 {
-    float zStep = mZLimit / float(mGridZ - 1);
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+    openSimulator();
+}
 
-    led.grid.resize(mGridZ);
+void VolumeMapperApp::openSimulator()
+{
+    mSimulator = SceneSimulatorRef(new SceneSimulator());
+    mSimulator->setup(mNumLeds);
 
-    // Don't filter depth values
-    led.mask.getTexture().bind();
-    led.mask.getTexture().setMinFilter(GL_NEAREST);
-    led.mask.getTexture().setMagFilter(GL_NEAREST);
+    Kinect::FreenectParams kinectConfig;
+    kinectConfig.mFrameSource = mSimulator;
+    openKinect(kinectConfig);
+    mSensors.clear();
 
-    for (int z = 0; z < mGridZ; z++) {
-        // Each slice is built up on a separate FBO
-        gl::Fbo& slice = led.grid[z];
-        bool needClear = false;
+    // The simulated scene starts empty, so capture its background again
+    mDepthTexture.reset();
+    mDepthBackgroundTexture.reset();
+    mDepthData.reset();
+    mDepthBackgroundData.reset();
+    mCurrentLed = 0;
+    mBackgroundInitCountdown = 120;
+    clearGrid();
+}
 
-        if (!slice) {
-            gl::Fbo::Format format;
-            format.setColorInternalFormat(GL_R32F);
-            slice = gl::Fbo(mGridX, mGridY, format);
-            needClear = true;
-        }
- 
-        slice.bindFramebuffer();
-        gl::setViewport(Area(Vec2i(0,0), slice.getSize()));
-        gl::setMatricesWindow(slice.getSize());
-        if (needClear) {
-            gl::clear();
-        }
-        gl::enableAlphaBlending();
-        
-        mSliceProg->bind();
-        mSliceProg->uniform("z_min", 1e-3f + z * zStep);
-        mSliceProg->uniform("z_max", 1e-3f + (z+1) * zStep);
-        mSliceProg->uniform("alpha", mSliceAlpha);
-        
-        mSliceProg->uniform("mask", 0);
-        mSliceProg->uniform("filter", 1);
-        
-        led.mask.getTexture().bind(0);
-        led.filter.getTexture().bind(1);
+void VolumeMapperApp::openKinect(Kinect::FreenectParams config)
+{
+    config.mDepthRegister = true;
+    config.mVideoGreen = mGreenVideo;
+    mKinect = Kinect::create(config);
+    mKinectConfig = config;
 
-        static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
-        GLint position = mSliceProg->getAttribLocation("position");
-        glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
-        glEnableVertexAttribArray(position);
-        glDrawArrays(GL_QUADS, 0, 4);
-        mSliceProg->unbind();
-        gl::disableAlphaBlending();
-        glDisableVertexAttribArray(position);
+    // Frames from the old source can't be paired with the new one. The
+    // color uploader is set up again for whatever format arrives first.
+    mPairer.clear();
+    mDepthData.reset();
+    mVideoChannels = 0;
+
+    // Frame numbering starts over too
+    mCalibrator.stop();
+    resetSequence();
+}
 
-        slice.unbindFramebuffer();
+void VolumeMapperApp::openSensors()
+{
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+
+    // Every other attached Kinect, keeping the poses of sensors already open
+    for (int i = mSensors.size() + 1; i < Kinect::getNumDevices(); i++) {
+        Kinect::FreenectParams config;
+        config.mDeviceIndex = i;
+        config.mDepthRegister = true;
+        config.mVideoGreen = mGreenVideo;
+
+        shared_ptr<Sensor> sensor(new Sensor());
+        try {
+            sensor->kinect = Kinect::create(config);
+        } catch (Kinect::ExcFailedOpenDevice &e) {
+            console() << "Can't open Kinect " << i << endl;
+            break;
+        }
+        sensor->lastFrameIndex = -1;
+        sensor->videoChannels = 0;
+        sensor->captureSerial = -1;
+        mSensors.push_back(sensor);
     }
 }
 
-void VolumeMapperApp::updateFilter(Led& led)
+void VolumeMapperApp::toggleMockOpc()
 {
-    if (led.frames.size() < 1) {
+    // The mock listens next to the usual OPC port, so a real server can keep running
+    static const uint16_t kMockPort = 7891;
+
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+    if (mMockOpc.isRunning()) {
+        MockOPCServer::Stats stats = mMockOpc.getStats();
+        console() << "Mock OPC: " << stats.frames << " frames, " << stats.framesPerSecond << " frames/sec, "
+            << stats.bytesPerSecond << " bytes/sec, interval " << stats.meanInterval * 1e3 << " ms mean, "
+            << stats.maxInterval * 1e3 << " ms max, jitter " << stats.jitter * 1e3 << " ms, fade "
+            << stats.meanFadeSeconds * 1e3 << " ms, queue " << stats.maxQueueBytes << " bytes max, "
+            << stats.lostFrames << " lost, " << stats.staleDatagrams << " stale, "
+            << mOPC.getSupersededFrames() << " superseded" << endl;
+        mMockOpc.stop();
+        mOPC.setAddress("localhost", 7890);
         return;
     }
 
-    if (!led.filter) {
-        gl::Fbo::Format format;
-        format.setColorInternalFormat(GL_R32F);
-        led.filter = gl::Fbo(led.frames[0]->getWidth(), led.frames[0]->getHeight(), format);
+    mMockOpc.mUdpChannelLeds = mOPC.getUdpChannelLeds();
+    if (!mMockOpc.start(kMockPort, OPCClient::Transport(mOpcTransport))) {
+        console() << "Can't start mock OPC server on port " << kMockPort << endl;
+        return;
     }
-    
-    led.filter.bindFramebuffer();
-    gl::setViewport(Area(Vec2i(0,0), led.filter.getSize()));
-    gl::setMatricesWindow(led.filter.getSize());
-    gl::clear();
-    gl::enableAdditiveBlending();
-    
-    mFilterProg->bind();
-    mFilterProg->uniform("gain", 1.0f / led.frames.size());
-    mFilterProg->uniform("frame1", 0);
-    mFilterProg->uniform("frame2", 1);
-    mFilterProg->uniform("mask", 2);
+    mOPC.setAddress("localhost", kMockPort);
+}
 
-    led.mask.getTexture().bind(2);
-    
-    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
-    GLint position = mFilterProg->getAttribLocation("position");
-    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
-    glEnableVertexAttribArray(position);
-    
-    for (int i = 0; i + 1 < led.frames.size(); i++) {
-        led.frames[i]->bind(0);
-        led.frames[i+1]->bind(1);
-        glDrawArrays(GL_QUADS, 0, 4);
+void VolumeMapperApp::resetSequence()
+{
+    // Frames already sequenced belong to the old numbering
+    mSequencer.reset();
+    mCaptureQueue.clear();
+    mCaptureSerial = -1;
+
+    for (int i = 0; i < mSensors.size(); i++) {
+        mSensors[i]->history.reset();
+        mSensors[i]->captureSerial = -1;
     }
+}
 
-    mFilterProg->unbind();
-    gl::disableAlphaBlending();
-    glDisableVertexAttribArray(position);
-    led.filter.unbindFramebuffer();
+void VolumeMapperApp::toggleGreenVideo()
+{
+    // The video format is fixed when a source opens, so reopen the current
+    // one. The device has to be released first; a replay starts over.
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+    Kinect::FreenectParams previous = mKinectConfig;
+    mGreenVideo = !mGreenVideo;
+    mKinect.reset();
+    try {
+        openKinect(previous);
+    } catch (Kinect::ExcFailedOpenDevice &e) {
+        // Go back to the source we had, in the format it had
+        console() << "Can't reopen the Kinect for " << (mGreenVideo ? "green" : "RGB") << " video" << endl;
+        mGreenVideo = !mGreenVideo;
+        try {
+            openKinect(previous);
+        } catch (Kinect::ExcFailedOpenDevice &e) {
+            console() << "Can't reopen the Kinect, switching to the simulator" << endl;
+            openSimulator();
+        }
+        return;
+    }
+
+    // A sensor that won't reopen is dropped, with the ones after it, since
+    // sensors are numbered by device index
+    for (int i = 0; i < mSensors.size(); i++) {
+        Sensor& sensor = *mSensors[i];
+        Kinect::FreenectParams config;
+        config.mDeviceIndex = i + 1;
+        config.mDepthRegister = true;
+        config.mVideoGreen = mGreenVideo;
+        sensor.kinect.reset();
+        try {
+            sensor.kinect = Kinect::create(config);
+        } catch (Kinect::ExcFailedOpenDevice &e) {
+            console() << "Can't reopen Kinect " << (i + 1) << endl;
+            mSensors.resize(i);
+            break;
+        }
+        sensor.pairer.clear();
+        sensor.lastFrameIndex = -1;
+        sensor.videoFrames.clear();
+    }
+
+    // Frames captured in the old format can't be differenced with new ones
+    mColorTexture.reset();
+    for (int i = 0; i < mLeds.size(); i++) {
+        mLeds[i].frames.clear();
+        mLeds[i].videoFrames.clear();
+    }
+    mCodedFrames.clear();
 }
 
-void VolumeMapperApp::updateDepthMask(Led& led)
+void VolumeMapperApp::calibrateLatency()
 {
-    if (!led.mask) {
-        gl::Fbo::Format format;
-        format.setColorInternalFormat(GL_R32F);
-        led.mask = gl::Fbo(mDepthTexture->getWidth(), mDepthTexture->getHeight(), format);
+    // Toggles; stopping early keeps the previous latency
+    std::lock_guard<std::mutex> lock(mCaptureMutex);
+    if (mCalibrator.isRunning()) {
+        mCalibrator.stop();
+        resetSequence();
+        return;
     }
-    
-    led.mask.bindFramebuffer();
-    gl::setViewport(Area(Vec2i(0,0), led.mask.getSize()));
-    gl::setMatricesWindow(led.mask.getSize());
-    gl::clear();
-    gl::disableAlphaBlending();
-    
-    mMaskProg->bind();
-    mMaskProg->uniform("depth", 0);
+    if (mKinect->isReplay()) {
+        console() << "Latency calibration needs live LEDs, not a replay" << endl;
+        return;
+    }
+    mCalibrator.start();
+}
+
+void VolumeMapperApp::finishCalibration()
+{
+    if (!mCalibrator.hasResult()) {
+        console() << "Latency calibration failed, not enough contrast between LEDs on and off" << endl;
+        return;
+    }
+
+    const LatencyCalibrator::Result& result = mCalibrator.getResult();
+    mLatencyFirstFrame = result.firstFrame;
+    mLatencySettledFrame = result.settledFrame;
+    mLatencyMs = result.medianSeconds * 1e3;
+
+    console() << "Latency over " << result.edges << " edges: frames " << result.firstFrame
+        << " to " << result.settledFrame << ", " << result.minSeconds * 1e3 << " / "
+        << result.medianSeconds * 1e3 << " / " << result.maxSeconds * 1e3 << " ms min/median/max" << endl;
+    for (unsigned i = 0; i < result.histogram.size(); i++) {
+        if (result.histogram[i]) {
+            console() << "  first change after " << i << " frames: " << result.histogram[i] << " edges" << endl;
+        }
+    }
+}
+
+void VolumeMapperApp::update()
+{
+    if (!usesCpuGrid()) {
+        // GPU grids are one atlas texture; CPU grids are only drawn in pieces
+        mGridZ = min(mGridZ, VoxelAtlas::getMaxSizeZ(mGridY));
+    }
+    if (mMockOpc.isRunning()) {
+        mMockStats = mMockOpc.getStats();
+        mMockQueueBytes = mMockStats.maxQueueBytes;
+    }
+    mLeds.resize(mNumLeds);
+    mSolver.setup(mLeds.size());
+    if (mCurrentLed >= mNumLeds) {
+        mCurrentLed = 0;
+    }
+
+    // Grids are only quantized once nothing is adding to them
+    if (!isAccumulating()) {
+        for (int i = 0; i < mLeds.size(); i++) {
+            if (i != mCurrentLed) {
+                packLed(i);
+            }
+        }
+    }
+
+    size_t voxelBytes = 0;
+    for (int i = 0; i < mLeds.size(); i++) {
+        const Led& led = mLeds[i];
+        voxelBytes += led.cpu.grid.getMemoryBytes() + led.fused.getMemoryBytes() +
+            led.packedGrid.getMemoryBytes() + led.packedFused.getMemoryBytes();
+    }
+    mVoxelMemoryMB = voxelBytes / float(1 << 20);
+
+    // Coded acquisition runs the whole pattern sequence as a single visit
+    int visits = mNumLeds;
+    int captures = mFramesPerLed;
+    if (mAcquisition == ACQUIRE_CODED) {
+        mCoder.setup(mCpuMapper.getWidth(), mCpuMapper.getHeight(), mNumLeds);
+        visits = 1;
+        captures = mCoder.getNumPatterns();
+    }
+
+    {
+        // Settings reach the capture thread between its batches of frames
+        std::lock_guard<std::mutex> lock(mCaptureMutex);
+        mOPC.setTransport(OPCClient::Transport(mOpcTransport));
+        if (mAcquisition != mLastAcquisition) {
+            mLastAcquisition = mAcquisition;
+            resetSequence();
+        }
+        if (mSequencer.setup(visits, captures, mLatencyFirstFrame, mLatencySettledFrame)) {
+            resetSequence();
+        }
+        for (int i = 0; i < mSensors.size(); i++) {
+            mSensors[i]->history.setup(visits, captures, mLatencyFirstFrame, mLatencySettledFrame);
+        }
+        if (mCalibrationDone) {
+            mCalibrationDone = false;
+            finishCalibration();
+            resetSequence();
+        }
+        mCaptureSettings.numLeds = mNumLeds;
+        mCaptureSettings.ledColor = mLedColor;
+        mCaptureSettings.acquisition = mAcquisition;
+
+        if (mKinect->isReplay() && mKinect->isReplayFinished() && !mReplayFinished) {
+            mReplayFinished = true;
+            console() << "Replay finished, " << mIncompleteLeds << " incomplete LED visits" << endl;
+        }
+
+        if (!mCaptureThread.joinable()) {
+            mCaptureRunning = true;
+            mCaptureThread = std::thread(&VolumeMapperApp::captureLoop, this);
+        }
+    }
+
+    // Everything captured since the last update, in order. Only the newest
+    // frame from the primary Kinect is shown; earlier ones are uploaded
+    // only if an LED visit needs them.
+    CaptureEvent event;
+    int newest = -1;
+    while (mCaptureQueue.pop(event)) {
+        if (event.sensor < 0) {
+            newest = mCaptureEvents.size();
+        }
+        mCaptureEvents.push_back(std::move(event));
+    }
+    for (int i = 0; i < mCaptureEvents.size(); i++) {
+        const CaptureEvent& e = mCaptureEvents[i];
+        if (e.sensor < 0) {
+            processFrame(e, i == newest);
+        } else if (e.sensor < mSensors.size()) {
+            processSensorFrame(e);
+        }
+    }
+    mCaptureEvents.clear();
+
+    applyMapResults();
+
+    BoundedQueue<CaptureEvent>::Stats captureStats = mCaptureQueue.getStats();
+    BoundedQueue<MapJob>::Stats mapStats = mMapJobs.getStats();
+    mDroppedCaptures = int(captureStats.dropped);
+    mCaptureQueuePeak = int(captureStats.maxDepth);
+    mDroppedMapJobs = int(mapStats.dropped);
+    mMapQueuePeak = int(mapStats.maxDepth);
+
+    if (mBackgroundInitCountdown) {
+        mBackgroundInitCountdown--;
+        captureBackground();
+    }
+}
+
+void VolumeMapperApp::captureLoop()
+{
+    while (mCaptureRunning) {
+        bool busy;
+        {
+            std::lock_guard<std::mutex> lock(mCaptureMutex);
+            busy = pollCapture();
+        }
+
+        // Frames arrive at 30 Hz, so there's no need to spin between them
+        if (!busy) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+bool VolumeMapperApp::pollCapture()
+{
+    bool busy = false;
+    FramePairer::Pair pair;
+
+    // Other sensors first, so their frames are numbered before the primary
+    // sensor sends its next packet
+    for (int i = 0; i < mSensors.size(); i++) {
+        Sensor& sensor = *mSensors[i];
+        pollKinect(sensor.kinect, sensor.pairer);
+        while (sensor.pairer.pop(pair)) {
+            sequenceSensorFrame(i, pair);
+            busy = true;
+        }
+    }
+
+    // Each video frame advances the mapper, along with the depth frame captured nearest to it
+    pollKinect(mKinect, mPairer);
+    while (mPairer.pop(pair)) {
+        sequenceFrame(pair);
+        busy = true;
+    }
+
+    // Finishes writes still in flight, even between frames
+    mOPC.update();
+    return busy;
+}
+
+void VolumeMapperApp::pollKinect(KinectRef kinect, FramePairer& pairer)
+{
+    if (kinect->checkNewDepthFrame()) {
+        Kinect::FrameInfo info;
+        shared_ptr<uint16_t> depthData = kinect->getDepthData(&info);
+        if (depthData) {
+            pairer.pushDepth(depthData, info);
+        }
+    }
+
+    if (kinect->checkNewVideoFrame()) {
+        Kinect::FrameInfo info;
+        shared_ptr<uint8_t> videoData = kinect->getVideoData(&info);
+        if (videoData) {
+            pairer.pushVideo(videoData, info);
+        }
+    }
+}
+
+void VolumeMapperApp::sequenceFrame(const FramePairer::Pair& pair)
+{
+    CaptureEvent event;
+    event.pair = pair;
+    event.unpaired = mPairer.getUnpairedCount();
+
+    // Frames count drops, so gaps in delivery don't shift the LED timing
+    int64_t frameIndex = int64_t(pair.videoInfo.mSequence) + pair.videoInfo.mDropped;
+    mSentCommand.videoTimestamp = pair.videoInfo.mTimestamp;
+
+    if (mKinect->isReplay()) {
+        // The LEDs were already sequenced when this was recorded
+        followReplay(frameIndex, pair.videoInfo.mTimestamp);
+        event.classified = mSequencer.classify(frameIndex, event.shown);
+        event.captures = mSequencer.getCapturesPerVisit();
+    } else if (mCalibrator.isRunning()) {
+        bool on = mCalibrator.update(frameIndex, pair.video.get(), 640, 480, pair.videoInfo.mChannels,
+            getElapsedSeconds());
+
+        // The render thread owns the latency settings, so it finishes up
+        if (!mCalibrator.isRunning()) {
+            mCalibrationDone = true;
+        }
+        LedSequencer::Command all = { -1, 0, on, -1 };
+        mSentCommand.command = all;
+        sendLeds(-1, on);
+    } else {
+        event.classified = mSequencer.classify(frameIndex, event.shown);
+        event.captures = mSequencer.getCapturesPerVisit();
+
+        LedSequencer::Command command = mSequencer.next(frameIndex);
+        for (int i = 0; i < mSensors.size(); i++) {
+            if (mSensors[i]->lastFrameIndex >= 0) {
+                mSensors[i]->history.record(mSensors[i]->lastFrameIndex, command);
+            }
+        }
+        mSentCommand.command = command;
+
+        if (mCaptureSettings.acquisition == ACQUIRE_CODED) {
+            sendPattern(command.capture);
+        } else {
+            sendLeds(command.led, command.on);
+        }
+    }
+
+    // If the render thread is this far behind, the frame is dropped. A visit
+    // it belonged to is incomplete, and comes around again.
+    mCaptureQueue.push(std::move(event));
+}
+
+void VolumeMapperApp::followReplay(int64_t frameIndex, uint32_t videoTimestamp)
+{
+    // Replays keep device timestamps, so the frame each recorded command
+    // was sent after is numbered the way this replay numbers it. The replay
+    // only holds the newest command; in real time some can go by unseen,
+    // and the frames that depend on them aren't classified.
+    mReplayFrames.push_back(make_pair(videoTimestamp, frameIndex));
+    while (mReplayFrames.size() > 16) {
+        mReplayFrames.pop_front();
+    }
+
+    vector<uint8_t> state = mKinect->getReplayLedState();
+    RecordedCommand recorded;
+    if (state.size() < sizeof recorded) {
+        return;
+    }
+    memcpy(&recorded, &state[0], sizeof recorded);
+    if (memcmp(recorded.tag, "VMLS", 4) || recorded.command.led < 0 ||
+        recorded.videoTimestamp == mReplayedTimestamp) {
+        return;
+    }
+
+    for (int i = int(mReplayFrames.size()) - 1; i >= 0; i--) {
+        if (mReplayFrames[i].first == recorded.videoTimestamp) {
+            mSequencer.record(mReplayFrames[i].second, recorded.command);
+            mReplayedTimestamp = recorded.videoTimestamp;
+            break;
+        }
+    }
+}
+
+void VolumeMapperApp::sequenceSensorFrame(int index, const FramePairer::Pair& pair)
+{
+    Sensor& sensor = *mSensors[index];
+    sensor.lastFrameIndex = int64_t(pair.videoInfo.mSequence) + pair.videoInfo.mDropped;
+
+    CaptureEvent event;
+    event.sensor = index;
+    event.pair = pair;
+
+    // Coded patterns are only decoded for the primary sensor
+    if (mCaptureSettings.acquisition == ACQUIRE_SINGLE) {
+        event.classified = sensor.history.classify(sensor.lastFrameIndex, event.shown);
+        event.captures = sensor.history.getCapturesPerVisit();
+    }
+    mCaptureQueue.push(std::move(event));
+}
+
+void VolumeMapperApp::processFrame(const CaptureEvent& event, bool display)
+{
+    const FramePairer::Pair& pair = event.pair;
+    mDroppedVideoFrames = pair.videoInfo.mDropped;
+    mUnpairedFrames = event.unpaired;
+
+    // Unpaired frames keep the last depth, which is older than we'd like
+    if (pair.depth) {
+        if (!mDepthData || pair.depthInfo.mSequence != mDepthInfo.mSequence) {
+            mDepthData = pair.depth;
+            mDepthTexture = mDepthUploader.upload(mDepthData.get());
+            if (!mDepthBackgroundTexture) {
+                mDepthUploader.upload(mDepthData.get(), mDepthBackgroundTexture);
+                mDepthBackgroundData = mDepthData;
+            }
+        }
+        mDepthInfo = pair.depthInfo;
+        mDroppedDepthFrames = pair.depthInfo.mDropped;
+        mDepthSkew = pair.depthInfo.mPeriod ? pair.skew / float(pair.depthInfo.mPeriod) : 0.0f;
+    }
+
+    // Green-only video is one byte per pixel, uploaded as a luminance texture
+    if (pair.videoInfo.mChannels != mVideoChannels) {
+        mVideoChannels = pair.videoInfo.mChannels;
+        if (mVideoChannels == 1) {
+            mColorUploader.setup(640, 480, GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE, 1);
+        } else {
+            mColorUploader.setup(640, 480, GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, 3);
+        }
+    }
+    if (!display && !event.classified) {
+        return;
+    }
+
+    // Captured frames are uploaded once, into the LED's own textures
+    bool uploaded = event.classified && captureFrame(event.shown, event.captures, pair.video);
+    if (display && !uploaded) {
+        mColorTexture = mColorUploader.upload(pair.video.get());
+    }
+}
+
+// Returns true if the frame was uploaded and is now mColorTexture
+bool VolumeMapperApp::captureFrame(const LedSequencer::Command& shown, int captures, shared_ptr<uint8_t> videoData)
+{
+    if (shown.led >= mLeds.size()) {
+        return false;
+    }
+
+    if (shown.serial != mCaptureSerial) {
+        mCaptureSerial = shown.serial;
+        mCaptured.assign(captures, false);
+    } else if (mCaptured.empty()) {
+        // This visit is already finished
+        return false;
+    }
+
+    // Store the frame we just captured
+    Led &l = mLeds[shown.led];
+    bool uploaded = false;
+    if (mAcquisition == ACQUIRE_CODED) {
+        mCodedFrames.resize(captures);
+        mCodedFrames[shown.capture] = videoData;
+    } else {
+        // Each LED reuses its own textures from one visit to the next
+        l.frames.resize(captures);
+        mColorUploader.upload(videoData.get(), l.frames[shown.capture]);
+        mColorTexture = l.frames[shown.capture];
+        uploaded = true;
+
+        // The fused grid is built on the CPU with either backend
+        if (mBackend == BACKEND_CPU || !mSensors.empty()) {
+            l.videoFrames.resize(l.frames.size());
+            l.videoFrames[shown.capture] = videoData;
+        } else {
+            l.videoFrames.clear();
+        }
+    }
+    mCaptured[shown.capture] = true;
+
+    if (shown.capture + 1 < captures) {
+        return uploaded;
+    }
+
+    // A visit missing captures, to dropped frames, waits for the next round
+    if (find(mCaptured.begin(), mCaptured.end(), false) != mCaptured.end()) {
+        mIncompleteLeds++;
+    } else if (mAcquisition == ACQUIRE_CODED) {
+        updateCoded();
+    } else if (mBackend == BACKEND_CPU) {
+        // Finished in applyMapResults. A visit the mapping thread had no
+        // room for waits for the next round, like one missing captures.
+        if (!queueMapJob(shown.led, -1, true)) {
+            mIncompleteLeds++;
+        }
+    } else {
+        unpackLed(shown.led);
+        updateDepthMask(l);
+        updateFilter(l);
+        updateGrid(l);
+        finishLedUpdate(shown.led);
+        if (!mSensors.empty()) {
+            queueMapJob(shown.led, -1, false);
+        }
+    }
+    l.videoFrames.clear();
+    mCaptured.clear();
+    return uploaded;
+}
+
+void VolumeMapperApp::processSensorFrame(const CaptureEvent& event)
+{
+    Sensor& sensor = *mSensors[event.sensor];
+    const FramePairer::Pair& pair = event.pair;
+
+    if (pair.depth && (!sensor.depthData || pair.depthInfo.mSequence != sensor.depthInfo.mSequence)) {
+        sensor.depthData = pair.depth;
+        if (!sensor.depthBackgroundData) {
+            sensor.depthBackgroundData = sensor.depthData;
+        }
+    }
+    sensor.depthInfo = pair.depthInfo;
+    sensor.videoChannels = pair.videoInfo.mChannels;
+
+    if (event.classified) {
+        captureSensorFrame(event.sensor, event.shown, event.captures, pair.video);
+    }
+}
+
+void VolumeMapperApp::captureSensorFrame(int index, const LedSequencer::Command& shown, int captures,
+    shared_ptr<uint8_t> videoData)
+{
+    if (shown.led >= mLeds.size()) {
+        return;
+    }
+
+    Sensor& sensor = *mSensors[index];
+    if (shown.serial != sensor.captureSerial) {
+        sensor.captureSerial = shown.serial;
+        sensor.captured.assign(captures, false);
+    } else if (sensor.captured.empty()) {
+        return;
+    }
+
+    sensor.videoFrames.resize(captures);
+    sensor.videoFrames[shown.capture] = videoData;
+    sensor.captured[shown.capture] = true;
+
+    if (shown.capture + 1 < captures) {
+        return;
+    }
+
+    if (find(sensor.captured.begin(), sensor.captured.end(), false) == sensor.captured.end()) {
+        queueMapJob(shown.led, index, false);
+    }
+    sensor.videoFrames.clear();
+    sensor.captured.clear();
+}
+
+void VolumeMapperApp::finishLedUpdate(int index)
+{
+    if (mCurrentLed != index && mCurrentLed < mLeds.size()) {
+        packLed(mCurrentLed);
+    }
+    mCurrentLed = index;
+    ledChanged(index);
+}
+
+bool VolumeMapperApp::queueMapJob(int led, int sensor, bool grid)
+{
+    // The job takes the visit's video frames, so raw frames aren't kept for
+    // every LED once its visit is done
+    MapJob job;
+    if (sensor < 0) {
+        job.depth = mDepthData;
+        job.background = mDepthBackgroundData;
+        job.videoFrames.swap(mLeds[led].videoFrames);
+        job.channels = mVideoChannels;
+    } else {
+        Sensor& s = *mSensors[sensor];
+        job.depth = s.depthData;
+        job.background = s.depthBackgroundData;
+        job.videoFrames.swap(s.videoFrames);
+        job.channels = s.videoChannels;
+    }
+    if (!job.depth || !job.background) {
+        return false;
+    }
+
+    job.led = led;
+    job.sensor = sensor;
+    job.grid = grid;
+    job.generation = mMapGeneration;
+    job.erodeRadius = mErodeRadius;
+    job.filterRadius = mFilterRadius;
+    job.depthBias = mDepthBias;
+    job.maxDepthSpread = mMaxDepthSpread;
+    job.gridX = mGridX;
+    job.gridY = mGridY;
+    job.gridZ = mGridZ;
+    job.zLimit = mZLimit;
+
+    // What every sensor sees goes into the fused grid
+    job.fuse = !mSensors.empty();
+    job.fusedMin = mFusedMin;
+    job.fusedMax = mFusedMax;
+    job.extrinsic = Matrix44f::identity();
+    if (sensor >= 0) {
+        const Sensor& s = *mSensors[sensor];
+        job.extrinsic = Matrix44f::createTranslation(s.position) * s.orientation.toMatrix44();
+    }
+
+    // If the mapping thread is this far behind, the visit is dropped and
+    // comes around again next round
+    return mMapJobs.push(std::move(job));
+}
+
+void VolumeMapperApp::mapLoop()
+{
+    MapJob job;
+    vector<const uint8_t*> frames;
+
+    while (mMapRunning) {
+        if (!mMapJobs.pop(job)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        frames.clear();
+        for (int i = 0; i < job.videoFrames.size(); i++) {
+            if (job.videoFrames[i]) {
+                frames.push_back(job.videoFrames[i].get());
+            }
+        }
+
+        MapResult result;
+        result.led = job.led;
+        result.sensor = job.sensor;
+        result.grid = job.grid;
+        result.generation = job.generation;
+        mMapWorker.updateDepthMask(result.cpu, job.depth.get(), job.background.get(),
+            job.erodeRadius, job.depthBias, job.maxDepthSpread);
+        mMapWorker.updateFilter(result.cpu, frames, job.filterRadius, job.channels);
+        result.binned = job.grid &&
+            mMapWorker.binGrid(result.cpu, job.gridX, job.gridY, job.gridZ, job.zLimit, result.bins);
+
+        result.fused = false;
+        if (job.fuse && !result.cpu.filter.empty()) {
+            mMapFusedGrid.setup(job.fusedMin.ptr(), job.fusedMax.ptr(), job.gridX, job.gridY, job.gridZ);
+            result.fused = mMapFusedGrid.bin(&result.cpu.mask[0], &result.cpu.filter[0],
+                mMapWorker.getWidth(), mMapWorker.getHeight(), job.extrinsic.m, result.fusedBins);
+        }
+
+        // Don't hold the frames while waiting
+        job = MapJob();
+
+        // Finished work isn't dropped; it waits for the render thread to make room
+        while (!mMapResults.push(std::move(result)) && mMapRunning) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void VolumeMapperApp::applyMapResults()
+{
+    MapResult result;
+    while (mMapResults.pop(result)) {
+        // Grids may have been cleared, or LEDs and sensors removed, since the job was queued
+        if (result.generation != mMapGeneration || result.led >= mLeds.size() ||
+            result.sensor >= int(mSensors.size())) {
+            continue;
+        }
+        Led& l = mLeds[result.led];
+        unpackLed(result.led);
+
+        // With the CPU backend, the primary sensor's mask and filter are the LED's own
+        if (result.grid) {
+            l.cpu.mask.swap(result.cpu.mask);
+            l.cpu.filter.swap(result.cpu.filter);
+            if (result.binned) {
+                CpuMapper::applyGrid(l.cpu.grid, result.bins, mSliceAlpha);
+            }
+            uploadCpuResults(l);
+            finishLedUpdate(result.led);
+        }
+
+        // Binned on the mapping thread, like the LED's own grid
+        if (result.fused) {
+            FusedGrid::apply(l.fused, result.fusedBins, mSliceAlpha);
+            ledChanged(result.led);
+        }
+        if (result.led != mCurrentLed) {
+            packLed(result.led);
+        }
+    }
+}
+
+void VolumeMapperApp::updateCoded()
+{
+    if (!mDepthData || !mDepthBackgroundData) {
+        return;
+    }
+
+    vector<const uint8_t*> frames;
+    for (int i = 0; i < mCodedFrames.size(); i++) {
+        if (!mCodedFrames[i]) {
+            return;
+        }
+        frames.push_back(mCodedFrames[i].get());
+    }
+    mCoder.decode(frames, mVideoChannels, mCodedMinContrast);
+
+    // The depth mask doesn't depend on the LED, so one serves them all.
+    // Decoding and gridding run on the CPU with either backend.
+    mCpuMapper.updateDepthMask(mCodedMask, mDepthData.get(), mDepthBackgroundData.get(),
+        mErodeRadius, mDepthBias, mMaxDepthSpread);
+
+    mCodedLeds = 0;
+    for (int i = 0; i < mNumLeds; i++) {
+        size_t count = mCoder.getNumPixels(i);
+        if (!count) {
+            continue;
+        }
+        unpackLed(i);
+        Led& led = mLeds[i];
+        mCpuMapper.updateGridSparse(led.cpu.grid, &mCodedMask.mask[0], &mCoder.getContrast()[0],
+            mCoder.getPixels(i), count, mGridX, mGridY, mGridZ, mZLimit, mSliceAlpha);
+        ledChanged(i);
+        if (i != mCurrentLed) {
+            packLed(i);
+        }
+        mCodedLeds++;
+    }
+    mCpuGridAtlasLed = -1;
+}
+
+void VolumeMapperApp::sendLeds(int led, bool on)
+{
+    vector<char>& packet = beginPacket();
+    auto& header = OPCClient::Header::view(packet);
+
+    // Light one LED, or all of them if 'led' is negative
+    if (on) {
+        for (int i = 0; i < mCaptureSettings.numLeds; i++) {
+            if (led < 0 || i == led) {
+                for (int ch = 0; ch < 3; ch++) {
+                    header.data()[i*3 + ch] = 255 * mCaptureSettings.ledColor[ch];
+                }
+            }
+        }
+    }
+    writePacket(packet);
+}
+
+void VolumeMapperApp::sendPattern(int pattern)
+{
+    vector<char>& packet = beginPacket();
+    auto& header = OPCClient::Header::view(packet);
+
+    for (int i = 0; i < mCaptureSettings.numLeds; i++) {
+        if (mCoder.isLit(pattern, i)) {
+            for (int ch = 0; ch < 3; ch++) {
+                header.data()[i*3 + ch] = 255 * mCaptureSettings.ledColor[ch];
+            }
+        }
+    }
+    writePacket(packet);
+}
+
+vector<char>& VolumeMapperApp::beginPacket()
+{
+    // Built in place in the OPC client's send buffer, which is already
+    // allocated at full size, with all LEDs off
+    vector<char>& packet = mOPC.getFrame();
+    packet.assign(sizeof(OPCClient::Header) + mCaptureSettings.numLeds * 3, 0);
+    OPCClient::Header::view(packet).init(0, mOPC.SET_PIXEL_COLORS, mCaptureSettings.numLeds * 3);
+    return packet;
+}
+
+void VolumeMapperApp::writePacket(const vector<char>& packet)
+{
+    if (mKinect->isRecording()) {
+        memcpy(mSentCommand.tag, "VMLS", 4);
+        mRecordBuffer.resize(sizeof mSentCommand + packet.size());
+        memcpy(&mRecordBuffer[0], &mSentCommand, sizeof mSentCommand);
+        memcpy(&mRecordBuffer[sizeof mSentCommand], &packet[0], packet.size());
+        mKinect->recordLedState(&mRecordBuffer[0], mRecordBuffer.size());
+    }
+    if (mSimulator) {
+        mSimulator->write(packet);
+    }
+
+    // Write two back-to-back frames, so this takes effect
+    // immediately even if Fadecandy's interpolation is enabled.
+    // Both go out in one write.
+    mOPC.sendFrame(2);
+    mOPC.update();
+}
+
+void VolumeMapperApp::draw()
+{
+    gl::setViewport(Area(Vec2i(0,0), getWindowSize()));
+    gl::setMatrices(mMayaCam.getCamera());
+    gl::clear();
+
+    // Common coordinate system is the unit cube from [0,0,0] to [1,1,1], in camera space
+    gl::translate(0.5, 0.5, 0.2);
+    gl::scale(-1.0f, -1.0f, 16.0);
+    
+    // Draw a cube around the coordinate system bounds
+    gl::color(0.2f, 0.2f, 0.8f);
+    gl::drawStrokedCube(Vec3f(0.5f, 0.5f, mZLimit / 2.0f), Vec3f(1.0f, 1.0f, mZLimit));
+    
+    Led& currentLed = mLeds[mCurrentLed];
+    
+    if (mViewFilteredPointCloud && currentLed.filter && currentLed.mask) {
+        mPointCloud.mGain = mGain;
+        mPointCloud.draw(currentLed.mask.getTexture(), currentLed.filter.getTexture());
+    }
+
+    if (mViewCameraPointCloud && mDepthTexture && mColorTexture) {
+        mPointCloud.mGain = 1.0f;
+        mPointCloud.draw(*mDepthTexture, *mColorTexture);
+    }
+
+    if (mViewVolumeGrid) {
+        unpackLed(mCurrentLed);
+        if (usesCpuGrid() || !currentLed.grid) {
+            const BrickVolume& grid = currentLed.cpu.grid;
+            if (mCpuGridAtlasLed != mCurrentLed && !grid.empty()) {
+                int piece = VoxelAtlas::getMaxSizeZ(grid.getSizeY());
+                mCpuGridAtlases.resize((grid.getSizeZ() + piece - 1) / piece);
+                for (int i = 0; i < int(mCpuGridAtlases.size()); i++) {
+                    grid.exportDense(mCpuGridDense, i * piece, min((i + 1) * piece, grid.getSizeZ()));
+                    mCpuGridAtlases[i].upload(mCpuGridDense);
+                }
+                mCpuGridAtlasLed = mCurrentLed;
+            }
+            if (mCpuGridAtlasLed == mCurrentLed) {
+                int firstSlice = 0;
+                for (int i = 0; i < int(mCpuGridAtlases.size()); i++) {
+                    drawGrid(mCpuGridAtlases[i], firstSlice, grid.getSizeZ());
+                    firstSlice += mCpuGridAtlases[i].getSizeZ();
+                }
+            }
+        } else {
+            drawGrid(currentLed.grid, 0, currentLed.grid.getSizeZ());
+        }
+    }
+
+    if (mViewFusedGrid) {
+        unpackLed(mCurrentLed);
+        drawFusedGrid(currentLed.fused);
+    }
+        
+    mParams->draw();
+}
+
+void VolumeMapperApp::drawGrid(VoxelAtlas& grid, int firstSlice, int totalSlices)
+{
+    if (!grid) {
+        return;
+    }
+
+    // One quad per slice. Vertices cover the whole grid, and each atlas
+    // draws the run of quads for the slices it holds.
+    int slices = grid.getSizeZ();
+    if (mGridVertices.size() != size_t(totalSlices) * 12) {
+        mGridVertices.clear();
+        for (int z = 0; z < totalSlices; z++) {
+            static const float corners[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
+            for (int i = 0; i < 4; i++) {
+                mGridVertices.push_back(corners[i*2]);
+                mGridVertices.push_back(corners[i*2 + 1]);
+                mGridVertices.push_back(z);
+            }
+        }
+    }
+
+    gl::enableAdditiveBlending();
+    mDrawGridProg->bind();
+    mDrawGridProg->uniform("gain", mGain);
+    mDrawGridProg->uniform("layer", 0);
+    mDrawGridProg->uniform("z_step", mZLimit / float(totalSlices - 1));
+    mDrawGridProg->uniform("slices", float(slices));
+    mDrawGridProg->uniform("first_slice", float(firstSlice));
+    mDrawGridProg->uniform("rows", float(grid.getSizeY()));
+
+    GLint position = mDrawGridProg->getAttribLocation("position");
+    glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, 0, &mGridVertices[0]);
+    glEnableVertexAttribArray(position);
+
+    grid.getTexture().bind(0);
+    glDrawArrays(GL_QUADS, firstSlice * 4, slices * 4);
+    
+    mDrawGridProg->unbind();
+    gl::disableAlphaBlending();
+    glDisableVertexAttribArray(position);
+}
+
+void VolumeMapperApp::drawFusedGrid(const BrickVolume& fused)
+{
+    if (fused.empty()) {
+        return;
+    }
+
+    // World space is the primary camera's, so each voxel center projects
+    // into the common coordinate system through the Kinect intrinsics. The
+    // grid is sparse, so this is cheap enough to redo every frame.
+    Vec3f cell = (mFusedMax - mFusedMin) / Vec3f(fused.getSizeX(), fused.getSizeY(), fused.getSizeZ());
+    mFusedPoints.clear();
+    mFusedColors.clear();
+    fused.forEachNonzero([&](int x, int y, int z, float value) {
+        Vec3f p = mFusedMin + (Vec3f(x, y, z) + Vec3f(0.5f, 0.5f, 0.5f)) * cell;
+        if (p.z <= 0.0f) {
+            return;
+        }
+        mFusedPoints.push_back(Vec3f((p.x * kKinectFocalLength / p.z + kKinectCenterX) / kKinectWidth,
+            (p.y * kKinectFocalLength / p.z + kKinectCenterY) / kKinectHeight, p.z / kKinectDepthScale));
+        mFusedColors.push_back(mLedColor * (value * mGain));
+    });
+    if (mFusedPoints.empty()) {
+        return;
+    }
+
+    gl::enableAdditiveBlending();
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, &mFusedPoints[0]);
+    glColorPointer(3, GL_FLOAT, 0, &mFusedColors[0]);
+    glDrawArrays(GL_POINTS, 0, GLsizei(mFusedPoints.size()));
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    gl::disableAlphaBlending();
+}
+
+bool VolumeMapperApp::usesCpuGrid() const
+{
+    return mBackend == BACKEND_CPU || mAcquisition == ACQUIRE_CODED;
+}
+
+void VolumeMapperApp::updateGrid(Led& led)
+{
+    // Carry on from a loaded map, which is only on the CPU. One that doesn't
+    // fit the clamped GPU grid size would be discarded by the resize below.
+    if (!led.grid && !led.cpu.grid.empty() && led.cpu.grid.getSizeX() == mGridX &&
+        led.cpu.grid.getSizeY() == mGridY && led.cpu.grid.getSizeZ() == mGridZ) {
+        led.cpu.grid.exportDense(mCpuGridDense);
+        led.grid.upload(mCpuGridDense);
+    }
+    led.grid.resize(mGridX, mGridY, mGridZ);
+
+    // Sizes with the same product, like 64x32 and 32x64, need different cells
+    if (mGridCellsX != mGridX || mGridCellsY != mGridY) {
+        mGridCellsX = mGridX;
+        mGridCellsY = mGridY;
+        mGridCells.clear();
+        for (int y = 0; y < mGridY; y++) {
+            for (int x = 0; x < mGridX; x++) {
+                mGridCells.push_back(Vec2f((x + 0.5f) / mGridX, (y + 0.5f) / mGridY));
+            }
+        }
+    }
+
+    // Don't filter depth values
+    led.mask.getTexture().bind();
+    led.mask.getTexture().setMinFilter(GL_NEAREST);
+    led.mask.getTexture().setMagFilter(GL_NEAREST);
+
+    led.grid.bindAll();
+    gl::enableAlphaBlending();
+    glPointSize(1.0f);
+
+    mSliceProg->bind();
+    mSliceProg->uniform("z_step", mZLimit / float(mGridZ - 1));
+    mSliceProg->uniform("slices", float(mGridZ));
+    mSliceProg->uniform("alpha", mSliceAlpha);
+    mSliceProg->uniform("mask", 0);
+    mSliceProg->uniform("filter", 1);
+
+    led.mask.getTexture().bind(0);
+    led.filter.getTexture().bind(1);
+
+    // Scatter every grid cell into its slice in a single pass
+    GLint position = mSliceProg->getAttribLocation("position");
+    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &mGridCells[0]);
+    glEnableVertexAttribArray(position);
+    glDrawArrays(GL_POINTS, 0, mGridCells.size());
+
+    led.grid.unbind();
+    mSliceProg->unbind();
+    gl::disableAlphaBlending();
+    glDisableVertexAttribArray(position);
+}
+
+void VolumeMapperApp::updateFilter(Led& led)
+{
+    if (led.frames.size() < 1) {
+        return;
+    }
+
+    int width = led.frames[0]->getWidth();
+    int height = led.frames[0]->getHeight();
+
+    gl::Fbo::Format format;
+    format.setColorInternalFormat(GL_R32F);
+
+    if (!led.filter) {
+        led.filter = gl::Fbo(width, height, format);
+    }
+    if (!mDiffFbo || mDiffFbo.getSize() != Vec2i(width, height)) {
+        // Scratch buffers, shared by all LEDs
+        mDiffFbo = gl::Fbo(width, height, format);
+        mBoxFbo = gl::Fbo(width, height, format);
+    }
+
+    // Sum the median color difference of each frame pair
+    mDiffFbo.bindFramebuffer();
+    gl::setViewport(Area(Vec2i(0,0), mDiffFbo.getSize()));
+    gl::setMatricesWindow(mDiffFbo.getSize());
+    gl::clear();
+    gl::enableAdditiveBlending();
+    
+    mFilterProg->bind();
+    mFilterProg->uniform("gain", 1.0f / led.frames.size());
+    mFilterProg->uniform("frame1", 0);
+    mFilterProg->uniform("frame2", 1);
+
+    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
+    GLint position = mFilterProg->getAttribLocation("position");
+    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
+    glEnableVertexAttribArray(position);
+    
+    for (int i = 0; i + 1 < led.frames.size(); i++) {
+        led.frames[i]->bind(0);
+        led.frames[i+1]->bind(1);
+        glDrawArrays(GL_QUADS, 0, 4);
+    }
+
+    mFilterProg->unbind();
+    gl::disableAlphaBlending();
+    glDisableVertexAttribArray(position);
+    mDiffFbo.unbindFramebuffer();
+
+    // Separable box filter
+    boxFilterPass(mDiffFbo, mBoxFbo, Vec2f(1.0f / width, 0.0f));
+    boxFilterPass(mBoxFbo, led.filter, Vec2f(0.0f, 1.0f / height));
+}
+
+void VolumeMapperApp::boxFilterPass(gl::Fbo& source, gl::Fbo& dest, Vec2f step)
+{
+    dest.bindFramebuffer();
+    gl::setViewport(Area(Vec2i(0,0), dest.getSize()));
+    gl::setMatricesWindow(dest.getSize());
+    gl::disableAlphaBlending();
+
+    // Sample exact texels
+    source.getTexture().bind(0);
+    source.getTexture().setMinFilter(GL_NEAREST);
+    source.getTexture().setMagFilter(GL_NEAREST);
+
+    mBoxFilterProg->bind();
+    mBoxFilterProg->uniform("source", 0);
+    mBoxFilterProg->uniform("step", step);
+    mBoxFilterProg->uniform("radius", mFilterRadius);
+
+    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
+    GLint position = mBoxFilterProg->getAttribLocation("position");
+    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
+    glEnableVertexAttribArray(position);
+    glDrawArrays(GL_QUADS, 0, 4);
+
+    mBoxFilterProg->unbind();
+    glDisableVertexAttribArray(position);
+    dest.unbindFramebuffer();
+}
+
+void VolumeMapperApp::updateDepthMask(Led& led)
+{
+    int width = mDepthTexture->getWidth();
+    int height = mDepthTexture->getHeight();
+
+    if (!led.mask) {
+        gl::Fbo::Format format;
+        format.setColorInternalFormat(GL_R32F);
+        led.mask = gl::Fbo(width, height, format);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!mDepthRangeFbos[i] || mDepthRangeFbos[i].getSize() != Vec2i(width, height)) {
+            gl::Fbo::Format format;
+            format.setColorInternalFormat(GL_RG32F);
+            mDepthRangeFbos[i] = gl::Fbo(width, height, format);
+        }
+    }
+
+    // Depth range over the erosion window, along rows and then columns.
+    // Each pass widens the window by its step, which can be up to one more
+    // than twice the window's half width, so a radius of 16 takes 4 passes
+    // each way, and 64 takes 5. Samples past the edge clamp, and so read
+    // what one wide loop would. Even a zero radius needs one pass to turn
+    // depth into a range.
+    gl::Texture* source = mDepthTexture.get();
+    bool fromDepth = true;
+    int target = 0;
+    for (int axis = 0; axis < 2; axis++) {
+        Vec2f texel = axis ? Vec2f(0.0f, 1.0f / height) : Vec2f(1.0f / width, 0.0f);
+        for (int window = 0; window < mErodeRadius || fromDepth;) {
+            int step = min(2 * window + 1, mErodeRadius - window);
+            depthRangePass(*source, fromDepth, mDepthRangeFbos[target], texel * float(step));
+            source = &mDepthRangeFbos[target].getTexture();
+            fromDepth = false;
+            target ^= 1;
+            window += step;
+        }
+    }
+
+    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
+    gl::disableAlphaBlending();
+
+    // Background test
+    led.mask.bindFramebuffer();
+    gl::setViewport(Area(Vec2i(0,0), led.mask.getSize()));
+    gl::setMatricesWindow(led.mask.getSize());
+    gl::clear();
+    
+    mMaskProg->bind();
+    mMaskProg->uniform("depth", 0);
     mMaskProg->uniform("background", 1);
+    mMaskProg->uniform("range", 2);
+    mMaskProg->uniform("bias", mDepthBias);
+    mMaskProg->uniform("max_spread", mMaxDepthSpread);
     mDepthTexture->bind(0);
     mDepthBackgroundTexture->bind(1);
+    source->bind(2);
+    source->setMinFilter(GL_NEAREST);
+    source->setMagFilter(GL_NEAREST);
     
-    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
     GLint position = mMaskProg->getAttribLocation("position");
     glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
     glEnableVertexAttribArray(position);
@@ -418,6 +2125,58 @@ void VolumeMapperApp::updateDepthMask(Led& led)
     led.mask.unbindFramebuffer();
 }
 
+void VolumeMapperApp::depthRangePass(gl::Texture& source, bool fromDepth, gl::Fbo& dest, Vec2f step)
+{
+    dest.bindFramebuffer();
+    gl::setViewport(Area(Vec2i(0,0), dest.getSize()));
+    gl::setMatricesWindow(dest.getSize());
+    gl::disableAlphaBlending();
+
+    // Sample exact texels
+    source.bind(0);
+    source.setMinFilter(GL_NEAREST);
+    source.setMagFilter(GL_NEAREST);
+
+    mDepthRangeProg->bind();
+    mDepthRangeProg->uniform("source", 0);
+    mDepthRangeProg->uniform("step", step);
+    mDepthRangeProg->uniform("from_depth", fromDepth);
+
+    static const float positionData[8] = { 0, 0, 1, 0, 1, 1, 0, 1 };
+    GLint position = mDepthRangeProg->getAttribLocation("position");
+    glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, &positionData[0]);
+    glEnableVertexAttribArray(position);
+    glDrawArrays(GL_QUADS, 0, 4);
+
+    mDepthRangeProg->unbind();
+    glDisableVertexAttribArray(position);
+    dest.unbindFramebuffer();
+}
+
+void VolumeMapperApp::uploadCpuResults(Led& led)
+{
+    int width = mCpuMapper.getWidth();
+    int height = mCpuMapper.getHeight();
+
+    gl::Fbo::Format format;
+    format.setColorInternalFormat(GL_R32F);
+
+    if (!led.mask) {
+        led.mask = gl::Fbo(width, height, format);
+    }
+    led.mask.getTexture().update(Channel32f(width, height, width * sizeof(float), 1, &led.cpu.mask[0]));
+
+    if (!led.cpu.filter.empty()) {
+        if (!led.filter) {
+            led.filter = gl::Fbo(width, height, format);
+        }
+        led.filter.getTexture().update(Channel32f(width, height, width * sizeof(float), 1, &led.cpu.filter[0]));
+    }
+
+    // The grid is uploaded when drawn
+    mCpuGridAtlasLed = -1;
+}
+
 void VolumeMapperApp::mouseDown(MouseEvent event)
 {
     mMayaCam.mouseDown(event.getPos());
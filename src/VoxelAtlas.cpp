@@ -0,0 +1,77 @@
+#include "VoxelAtlas.h"
+#include "cinder/Channel.h"
+
+using namespace std;
+using namespace ci;
+
+
+bool VoxelAtlas::resize(int x, int y, int z)
+{
+    if (mFbo && x == mSizeX && y == mSizeY && z == mSizeZ) {
+        return false;
+    }
+
+    mSizeX = x;
+    mSizeY = y;
+    mSizeZ = z;
+
+    gl::Fbo::Format format;
+    format.setColorInternalFormat(GL_R32F);
+    format.enableDepthBuffer(false);
+    mFbo = gl::Fbo(x, y * z, format);
+
+    clear();
+    return true;
+}
+
+void VoxelAtlas::clear()
+{
+    if (!mFbo) {
+        return;
+    }
+    bindAll();
+    gl::clear();
+    unbind();
+}
+
+void VoxelAtlas::bindAll()
+{
+    mFbo.bindFramebuffer();
+    gl::setViewport(mFbo.getBounds());
+    gl::setMatricesWindow(mFbo.getSize());
+}
+
+void VoxelAtlas::unbind()
+{
+    mFbo.unbindFramebuffer();
+}
+
+void VoxelAtlas::upload(const VoxelVolume& volume)
+{
+    resize(volume.getSizeX(), volume.getSizeY(), volume.getSizeZ());
+    if (volume.empty()) {
+        return;
+    }
+
+    Channel32f channel(mSizeX, mSizeY * mSizeZ, mSizeX * sizeof(float), 1, const_cast<float*>(volume.getData()));
+    mFbo.getTexture().update(channel);
+}
+
+void VoxelAtlas::download(VoxelVolume& volume)
+{
+    volume.resize(mSizeX, mSizeY, mSizeZ);
+    if (!mFbo || volume.empty()) {
+        return;
+    }
+
+    mFbo.bindFramebuffer();
+    glReadPixels(0, 0, mSizeX, mSizeY * mSizeZ, GL_RED, GL_FLOAT, volume.getData());
+    mFbo.unbindFramebuffer();
+}
+
+int VoxelAtlas::getMaxSizeZ(int y)
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    return max(1, int(maxSize) / max(1, y));
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "cinder/gl/gl.h"
+#include "cinder/gl/Fbo.h"
+#include "VoxelVolume.h"
+
+// GPU voxel volume, stored as a single R32F framebuffer with all Z slices
+// stacked vertically. Slice z occupies rows [z * sizeY, (z+1) * sizeY).
+
+class VoxelAtlas
+{
+public:
+    VoxelAtlas() : mSizeX(0), mSizeY(0), mSizeZ(0) {}
+
+    // Reallocates and clears if the size changed. Returns true if it did.
+    bool resize(int x, int y, int z);
+    void clear();
+
+    // Bind the framebuffer with a viewport covering the whole atlas
+    void bindAll();
+    void unbind();
+
+    // Single-transfer copies to and from a CPU volume of the same size
+    void upload(const VoxelVolume& volume);
+    void download(VoxelVolume& volume);
+
+    ci::gl::Texture& getTexture() { return mFbo.getTexture(); }
+
+    int getSizeX() const { return mSizeX; }
+    int getSizeY() const { return mSizeY; }
+    int getSizeZ() const { return mSizeZ; }
+
+    // Largest Z size that fits in one texture at the given Y size
+    static int getMaxSizeZ(int y);
+
+    operator bool() const { return mFbo; }
+
+private:
+    ci::gl::Fbo mFbo;
+    int mSizeX, mSizeY, mSizeZ;
+};
@@ -0,0 +1,316 @@
+#include "VoxelMapFile.h"
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace VoxelMapFile {
+
+static uint64_t alignUp(uint64_t offset)
+{
+    return (offset + kAlignment - 1) & ~uint64_t(kAlignment - 1);
+}
+
+
+Writer::Writer()
+    : mFile(0), mOffset(0), mFailed(false), mFormat(PackedVolume::FORMAT_FLOAT), mMaxError(0)
+{}
+
+Writer::~Writer()
+{
+    close();
+}
+
+bool Writer::open(const string& path, uint32_t ledCount, const Metadata& metadata, PackedVolume::Format format)
+{
+    close();
+
+    mFile = fopen(path.c_str(), "wb");
+    if (!mFile) {
+        return false;
+    }
+    mOffset = 0;
+    mFailed = false;
+    mFormat = format;
+    mMaxError = 0;
+
+    memset(&mHeader, 0, sizeof mHeader);
+    memcpy(mHeader.magic, kMagic, sizeof mHeader.magic);
+    mHeader.version = kVersion;
+    mHeader.alignment = kAlignment;
+    mHeader.brickSize = BrickVolume::kBrickSize;
+    mHeader.ledCount = ledCount;
+    mHeader.zLimit = metadata.zLimit;
+    memcpy(mHeader.fusedMin, metadata.fusedMin, sizeof mHeader.fusedMin);
+    memcpy(mHeader.fusedMax, metadata.fusedMax, sizeof mHeader.fusedMax);
+
+    // Header and table are written again once the table is filled in; an
+    // unfinished file has a zero magic and is never mistaken for a map.
+    FileHeader blank;
+    memset(&blank, 0, sizeof blank);
+    writePadded(&blank, sizeof blank);
+
+    mLeds.assign(ledCount, LedEntry());
+    mHeader.ledTableOffset = mOffset;
+    writePadded(mLeds.empty() ? 0 : &mLeds[0], mLeds.size() * sizeof(LedEntry));
+    return !mFailed;
+}
+
+void Writer::writePadded(const void* data, size_t size)
+{
+    static const uint8_t zeroes[kAlignment] = { 0 };
+    uint64_t padded = alignUp(size);
+
+    if ((size && fwrite(data, 1, size, mFile) != size) ||
+        (padded > size && fwrite(zeroes, 1, padded - size, mFile) != padded - size)) {
+        mFailed = true;
+    }
+    mOffset += padded;
+}
+
+VolumeEntry Writer::writeVolume(const BrickVolume& volume)
+{
+    VolumeEntry entry;
+    memset(&entry, 0, sizeof entry);
+    entry.sizeX = volume.getSizeX();
+    entry.sizeY = volume.getSizeY();
+    entry.sizeZ = volume.getSizeZ();
+    entry.brickCount = volume.getNumBricks();
+
+    size_t count = volume.getNumBricks() * BrickVolume::kBrickVoxels;
+    PackedVolume::Quantization q = PackedVolume::quantize(volume.getVoxels(), count, mFormat);
+    entry.format = q.format;
+    entry.scale = q.scale;
+    entry.offset = q.offset;
+
+    // Encoded voxels can't be used in place, so their pages would only be
+    // rebuilt on load anyway
+    if (mFormat == PackedVolume::FORMAT_FLOAT) {
+        entry.pagesOffset = mOffset;
+        writePadded(volume.getPages(), volume.getNumPages() * sizeof(int32_t));
+    }
+    entry.bricksOffset = mOffset;
+    writePadded(volume.getBricks(), volume.getNumBricks() * sizeof(uint32_t));
+
+    entry.voxelsOffset = mOffset;
+    if (mFormat == PackedVolume::FORMAT_FLOAT) {
+        entry.voxelsSize = count * sizeof(float);
+        writePadded(volume.getVoxels(), entry.voxelsSize);
+    } else {
+        mEncoded.clear();
+        mMaxError = max(mMaxError, PackedVolume::encode(volume.getVoxels(), count, q, mEncoded));
+        entry.voxelsSize = mEncoded.size();
+        writePadded(mEncoded.empty() ? 0 : &mEncoded[0], mEncoded.size());
+    }
+    return entry;
+}
+
+void Writer::writeLed(uint32_t led, const BrickVolume& grid, const BrickVolume& fused)
+{
+    if (!mFile || led >= mLeds.size()) {
+        return;
+    }
+    mLeds[led].grid = writeVolume(grid);
+    mLeds[led].fused = writeVolume(fused);
+}
+
+bool Writer::close()
+{
+    if (!mFile) {
+        return false;
+    }
+
+    // LEDs never written keep zero offsets, which is harmless for empty volumes
+    if (fseek(mFile, long(mHeader.ledTableOffset), SEEK_SET) ||
+        (!mLeds.empty() && fwrite(&mLeds[0], sizeof(LedEntry), mLeds.size(), mFile) != mLeds.size())) {
+        mFailed = true;
+    }
+
+    // Header last, so a file that failed part way never looks valid
+    if (!mFailed) {
+        if (fflush(mFile) || fseek(mFile, 0, SEEK_SET) || fwrite(&mHeader, sizeof mHeader, 1, mFile) != 1) {
+            mFailed = true;
+        }
+    }
+    if (fclose(mFile)) {
+        mFailed = true;
+    }
+    mFile = 0;
+    mLeds.clear();
+    return !mFailed;
+}
+
+
+Reader::Reader()
+    : mFd(-1), mData(0), mSize(0), mLeds(0)
+{}
+
+Reader::~Reader()
+{
+    close();
+}
+
+bool Reader::open(const string& path)
+{
+    close();
+
+    mFd = ::open(path.c_str(), O_RDONLY);
+    if (mFd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(mFd, &st) < 0 || st.st_size < off_t(sizeof(FileHeader))) {
+        close();
+        return false;
+    }
+
+    mSize = st.st_size;
+    void *map = mmap(0, mSize, PROT_READ, MAP_SHARED, mFd, 0);
+    if (map == MAP_FAILED) {
+        mSize = 0;
+        close();
+        return false;
+    }
+    mData = (const uint8_t*)map;
+
+    const FileHeader &header = getHeader();
+    bool v1 = header.version == kVersion1;
+    size_t entrySize = v1 ? sizeof(LedEntryV1) : sizeof(LedEntry);
+    if (memcmp(header.magic, kMagic, sizeof header.magic) || (header.version != kVersion && !v1) ||
+        header.alignment != kAlignment || header.brickSize != uint32_t(BrickVolume::kBrickSize) ||
+        header.ledTableOffset % kAlignment ||
+        !inBounds(header.ledTableOffset, uint64_t(header.ledCount) * entrySize)) {
+        close();
+        return false;
+    }
+
+    if (v1) {
+        const LedEntryV1 *leds = (const LedEntryV1*)(mData + header.ledTableOffset);
+        mConverted.resize(header.ledCount);
+        for (uint32_t i = 0; i < header.ledCount; i++) {
+            mConverted[i].grid = convert(leds[i].grid);
+            mConverted[i].fused = convert(leds[i].fused);
+        }
+        mLeds = mConverted.empty() ? 0 : &mConverted[0];
+    } else {
+        mLeds = (const LedEntry*)(mData + header.ledTableOffset);
+    }
+    return true;
+}
+
+VolumeEntry Reader::convert(const VolumeEntryV1& entry)
+{
+    VolumeEntry converted;
+    memset(&converted, 0, sizeof converted);
+    converted.sizeX = entry.sizeX;
+    converted.sizeY = entry.sizeY;
+    converted.sizeZ = entry.sizeZ;
+    converted.brickCount = entry.brickCount;
+    converted.format = PackedVolume::FORMAT_FLOAT;
+    converted.scale = 1.0f;
+    converted.pagesOffset = entry.pagesOffset;
+    converted.bricksOffset = entry.bricksOffset;
+    converted.voxelsOffset = entry.voxelsOffset;
+    converted.voxelsSize = uint64_t(entry.brickCount) * BrickVolume::kBrickVoxels * sizeof(float);
+    return converted;
+}
+
+void Reader::close()
+{
+    if (mData) {
+        munmap((void*)mData, mSize);
+    }
+    if (mFd >= 0) {
+        ::close(mFd);
+    }
+    mFd = -1;
+    mData = 0;
+    mSize = 0;
+    mLeds = 0;
+    mConverted.clear();
+}
+
+bool Reader::inBounds(uint64_t offset, uint64_t size) const
+{
+    return offset <= mSize && size <= mSize - offset;
+}
+
+bool Reader::getNumPages(const VolumeEntry& entry, size_t& pages)
+{
+    pages = 0;
+    if (entry.sizeX < 0 || entry.sizeY < 0 || entry.sizeZ < 0 ||
+        entry.sizeX > kMaxSize || entry.sizeY > kMaxSize || entry.sizeZ > kMaxSize) {
+        return false;
+    }
+    const uint64_t n = BrickVolume::kBrickSize;
+    uint64_t count = (uint64_t(entry.sizeX) + n - 1) / n * ((uint64_t(entry.sizeY) + n - 1) / n) *
+        ((uint64_t(entry.sizeZ) + n - 1) / n);
+    if (count > SIZE_MAX / sizeof(int32_t)) {
+        return false;
+    }
+    pages = size_t(count);
+    return true;
+}
+
+const int32_t* Reader::getPages(const VolumeEntry& entry) const
+{
+    size_t pages;
+    if (entry.format != PackedVolume::FORMAT_FLOAT || !getNumPages(entry, pages)) {
+        return 0;
+    }
+    size_t bytes = pages * sizeof(int32_t);
+    return inBounds(entry.pagesOffset, bytes) ? (const int32_t*)(mData + entry.pagesOffset) : 0;
+}
+
+const uint32_t* Reader::getBricks(const VolumeEntry& entry) const
+{
+    size_t bytes = size_t(entry.brickCount) * sizeof(uint32_t);
+    return inBounds(entry.bricksOffset, bytes) ? (const uint32_t*)(mData + entry.bricksOffset) : 0;
+}
+
+const uint8_t* Reader::getVoxelData(const VolumeEntry& entry) const
+{
+    return inBounds(entry.voxelsOffset, entry.voxelsSize) ? mData + entry.voxelsOffset : 0;
+}
+
+const float* Reader::getVoxels(const VolumeEntry& entry) const
+{
+    size_t bytes = size_t(entry.brickCount) * BrickVolume::kBrickVoxels * sizeof(float);
+    if (entry.format != PackedVolume::FORMAT_FLOAT || entry.voxelsSize != bytes) {
+        return 0;
+    }
+    return (const float*)getVoxelData(entry);
+}
+
+bool Reader::load(const VolumeEntry& entry, BrickVolume& volume) const
+{
+    const uint32_t *bricks = getBricks(entry);
+    const uint8_t *data = getVoxelData(entry);
+
+    // Pages are rebuilt from the bricks, which is cheaper than checking them.
+    // Sizes are checked first, since that allocates the page table.
+    size_t pages;
+    if (!bricks || !data || !getNumPages(entry, pages) || entry.brickCount > pages) {
+        volume.resize(0, 0, 0);
+        return false;
+    }
+
+    PackedVolume::Quantization q;
+    q.format = entry.format;
+    q.scale = entry.scale;
+    q.offset = entry.offset;
+    if (!volume.assign(entry.sizeX, entry.sizeY, entry.sizeZ, bricks, entry.brickCount) ||
+        !PackedVolume::decode(data, entry.voxelsSize, q, volume.getVoxels(),
+            size_t(entry.brickCount) * BrickVolume::kBrickVoxels)) {
+        volume.clear();
+        return false;
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "BrickVolume.h"
+#include "PackedVolume.h"
+
+// Voxel map files hold the volumes learned for every LED:
+//
+//   FileHeader
+//   LedEntry[ledCount]
+//   { pages, bricks, voxels } for each stored volume
+//
+// Offsets are from the start of the file and every payload starts on a
+// kAlignment boundary, so a reader can map the file and use any LED's
+// volume in place, without reading the others. Pages and bricks are in
+// BrickVolume's own layout. Voxels are raw floats, or quantized and
+// run-length coded as in PackedVolume.
+//
+// Version 1 files have only raw float volumes, with a shorter VolumeEntry
+// that has no format, quantization or size. They're read by converting
+// their LED table on open; the payloads are laid out the same.
+
+namespace VoxelMapFile {
+
+    static const char       kMagic[8] = { 'V', 'M', 'V', 'M', 'A', 'P', '0', '1' };
+    static const uint32_t   kVersion = 2;
+    static const uint32_t   kVersion1 = 1;
+    static const uint32_t   kAlignment = 64;
+
+    // Largest volume size on any axis a reader accepts. The app's grids are
+    // at most 640 x 480 x 1024, so anything bigger is a damaged entry, and
+    // its page table would be allocated before any brick is checked.
+    static const int32_t    kMaxSize = 1024;
+
+    struct FileHeader {
+        char        magic[8];
+        uint32_t    version;
+        uint32_t    alignment;
+        uint32_t    brickSize;      // BrickVolume::kBrickSize
+        uint32_t    ledCount;
+        uint64_t    ledTableOffset;
+        float       zLimit;         // Depth covered by the per-LED grids, normalized
+        float       fusedMin[3];    // World-space box covered by the fused grids, in mm
+        float       fusedMax[3];
+        uint32_t    reserved;
+    };
+
+    struct VolumeEntry {
+        int32_t     sizeX, sizeY, sizeZ;
+        uint32_t    brickCount;
+        uint32_t    format;         // PackedVolume::Format
+        float       scale;          // Quantization, for the integer formats
+        float       offset;
+        uint32_t    reserved;
+        uint64_t    pagesOffset;    // int32_t brick slot per brick position, or -1; floats only
+        uint64_t    bricksOffset;   // uint32_t brick position per slot
+        uint64_t    voxelsOffset;   // BrickVolume::kBrickVoxels voxels per slot
+        uint64_t    voxelsSize;     // In bytes, as stored
+    };
+
+    struct LedEntry {
+        VolumeEntry grid;           // In the camera's image space, as CpuMapper builds it
+        VolumeEntry fused;          // World space, from every sensor
+    };
+
+    struct VolumeEntryV1 {
+        int32_t     sizeX, sizeY, sizeZ;
+        uint32_t    brickCount;
+        uint64_t    pagesOffset;
+        uint64_t    bricksOffset;
+        uint64_t    voxelsOffset;   // Always floats
+    };
+
+    struct LedEntryV1 {
+        VolumeEntryV1 grid;
+        VolumeEntryV1 fused;
+    };
+
+    struct Metadata {
+        float       zLimit;
+        float       fusedMin[3];
+        float       fusedMax[3];
+    };
+
+    // Streams volumes to a new file. LEDs may be written in any order; any
+    // not written are stored empty.
+    class Writer {
+    public:
+        Writer();
+        ~Writer();
+
+        bool open(const std::string& path, uint32_t ledCount, const Metadata& metadata,
+            PackedVolume::Format format = PackedVolume::FORMAT_FLOAT);
+        void writeLed(uint32_t led, const BrickVolume& grid, const BrickVolume& fused);
+
+        // Largest quantization error of any voxel written so far
+        float getMaxError() const { return mMaxError; }
+
+        // Writes the LED table and header. Returns false if any write failed,
+        // in which case the file is not valid.
+        bool close();
+
+    private:
+        FILE                    *mFile;
+        uint64_t                mOffset;
+        bool                    mFailed;
+        PackedVolume::Format    mFormat;
+        float                   mMaxError;
+        FileHeader              mHeader;
+        std::vector<LedEntry>   mLeds;
+        std::vector<uint8_t>    mEncoded;
+
+        VolumeEntry writeVolume(const BrickVolume& volume);
+        void writePadded(const void* data, size_t size);
+    };
+
+    // Read-only memory mapped view of a voxel map file
+    class Reader {
+    public:
+        Reader();
+        ~Reader();
+
+        // Checks the header and LED table only
+        bool open(const std::string& path);
+        void close();
+        bool isOpen() const { return mData != 0; }
+
+        const FileHeader& getHeader() const { return *(const FileHeader*)mData; }
+        uint32_t getLedCount() const { return getHeader().ledCount; }
+        const LedEntry& getLed(uint32_t led) const { return mLeds[led]; }
+
+        // In place, within the mapping. Null if the entry is out of bounds.
+        // Pages and floats are only stored for volumes in FORMAT_FLOAT.
+        const int32_t* getPages(const VolumeEntry& entry) const;
+        const uint32_t* getBricks(const VolumeEntry& entry) const;
+        const uint8_t* getVoxelData(const VolumeEntry& entry) const;
+        const float* getVoxels(const VolumeEntry& entry) const;
+
+        // Copies and decodes one volume. Returns false, leaving it empty, if
+        // the entry is damaged.
+        bool load(const VolumeEntry& entry, BrickVolume& volume) const;
+
+    private:
+        int             mFd;
+        const uint8_t   *mData;
+        size_t          mSize;
+        const LedEntry  *mLeds;
+        std::vector<LedEntry> mConverted;   // Table of a version 1 file
+
+        static bool getNumPages(const VolumeEntry& entry, size_t& pages);
+        static VolumeEntry convert(const VolumeEntryV1& entry);
+        bool inBounds(uint64_t offset, uint64_t size) const;
+    };
+
+}
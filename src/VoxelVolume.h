@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+// Dense float volume in one contiguous allocation. Slices are stored one
+// after another along Z, each slice row-major in X then Y. This matches the
+// layout of VoxelAtlas, so the two can be copied with a single transfer.
+
+class VoxelVolume
+{
+public:
+    VoxelVolume() : mSizeX(0), mSizeY(0), mSizeZ(0) {}
+
+    // Changing the size discards all voxels. Returns true if the size changed.
+    bool resize(int x, int y, int z)
+    {
+        if (x == mSizeX && y == mSizeY && z == mSizeZ) {
+            return false;
+        }
+        mSizeX = x;
+        mSizeY = y;
+        mSizeZ = z;
+        mData.assign(size_t(x) * y * z, 0.0f);
+        return true;
+    }
+
+    void clear() { std::fill(mData.begin(), mData.end(), 0.0f); }
+    bool empty() const { return mData.empty(); }
+
+    int getSizeX() const { return mSizeX; }
+    int getSizeY() const { return mSizeY; }
+    int getSizeZ() const { return mSizeZ; }
+    size_t getSliceSize() const { return size_t(mSizeX) * mSizeY; }
+    size_t getNumVoxels() const { return mData.size(); }
+
+    float* getData() { return mData.empty() ? 0 : &mData[0]; }
+    const float* getData() const { return mData.empty() ? 0 : &mData[0]; }
+
+    float* getSlice(int z) { return getData() + z * getSliceSize(); }
+    const float* getSlice(int z) const { return getData() + z * getSliceSize(); }
+
+    float& at(int x, int y, int z) { return mData[z * getSliceSize() + size_t(y) * mSizeX + x]; }
+    float at(int x, int y, int z) const { return mData[z * getSliceSize() + size_t(y) * mSizeX + x]; }
+
+private:
+    int mSizeX, mSizeY, mSizeZ;
+    std::vector<float> mData;
+};
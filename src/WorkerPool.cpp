@@ -0,0 +1,92 @@
+#include "WorkerPool.h"
+#include <algorithm>
+
+using namespace std;
+
+
+WorkerPool::WorkerPool()
+    : mTask(0), mCount(0), mNext(0), mPending(0), mBatch(0), mStopping(false)
+{}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void WorkerPool::setup(unsigned numThreads)
+{
+    numThreads = max(1u, numThreads);
+    if (numThreads == getNumThreads()) {
+        return;
+    }
+
+    stop();
+    mStopping = false;
+    for (unsigned i = 1; i < numThreads; i++) {
+        mThreads.push_back(thread(&WorkerPool::workerLoop, this));
+    }
+}
+
+void WorkerPool::stop()
+{
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mStart.notify_all();
+    for (unsigned i = 0; i < mThreads.size(); i++) {
+        mThreads[i].join();
+    }
+    mThreads.clear();
+}
+
+void WorkerPool::run(unsigned count, const function<void(unsigned)>& fn)
+{
+    if (count <= 1 || mThreads.empty()) {
+        for (unsigned i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    unique_lock<mutex> lock(mMutex);
+    mTask = &fn;
+    mCount = count;
+    mNext = 0;
+    mPending = count;
+    mBatch++;
+    mStart.notify_all();
+
+    // The caller takes its share, then waits for the stragglers
+    work(lock);
+    mDone.wait(lock, [this]() { return mPending == 0; });
+    mTask = 0;
+}
+
+void WorkerPool::work(unique_lock<mutex>& lock)
+{
+    while (mNext < mCount) {
+        unsigned i = mNext++;
+        const function<void(unsigned)>& fn = *mTask;
+        lock.unlock();
+        fn(i);
+        lock.lock();
+        if (--mPending == 0) {
+            mDone.notify_all();
+        }
+    }
+}
+
+void WorkerPool::workerLoop()
+{
+    uint64_t seen = 0;
+    unique_lock<mutex> lock(mMutex);
+    for (;;) {
+        mStart.wait(lock, [&]() { return mStopping || mBatch != seen; });
+        if (mStopping) {
+            return;
+        }
+        seen = mBatch;
+        work(lock);
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that stay up between calls, for splitting one image operation
+// into bands. Starting threads for every pass costs more than some of the
+// passes themselves.
+
+class WorkerPool
+{
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    // Total threads, counting the caller's. Restarts the workers if it changes.
+    void setup(unsigned numThreads);
+    unsigned getNumThreads() const { return unsigned(mThreads.size()) + 1; }
+
+    // Calls fn(i) for each i in [0, count), spread over the workers and the
+    // calling thread, and returns once all calls are done. Not reentrant.
+    void run(unsigned count, const std::function<void(unsigned)>& fn);
+
+private:
+    std::vector<std::thread>    mThreads;
+    std::mutex                  mMutex;
+    std::condition_variable     mStart;
+    std::condition_variable     mDone;
+
+    // The current batch, guarded by mMutex
+    const std::function<void(unsigned)> *mTask;
+    unsigned                    mCount;
+    unsigned                    mNext;      // Next index to hand out
+    unsigned                    mPending;   // Calls not yet finished
+    uint64_t                    mBatch;     // Counts batches, so workers can tell a new one
+    bool                        mStopping;
+
+    void workerLoop();
+    void work(std::unique_lock<std::mutex>& lock);
+    void stop();
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+};
@@ -0,0 +1,391 @@
+// Checks CpuMapper against direct, per-pixel versions of the shader math
+// in depthMask.glslf, filter.glslf / boxFilter.glslf and slice.glslv, and
+// reports how fast a whole LED goes through it at 640x480. Also checks
+// that importing a dense grid leaves voxels under the threshold empty, that
+// grids binned on one thread and applied on another come out the same, and
+// that fused bins average the pixels in each voxel, even in a world grid
+// far too big to hold densely.
+
+#include "CpuMapper.h"
+#include "FusedGrid.h"
+#include "TestCheck.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+static const int kWidth = 640;
+static const int kHeight = 480;
+
+struct Scene {
+    vector<uint16_t> depth, background;
+    vector<vector<uint8_t> > frames;
+    vector<const uint8_t*> framePointers;
+};
+
+// A wall with a few boxes in front of it, some missing depth, and an LED
+// lighting a patch of the boxes in the first frame
+static void makeScene(Scene& scene, int numFrames, int channels, unsigned seed)
+{
+    srand(seed);
+    scene.background.assign(kWidth * kHeight, 0);
+    scene.depth.assign(kWidth * kHeight, 0);
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            uint16_t wall = uint16_t(9000 + (x + y) % 50);
+            uint16_t d = wall;
+            if ((x / 80 + y / 60) % 3 == 0) {
+                d = uint16_t(4000 + (x * 7 + y * 3) % 200);
+            }
+            if (rand() % 200 == 0) {
+                d = 0;
+            }
+            scene.background[y * kWidth + x] = wall;
+            scene.depth[y * kWidth + x] = d;
+        }
+    }
+
+    scene.frames.resize(numFrames);
+    scene.framePointers.clear();
+    for (int i = 0; i < numFrames; i++) {
+        vector<uint8_t>& frame = scene.frames[i];
+        frame.resize(kWidth * kHeight * channels);
+        for (int y = 0; y < kHeight; y++) {
+            for (int x = 0; x < kWidth; x++) {
+                bool lit = i == 0 && x > 200 && x < 400 && y > 100 && y < 300;
+                for (int c = 0; c < channels; c++) {
+                    int v = 40 + rand() % 8 + (lit ? 120 + c * 20 : 0);
+                    frame[(y * kWidth + x) * channels + c] = uint8_t(min(v, 255));
+                }
+            }
+        }
+        scene.framePointers.push_back(&frame[0]);
+    }
+}
+
+static int clampi(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void referenceMask(const Scene& scene, int radius, float bias, float maxSpread, vector<float>& mask)
+{
+    mask.assign(kWidth * kHeight, 0.0f);
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            uint16_t hi = 0, lo = 0xffff;
+            for (int dy = -radius; dy <= radius; dy++) {
+                for (int dx = -radius; dx <= radius; dx++) {
+                    uint16_t d = scene.depth[clampi(y + dy, 0, kHeight - 1) * kWidth + clampi(x + dx, 0, kWidth - 1)];
+                    hi = max(hi, d);
+                    lo = min(lo, d);
+                }
+            }
+            float threshold = scene.background[y * kWidth + x] / 65535.0f - bias;
+            float fhi = hi / 65535.0f;
+            float flo = lo / 65535.0f;
+            bool valid = threshold > 0.0f && fhi <= threshold && flo >= 1e-4f &&
+                (maxSpread <= 0.0f || fhi - flo <= maxSpread);
+            mask[y * kWidth + x] = valid ? scene.depth[y * kWidth + x] / 65535.0f : 0.0f;
+        }
+    }
+}
+
+static int median3(int a, int b, int c)
+{
+    int v[3] = { a, b, c };
+    sort(v, v + 3);
+    return v[1];
+}
+
+static void referenceFilter(const Scene& scene, int radius, int channels, vector<float>& filter)
+{
+    size_t numFrames = scene.framePointers.size();
+    vector<int> diff(kWidth * kHeight, 0);
+    for (size_t i = 0; i + 1 < numFrames; i++) {
+        const uint8_t *a = scene.framePointers[i];
+        const uint8_t *b = scene.framePointers[i + 1];
+        for (int p = 0; p < kWidth * kHeight; p++) {
+            if (channels == 1) {
+                diff[p] += int(a[p]) - int(b[p]);
+            } else {
+                diff[p] += median3(int(a[p*3]) - int(b[p*3]), int(a[p*3+1]) - int(b[p*3+1]),
+                    int(a[p*3+2]) - int(b[p*3+2]));
+            }
+        }
+    }
+
+    filter.assign(kWidth * kHeight, 0.0f);
+    const float scale = 1.0f / (255.0f * numFrames);
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            int sum = 0;
+            for (int dy = -radius; dy <= radius; dy++) {
+                for (int dx = -radius; dx <= radius; dx++) {
+                    sum += diff[clampi(y + dy, 0, kHeight - 1) * kWidth + clampi(x + dx, 0, kWidth - 1)];
+                }
+            }
+            filter[y * kWidth + x] = sum * scale;
+        }
+    }
+}
+
+// One pass per slice, as updateGrid used to draw them
+static float referenceVoxel(const CpuMapper::Led& led, int gx, int gy, int gz,
+    int gridX, int gridY, int gridZ, float zLimit)
+{
+    const float kFilterOffset = 0.01f;
+    float u = (gx + 0.5f) / gridX;
+    float v = (gy + 0.5f) / gridY;
+    float z = led.mask[min(int(v * kHeight), kHeight - 1) * kWidth + min(int(u * kWidth), kWidth - 1)];
+
+    float zStep = zLimit / float(max(1, gridZ - 1));
+    if (!(z > 1e-3f + gz * zStep && z <= 1e-3f + (gz + 1) * zStep)) {
+        return 0.0f;
+    }
+
+    float fx = min(max((u + kFilterOffset) * kWidth - 0.5f, 0.0f), float(kWidth - 1));
+    float fy = min(max((v + kFilterOffset) * kHeight - 0.5f, 0.0f), float(kHeight - 1));
+    int x0 = int(fx), y0 = int(fy);
+    int x1 = min(x0 + 1, kWidth - 1), y1 = min(y0 + 1, kHeight - 1);
+    float tx = fx - x0, ty = fy - y0;
+    const float *f0 = &led.filter[y0 * kWidth];
+    const float *f1 = &led.filter[y1 * kWidth];
+    return (f0[x0] * (1.0f - tx) + f0[x1] * tx) * (1.0f - ty) +
+        (f1[x0] * (1.0f - tx) + f1[x1] * tx) * ty;
+}
+
+static bool sameImage(const vector<float>& a, const vector<float>& b, float tolerance)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (fabsf(a[i] - b[i]) > tolerance) {
+            printf("  pixel %d,%d: %g vs %g\n", int(i % kWidth), int(i / kWidth), a[i], b[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testAgainstReference(int channels, unsigned threads)
+{
+    Scene scene;
+    makeScene(scene, 3, channels, 1234 + channels);
+
+    CpuMapper mapper;
+    mapper.setup(kWidth, kHeight, threads);
+
+    const int radius = 4;
+    const float bias = 0.005f;
+    CpuMapper::Led led;
+    vector<float> expected;
+
+    // Twice, so the second run goes through workers that already exist
+    for (int run = 0; run < 2; run++) {
+        mapper.updateDepthMask(led, &scene.depth[0], &scene.background[0], radius, bias, 0.001f);
+        referenceMask(scene, radius, bias, 0.001f, expected);
+        check(sameImage(led.mask, expected, 0.0f), "depth mask with max spread matches the reference");
+
+        mapper.updateDepthMask(led, &scene.depth[0], &scene.background[0], radius, bias, 0.0f);
+        referenceMask(scene, radius, bias, 0.0f, expected);
+        check(sameImage(led.mask, expected, 0.0f), "depth mask matches the reference");
+
+        mapper.updateFilter(led, scene.framePointers, 5, channels);
+        referenceFilter(scene, 5, channels, expected);
+        check(sameImage(led.filter, expected, 1e-6f), "filter matches the reference");
+    }
+
+    const int gridX = 64, gridY = 48, gridZ = 64;
+    const float zLimit = 0.067f;
+    mapper.updateGrid(led, gridX, gridY, gridZ, zLimit, 1.0f);
+
+    bool gridOk = true;
+    size_t lit = 0;
+    for (int z = 0; z < gridZ && gridOk; z++) {
+        for (int y = 0; y < gridY && gridOk; y++) {
+            for (int x = 0; x < gridX; x++) {
+                float want = referenceVoxel(led, x, y, z, gridX, gridY, gridZ, zLimit);
+                if (led.grid.get(x, y, z) != want) {
+                    printf("  voxel %d,%d,%d: %g vs %g\n", x, y, z, led.grid.get(x, y, z), want);
+                    gridOk = false;
+                    break;
+                }
+                lit += want != 0.0f;
+            }
+        }
+    }
+    check(gridOk, "grid matches one pass per slice");
+    check(lit > 0, "grid has lit voxels");
+
+    // Binning then applying separately is the same as updateGrid
+    CpuMapper::Led split;
+    split.mask = led.mask;
+    split.filter = led.filter;
+    CpuMapper::GridBins bins;
+    check(mapper.binGrid(split, gridX, gridY, gridZ, zLimit, bins), "binGrid bins");
+    CpuMapper::applyGrid(split.grid, bins, 1.0f);
+    bool same = split.grid.getNumBricks() == led.grid.getNumBricks();
+    for (int z = 0; z < gridZ && same; z++) {
+        for (int y = 0; y < gridY && same; y++) {
+            for (int x = 0; x < gridX && same; x++) {
+                same = split.grid.get(x, y, z) == led.grid.get(x, y, z);
+            }
+        }
+    }
+    check(same, "binGrid and applyGrid match updateGrid");
+
+    // Same for the fused grid, blended twice so partial alpha is covered,
+    // with a camera moved off the world origin
+    const float boundsMin[3] = { -3000, -3000, 3000 }, boundsMax[3] = { 3000, 3000, 5000 };
+    float transform[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  100, -50, 200, 1 };
+    FusedGrid fused;
+    fused.setup(boundsMin, boundsMax, gridX, gridY, gridZ);
+    BrickVolume whole, halves;
+    FusedGrid::Bins fusedBins;
+    for (int pass = 0; pass < 2; pass++) {
+        fused.accumulate(whole, &led.mask[0], &led.filter[0], kWidth, kHeight, transform, 0.5f);
+        check(fused.bin(&led.mask[0], &led.filter[0], kWidth, kHeight, transform, fusedBins), "fused grid bins");
+        FusedGrid::apply(halves, fusedBins, 0.5f);
+    }
+    same = whole.getNumBricks() > 0 && halves.getNumBricks() == whole.getNumBricks();
+    for (int z = 0; z < gridZ && same; z++) {
+        for (int y = 0; y < gridY && same; y++) {
+            for (int x = 0; x < gridX && same; x++) {
+                same = halves.get(x, y, z) == whole.get(x, y, z);
+            }
+        }
+    }
+    check(same, "FusedGrid bin and apply match accumulate");
+}
+
+static void testImportThreshold()
+{
+    // Faint noise everywhere, as a GPU grid accumulates, and one real voxel
+    VoxelVolume dense;
+    dense.resize(32, 32, 32);
+    for (int z = 0; z < 32; z++) {
+        for (int y = 0; y < 32; y++) {
+            for (int x = 0; x < 32; x++) {
+                dense.at(x, y, z) = ((x + y + z) & 1) ? 0.0005f : -0.0005f;
+            }
+        }
+    }
+    dense.at(9, 20, 3) = 0.5f;
+
+    BrickVolume bricks;
+    bricks.importDense(dense);
+    check(bricks.getNumBricks() == 64, "without a threshold, noise fills every brick");
+
+    bricks.importDense(dense, 0.001f);
+    check(bricks.getNumBricks() == 1, "noise under the threshold stays empty");
+    check(bricks.get(9, 20, 3) == 0.5f, "voxels over the threshold are kept");
+    check(bricks.get(8, 20, 3) == 0.0f, "voxels under the threshold read as zero");
+}
+
+static void testExportSlices()
+{
+    // Taller than it is wide, with bricks straddling every piece boundary
+    BrickVolume bricks;
+    bricks.resize(20, 12, 200);
+    for (int i = 0; i < 300; i++) {
+        bricks.at(i * 7 % 20, i * 5 % 12, i * 13 % 200) = 1.0f + i;
+    }
+
+    VoxelVolume whole, piece;
+    bricks.exportDense(whole);
+    bool same = whole.getSizeZ() == 200;
+    const int kPiece = 27;
+    for (int z0 = 0; z0 < 200 && same; z0 += kPiece) {
+        int z1 = min(z0 + kPiece, 200);
+        bricks.exportDense(piece, z0, z1);
+        same = piece.getSizeZ() == z1 - z0 &&
+            equal(piece.getData(), piece.getData() + piece.getNumVoxels(), whole.getSlice(z0));
+    }
+    check(same, "exporting in Z pieces matches the whole volume");
+}
+
+static void testFusedAverages(int gridX, int gridY, int gridZ, bool shared)
+{
+    const unsigned width = 64, height = 48;
+    const float boundsMin[3] = { -3000, -3000, 3000 }, boundsMax[3] = { 3000, 3000, 5000 };
+    const float transform[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1 };
+    srand(17);
+
+    vector<float> mask(width * height), values(width * height);
+    for (unsigned i = 0; i < mask.size(); i++) {
+        mask[i] = rand() % 10 ? (4000 + (i * 37) % 300) / 65535.0f : 0.0f;
+        values[i] = (rand() % 1000) / 1000.0f;
+    }
+
+    FusedGrid fused;
+    fused.setup(boundsMin, boundsMax, gridX, gridY, gridZ);
+
+    // Find each pixel's voxel by binning it alone, then average by hand
+    map<uint32_t, pair<double, int> > expected;
+    vector<float> single(width * height, 0.0f);
+    FusedGrid::Bins bins;
+    int binned = 0;
+    for (unsigned i = 0; i < mask.size(); i++) {
+        single[i] = mask[i];
+        if (fused.bin(&single[0], &values[0], width, height, transform, bins)) {
+            pair<double, int>& sum = expected[bins.voxels[0]];
+            sum.first += values[i];
+            sum.second++;
+            binned++;
+        }
+        single[i] = 0.0f;
+    }
+    check(binned > int(mask.size()) / 2, "most pixels land in the grid");
+    if (shared) {
+        check(expected.size() * 4 < size_t(binned), "pixels share voxels");
+    }
+
+    bool ok = fused.bin(&mask[0], &values[0], width, height, transform, bins) &&
+        bins.voxels.size() == expected.size() && bins.values.size() == expected.size();
+    for (size_t i = 0; i < bins.voxels.size() && ok; i++) {
+        auto it = expected.find(bins.voxels[i]);
+        ok = it != expected.end() && fabs(bins.values[i] - it->second.first / it->second.second) < 1e-5;
+    }
+    check(ok, "fused bins hold each voxel's mean value");
+}
+
+static void benchmark()
+{
+    Scene scene;
+    makeScene(scene, 3, 3, 99);
+
+    CpuMapper mapper;
+    mapper.setup(kWidth, kHeight);
+    CpuMapper::Led led;
+
+    const int iterations = 30;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        mapper.updateDepthMask(led, &scene.depth[0], &scene.background[0], 16, 0.005f, 0.0f);
+        mapper.updateFilter(led, scene.framePointers, 5, 3);
+        mapper.updateGrid(led, 64, 64, 64, 0.067f, 0.1f);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("CpuMapper: %.1f LEDs/sec at 640x480, 3 frames, 64 slices\n", iterations / seconds);
+}
+
+int main()
+{
+    testAgainstReference(3, 1);
+    testAgainstReference(3, 4);
+    testAgainstReference(1, 3);
+    testImportThreshold();
+    testExportSlices();
+    testFusedAverages(8, 8, 4, true);
+    testFusedAverages(640, 480, 1024, false);
+    benchmark();
+
+    return finish("CpuMapperTest");
+}
@@ -0,0 +1,219 @@
+// Checks freenect_demosaic, bands from freenect_demosaic_rows and the green
+// plane bit for bit against the byte-at-a-time convert_bayer_to_rgb it
+// replaced, on random frames of many sizes. Widths that aren't a multiple
+// of 16 leave a tail for the scalar loop after the SSSE3 one. Then times
+// whole 640x480 frames.
+
+extern "C" {
+#include "demosaic.h"
+#include "cpu.h"
+}
+#include "TestCheck.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+// The old convert_bayer_to_rgb from cameras.c, with the frame mode replaced
+// by its width and height. It reads past the frame when height is 2.
+static void referenceDemosaic(const uint8_t *raw_buf, uint8_t *proc_buf, int width, int height)
+{
+    int x, y;
+    uint8_t *dst = proc_buf;
+    const uint8_t *prevLine = 0;
+    const uint8_t *curLine = raw_buf;
+    const uint8_t *nextLine = curLine + width;
+    uint32_t hVals, vSums;
+
+    for (y = 0; y < height; ++y) {
+        if ((y > 0) && (y < height - 1))
+            prevLine = curLine - width;
+        else if (y == 0)
+            prevLine = nextLine;
+        else
+            nextLine = prevLine;
+
+        hVals  = (*(curLine++) << 8);
+        hVals |= (*curLine << 16);
+        vSums = ((*(prevLine++) + *(nextLine++)) << 7) & 0xFF00;
+        vSums |= ((*prevLine + *nextLine) << 15) & 0xFF0000;
+
+        uint8_t yOdd = y & 1;
+        for (x = 0; x < width - 1; ++x) {
+            hVals |= *(curLine++);
+            vSums |= (*(prevLine++) + *(nextLine++)) >> 1;
+
+            uint8_t hSum = ((uint8_t)(hVals >> 16) + (uint8_t)(hVals)) >> 1;
+
+            if (yOdd == 0) {
+                if ((x & 1) == 0) {
+                    *(dst++) = hSum;
+                    *(dst++) = hVals >> 8;
+                    *(dst++) = vSums >> 8;
+                } else {
+                    *(dst++) = hVals >> 8;
+                    *(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+                    *(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
+                }
+            } else {
+                if ((x & 1) == 0) {
+                    *(dst++) = ((uint8_t)(vSums >> 16) + (uint8_t)(vSums)) >> 1;
+                    *(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+                    *(dst++) = hVals >> 8;
+                } else {
+                    *(dst++) = vSums >> 8;
+                    *(dst++) = hVals >> 8;
+                    *(dst++) = hSum;
+                }
+            }
+            hVals <<= 8;
+            vSums <<= 8;
+        }
+        hVals |= (uint8_t)(hVals >> 16);
+        vSums |= (uint8_t)(vSums >> 16);
+        uint8_t hSum = (uint8_t)(hVals);
+
+        if (yOdd == 0) {
+            if ((x & 1) == 0) {
+                *(dst++) = hSum;
+                *(dst++) = hVals >> 8;
+                *(dst++) = vSums >> 8;
+            } else {
+                *(dst++) = hVals >> 8;
+                *(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+                *(dst++) = vSums;
+            }
+        } else {
+            if ((x & 1) == 0) {
+                *(dst++) = vSums;
+                *(dst++) = (hSum + (uint8_t)(vSums >> 8)) >> 1;
+                *(dst++) = hVals >> 8;
+            } else {
+                *(dst++) = vSums >> 8;
+                *(dst++) = hVals >> 8;
+                *(dst++) = hSum;
+            }
+        }
+    }
+}
+
+static void testSizes()
+{
+    const uint8_t kGuard = 0xA5;
+    srand(11);
+
+    vector<pair<int, int> > sizes;
+    for (int width = 2; width <= 70; width++) {
+        sizes.push_back(make_pair(width, 3 + width % 5));
+    }
+    sizes.push_back(make_pair(640, 480));
+    sizes.push_back(make_pair(1280, 1024));
+    sizes.push_back(make_pair(1400, 8));
+
+    for (size_t s = 0; s < sizes.size(); s++) {
+        int width = sizes[s].first;
+        int height = sizes[s].second;
+        size_t pixels = size_t(width) * height;
+
+        // Exactly the frame size, so a sanitizer catches reads past the end
+        vector<uint8_t> raw(pixels);
+        for (size_t i = 0; i < raw.size(); i++) {
+            raw[i] = uint8_t(rand());
+        }
+        vector<uint8_t> expected(pixels * 3);
+        referenceDemosaic(&raw[0], &expected[0], width, height);
+
+        // Guard bytes after the output catch writes past the end
+        vector<uint8_t> rgb(pixels * 3 + 64, kGuard);
+        freenect_demosaic(&raw[0], &rgb[0], width, height);
+        bool same = memcmp(&rgb[0], &expected[0], pixels * 3) == 0;
+        bool guarded = true;
+        for (size_t i = pixels * 3; i < rgb.size(); i++) {
+            guarded = guarded && rgb[i] == kGuard;
+        }
+        if (!same || !guarded) {
+            printf("  whole frame, %dx%d\n", width, height);
+        }
+        check(same, "demosaiced frame matches the reference");
+        check(guarded, "nothing written past the last pixel");
+
+        // Uneven bands, converted out of order, as threads might
+        for (int numBands = 2; numBands <= 5; numBands += 3) {
+            if (numBands > height) {
+                continue;
+            }
+            fill(rgb.begin(), rgb.end(), kGuard);
+            for (int band = numBands - 1; band >= 0; band--) {
+                freenect_demosaic_rows(&raw[0], &rgb[0], width, height,
+                    height * band / numBands, height * (band + 1) / numBands);
+            }
+            same = memcmp(&rgb[0], &expected[0], pixels * 3) == 0;
+            if (!same) {
+                printf("  %d bands, %dx%d\n", numBands, width, height);
+            }
+            check(same, "banded frame matches the reference");
+        }
+
+        vector<uint8_t> green(pixels + 64, kGuard);
+        freenect_demosaic_green(&raw[0], &green[0], width, height);
+        same = true;
+        for (size_t i = 0; i < pixels; i++) {
+            same = same && green[i] == expected[i * 3 + 1];
+        }
+        guarded = true;
+        for (size_t i = pixels; i < green.size(); i++) {
+            guarded = guarded && green[i] == kGuard;
+        }
+        if (!same || !guarded) {
+            printf("  green plane, %dx%d\n", width, height);
+        }
+        check(same, "green plane matches the reference's green channel");
+        check(guarded, "nothing written past the last green pixel");
+    }
+}
+
+static void benchmark()
+{
+    const int width = 640, height = 480;
+    const int frames = 200;
+    vector<uint8_t> raw(width * height);
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = uint8_t(rand());
+    }
+    vector<uint8_t> rgb(width * height * 3);
+    vector<uint8_t> green(width * height);
+
+    printf("Demosaic: 640x480 Bayer, %s\n", freenect_cpu_has_ssse3() ? "SSSE3" : "scalar");
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        referenceDemosaic(&raw[0], &rgb[0], width, height);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("  old converter  %7.3f ms/frame\n", seconds * 1e3 / frames);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        freenect_demosaic(&raw[0], &rgb[0], width, height);
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("  RGB            %7.3f ms/frame\n", seconds * 1e3 / frames);
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        freenect_demosaic_green(&raw[0], &green[0], width, height);
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("  green only     %7.3f ms/frame\n", seconds * 1e3 / frames);
+}
+
+int main()
+{
+    testSizes();
+    benchmark();
+
+    return finish("DemosaicTest");
+}
@@ -0,0 +1,159 @@
+// Checks FramePairer's pairing decisions: each video frame gets the depth
+// frame nearest in time, and is held until no later depth could be nearer.
+// Covers depth that stalls or drops frames, so video is released after
+// mMaxPendingVideo frames, skews past mMaxSkew, timestamps that arrive out
+// of order, and the device clock wrapping.
+
+#include "FramePairer.h"
+#include "TestCheck.h"
+#include <stdio.h>
+#include <memory>
+
+using namespace cinder;
+using namespace std;
+
+static const uint32_t kPeriod = 1000;
+
+// The pairer never looks inside frames, so they're single pixels
+static void pushDepth(FramePairer& pairer, uint32_t timestamp, uint32_t period = kPeriod)
+{
+    KinectFrameInfo info;
+    info.mTimestamp = timestamp;
+    info.mPeriod = period;
+    pairer.pushDepth(shared_ptr<uint16_t>(new uint16_t(0)), info);
+}
+
+static void pushVideo(FramePairer& pairer, uint32_t timestamp)
+{
+    KinectFrameInfo info;
+    info.mTimestamp = timestamp;
+    info.mPeriod = kPeriod;
+    pairer.pushVideo(shared_ptr<uint8_t>(new uint8_t(0)), info);
+}
+
+// Pops one frame and checks it was paired with depth at the given timestamp
+static bool popPaired(FramePairer& pairer, uint32_t video, uint32_t depth)
+{
+    FramePairer::Pair pair;
+    return pairer.pop(pair) && pair.videoInfo.mTimestamp == video && pair.depth &&
+        pair.depthInfo.mTimestamp == depth && pair.skew == int32_t(depth - video);
+}
+
+static bool popUnpaired(FramePairer& pairer, uint32_t video)
+{
+    FramePairer::Pair pair;
+    return pairer.pop(pair) && pair.videoInfo.mTimestamp == video && !pair.depth && pair.skew == 0;
+}
+
+static void testNearest()
+{
+    FramePairer pairer;
+    pushDepth(pairer, 10000);
+    pushVideo(pairer, 10300);
+
+    // Depth after the video could still be nearer
+    FramePairer::Pair pair;
+    check(!pairer.pop(pair), "video is held until depth catches up");
+
+    pushDepth(pairer, 11000);
+    check(popPaired(pairer, 10300, 10000), "nearest earlier depth wins");
+
+    pushVideo(pairer, 10800);
+    check(popPaired(pairer, 10800, 11000), "nearest later depth wins");
+
+    // Depth older than the last pairing was dropped, though it would be
+    // near enough, and 11000 is too far
+    pushVideo(pairer, 10400);
+    check(popUnpaired(pairer, 10400), "depth before the last pairing is forgotten");
+
+    check(!pairer.pop(pair), "nothing left to pop");
+    check(pairer.getPairedCount() == 2 && pairer.getUnpairedCount() == 1, "two frames paired, one not");
+}
+
+static void testStalledDepth()
+{
+    FramePairer pairer;
+    pairer.mMaxPendingVideo = 2;
+
+    // Depth stops at 20000 while video carries on
+    pushDepth(pairer, 20000);
+    pushVideo(pairer, 20400);
+    pushVideo(pairer, 21400);
+
+    FramePairer::Pair pair;
+    check(!pairer.pop(pair), "held while within mMaxPendingVideo");
+
+    pushVideo(pairer, 22400);
+    check(popPaired(pairer, 20400, 20000), "released on overflow with the nearest depth");
+    check(!pairer.pop(pair), "the rest wait again");
+
+    // Too far from the only depth frame to pair
+    pushVideo(pairer, 23400);
+    check(popUnpaired(pairer, 21400), "released unpaired past mMaxSkew");
+    check(pairer.getPairedCount() == 1 && pairer.getUnpairedCount() == 1, "one paired, one unpaired");
+
+    // Depth resumes after a dropped frame
+    pushDepth(pairer, 22000);
+    pushDepth(pairer, 23800);
+    check(popPaired(pairer, 22400, 22000), "pairs across a dropped depth frame");
+    check(popPaired(pairer, 23400, 23800), "and with the frame after it");
+}
+
+static void testSkewLimit()
+{
+    FramePairer pairer;
+    pairer.mMaxSkew = 0.25f;
+
+    pushDepth(pairer, 30000);
+    pushDepth(pairer, 31000);
+    pushVideo(pairer, 30400);
+    check(popUnpaired(pairer, 30400), "depth 0.4 periods off is rejected at mMaxSkew 0.25");
+
+    pushVideo(pairer, 30800);
+    check(popPaired(pairer, 30800, 31000), "depth 0.2 periods off is accepted");
+
+    // Until the period is known there's no limit
+    FramePairer unknown;
+    unknown.mMaxSkew = 0.25f;
+    pushDepth(unknown, 30000, 0);
+    pushDepth(unknown, 34000, 0);
+    pushVideo(unknown, 31000);
+    check(popPaired(unknown, 31000, 30000), "nearest depth is taken while the period is unknown");
+}
+
+static void testReordered()
+{
+    // Depth arriving out of timestamp order still pairs by nearest time
+    FramePairer pairer;
+    pushDepth(pairer, 42000);
+    pushDepth(pairer, 40000);
+    pushDepth(pairer, 41000);
+    pushVideo(pairer, 40900);
+    check(popPaired(pairer, 40900, 41000), "reordered depth pairs by timestamp");
+
+    // The same across the wrap of the device clock
+    FramePairer wrapped;
+    pushDepth(wrapped, 0xFFFFFE00u);
+    pushVideo(wrapped, 0xFFFFFF00u);
+    FramePairer::Pair pair;
+    check(!wrapped.pop(pair), "held before the clock wraps");
+    pushDepth(wrapped, 0x00000100u);
+    check(popPaired(wrapped, 0xFFFFFF00u, 0xFFFFFE00u), "nearest depth across the wrap, before");
+
+    pushVideo(wrapped, 0x00000020u);
+    check(popPaired(wrapped, 0x00000020u, 0x00000100u), "nearest depth across the wrap, after");
+
+    // clear() forgets everything queued
+    pushVideo(wrapped, 0x00000200u);
+    wrapped.clear();
+    check(!wrapped.pop(pair), "nothing after clear()");
+}
+
+int main()
+{
+    testNearest();
+    testStalledDepth();
+    testSkewLimit();
+    testReordered();
+    return finish("FramePairerTest");
+}
@@ -0,0 +1,169 @@
+// Checks FrameRing's buffer lifetimes, and benchmarks the CPU side of
+// FrameUploader against what it replaced: a new buffer and an ImageSource
+// style row-by-row conversion for every frame, versus one memcpy into a
+// reused ring buffer. Also shows what happens to the ring when LEDs keep
+// ring buffers instead of copies of their own.
+
+#include "FrameRing.h"
+#include "TestCheck.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+static const int kWidth = 640;
+static const int kHeight = 480;
+static const size_t kFrameBytes = kWidth * kHeight * 3;
+
+typedef vector<uint8_t> Frame;
+typedef shared_ptr<Frame> FrameRef;
+
+static FrameRef createFrame()
+{
+    return FrameRef(new Frame(kFrameBytes));
+}
+
+static void testLifetimes()
+{
+    FrameRing<Frame> ring(3);
+    size_t index;
+
+    // Nothing else holds the buffers, so they're reused in place
+    const Frame* first[3];
+    for (int i = 0; i < 3; i++) {
+        first[i] = ring.next(createFrame, &index).get();
+        check(index == size_t(i), "slots are handed out in order");
+    }
+    for (int i = 0; i < 30; i++) {
+        const Frame* frame = ring.next(createFrame, &index).get();
+        check(frame == first[index], "an unheld slot keeps its buffer");
+    }
+    check(ring.getAllocations() == 3, "one allocation per slot");
+
+    // A held buffer stays with its holder, and the slot gets a new one
+    FrameRef held = ring.next(createFrame, &index);
+    const Frame* heldFrame = held.get();
+    ring.next(createFrame);
+    ring.next(createFrame);
+    FrameRef& again = ring.next(createFrame, &index);
+    check(again.get() != heldFrame, "a held slot gets a new buffer");
+    check(held.get() == heldFrame, "the holder keeps its buffer");
+    check(ring.getAllocations() == 4, "one allocation for the held slot");
+
+    ring.clear();
+    ring.next(createFrame, &index);
+    check(index == 0 && ring.getAllocations() == 5, "clear drops the buffers and starts over");
+}
+
+// What ImageSource::load did: a call per row, converting each pixel into
+// the surface's channel layout
+struct RowTarget {
+    virtual ~RowTarget() {}
+    virtual void setRow(int y, const uint8_t* row) = 0;
+};
+
+struct RgbaSurface : public RowTarget {
+    vector<uint8_t> pixels;
+
+    RgbaSurface() : pixels(kWidth * kHeight * 4) {}
+
+    virtual void setRow(int y, const uint8_t* row)
+    {
+        uint8_t* dest = &pixels[y * kWidth * 4];
+        for (int x = 0; x < kWidth; x++) {
+            dest[x * 4 + 0] = row[x * 3 + 0];
+            dest[x * 4 + 1] = row[x * 3 + 1];
+            dest[x * 4 + 2] = row[x * 3 + 2];
+            dest[x * 4 + 3] = 255;
+        }
+    }
+};
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void benchmark()
+{
+    const int frames = 960;     // Five rounds of 64 LEDs
+    const int numLeds = 64, captures = 3;
+    Frame source(kFrameBytes);
+    for (size_t i = 0; i < source.size(); i++) {
+        source[i] = uint8_t(i * 31);
+    }
+
+    // Before: a new surface for every frame, filled row by row
+    auto start = chrono::steady_clock::now();
+    size_t checksum = 0;
+    for (int i = 0; i < frames; i++) {
+        unique_ptr<RgbaSurface> surface(new RgbaSurface());
+        RowTarget* target = surface.get();
+        for (int y = 0; y < kHeight; y++) {
+            target->setRow(y, &source[y * kWidth * 3]);
+        }
+        checksum += surface->pixels[i];
+    }
+    double converted = secondsSince(start);
+
+    // LEDs keeping ring buffers: every captured frame pins its slot
+    FrameRing<Frame> pinned(3);
+    vector<FrameRef> ledFrames(numLeds * captures);
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        FrameRef& frame = pinned.next(createFrame);
+        memcpy(&(*frame)[0], &source[0], kFrameBytes);
+        ledFrames[i % ledFrames.size()] = frame;
+    }
+    double pinnedSeconds = secondsSince(start);
+
+    // LEDs keeping buffers of their own, reused from one visit to the next,
+    // which captured frames go straight into as FrameUploader does now
+    FrameRing<Frame> ring(3);
+    vector<FrameRef> ledCopies(numLeds * captures);
+    int ledAllocations = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        FrameRef& own = ledCopies[i % ledCopies.size()];
+        if (!own) {
+            own = createFrame();
+            ledAllocations++;
+        }
+        memcpy(&(*own)[0], &source[0], kFrameBytes);
+        checksum += (*own)[i];
+    }
+    double copied = secondsSince(start);
+
+    // Frames that are only shown
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        FrameRef& frame = ring.next(createFrame);
+        memcpy(&(*frame)[0], &source[0], kFrameBytes);
+        checksum += (*frame)[i];
+    }
+    double streamed = secondsSince(start);
+
+    check(pinned.getAllocations() == uint64_t(frames), "pinned slots allocate on every frame");
+    check(ring.getAllocations() == 3, "frames that are only shown reuse the ring");
+    check(ledAllocations == numLeds * captures, "LED buffers are allocated once");
+
+    printf("FrameRing: %d frames of 640x480 RGB (checksum %u)\n", frames, unsigned(checksum & 0xff));
+    printf("  new surface, row conversion:   %6.3f ms/frame\n", converted * 1e3 / frames);
+    printf("  ring, LEDs keep ring buffers:  %6.3f ms/frame, %d ring allocations\n",
+        pinnedSeconds * 1e3 / frames, int(pinned.getAllocations()));
+    printf("  LEDs keep their own buffers:   %6.3f ms/frame, %d allocations, once per capture slot\n",
+        copied * 1e3 / frames, ledAllocations);
+    printf("  ring, display only:            %6.3f ms/frame, %d ring allocations\n",
+        streamed * 1e3 / frames, int(ring.getAllocations()));
+}
+
+int main()
+{
+    testLifetimes();
+    benchmark();
+
+    return finish("FrameRingTest");
+}
@@ -0,0 +1,290 @@
+// Checks that capture files replay what was recorded, and that a reader only
+// hands out frames that lie inside the file and have the full size of their
+// type. Covers files cut short in a record or in the index, indexes with
+// overflowing counts or bad entries, records of the wrong size, and a writer
+// that runs out of room, which must leave a file no reader accepts.
+
+#include "KinectCapture.h"
+#include "TestCheck.h"
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace cinder;
+using namespace cinder::KinectCapture;
+using namespace std;
+
+struct Frame {
+    FrameType   type;
+    size_t      size;
+    uint32_t    deviceTimestamp;
+};
+
+static string tempPath(const char* name)
+{
+    char path[256];
+    snprintf(path, sizeof path, "/tmp/KinectCaptureTest-%d-%s.vmk", int(getpid()), name);
+    return path;
+}
+
+// Each frame's bytes depend on its device timestamp, so a mixed-up frame shows
+static vector<uint8_t> payload(const Frame& frame)
+{
+    vector<uint8_t> data(frame.size);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = uint8_t(frame.deviceTimestamp * 13 + i * 31 + (i >> 8));
+    }
+    return data;
+}
+
+static vector<uint8_t> readFile(const string& path)
+{
+    vector<uint8_t> data;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        data.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        if (!data.empty() && fread(&data[0], 1, data.size(), f) != data.size()) {
+            data.clear();
+        }
+        fclose(f);
+    }
+    return data;
+}
+
+static void writeFile(const string& path, const vector<uint8_t>& data, size_t size)
+{
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f) {
+        fwrite(&data[0], 1, size, f);
+        fclose(f);
+    }
+}
+
+// Fewer frames than Writer::kMaxPending, so none are dropped
+static vector<Frame> sampleFrames()
+{
+    static const FrameType kTypes[] = { FRAME_DEPTH, FRAME_VIDEO_RGB, FRAME_LED_STATE, FRAME_VIDEO_IR, FRAME_VIDEO_BAYER };
+    vector<Frame> frames;
+    for (uint32_t i = 0; i < 20; i++) {
+        Frame frame;
+        frame.type = kTypes[i % 5];
+        frame.size = frame.type == FRAME_LED_STATE ? 3 + i * 50 : getFrameSize(frame.type);
+        frame.deviceTimestamp = 1000 + i;
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+static bool record(const string& path, const vector<Frame>& frames)
+{
+    Writer writer(path);
+    for (size_t i = 0; i < frames.size(); i++) {
+        vector<uint8_t> data = payload(frames[i]);
+        writer.writeFrame(frames[i].type, data.data(), data.size(), frames[i].deviceTimestamp);
+    }
+    writer.close();
+    return writer.getFrameCount() == frames.size() && writer.getDroppedFrames() == 0;
+}
+
+// True if the reader holds exactly the given frames, with their bytes
+static bool replays(const Reader& reader, const vector<Frame>& frames, size_t fileSize)
+{
+    if (reader.getFrameCount() != frames.size()) {
+        printf("  %zu frames, expected %zu\n", reader.getFrameCount(), frames.size());
+        return false;
+    }
+    uint32_t sequence[FRAME_VIDEO_BAYER + 1] = { 0 };
+    uint64_t timestamp = 0;
+    for (size_t i = 0; i < frames.size(); i++) {
+        const IndexEntry& entry = reader.getEntry(i);
+        if (entry.type != uint32_t(frames[i].type) || entry.size != frames[i].size ||
+                entry.deviceTimestamp != frames[i].deviceTimestamp || entry.sequence != sequence[entry.type]++ ||
+                entry.timestamp < timestamp || entry.offset % kAlignment || entry.offset + entry.size > fileSize) {
+            return false;
+        }
+        vector<uint8_t> data = payload(frames[i]);
+        if (memcmp(reader.getPayload(i), data.data(), data.size())) {
+            return false;
+        }
+        timestamp = entry.timestamp;
+    }
+    return true;
+}
+
+static bool opens(const string& path, const vector<Frame>& frames)
+{
+    try {
+        Reader reader(path);
+        return replays(reader, frames, readFile(path).size());
+    } catch (Exc&) {
+        return false;
+    }
+}
+
+static void testRoundTrip(const string& path)
+{
+    vector<Frame> frames = sampleFrames();
+    check(record(path, frames), "every frame is queued and written");
+
+    Reader reader(path);
+    check(replays(reader, frames, readFile(path).size()), "replay returns the recorded frames");
+    check(reader.getDuration() == reader.getEntry(frames.size() - 1).timestamp, "duration is the last timestamp");
+
+    // Without the index, walking the records finds the same frames
+    vector<uint8_t> data = readFile(path);
+    FileHeader header;
+    memcpy(&header, &data[0], sizeof header);
+    size_t indexOffset = header.indexOffset;
+    header.indexOffset = 0;
+    header.frameCount = 0;
+    memcpy(&data[0], &header, sizeof header);
+    string unfinished = tempPath("unfinished");
+    writeFile(unfinished, data, indexOffset);
+    check(opens(unfinished, frames), "an unfinished file replays from its records");
+    unlink(unfinished.c_str());
+
+    // Files that aren't captures are refused
+    memset(&data[0], 0, sizeof header);
+    string zeroed = tempPath("zeroed");
+    writeFile(zeroed, data, data.size());
+    bool refused = false;
+    try {
+        Reader bad(zeroed);
+    } catch (ExcBadFormat&) {
+        refused = true;
+    }
+    check(refused, "a file without the magic is refused");
+    unlink(zeroed.c_str());
+}
+
+static void testTruncated(const string& path)
+{
+    vector<Frame> frames = sampleFrames();
+    vector<uint8_t> data = readFile(path);
+    Reader whole(path);
+    FileHeader header;
+    memcpy(&header, &data[0], sizeof header);
+
+    // Cut in the index, at the end of a payload, in a payload, in a record
+    // header, and inside the first frame
+    const IndexEntry& last = whole.getEntry(frames.size() - 1);
+    const IndexEntry& middle = whole.getEntry(7);
+    size_t cuts[] = {
+        size_t(header.indexOffset + sizeof(IndexEntry) * 3 + 5),
+        size_t(last.offset + last.size),
+        size_t(last.offset + last.size / 2),
+        size_t(middle.offset - kAlignment + 8),
+        size_t(whole.getEntry(0).offset + 100),
+    };
+    string truncated = tempPath("truncated");
+    for (size_t c = 0; c < sizeof cuts / sizeof cuts[0]; c++) {
+        vector<Frame> expected;
+        for (size_t i = 0; i < frames.size() && whole.getEntry(i).offset + whole.getEntry(i).size <= cuts[c]; i++) {
+            expected.push_back(frames[i]);
+        }
+        writeFile(truncated, data, cuts[c]);
+        if (!opens(truncated, expected)) {
+            printf("  cut at %zu of %zu\n", cuts[c], data.size());
+            check(false, "a truncated file replays only its complete frames");
+        }
+    }
+    unlink(truncated.c_str());
+}
+
+static void testBadIndex(const string& path)
+{
+    vector<Frame> frames = sampleFrames();
+    vector<uint8_t> original = readFile(path);
+    FileHeader header;
+    memcpy(&header, &original[0], sizeof header);
+    string damaged = tempPath("damaged");
+
+    // Each damage makes the reader fall back to walking the records,
+    // which are intact, so every frame is still there
+    for (int damage = 0; damage < 7; damage++) {
+        vector<uint8_t> data = original;
+        FileHeader* h = (FileHeader*)&data[0];
+        IndexEntry* index = (IndexEntry*)&data[header.indexOffset];
+        switch (damage) {
+        case 0: h->frameCount = uint64_t(1) << 59; break;     // Wraps to zero bytes of index
+        case 1: h->indexOffset = data.size() + kAlignment; break;
+        case 2: h->indexOffset = ~uint64_t(0) - 7; break;
+        case 3: index[4].offset = data.size() - 10; break;
+        case 4: index[5].offset = ~uint64_t(0) - 100; break;
+        case 5: index[0].size -= 1; break;
+        case 6: index[9].type = 9; break;
+        }
+        writeFile(damaged, data, data.size());
+        if (!opens(damaged, frames)) {
+            printf("  damage %d\n", damage);
+            check(false, "a damaged index is rebuilt from the records");
+        }
+    }
+    unlink(damaged.c_str());
+}
+
+static void testBadRecord()
+{
+    // A depth record too short for a depth frame is skipped, and replay
+    // carries on after it
+    vector<Frame> frames = sampleFrames();
+    frames.resize(5);
+    Frame shortDepth = { FRAME_DEPTH, 1000, 77 };
+    frames.insert(frames.begin() + 2, shortDepth);
+
+    string path = tempPath("short");
+    record(path, frames);
+    frames.erase(frames.begin() + 2);
+    check(opens(path, frames), "a record of the wrong size for its type is skipped");
+    unlink(path.c_str());
+}
+
+static void testFailedWrite()
+{
+    // Limit the file size so frame writes fail partway through
+    struct rlimit saved, limit;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    limit = saved;
+    limit.rlim_cur = 1 << 20;
+    signal(SIGXFSZ, SIG_IGN);
+    if (setrlimit(RLIMIT_FSIZE, &limit)) {
+        printf("  can't limit the file size, skipping the failed write test\n");
+        return;
+    }
+
+    string path = tempPath("full");
+    vector<Frame> frames = sampleFrames();
+    frames.resize(4);
+    record(path, frames);
+    setrlimit(RLIMIT_FSIZE, &saved);
+
+    vector<uint8_t> data = readFile(path);
+    check(data.size() >= sizeof(FileHeader) && data.size() <= (1 << 20), "the file stopped at the limit");
+    bool refused = false;
+    try {
+        Reader reader(path);
+    } catch (ExcBadFormat&) {
+        refused = true;
+    }
+    check(refused, "a file whose writes failed is refused");
+    unlink(path.c_str());
+}
+
+int main()
+{
+    string path = tempPath("capture");
+    testRoundTrip(path);
+    testTruncated(path);
+    testBadIndex(path);
+    unlink(path.c_str());
+
+    testBadRecord();
+    testFailedWrite();
+    return finish("KinectCaptureTest");
+}
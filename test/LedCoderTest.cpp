@@ -0,0 +1,201 @@
+// Checks LedCoder's Gray-code patterns and decoding on synthetic frames.
+// For LED counts that are and aren't powers of two, every LED gets a pixel
+// that sees only it, and extra pixels see two LEDs at once, too little
+// contrast, one bit plane too faint, light that goes out when the LEDs come
+// on, or a code past the last LED. Only the single-LED pixels may decode.
+
+#include "LedCoder.h"
+#include "TestCheck.h"
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+static const int kAmbient = 40;
+static const int kGain = 180;
+
+enum PixelKind {
+    PIXEL_LED,          // Sees one LED
+    PIXEL_MIXED,        // Sees LEDs 0 and numLeds-1 equally
+    PIXEL_DIM,          // One LED, below minContrast
+    PIXEL_WEAK_BIT,     // One LED, but bit 0 barely changes
+    PIXEL_INVERSE,      // Darkens when its LED lights
+    PIXEL_PAST_END,     // Shows the code for LED numLeds
+    PIXEL_DARK,         // Ambient light only
+};
+
+struct Pixel {
+    PixelKind   kind;
+    int         led;
+};
+
+static int pixelValue(const LedCoder& coder, const Pixel& pixel, int pattern, int numLeds)
+{
+    bool lit = coder.isLit(pattern, pixel.led);
+    switch (pixel.kind) {
+    case PIXEL_LED:
+    case PIXEL_PAST_END:
+        return kAmbient + (lit ? kGain : 0);
+    case PIXEL_MIXED:
+        return kAmbient + (coder.isLit(pattern, 0) ? kGain / 2 : 0) + (coder.isLit(pattern, numLeds - 1) ? kGain / 2 : 0);
+    case PIXEL_DIM:
+        return kAmbient + (lit ? 5 : 0);
+    case PIXEL_WEAK_BIT:
+        // Full contrast, but the first bit plane and its inverse differ by 20
+        if (pattern == 2 || pattern == 3) {
+            return kAmbient + kGain / 2 + (lit ? 10 : -10);
+        }
+        return kAmbient + (lit ? kGain : 0);
+    case PIXEL_INVERSE:
+        return kAmbient + (lit ? 0 : kGain);
+    case PIXEL_DARK:
+        return kAmbient;
+    }
+    return 0;
+}
+
+static void testPatterns(int numLeds)
+{
+    LedCoder coder;
+    check(coder.setup(4, 1, numLeds), "setup reports a change");
+    check(!coder.setup(4, 1, numLeds), "setup with the same size changes nothing");
+
+    int bits = 1;
+    while ((1 << bits) < numLeds) {
+        bits++;
+    }
+    check(coder.getNumBits() == bits, "enough bits for every LED index, and no more");
+    check(coder.getNumPatterns() == 2 + 2 * bits, "all on, all off, and each bit plane with its inverse");
+
+    bool ok = true;
+    for (int led = 0; led < numLeds; led++) {
+        ok = ok && coder.isLit(0, led) && !coder.isLit(1, led);
+        for (int bit = 0; bit < bits; bit++) {
+            ok = ok && coder.isLit(2 + 2*bit, led) != coder.isLit(3 + 2*bit, led);
+        }
+    }
+    check(ok, "each bit plane is the inverse of the next");
+
+    // Neighboring LEDs differ in exactly one bit plane, and no two LEDs match
+    ok = true;
+    for (int a = 0; a < numLeds; a++) {
+        for (int b = a + 1; b < numLeds; b++) {
+            int differ = 0;
+            for (int bit = 0; bit < bits; bit++) {
+                differ += coder.isLit(2 + 2*bit, a) != coder.isLit(2 + 2*bit, b);
+            }
+            ok = ok && differ > 0 && (b != a + 1 || differ == 1);
+        }
+    }
+    check(ok, "LED codes are distinct Gray codes");
+}
+
+static void testDecode(int numLeds, int channels)
+{
+    vector<Pixel> pixels;
+    for (int led = 0; led < numLeds; led++) {
+        Pixel p = { PIXEL_LED, (led * 7) % numLeds };
+        pixels.push_back(p);
+    }
+    Pixel extras[] = {
+        { PIXEL_MIXED, 0 },
+        { PIXEL_DIM, numLeds / 2 },
+        { PIXEL_WEAK_BIT, numLeds - 1 },
+        { PIXEL_INVERSE, numLeds / 3 },
+        { PIXEL_PAST_END, numLeds },
+        { PIXEL_DARK, 0 },
+    };
+    for (size_t i = 0; i < sizeof extras / sizeof extras[0]; i++) {
+        // Two LEDs are only a mix when there are two
+        if (extras[i].kind == PIXEL_MIXED && numLeds < 2) {
+            continue;
+        }
+        pixels.push_back(extras[i]);
+    }
+
+    // Interleave the extras with the LED pixels, in two rows
+    vector<Pixel> layout;
+    for (size_t i = 0, j = numLeds; i < size_t(numLeds) || j < pixels.size(); i++, j++) {
+        if (i < size_t(numLeds)) layout.push_back(pixels[i]);
+        if (j < pixels.size()) layout.push_back(pixels[j]);
+    }
+    if (layout.size() % 2) {
+        Pixel dark = { PIXEL_DARK, 0 };
+        layout.push_back(dark);
+    }
+    unsigned width = unsigned(layout.size() / 2);
+
+    LedCoder coder;
+    coder.setup(width, 2, numLeds);
+
+    vector<vector<uint8_t> > frames(coder.getNumPatterns());
+    vector<const uint8_t*> framePtrs;
+    for (int pattern = 0; pattern < coder.getNumPatterns(); pattern++) {
+        frames[pattern].resize(layout.size() * channels);
+        for (size_t i = 0; i < layout.size(); i++) {
+            int v = pixelValue(coder, layout[i], pattern, numLeds);
+            for (int ch = 0; ch < channels; ch++) {
+                frames[pattern][i * channels + ch] = uint8_t(v);
+            }
+        }
+        framePtrs.push_back(&frames[pattern][0]);
+    }
+    coder.decode(framePtrs, channels);
+
+    const vector<int32_t>& map = coder.getLedMap();
+    const vector<float>& contrast = coder.getContrast();
+    bool leds = true, others = true, contrastOk = true;
+    for (size_t i = 0; i < layout.size(); i++) {
+        // When numLeds is a power of two, the code past the end wraps
+        // around to a real LED's
+        bool wraps = layout[i].kind == PIXEL_PAST_END && layout[i].led >= (1 << coder.getNumBits());
+        if (layout[i].kind == PIXEL_LED) {
+            leds = leds && map[i] == layout[i].led;
+            contrastOk = contrastOk && contrast[i] > kGain / 255.0f - 0.01f && contrast[i] < kGain / 255.0f + 0.01f;
+        } else if (!wraps) {
+            if (map[i] != -1) {
+                printf("  pixel kind %d decoded to LED %d, %d LEDs, %d channels\n", layout[i].kind, map[i], numLeds, channels);
+            }
+            others = others && map[i] == -1 && contrast[i] == 0.0f;
+        }
+    }
+    check(leds, "single-LED pixels decode to their LED");
+    check(contrastOk, "contrast is all-on minus all-off, normalized");
+    check(others, "mixed, dim, weak, inverse, dark and out-of-range pixels stay undecoded");
+
+    // Buckets list each LED's pixels in frame order
+    bool buckets = true;
+    size_t total = 0, decoded = 0;
+    for (size_t i = 0; i < map.size(); i++) {
+        decoded += map[i] >= 0;
+    }
+    for (int led = 0; led < numLeds; led++) {
+        const uint32_t* list = coder.getPixels(led);
+        size_t n = coder.getNumPixels(led);
+        total += n;
+        for (size_t k = 0; k < n; k++) {
+            buckets = buckets && map[list[k]] == led && (k == 0 || list[k] > list[k - 1]);
+        }
+    }
+    check(buckets && total == decoded, "every decoded pixel is bucketed under its LED");
+
+    // Missing frames decode nothing
+    framePtrs.pop_back();
+    coder.decode(framePtrs, channels);
+    bool empty = true;
+    for (size_t i = 0; i < map.size(); i++) {
+        empty = empty && map[i] == -1;
+    }
+    check(empty && coder.getNumPixels(0) == 0, "too few frames decode nothing");
+}
+
+int main()
+{
+    static const int kCounts[] = { 1, 2, 3, 5, 8, 37, 64, 100, 1000 };
+    for (size_t i = 0; i < sizeof kCounts / sizeof kCounts[0]; i++) {
+        testPatterns(kCounts[i]);
+        testDecode(kCounts[i], 1);
+        testDecode(kCounts[i], 3);
+    }
+    return finish("LedCoderTest");
+}
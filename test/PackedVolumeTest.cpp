@@ -0,0 +1,284 @@
+// Round-trips sparse volumes through PackedVolume in each integer format,
+// checks that decode rejects damaged streams, that voxel map files from
+// before quantization (version 1) still load, and that damaged volume
+// sizes are rejected before anything is allocated for them.
+
+#include "PackedVolume.h"
+#include "VoxelMapFile.h"
+#include "TestCheck.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static float randomUnit()
+{
+    return rand() / float(RAND_MAX);
+}
+
+// A few scattered bricks with runs of zeros, isolated values and long
+// nonzero runs, so every token kind and the run length limit get used.
+// 'lo' may be negative for a signed range.
+static void makeVolume(BrickVolume& volume, float lo, float hi, unsigned seed)
+{
+    srand(seed);
+    volume.resize(40, 33, 70);
+    volume.clear();
+    for (int i = 0; i < 12; i++) {
+        int bx = rand() % 40, by = rand() % 33, bz = rand() % 70;
+        for (int z = bz; z < min(bz + 8, 70); z++) {
+            for (int y = by; y < min(by + 8, 33); y++) {
+                for (int x = bx; x < min(bx + 8, 40); x++) {
+                    if (rand() % 3) {
+                        volume.at(x, y, z) = lo + (hi - lo) * randomUnit();
+                    }
+                }
+            }
+        }
+    }
+    // The range ends exactly, and a voxel far smaller than one step
+    volume.at(0, 0, 0) = lo;
+    volume.at(1, 0, 0) = hi;
+    volume.at(2, 0, 0) = lo + (hi - lo) * 1e-6f;
+}
+
+static void testRoundTrip(PackedVolume::Format format, float lo, float hi, const char* name)
+{
+    BrickVolume volume;
+    makeVolume(volume, lo, hi, 5);
+
+    PackedVolume packed;
+    packed.pack(volume, format);
+    BrickVolume unpacked;
+    bool ok = packed.unpack(unpacked);
+    check(ok, "packed volume unpacks");
+    if (!ok) {
+        return;
+    }
+
+    size_t count = volume.getNumBricks() * BrickVolume::kBrickVoxels;
+    float scale = PackedVolume::quantize(volume.getVoxels(), count, format).scale;
+    unsigned maxCode = format == PackedVolume::FORMAT_UINT8 ? 0xff : 0xffff;
+    check(scale <= (hi - lo) / (maxCode - 2), "steps cover the range with at most one to spare");
+    // Rounding to the nearest step, plus float error in computing the step
+    float bound = scale * 0.5f + fabsf(hi) * 1e-6f;
+
+    check(unpacked.getSizeX() == volume.getSizeX() && unpacked.getSizeY() == volume.getSizeY() &&
+        unpacked.getSizeZ() == volume.getSizeZ(), "size is unchanged");
+    check(unpacked.getNumBricks() == volume.getNumBricks() &&
+        !memcmp(unpacked.getBricks(), volume.getBricks(), volume.getNumBricks() * sizeof(uint32_t)),
+        "brick set is unchanged");
+
+    float maxError = 0.0f;
+    bool zeros = true, nonzeros = true;
+    for (int z = 0; z < volume.getSizeZ(); z++) {
+        for (int y = 0; y < volume.getSizeY(); y++) {
+            for (int x = 0; x < volume.getSizeX(); x++) {
+                float a = volume.get(x, y, z), b = unpacked.get(x, y, z);
+                maxError = max(maxError, fabsf(a - b));
+                zeros = zeros && (a != 0.0f || b == 0.0f);
+                nonzeros = nonzeros && (a == 0.0f || b != 0.0f);
+            }
+        }
+    }
+    printf("  %-24s max error %.3g, step %.3g, %u bytes for %u bricks\n", name,
+        maxError, scale, unsigned(packed.getMemoryBytes()), unsigned(volume.getNumBricks()));
+    check(maxError <= bound, "error is at most half a step");
+    check(packed.getMaxError() <= bound && packed.getMaxError() == maxError, "reported error is the real error");
+    check(zeros, "zeros stay zero");
+    check(nonzeros, "nonzeros stay nonzero");
+}
+
+static void testDamagedStreams()
+{
+    BrickVolume volume;
+    makeVolume(volume, 0.01f, 1.0f, 9);
+    size_t count = volume.getNumBricks() * BrickVolume::kBrickVoxels;
+    vector<float> voxels(count);
+
+    for (int f = PackedVolume::FORMAT_FLOAT; f <= PackedVolume::FORMAT_UINT8; f++) {
+        PackedVolume::Quantization q = PackedVolume::quantize(volume.getVoxels(), count, PackedVolume::Format(f));
+        vector<uint8_t> data;
+        PackedVolume::encode(volume.getVoxels(), count, q, data);
+        check(PackedVolume::decode(&data[0], data.size(), q, &voxels[0], count), "whole stream decodes");
+
+        // Every truncation point, through the middle of a literal run too
+        bool rejected = true;
+        for (size_t size = 0; size < data.size(); size++) {
+            rejected = rejected && !PackedVolume::decode(&data[0], size, q, &voxels[0], count);
+        }
+        check(rejected, "truncated streams are rejected");
+
+        check(!PackedVolume::decode(&data[0], data.size(), q, &voxels[0], count - 1),
+            "streams with too many voxels are rejected");
+        if (f != PackedVolume::FORMAT_FLOAT) {
+            data.push_back(0x80);
+            check(!PackedVolume::decode(&data[0], data.size(), q, &voxels[0], count),
+                "trailing tokens are rejected");
+        }
+    }
+
+    PackedVolume::Quantization bad = { 7, 1.0f, 0.0f };
+    uint8_t zeros = 0x80;
+    check(!PackedVolume::decode(&zeros, 1, bad, &voxels[0], 1), "unknown formats are rejected");
+}
+
+// Writes what version 1 of VoxelMapFile::Writer did: raw floats, and the
+// shorter volume entry
+static void writeVersion1(FILE* file, const BrickVolume& grid, const VoxelMapFile::Metadata& metadata)
+{
+    using namespace VoxelMapFile;
+    vector<uint8_t> out;
+    auto append = [&out](const void* data, size_t size) {
+        uint64_t offset = out.size();
+        const uint8_t *bytes = (const uint8_t*)data;
+        out.insert(out.end(), bytes, bytes + size);
+        out.resize((out.size() + kAlignment - 1) / kAlignment * kAlignment, 0);
+        return offset;
+    };
+
+    FileHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, kMagic, sizeof header.magic);
+    header.version = kVersion1;
+    header.alignment = kAlignment;
+    header.brickSize = BrickVolume::kBrickSize;
+    header.ledCount = 2;
+    header.zLimit = metadata.zLimit;
+    memcpy(header.fusedMin, metadata.fusedMin, sizeof header.fusedMin);
+    memcpy(header.fusedMax, metadata.fusedMax, sizeof header.fusedMax);
+    append(&header, sizeof header);
+
+    LedEntryV1 leds[2];
+    memset(leds, 0, sizeof leds);
+    header.ledTableOffset = append(leds, sizeof leds);
+
+    VolumeEntryV1 &entry = leds[1].grid;
+    entry.sizeX = grid.getSizeX();
+    entry.sizeY = grid.getSizeY();
+    entry.sizeZ = grid.getSizeZ();
+    entry.brickCount = grid.getNumBricks();
+    entry.pagesOffset = append(grid.getPages(), grid.getNumPages() * sizeof(int32_t));
+    entry.bricksOffset = append(grid.getBricks(), grid.getNumBricks() * sizeof(uint32_t));
+    entry.voxelsOffset = append(grid.getVoxels(), grid.getNumBricks() * BrickVolume::kBrickVoxels * sizeof(float));
+
+    memcpy(&out[0], &header, sizeof header);
+    memcpy(&out[header.ledTableOffset], leds, sizeof leds);
+    fwrite(&out[0], 1, out.size(), file);
+}
+
+static void testVersion1Map()
+{
+    BrickVolume grid;
+    makeVolume(grid, 0.0f, 2.0f, 13);
+    VoxelMapFile::Metadata metadata = { 0.067f, { -1500, -1500, 500 }, { 1500, 1500, 3500 } };
+
+    char path[] = "/tmp/PackedVolumeTest.XXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fd < 0 ? 0 : fdopen(fd, "wb");
+    check(file != 0, "temporary map file opens");
+    if (!file) {
+        return;
+    }
+    writeVersion1(file, grid, metadata);
+    fclose(file);
+
+    VoxelMapFile::Reader reader;
+    bool opened = reader.open(path);
+    check(opened, "version 1 map opens");
+    if (opened) {
+        check(reader.getLedCount() == 2 && reader.getHeader().zLimit == metadata.zLimit,
+            "version 1 header is read");
+
+        BrickVolume loaded;
+        const VoxelMapFile::LedEntry& led = reader.getLed(1);
+        check(reader.load(led.grid, loaded), "version 1 volume loads");
+        check(loaded.getNumBricks() == grid.getNumBricks() &&
+            !memcmp(loaded.getVoxels(), grid.getVoxels(),
+                grid.getNumBricks() * BrickVolume::kBrickVoxels * sizeof(float)),
+            "version 1 voxels are unchanged");
+        check(reader.getVoxels(led.grid) != 0, "version 1 voxels can be used in place");
+        check(reader.load(reader.getLed(0).fused, loaded) && loaded.empty(), "empty version 1 volumes load empty");
+    }
+    reader.close();
+    unlink(path);
+}
+
+// Saves one LED, then overwrites its grid's sizes in the LED table
+static void testDamagedSizes()
+{
+    BrickVolume grid, empty;
+    makeVolume(grid, 0.0f, 2.0f, 17);
+    VoxelMapFile::Metadata metadata = { 0.067f, { -1500, -1500, 500 }, { 1500, 1500, 3500 } };
+
+    static const int32_t kSizes[][3] = {
+        { 40, 33, 70 },                         // As written
+        { 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF }, // Would overflow the page count
+        { 40, 33, VoxelMapFile::kMaxSize + 1 },
+        { 40, -8, 70 },
+        { 8, 8, 8 },                            // Too small for the bricks stored
+    };
+
+    for (size_t i = 0; i < sizeof kSizes / sizeof kSizes[0]; i++) {
+        char path[] = "/tmp/PackedVolumeTest.XXXXXX";
+        int fd = mkstemp(path);
+        check(fd >= 0, "temporary map file opens");
+        if (fd < 0) {
+            return;
+        }
+        close(fd);
+
+        VoxelMapFile::Writer writer;
+        check(writer.open(path, 1, metadata), "map file is created");
+        writer.writeLed(0, grid, empty);
+        check(writer.close(), "map file is written");
+
+        FILE *file = fopen(path, "r+b");
+        VoxelMapFile::FileHeader header;
+        check(file && fread(&header, sizeof header, 1, file) == 1, "map header reads back");
+        if (file) {
+            fseek(file, long(header.ledTableOffset + offsetof(VoxelMapFile::LedEntry, grid) +
+                offsetof(VoxelMapFile::VolumeEntry, sizeX)), SEEK_SET);
+            fwrite(kSizes[i], sizeof kSizes[i], 1, file);
+            fclose(file);
+        }
+
+        VoxelMapFile::Reader reader;
+        bool opened = reader.open(path);
+        check(opened, "map with a damaged volume still opens");
+        if (opened) {
+            BrickVolume loaded;
+            bool ok = reader.load(reader.getLed(0).grid, loaded);
+            if (i == 0) {
+                check(ok && loaded.getNumBricks() == grid.getNumBricks(), "undamaged volume loads");
+            } else {
+                check(!ok && loaded.empty() && loaded.getNumPages() <= grid.getNumPages(),
+                    "damaged sizes are rejected without allocating for them");
+                if (i < 4) {
+                    check(reader.getPages(reader.getLed(0).grid) == 0, "no page table for sizes out of range");
+                }
+            }
+        }
+        reader.close();
+        unlink(path);
+    }
+}
+
+int main()
+{
+    printf("PackedVolume: %d voxel bricks\n", BrickVolume::kBrickVoxels);
+    testRoundTrip(PackedVolume::FORMAT_UINT16, 0.001f, 3.0f, "16-bit");
+    testRoundTrip(PackedVolume::FORMAT_UINT8, 0.001f, 3.0f, "8-bit");
+    testRoundTrip(PackedVolume::FORMAT_UINT16, -1.0f, 1.0f, "16-bit, signed range");
+    testRoundTrip(PackedVolume::FORMAT_UINT8, -1.0f, 1.0f, "8-bit, signed range");
+    testDamagedStreams();
+    testVersion1Map();
+    testDamagedSizes();
+
+    return finish("PackedVolumeTest");
+}
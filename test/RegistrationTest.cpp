@@ -0,0 +1,211 @@
+// Checks the banded depth registration, scalar and AVX2, bit for bit
+// against the single ordered loop it replaced, on random and smooth depth
+// frames. The calibration warps and shifts the image, and the pad offset
+// is tried at zero and at values that aren't a whole number of rows, so
+// target rows straddle the ends of the output. registration.c is built
+// with four bands here, so freenect_apply_registration runs on its worker
+// threads. Then times whole frames.
+
+extern "C" {
+#include "freenect_internal.h"
+#include "registration.h"
+#include "unpack.h"
+#include "cpu.h"
+}
+#include "TestCheck.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+static const int kWidth = 640;
+static const int kHeight = 480;
+static const int kPixels = kWidth * kHeight;
+static const int kScale = 256;      // REG_X_VAL_SCALE
+
+// Pixel i goes in the 11 bits starting at bit 11*i, most significant first
+static void pack11(const vector<uint16_t>& frame, vector<uint8_t>& raw)
+{
+    raw.assign(frame.size() * 11 / 8, 0);
+    for (size_t i = 0; i < frame.size(); i++) {
+        for (int bit = 0; bit < 11; bit++) {
+            size_t pos = i * 11 + bit;
+            if (frame[i] >> (10 - bit) & 1) {
+                raw[pos / 8] |= uint8_t(0x80 >> (pos % 8));
+            }
+        }
+    }
+}
+
+// The old freenect_apply_registration loop, without DENSE_REGISTRATION. It
+// wrote through any index; here targets outside the frame are skipped.
+static void referenceRegister(const freenect_registration& reg, const uint8_t* input_packed, uint16_t* output_mm)
+{
+    memset(output_mm, 0, kPixels * sizeof(uint16_t));
+    vector<uint16_t> unpack(kWidth);
+    uint32_t target_offset = kHeight * reg.reg_pad_info.start_lines;
+
+    for (uint32_t y = 0; y < uint32_t(kHeight); y++) {
+        freenect_unpack_11bit(input_packed, &unpack[0], kWidth);
+        input_packed += kWidth * 11 / 8;
+
+        for (uint32_t x = 0; x < uint32_t(kWidth); x++) {
+            uint16_t metric_depth = reg.raw_to_mm_shift[unpack[x]];
+            if (metric_depth == FREENECT_DEPTH_MM_NO_VALUE) continue;
+            if (metric_depth >= FREENECT_DEPTH_MM_MAX_VALUE) continue;
+
+            uint32_t reg_index = y * kWidth + x;
+            uint32_t nx = (reg.registration_table[reg_index][0] + reg.depth_to_rgb_shift[metric_depth]) / kScale;
+            uint32_t ny = reg.registration_table[reg_index][1];
+            if (nx >= uint32_t(kWidth)) continue;
+
+            uint32_t target_index = ny * kWidth + nx - target_offset;
+            if (target_index >= uint32_t(kPixels)) continue;
+
+            uint16_t current_depth = output_mm[target_index];
+            if ((current_depth == FREENECT_DEPTH_MM_NO_VALUE) || (current_depth > metric_depth)) {
+                output_mm[target_index] = metric_depth;
+            }
+        }
+    }
+}
+
+// Typical zero plane numbers, and a registration that shifts the image
+// right and up with a little stretch both ways, so some rows land partly
+// or entirely outside.
+static void setupDevice(freenect_device& dev, uint16_t startLines)
+{
+    memset(&dev, 0, sizeof dev);
+    freenect_registration& reg = dev.registration;
+
+    reg.zero_plane_info.dcmos_emitter_dist = 7.5f;
+    reg.zero_plane_info.dcmos_rcmos_dist = 2.3f;
+    reg.zero_plane_info.reference_distance = 120.0f;
+    reg.zero_plane_info.reference_pixel_size = 0.1042f;
+    reg.const_shift = 200.0;
+
+    reg.reg_info.dx_start = 512;        // 2 pixels, in 1/256ths
+    reg.reg_info.dy_start = -384;       // -1.5 pixels
+    reg.reg_info.dxdx_start = 400;
+    reg.reg_info.dydy_start = 200;
+    reg.reg_pad_info.start_lines = startLines;
+
+    freenect_init_registration(&dev);
+}
+
+// Random raw depth, or a tilted plane with noise so neighbors compete in the z-buffer
+static void makeFrame(vector<uint16_t>& frame, bool smooth)
+{
+    frame.resize(kPixels);
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            int v = smooth ? 650 + x / 8 + y / 6 + rand() % 9 : rand() % 2048;
+            if (rand() % 50 == 0) {
+                v = 2047;   // No reading
+            }
+            frame[y * kWidth + x] = uint16_t(v);
+        }
+    }
+}
+
+static void testEquivalence()
+{
+    static const uint16_t kStartLines[] = { 0, 1, 3 };
+    static const int kBands[] = { 1, 3, 7 };
+    srand(12);
+
+    for (size_t s = 0; s < sizeof kStartLines / sizeof kStartLines[0]; s++) {
+        freenect_device dev;
+        setupDevice(dev, kStartLines[s]);
+
+        for (int f = 0; f < 4; f++) {
+            vector<uint16_t> frame;
+            vector<uint8_t> raw;
+            makeFrame(frame, f % 2 == 1);
+            pack11(frame, raw);
+
+            vector<uint16_t> expected(kPixels);
+            referenceRegister(dev.registration, &raw[0], &expected[0]);
+            size_t written = 0;
+            for (int i = 0; i < kPixels; i++) {
+                written += expected[i] != 0;
+            }
+            check(written > size_t(kPixels) / 4, "the reference registers a good part of the frame");
+
+            // Start from garbage, so every band has to clear its own range
+            vector<uint16_t> output(kPixels);
+            for (size_t b = 0; b < sizeof kBands / sizeof kBands[0]; b++) {
+                for (int simd = 0; simd <= 1; simd++) {
+                    memset(&output[0], 0x5A, kPixels * sizeof(uint16_t));
+                    freenect_apply_registration_bands(&dev.registration, &raw[0], &output[0], kBands[b], simd);
+                    bool same = memcmp(&output[0], &expected[0], kPixels * sizeof(uint16_t)) == 0;
+                    if (!same) {
+                        printf("  start_lines %d, %s frame, %d bands, %s\n", kStartLines[s],
+                            f % 2 ? "smooth" : "random", kBands[b], simd ? "AVX2" : "scalar");
+                    }
+                    check(same, "banded registration matches the reference");
+                }
+            }
+
+            memset(&output[0], 0x5A, kPixels * sizeof(uint16_t));
+            freenect_apply_registration(&dev, &raw[0], &output[0]);
+            check(memcmp(&output[0], &expected[0], kPixels * sizeof(uint16_t)) == 0,
+                "freenect_apply_registration matches the reference");
+        }
+
+        freenect_destroy_registration(&dev.registration);
+    }
+}
+
+static void benchmark()
+{
+    const int frames = 50;
+    freenect_device dev;
+    setupDevice(dev, 0);
+
+    vector<uint16_t> frame;
+    vector<uint8_t> raw;
+    vector<uint16_t> output(kPixels);
+    makeFrame(frame, true);
+    pack11(frame, raw);
+
+    printf("Registration: 640x480, smooth frame, %s\n", freenect_cpu_has_avx2() ? "AVX2" : "no AVX2");
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        referenceRegister(dev.registration, &raw[0], &output[0]);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("  old loop   %7.3f ms/frame\n", seconds * 1e3 / frames);
+
+    for (int simd = 0; simd <= 1; simd++) {
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++) {
+            freenect_apply_registration_bands(&dev.registration, &raw[0], &output[0], 1, simd);
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("  %-10s %7.3f ms/frame\n", simd ? "AVX2" : "scalar", seconds * 1e3 / frames);
+    }
+
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < frames; i++) {
+        freenect_apply_registration(&dev, &raw[0], &output[0]);
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("  4 threads  %7.3f ms/frame\n", seconds * 1e3 / frames);
+
+    freenect_destroy_registration(&dev.registration);
+}
+
+int main()
+{
+    // As freenect_init() does
+    freenect_unpack_init();
+    testEquivalence();
+    benchmark();
+
+    return finish("RegistrationTest");
+}
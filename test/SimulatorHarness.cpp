@@ -0,0 +1,158 @@
+// Maps the simulated scene without a window, a GL context or a Kinect:
+// lights each LED through SceneSimulator's OPC stand-in, runs the frames
+// it renders through CpuMapper, locates every LED with LedSolver, and
+// reports how far each solved position is from the simulator's ground
+// truth and how many frames per second the whole path keeps up with.
+//
+// SceneSimulator uses Cinder's vector and color types and OPCClient's
+// packet header, so this needs Cinder's headers; see the Makefile.
+
+#include "SceneSimulator.h"
+#include "OPCClient.h"
+#include "CpuMapper.h"
+#include "LedSolver.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace ci;
+using namespace std;
+
+static const int kWidth = 640;
+static const int kHeight = 480;
+
+// The app's defaults
+static const int kFramesPerLed = 3;
+static const int kGridSize = 64;
+static const float kZLimit = 0.067f;
+static const int kFilterRadius = 5;
+static const int kErodeRadius = 16;
+static const float kDepthBias = 0.005f;
+
+static void lightLed(SceneSimulator& sim, int numLeds, int led)
+{
+    vector<char> packet(sizeof(OPCClient::Header) + numLeds * 3, 0);
+    OPCClient::Header& header = OPCClient::Header::view(packet);
+    header.init(0, OPCClient::SET_PIXEL_COLORS, numLeds * 3);
+    if (led >= 0) {
+        fill(header.data() + led * 3, header.data() + led * 3 + 3, 255);
+    }
+    sim.write(packet);
+}
+
+// The mapper sees LEDs by the light they throw on surfaces near them, so
+// for a meaningful error the LEDs sit just in front of the objects it maps
+// rather than strung through open space as in the default scene
+static vector<Vec3f> ledsOnObjects(int numLeds)
+{
+    const Vec3f faces[][2] = {
+        { Vec3f(-800, 200, 2000), Vec3f(-200, 1000, 2000) },
+        { Vec3f(300, -300, 2800), Vec3f(900, 1000, 2800) },
+        { Vec3f(-200, 600, 1500), Vec3f(400, 1000, 1500) },
+    };
+    vector<Vec3f> leds;
+    for (int i = 0; i < numLeds; i++) {
+        const Vec3f* face = faces[i % 3];
+        float u = ((i / 3) * 0.618034f) - floorf((i / 3) * 0.618034f);
+        float v = ((i / 3) * 0.754878f) - floorf((i / 3) * 0.754878f);
+        leds.push_back(Vec3f(face[0].x + (face[1].x - face[0].x) * (0.2f + 0.6f * u),
+            face[0].y + (face[1].y - face[0].y) * (0.2f + 0.6f * v), face[0].z - 30.0f));
+    }
+    return leds;
+}
+
+static float distance(const float a[3], const Vec3f& b)
+{
+    float dx = a[0] - b.x, dy = a[1] - b.y, dz = a[2] - b.z;
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+}
+
+static float median(vector<float> values)
+{
+    if (values.empty()) {
+        return 0.0f;
+    }
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+int main(int argc, char** argv)
+{
+    int numLeds = argc > 1 ? max(1, atoi(argv[1])) : 32;
+
+    // Every frame sees the packet written just before it, and nothing is dropped
+    SceneSimulator sim;
+    sim.setup(numLeds);
+    sim.setLedPositions(ledsOnObjects(numLeds));
+    sim.mLatency = 0.0f;
+    sim.mDropRate = 0.0f;
+
+    vector<uint16_t> background(kWidth * kHeight), depth(kWidth * kHeight);
+    vector<vector<uint8_t> > video(kFramesPerLed, vector<uint8_t>(kWidth * kHeight * 3));
+    vector<const uint8_t*> frames;
+    for (int i = 0; i < kFramesPerLed; i++) {
+        frames.push_back(&video[i][0]);
+    }
+    uint32_t timestamp;
+
+    // Background first, then bring in the objects to map
+    sim.mForegroundDelay = 1e9f;
+    sim.renderDepth(&background[0], timestamp);
+    sim.mForegroundDelay = 0.0f;
+
+    CpuMapper mapper;
+    mapper.setup(kWidth, kHeight);
+    vector<CpuMapper::Led> leds(numLeds);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < numLeds; i++) {
+        // On for the first half of the captures, as LedSequencer does
+        for (int c = 0; c < kFramesPerLed; c++) {
+            lightLed(sim, numLeds, c < (kFramesPerLed + 1) / 2 ? i : -1);
+            sim.renderVideo(&video[c][0], timestamp);
+        }
+        sim.renderDepth(&depth[0], timestamp);
+
+        CpuMapper::Led& led = leds[i];
+        mapper.updateDepthMask(led, &depth[0], &background[0], kErodeRadius, kDepthBias, 0.0f);
+        mapper.updateFilter(led, frames, kFilterRadius, 3);
+        mapper.updateGrid(led, kGridSize, kGridSize, kGridSize, kZLimit, 1.0f);
+    }
+    double mapSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LedSolver solver;
+    solver.setup(numLeds);
+    auto solveStart = chrono::steady_clock::now();
+    solver.solve([&](size_t led, BrickVolume&, LedSolver::Space& space) -> const BrickVolume* {
+        space = LedSolver::Space::camera(kZLimit);
+        return &leds[led].grid;
+    });
+    double solveSeconds = chrono::duration<double>(chrono::steady_clock::now() - solveStart).count();
+
+    const vector<Vec3f>& truth = sim.getLedPositions();
+    vector<float> peakErrors, centroidErrors;
+    for (int i = 0; i < numLeds; i++) {
+        const LedSolver::Result& r = solver.getResult(i);
+        if (r.valid) {
+            peakErrors.push_back(distance(r.peak, truth[i]));
+            centroidErrors.push_back(distance(r.centroid, truth[i]));
+        }
+    }
+
+    int totalFrames = numLeds * kFramesPerLed;
+    printf("SimulatorHarness: %d LEDs, %d located\n", numLeds, int(peakErrors.size()));
+    if (!peakErrors.empty()) {
+        printf("  peak error (mm):      median %.0f, max %.0f\n", median(peakErrors),
+            *max_element(peakErrors.begin(), peakErrors.end()));
+        printf("  centroid error (mm):  median %.0f, max %.0f\n", median(centroidErrors),
+            *max_element(centroidErrors.begin(), centroidErrors.end()));
+    }
+    printf("  %.1f frames/sec rendered and mapped, solved in %.1f ms\n",
+        totalFrames / mapSeconds, solveSeconds * 1e3);
+    printf("  %.1f frames/sec including the solve\n", totalFrames / (mapSeconds + solveSeconds));
+
+    return peakErrors.empty() ? 1 : 0;
+}
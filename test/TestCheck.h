@@ -0,0 +1,27 @@
+#pragma once
+
+// Pass/fail bookkeeping shared by the headless tests. Each test is a single
+// translation unit, so the failure count can live here.
+
+#include <stdio.h>
+
+static int sFailures = 0;
+
+static inline void check(bool ok, const char* what)
+{
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        sFailures++;
+    }
+}
+
+// Prints the verdict, and returns main()'s exit status
+static inline int finish(const char* name)
+{
+    if (sFailures) {
+        printf("%s: %d failures\n", name, sFailures);
+        return 1;
+    }
+    printf("%s: passed\n", name);
+    return 0;
+}
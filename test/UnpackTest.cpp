@@ -0,0 +1,121 @@
+// Checks the SSSE3 and AVX2 11-bit depth unpackers bit for bit against
+// the scalar one, and the scalar one against a plain bit reader, on random
+// input of many lengths: odd and even numbers of 8-pixel groups, so every
+// SIMD loop hands a different tail to the scalar loop. Then times each
+// on whole 640x480 frames.
+
+extern "C" {
+#include "unpack.h"
+}
+#include "TestCheck.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+static const char* kNames[] = { "scalar", "SSSE3", "AVX2" };
+
+// Pixel i is the 11 bits starting at bit 11*i, most significant first
+static void referenceUnpack(const vector<uint8_t>& raw, vector<uint16_t>& frame, int n)
+{
+    frame.assign(n, 0);
+    for (int i = 0; i < n; i++) {
+        uint16_t v = 0;
+        for (int bit = 0; bit < 11; bit++) {
+            int pos = i * 11 + bit;
+            v = uint16_t(v << 1 | ((raw[pos / 8] >> (7 - pos % 8)) & 1));
+        }
+        frame[i] = v;
+    }
+}
+
+static void testLengths()
+{
+    const uint16_t kGuard = 0xBEEF;
+    srand(11);
+
+    vector<int> lengths;
+    for (int groups = 1; groups <= 64; groups++) {
+        lengths.push_back(groups * 8);
+    }
+    lengths.push_back(640);
+    lengths.push_back(640 * 480);
+
+    for (size_t l = 0; l < lengths.size(); l++) {
+        int n = lengths[l];
+
+        // Exactly the packed size, so a sanitizer catches reads past the end
+        vector<uint8_t> raw(n * 11 / 8);
+        for (size_t i = 0; i < raw.size(); i++) {
+            raw[i] = uint8_t(rand());
+        }
+
+        vector<uint16_t> expected;
+        referenceUnpack(raw, expected, n);
+
+        for (int isa = FREENECT_UNPACK_SCALAR; isa <= FREENECT_UNPACK_AVX2; isa++) {
+            freenect_unpack_func unpack = freenect_unpack_11bit_isa(freenect_unpack_isa(isa));
+            if (!unpack) {
+                continue;
+            }
+
+            // Guard words after the output catch writes past the end
+            vector<uint16_t> frame(n + 16, kGuard);
+            unpack(&raw[0], &frame[0], n);
+
+            bool same = memcmp(&frame[0], &expected[0], n * sizeof(uint16_t)) == 0;
+            bool guarded = true;
+            for (int i = n; i < n + 16; i++) {
+                guarded = guarded && frame[i] == kGuard;
+            }
+            if (!same || !guarded) {
+                printf("  %s, n = %d\n", kNames[isa], n);
+            }
+            check(same, "unpacked pixels match the reference");
+            check(guarded, "nothing written past the last pixel");
+        }
+
+        vector<uint16_t> frame(n);
+        freenect_unpack_11bit(&raw[0], &frame[0], n);
+        check(memcmp(&frame[0], &expected[0], n * sizeof(uint16_t)) == 0, "dispatched unpack matches the reference");
+    }
+}
+
+static void benchmark()
+{
+    const int n = 640 * 480;
+    const int frames = 200;
+    vector<uint8_t> raw(n * 11 / 8);
+    for (size_t i = 0; i < raw.size(); i++) {
+        raw[i] = uint8_t(rand());
+    }
+    vector<uint16_t> frame(n);
+
+    printf("Unpack: 640x480 11-bit depth\n");
+    for (int isa = FREENECT_UNPACK_SCALAR; isa <= FREENECT_UNPACK_AVX2; isa++) {
+        freenect_unpack_func unpack = freenect_unpack_11bit_isa(freenect_unpack_isa(isa));
+        if (!unpack) {
+            printf("  %-7s not supported here\n", kNames[isa]);
+            continue;
+        }
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < frames; i++) {
+            unpack(&raw[0], &frame[0], n);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("  %-7s %7.3f ms/frame\n", kNames[isa], seconds * 1e3 / frames);
+    }
+}
+
+int main()
+{
+    // As freenect_init() does
+    freenect_unpack_init();
+    testLengths();
+    benchmark();
+
+    return finish("UnpackTest");
+}
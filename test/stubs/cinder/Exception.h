@@ -0,0 +1,16 @@
+#pragma once
+
+// Stands in for Cinder's header of the same name, so the tests can build
+// code whose only tie to Cinder is its exception base class.
+
+#include <exception>
+
+namespace cinder {
+
+class Exception : public std::exception {
+  public:
+	Exception() {}
+	virtual ~Exception() throw() {}
+};
+
+} // namespace cinder